@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# Compare the blocking and io_uring paths of syncserver/syncclient on a
+# tree of many small files:
+#
+#   ./bench_uring.sh [file_count] [work_dir]
+#
+# For each backend the server indexes the tree at startup, then one client
+# syncs it into an empty directory. Reported are the time to index (server
+# start to "listening") and the time for the client to write every file.
+# The client connects to 127.0.0.1:8080, so that port must be free.
+
+files=${1:-100000}
+work=${2:-/tmp/syncbench}
+per_dir=1000
+here=$(cd "$(dirname "$0")" && pwd)
+
+mkdir -p "$work"
+cd "$work" || exit 1
+
+gcc -O2 -o syncserver "$here"/syncserver.c "$here"/syncdelta.c "$here"/syncchunk.c \
+    "$here"/synctree.c "$here"/syncignore.c "$here"/syncprefix.c "$here"/synccoalesce.c \
+    "$here"/syncwatch.c "$here"/syncmetrics.c "$here"/syncuring.c "$here"/syncjournal.c \
+    "$here"/syncversion.c "$here"/syncslab.c -pthread -lz || exit 1
+gcc -O2 -o syncclient "$here"/syncclient.c "$here"/syncdelta.c "$here"/syncchunk.c \
+    "$here"/synctree.c "$here"/syncignore.c "$here"/syncprefix.c "$here"/syncuring.c \
+    "$here"/synccoalesce.c "$here"/syncwatch.c "$here"/syncversion.c -pthread -lz || exit 1
+
+# Files of 24 bytes to just over 1 KB, 1000 to a directory
+if [ "$(find src -type f 2>/dev/null | wc -l)" -ne "$files" ]; then
+    rm -rf src
+    block=$(printf '%01024d' 0)
+    for ((i = 0; i < files; i++)); do
+        dir=src/d$((i / per_dir))
+        if ((i % per_dir == 0)); then mkdir -p "$dir"; fi
+        printf '%s\n' "file $i ${block:0:$((i % 1000))}" > "$dir/f$i"
+    done
+fi
+: > ignore.txt
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+secs() { printf "%d.%02d" $(($1 / 1000)) $(($1 % 1000 / 10)); }
+
+# run_backend name server_mode client_flags
+run_backend() {
+    rm -rf dst
+    rm -f server.log client.log
+
+    local start=$(now_ms)
+    stdbuf -oL ./syncserver -m "$2" -w 0 src 8080 0 > server.log 2>&1 &
+    local server=$!
+    until grep -q "listening" server.log 2>/dev/null; do
+        if ! kill -0 $server 2>/dev/null; then
+            echo "$1: server failed to start"; cat server.log; return 1
+        fi
+        sleep 0.01
+    done
+    local indexed=$(now_ms)
+
+    stdbuf -oL ./syncclient $3 dst ignore.txt > client.log 2>&1 &
+    local client=$!
+    while [ "$(grep -c "^Received and wrote file" client.log)" -lt "$files" ]; do
+        if ! kill -0 $client 2>/dev/null; then
+            echo "$1: client exited early"; tail -5 client.log; break
+        fi
+        sleep 0.05
+    done
+    local synced=$(now_ms)
+
+    kill $client $server 2>/dev/null
+    wait $client $server 2>/dev/null
+
+    local written=$(find dst -type f | wc -l)
+    printf "%-10s index %6ss   sync %6ss   %d/%d files\n" "$1" \
+        "$(secs $((indexed - start)))" "$(secs $((synced - indexed)))" "$written" "$files"
+    if ! diff -r -q src dst > /dev/null; then echo "$1: trees differ"; fi
+}
+
+echo "$files files in $((files / per_dir)) directories"
+run_backend blocking thread ""
+run_backend io_uring uring "-U"
@@ -0,0 +1,966 @@
+/*
+ * End-to-end benchmark for syncserver and syncclient
+ * --------------------------------------------------
+ * Runs a server and N clients on localhost, each client syncing into its
+ * own directory, then drives reproducible workloads through the server's
+ * directory and times how long every change takes to reach every client.
+ *
+ * Compile the benchmark (next to syncserver and syncclient)
+ * gcc -O2 -o syncbench syncbench.c syncwatch.c syncmetrics.c -pthread
+ *
+ * Usage:
+ *   ./syncbench [-n clients] [-l workload,...] [-f small_files] [-H huge_mb]
+ *               [-r renames] [-D depth] [-S seed] [-t timeout_s] [-p port]
+ *               [-B bin_dir] [-s "server options"] [-c "client options"]
+ *               [-o results.json] [-g baseline.json] [-G percent] [work_dir]
+ *
+ * Example:
+ *   ./syncbench -n 8 -o base.json
+ *   ./syncbench -n 8 -s "-m epoll -s 2" -c "-z" -g base.json
+ *
+ * Workloads (-l, default all of them in this order):
+ *
+ *   small    -f files of 64 bytes to 16 KB, 100 to a directory (default 5000)
+ *   huge     three files of -H MB each (default 64)
+ *   rename   -r files (default 2000), then every one of them renamed
+ *   replace  -r files, each then overwritten by a file moved in from outside
+ *            the tree and deleted straight after, inside one event window
+ *   deep     four directory chains -D levels deep (default 64), each level
+ *            created and given four small files in turn
+ *
+ * File names, sizes, contents and the rename order all come from -S seed,
+ * so two runs with the same options do the same work. Before a workload is
+ * timed, what it builds on (its directories, the files a rename storm
+ * renames) is created and allowed to reach every client.
+ *
+ * The work directory (default /tmp/syncbench) gets the server's directory
+ * src, stage for the files replace moves in, one directory per client c0,
+ * c1, ... and their logs; all of these are emptied first. The benchmark watches every client
+ * directory with inotify (one instance per client, so a busy client cannot
+ * overflow another's queue) and counts a change as arrived when the file
+ * appears under its final name with its final size, the directory exists,
+ * or a deleted file is gone. The server runs with its default 50 ms event window (-s "-w 0"
+ * turns it off), which is part of every latency.
+ *
+ * Results go to -o (default stdout) as JSON, one line per workload:
+ *
+ *   ops, bytes           changes made and bytes written to src
+ *   duration_s           first change made to last change arrived anywhere
+ *   throughput_mb_s      bytes delivered to all clients per second
+ *   ops_per_s            changes delivered to all clients per second
+ *   latency_ms           p50, p90, p99 and max from a change being made to
+ *                        it arriving at a client, over every client
+ *   missing              (change, client) pairs still missing at -t seconds
+ *   server, clients[]    CPU seconds used during the workload, resident
+ *                        memory afterwards and the process's peak so far
+ *
+ * With -g the results are compared with an earlier run's file: a workload
+ * whose p99 latency grew or whose ops_per_s fell by more than -G percent
+ * (default 20) is reported, and the exit status is 2. A run with missing
+ * changes exits with 1.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "syncproto.h"
+#include "syncwatch.h"
+#include "syncmetrics.h"
+
+#define MAX_PATH 4096
+#define MAX_CLIENTS 256
+#define MAX_ARGS 64
+#define EXPECT_BUCKETS 65536
+#define WRITE_BLOCK (1024 * 1024)
+#define WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM)
+#define SMALL_PER_DIR 100
+#define HUGE_FILES 3
+#define DEEP_CHAINS 4
+#define DEEP_FILES 4
+#define DEFAULT_TIMEOUT 120
+
+// One client and the watches on its directory
+typedef struct {
+    pid_t pid;
+    int inotify_fd;
+    WatchTable *watches;
+    char dir[16];
+} Mirror;
+
+// A change waiting to reach every client: path must become a regular file
+// of size bytes, a directory if size is -1, or disappear if size is -2
+typedef struct Expect {
+    struct Expect *next;
+    char *path;
+    off_t size;
+    uint64_t made_ns;
+    uint8_t arrived[];      // per client
+} Expect;
+
+typedef struct {
+    double cpu_s;
+    long rss_kb;
+    long peak_rss_kb;
+} Usage;
+
+typedef struct {
+    const char *name;
+    void (*prepare)(void);
+    void (*run)(void);
+} Workload;
+
+typedef struct {
+    const char *name;
+    size_t ops;
+    uint64_t bytes;
+    double duration_s;
+    double latency_ms[4];   // p50, p90, p99, max
+    size_t missing;
+    uint64_t overflows;
+    Usage server;
+    Usage clients[MAX_CLIENTS];
+} Result;
+
+static char work_dir[MAX_PATH] = "/tmp/syncbench";
+static char bin_dir[MAX_PATH] = ".";
+static char *server_args[MAX_ARGS];
+static char *client_args[MAX_ARGS];
+static int nserver_args, nclient_args;
+static int port = 8099;
+static int timeout_s = DEFAULT_TIMEOUT;
+static size_t small_files = 5000;
+static size_t huge_mb = 64;
+static size_t renames = 2000;
+static size_t deep_levels = 64;
+static uint64_t seed = 1;
+
+static pid_t server_pid;
+static Mirror mirrors[MAX_CLIENTS];
+static int nclients = 4;
+static volatile int watching = 1;
+
+// Changes in flight, guarded by expect_lock
+static pthread_mutex_t expect_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t expect_cond = PTHREAD_COND_INITIALIZER;
+static Expect *expects[EXPECT_BUCKETS];
+static size_t outstanding;          // (change, client) pairs not arrived
+static int timing;                  // record latencies (not while preparing)
+static Histogram latencies;
+static uint64_t last_arrival_ns;
+static uint64_t overflows;
+
+static uint64_t rng_state;
+static size_t ops_made;
+static uint64_t bytes_made;
+
+// xorshift64*: cheap and the same everywhere for a given seed
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static size_t rng_range(size_t lo, size_t hi) {
+    return lo + rng_next() % (hi - lo + 1);
+}
+
+static uint32_t hash_path(const char *path) {
+    uint32_t h = 2166136261u;
+    for (const char *c = path; *c; c++) h = (h ^ (uint8_t)*c) * 16777619u;
+    return h;
+}
+
+// Start waiting for path to reach every client; replaces an older wait on
+// the same path
+static void expect(const char *path, off_t size) {
+    Expect *e = calloc(1, sizeof(Expect) + nclients);
+    if (!e || !(e->path = strdup(path))) {
+        perror("expect");
+        exit(EXIT_FAILURE);
+    }
+    e->size = size;
+    Expect **bucket = &expects[hash_path(path) % EXPECT_BUCKETS];
+
+    pthread_mutex_lock(&expect_lock);
+    for (Expect **link = bucket; *link; link = &(*link)->next) {
+        if (strcmp((*link)->path, path) != 0) continue;
+        Expect *old = *link;
+        for (int c = 0; c < nclients; c++) outstanding -= !old->arrived[c];
+        *link = old->next;
+        free(old->path);
+        free(old);
+        break;
+    }
+    e->next = *bucket;
+    *bucket = e;
+    outstanding += nclients;
+    ops_made++;
+    e->made_ns = metrics_now_ns();
+    pthread_mutex_unlock(&expect_lock);
+}
+
+static void forget_all(void) {
+    pthread_mutex_lock(&expect_lock);
+    for (size_t b = 0; b < EXPECT_BUCKETS; b++) {
+        while (expects[b]) {
+            Expect *e = expects[b];
+            expects[b] = e->next;
+            free(e->path);
+            free(e);
+        }
+    }
+    outstanding = 0;
+    pthread_mutex_unlock(&expect_lock);
+}
+
+// Something appeared at path (relative to the synced root) in a client's
+// directory: if it is what we are waiting for, it has arrived there
+static void check_arrival(int client, const char *path) {
+    char full[MAX_PATH];
+    struct stat st;
+    if (snprintf(full, sizeof(full), "%s/%s", mirrors[client].dir, path) >= (int)sizeof(full)) {
+        return;
+    }
+    int exists = lstat(full, &st) == 0;
+    if (!exists && errno != ENOENT) return;
+    uint64_t now = metrics_now_ns();
+
+    pthread_mutex_lock(&expect_lock);
+    Expect *e = expects[hash_path(path) % EXPECT_BUCKETS];
+    while (e && strcmp(e->path, path) != 0) e = e->next;
+    if (e && !e->arrived[client] &&
+        (e->size == -2 ? !exists :
+         exists && (e->size < 0 ? S_ISDIR(st.st_mode) :
+                    S_ISREG(st.st_mode) && st.st_size == e->size))) {
+        e->arrived[client] = 1;
+        if (timing) {
+            hist_record(&latencies, now - e->made_ns);
+            last_arrival_ns = now;
+        }
+        if (--outstanding == 0) pthread_cond_broadcast(&expect_cond);
+    }
+    pthread_mutex_unlock(&expect_lock);
+}
+
+// Watch a client's directory and everything below it, checking what is
+// already there: files can land in a new directory before it is watched
+static void add_watches(int client, const char *rel) {
+    Mirror *m = &mirrors[client];
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s%s%s", m->dir, rel[0] ? "/" : "", rel);
+    int wd = inotify_add_watch(m->inotify_fd, path, WATCH_MASK);
+    if (wd < 0 || watch_table_set(m->watches, wd, rel) < 0) return;
+    if (rel[0]) check_arrival(client, rel);
+
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            sync_is_temp(entry->d_name)) {
+            continue;
+        }
+        char subpath[MAX_PATH];
+        struct stat st;
+        if (snprintf(subpath, sizeof(subpath), "%s%s%s", rel, rel[0] ? "/" : "",
+                     entry->d_name) >= (int)sizeof(subpath) ||
+            fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) add_watches(client, subpath);
+        else check_arrival(client, subpath);
+    }
+    closedir(dir);
+}
+
+// Handle one batch of inotify events from a client's directory
+static void read_events(int client) {
+    Mirror *m = &mirrors[client];
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(m->inotify_fd, buffer, sizeof(buffer));
+    for (char *p = buffer; len > 0 && p < buffer + len;) {
+        struct inotify_event *event = (struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            // Lost events: look at the whole tree again
+            __atomic_fetch_add(&overflows, 1, __ATOMIC_RELAXED);
+            add_watches(client, "");
+            continue;
+        }
+        if (event->mask & IN_IGNORED) {
+            watch_table_remove(m->watches, event->wd);
+            continue;
+        }
+        const char *dir = watch_table_get(m->watches, event->wd);
+        if (!dir || event->len == 0 || sync_is_temp(event->name)) continue;
+
+        char rel[MAX_PATH];
+        if (snprintf(rel, sizeof(rel), "%s%s%s", dir, dir[0] ? "/" : "",
+                     event->name) >= (int)sizeof(rel)) {
+            continue;
+        }
+        if (event->mask & IN_ISDIR) add_watches(client, rel);
+        else check_arrival(client, rel);
+    }
+}
+
+// Watcher thread: waits on every client's inotify instance at once
+static void *watch_clients(void *arg) {
+    (void)arg;
+    struct pollfd fds[MAX_CLIENTS];
+    for (int c = 0; c < nclients; c++) {
+        fds[c].fd = mirrors[c].inotify_fd;
+        fds[c].events = POLLIN;
+    }
+    while (watching) {
+        if (poll(fds, nclients, 100) <= 0) continue;
+        for (int c = 0; c < nclients; c++) {
+            if (fds[c].revents & POLLIN) read_events(c);
+        }
+    }
+    return NULL;
+}
+
+// Wait until every change has reached every client; returns the number of
+// (change, client) pairs still missing after the timeout
+static size_t wait_arrived(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_s;
+
+    pthread_mutex_lock(&expect_lock);
+    while (outstanding > 0 &&
+           pthread_cond_timedwait(&expect_cond, &expect_lock, &deadline) != ETIMEDOUT) {
+    }
+    size_t missing = outstanding;
+    pthread_mutex_unlock(&expect_lock);
+    return missing;
+}
+
+static void src_path(char *out, const char *rel) {
+    snprintf(out, MAX_PATH, "src/%s", rel);
+}
+
+static void make_dir(const char *rel, int wait) {
+    char path[MAX_PATH];
+    src_path(path, rel);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (wait) expect(rel, -1);
+}
+
+// Write size seeded bytes to rel; the change counts as made at close,
+// which is when the server hears of it
+static void write_file(const char *rel, size_t size) {
+    static char block[WRITE_BLOCK];
+    char path[MAX_PATH];
+    src_path(path, rel);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t done = 0; done < size;) {
+        size_t n = size - done < sizeof(block) ? size - done : sizeof(block);
+        for (size_t i = 0; i < n; i += 8) {
+            uint64_t r = rng_next();
+            memcpy(block + i, &r, n - i < 8 ? n - i : 8);
+        }
+        if (write(fd, block, n) != (ssize_t)n) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+    expect(rel, size);
+    bytes_made += size;
+    close(fd);
+}
+
+static void prepare_small(void) {
+    make_dir("small", 1);
+    for (size_t d = 0; d * SMALL_PER_DIR < small_files; d++) {
+        char rel[64];
+        snprintf(rel, sizeof(rel), "small/d%zu", d);
+        make_dir(rel, 1);
+    }
+}
+
+static void run_small(void) {
+    for (size_t i = 0; i < small_files; i++) {
+        char rel[64];
+        snprintf(rel, sizeof(rel), "small/d%zu/f%zu", i / SMALL_PER_DIR, i);
+        write_file(rel, rng_range(64, 16 * 1024));
+    }
+}
+
+static void prepare_huge(void) {
+    make_dir("huge", 1);
+}
+
+static void run_huge(void) {
+    for (int i = 0; i < HUGE_FILES; i++) {
+        char rel[64];
+        snprintf(rel, sizeof(rel), "huge/f%d", i);
+        write_file(rel, huge_mb * 1024 * 1024);
+    }
+}
+
+static size_t *rename_sizes;
+
+static void prepare_rename(void) {
+    make_dir("rename", 1);
+    rename_sizes = realloc(rename_sizes, renames * sizeof(size_t));
+    if (!rename_sizes) {
+        perror("rename");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < renames; i++) {
+        char rel[64];
+        snprintf(rel, sizeof(rel), "rename/f%zu", i);
+        rename_sizes[i] = rng_range(64, 4096);
+        write_file(rel, rename_sizes[i]);
+    }
+}
+
+static void run_rename(void) {
+    size_t *order = malloc(renames * sizeof(size_t));
+    if (!order) {
+        perror("rename");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < renames; i++) order[i] = i;
+    for (size_t i = renames; i > 1; i--) {
+        size_t j = rng_next() % i, t = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = t;
+    }
+    for (size_t i = 0; i < renames; i++) {
+        char from[MAX_PATH], to[MAX_PATH], rel[64];
+        snprintf(rel, sizeof(rel), "rename/f%zu", order[i]);
+        src_path(from, rel);
+        snprintf(rel, sizeof(rel), "rename/r%zu", order[i]);
+        src_path(to, rel);
+        expect(rel, rename_sizes[order[i]]);
+        if (rename(from, to) < 0) {
+            perror(from);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(order);
+}
+
+static void prepare_replace(void) {
+    make_dir("replace", 1);
+    for (size_t i = 0; i < renames; i++) {
+        char rel[64];
+        snprintf(rel, sizeof(rel), "replace/f%zu", i);
+        write_file(rel, rng_range(64, 4096));
+    }
+}
+
+// The server sees a MOVED_TO with no MOVED_FROM and then a DELETE for the
+// same name: the file the move replaced must still go from every client
+static void run_replace(void) {
+    for (size_t i = 0; i < renames; i++) {
+        char staged[64], rel[64], path[MAX_PATH];
+        snprintf(staged, sizeof(staged), "stage/f%zu", i);
+        int fd = open(staged, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror(staged);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        snprintf(rel, sizeof(rel), "replace/f%zu", i);
+        src_path(path, rel);
+        expect(rel, -2);
+        if (rename(staged, path) < 0 || unlink(path) < 0) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void prepare_deep(void) {
+    make_dir("deep", 1);
+}
+
+static void run_deep(void) {
+    for (int c = 0; c < DEEP_CHAINS; c++) {
+        char rel[MAX_PATH];
+        size_t len = snprintf(rel, sizeof(rel), "deep/c%d", c);
+        for (size_t level = 0; level < deep_levels && len + 32 < sizeof(rel); level++) {
+            if (level) len += snprintf(rel + len, sizeof(rel) - len, "/l%zu", level);
+            make_dir(rel, 0);
+            for (int f = 0; f < DEEP_FILES; f++) {
+                char file[MAX_PATH];
+                snprintf(file, sizeof(file), "%s/f%d", rel, f);
+                write_file(file, rng_range(64, 4096));
+            }
+        }
+    }
+}
+
+static const Workload workloads[] = {
+    { "small", prepare_small, run_small },
+    { "huge", prepare_huge, run_huge },
+    { "rename", prepare_rename, run_rename },
+    { "replace", prepare_replace, run_replace },
+    { "deep", prepare_deep, run_deep },
+};
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// CPU time and memory of a child from /proc
+static Usage read_usage(pid_t pid) {
+    Usage u = {0};
+    char path[64], line[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        unsigned long utime = 0, stime = 0;
+        char *end;
+        if (fgets(line, sizeof(line), fp) && (end = strrchr(line, ')')) != NULL &&
+            sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                   &utime, &stime) == 2) {
+            u.cpu_s = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+        fclose(fp);
+    }
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    fp = fopen(path, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            sscanf(line, "VmRSS: %ld", &u.rss_kb);
+            sscanf(line, "VmHWM: %ld", &u.peak_rss_kb);
+        }
+        fclose(fp);
+    }
+    return u;
+}
+
+static Usage usage_since(pid_t pid, const Usage *before) {
+    Usage u = read_usage(pid);
+    u.cpu_s -= before->cpu_s;
+    return u;
+}
+
+// Run one workload: prepare, let that settle, then time the changes
+static void run_workload(const Workload *w, Result *r) {
+    r->name = w->name;
+    timing = 0;
+    w->prepare();
+    if (wait_arrived() > 0) {
+        fprintf(stderr, "%s: setup did not reach every client in %d s\n", w->name, timeout_s);
+    }
+    forget_all();
+
+    Usage server_before = read_usage(server_pid), client_before[MAX_CLIENTS];
+    for (int c = 0; c < nclients; c++) client_before[c] = read_usage(mirrors[c].pid);
+    memset(&latencies, 0, sizeof(latencies));
+    uint64_t overflows_before = __atomic_load_n(&overflows, __ATOMIC_RELAXED);
+    ops_made = 0;
+    bytes_made = 0;
+
+    uint64_t start = metrics_now_ns();
+    pthread_mutex_lock(&expect_lock);
+    timing = 1;
+    last_arrival_ns = start;
+    pthread_mutex_unlock(&expect_lock);
+    w->run();
+    r->missing = wait_arrived();
+
+    pthread_mutex_lock(&expect_lock);
+    timing = 0;
+    r->duration_s = (last_arrival_ns - start) / 1e9;
+    r->latency_ms[0] = hist_quantile(&latencies, 0.50) / 1e6;
+    r->latency_ms[1] = hist_quantile(&latencies, 0.90) / 1e6;
+    r->latency_ms[2] = hist_quantile(&latencies, 0.99) / 1e6;
+    r->latency_ms[3] = latencies.max / 1e6;
+    pthread_mutex_unlock(&expect_lock);
+    r->ops = ops_made;
+    r->bytes = bytes_made;
+    r->overflows = __atomic_load_n(&overflows, __ATOMIC_RELAXED) - overflows_before;
+
+    r->server = usage_since(server_pid, &server_before);
+    for (int c = 0; c < nclients; c++) r->clients[c] = usage_since(mirrors[c].pid, &client_before[c]);
+    forget_all();
+}
+
+static double throughput_mb_s(const Result *r) {
+    return r->duration_s > 0 ? r->bytes * (double)nclients / r->duration_s / 1e6 : 0;
+}
+
+static double ops_per_s(const Result *r) {
+    return r->duration_s > 0 ? r->ops * (double)nclients / r->duration_s : 0;
+}
+
+static void write_usage(FILE *out, const Usage *u) {
+    fprintf(out, "{\"cpu_s\": %.3f, \"rss_kb\": %ld, \"peak_rss_kb\": %ld}",
+            u->cpu_s, u->rss_kb, u->peak_rss_kb);
+}
+
+static void write_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', out);
+        if ((unsigned char)*s >= 0x20) fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void write_args(FILE *out, char **args, int n) {
+    fputc('[', out);
+    for (int i = 0; i < n; i++) {
+        if (i) fputs(", ", out);
+        write_json_string(out, args[i]);
+    }
+    fputc(']', out);
+}
+
+static void write_results(FILE *out, const Result *results, size_t n) {
+    fprintf(out, "{\n\"seed\": %llu, \"clients\": %d, \"server_options\": ",
+            (unsigned long long)seed, nclients);
+    write_args(out, server_args, nserver_args);
+    fputs(", \"client_options\": ", out);
+    write_args(out, client_args, nclient_args);
+    fputs(",\n\"workloads\": [\n", out);
+    for (size_t i = 0; i < n; i++) {
+        const Result *r = &results[i];
+        fprintf(out, "{\"name\": \"%s\", \"ops\": %zu, \"bytes\": %llu, \"duration_s\": %.3f, "
+                "\"throughput_mb_s\": %.2f, \"ops_per_s\": %.1f, \"latency_ms\": {\"p50\": %.2f, "
+                "\"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}, \"missing\": %zu, \"overflows\": %llu, "
+                "\"server\": ", r->name, r->ops, (unsigned long long)r->bytes, r->duration_s,
+                throughput_mb_s(r), ops_per_s(r), r->latency_ms[0], r->latency_ms[1],
+                r->latency_ms[2], r->latency_ms[3], r->missing, (unsigned long long)r->overflows);
+        write_usage(out, &r->server);
+        fputs(", \"clients\": [", out);
+        for (int c = 0; c < nclients; c++) {
+            if (c) fputs(", ", out);
+            write_usage(out, &r->clients[c]);
+        }
+        fprintf(out, "]}%s\n", i + 1 < n ? "," : "");
+    }
+    fputs("]\n}\n", out);
+}
+
+// Number after "key": on a line of a results file
+static int json_number(const char *line, const char *key, double *value) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char *at = strstr(line, pattern);
+    if (!at) return -1;
+    *value = strtod(at + strlen(pattern), NULL);
+    return 0;
+}
+
+// Compare with a results file written by an earlier run; each workload
+// sits on a line of its own there. Returns the number of regressions.
+static int compare_baseline(const char *file, const Result *results, size_t n, double percent) {
+    FILE *fp = fopen(file, "r");
+    if (!fp) {
+        perror(file);
+        return -1;
+    }
+    int regressions = 0;
+    char line[8192];
+    while (fgets(line, sizeof(line), fp)) {
+        for (size_t i = 0; i < n; i++) {
+            char name[64];
+            double p99, rate;
+            snprintf(name, sizeof(name), "{\"name\": \"%s\",", results[i].name);
+            if (strncmp(line, name, strlen(name)) != 0 || json_number(line, "p99", &p99) < 0 ||
+                json_number(line, "ops_per_s", &rate) < 0) {
+                continue;
+            }
+            if (results[i].latency_ms[2] > p99 * (1 + percent / 100)) {
+                fprintf(stderr, "%s: p99 latency %.2f ms, was %.2f ms\n", results[i].name,
+                        results[i].latency_ms[2], p99);
+                regressions++;
+            }
+            if (ops_per_s(&results[i]) < rate * (1 - percent / 100)) {
+                fprintf(stderr, "%s: %.1f ops/s, was %.1f\n", results[i].name,
+                        ops_per_s(&results[i]), rate);
+                regressions++;
+            }
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+// Split an option string on spaces into args
+static int split_args(char *s, char **args) {
+    int n = 0;
+    for (char *tok = strtok(s, " \t"); tok && n < MAX_ARGS - 8; tok = strtok(NULL, " \t")) {
+        args[n++] = tok;
+    }
+    return n;
+}
+
+// Start a child with its output going to log
+static pid_t spawn(char **argv, const char *log) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void stop_children(void) {
+    for (int c = 0; c < nclients; c++) {
+        if (mirrors[c].pid > 0) kill(mirrors[c].pid, SIGTERM);
+    }
+    if (server_pid > 0) kill(server_pid, SIGTERM);
+    for (int c = 0; c < nclients; c++) {
+        if (mirrors[c].pid > 0) waitpid(mirrors[c].pid, NULL, 0);
+        mirrors[c].pid = 0;
+    }
+    if (server_pid > 0) waitpid(server_pid, NULL, 0);
+    server_pid = 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static void fresh_dir(const char *path) {
+    nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    if (mkdir(path, 0755) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void start_server(void) {
+    char binary[MAX_PATH + 16], port_arg[16];
+    snprintf(binary, sizeof(binary), "%s/syncserver", bin_dir);
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    char *argv[MAX_ARGS];
+    int n = 0;
+    argv[n++] = binary;
+    for (int i = 0; i < nserver_args; i++) argv[n++] = server_args[i];
+    argv[n++] = "src";
+    argv[n++] = port_arg;
+    argv[n++] = "0";
+    argv[n] = NULL;
+    server_pid = spawn(argv, "server.log");
+
+    // Up once it accepts connections (its log is not line buffered)
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port),
+                              .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    for (int tries = 0; tries < 1000; tries++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int up = fd >= 0 && connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0;
+        if (fd >= 0) close(fd);
+        if (up) return;
+        if (waitpid(server_pid, NULL, WNOHANG) == server_pid) break;
+        usleep(10000);
+    }
+    server_pid = 0;
+    fprintf(stderr, "Server did not start; see %s/server.log\n", work_dir);
+    exit(EXIT_FAILURE);
+}
+
+static void start_clients(void) {
+    char binary[MAX_PATH + 16], addr[32];
+    snprintf(binary, sizeof(binary), "%s/syncclient", bin_dir);
+    snprintf(addr, sizeof(addr), "127.0.0.1:%d", port);
+    FILE *fp = fopen("ignore.txt", "w");
+    if (fp) fclose(fp);
+
+    for (int c = 0; c < nclients; c++) {
+        Mirror *m = &mirrors[c];
+        snprintf(m->dir, sizeof(m->dir), "c%d", c);
+        fresh_dir(m->dir);
+        m->watches = watch_table_new();
+        m->inotify_fd = inotify_init1(IN_NONBLOCK);
+        if (!m->watches || m->inotify_fd < 0) {
+            perror("inotify");
+            exit(EXIT_FAILURE);
+        }
+        add_watches(c, "");
+
+        char *argv[MAX_ARGS], log[32];
+        int n = 0;
+        argv[n++] = binary;
+        argv[n++] = "-a";
+        argv[n++] = addr;
+        for (int i = 0; i < nclient_args; i++) argv[n++] = client_args[i];
+        argv[n++] = m->dir;
+        argv[n++] = "ignore.txt";
+        argv[n] = NULL;
+        snprintf(log, sizeof(log), "%s.log", m->dir);
+        m->pid = spawn(argv, log);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *list = NULL, *out_file = NULL, *baseline = NULL;
+    double percent = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l:f:H:r:D:S:t:p:B:s:c:o:g:G:")) != -1) {
+        if (opt == 'n') {
+            nclients = atoi(optarg);
+            if (nclients < 1 || nclients > MAX_CLIENTS) {
+                fprintf(stderr, "Client count must be between 1 and %d\n", MAX_CLIENTS);
+                exit(EXIT_FAILURE);
+            }
+        } else if (opt == 'l') {
+            list = optarg;
+        } else if (opt == 'f') {
+            small_files = strtoul(optarg, NULL, 10);
+        } else if (opt == 'H') {
+            huge_mb = strtoul(optarg, NULL, 10);
+        } else if (opt == 'r') {
+            renames = strtoul(optarg, NULL, 10);
+        } else if (opt == 'D') {
+            deep_levels = strtoul(optarg, NULL, 10);
+        } else if (opt == 'S') {
+            seed = strtoull(optarg, NULL, 10);
+        } else if (opt == 't') {
+            timeout_s = atoi(optarg);
+        } else if (opt == 'p') {
+            port = atoi(optarg);
+        } else if (opt == 'B') {
+            strncpy(bin_dir, optarg, sizeof(bin_dir) - 1);
+        } else if (opt == 's') {
+            nserver_args = split_args(optarg, server_args);
+        } else if (opt == 'c') {
+            nclient_args = split_args(optarg, client_args);
+        } else if (opt == 'o') {
+            out_file = optarg;
+        } else if (opt == 'g') {
+            baseline = optarg;
+        } else if (opt == 'G') {
+            percent = atof(optarg);
+        } else {
+            argc = -1;
+        }
+    }
+    if (argc < 0 || argc - optind > 1 || timeout_s < 1) {
+        printf("Usage: %s [-n clients] [-l workload,...] [-f small_files] [-H huge_mb] "
+               "[-r renames] [-D depth] [-S seed] [-t timeout_s] [-p port] [-B bin_dir] "
+               "[-s \"server options\"] [-c \"client options\"] [-o results.json] "
+               "[-g baseline.json] [-G percent] [work_dir]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc - optind == 1) strncpy(work_dir, argv[optind], sizeof(work_dir) - 1);
+    rng_state = seed ? seed : 1;
+
+    const Workload *chosen[NWORKLOADS];
+    size_t nchosen = 0;
+    for (size_t i = 0; i < NWORKLOADS; i++) {
+        const char *at = list ? strstr(list, workloads[i].name) : NULL;
+        size_t len = strlen(workloads[i].name);
+        if (!list || (at && (at == list || at[-1] == ',') && (at[len] == '\0' || at[len] == ','))) {
+            chosen[nchosen++] = &workloads[i];
+        }
+    }
+    if (nchosen == 0) {
+        fprintf(stderr, "No workload in %s (small, huge, rename, replace, deep)\n", list);
+        exit(EXIT_FAILURE);
+    }
+
+    // Paths below are relative to the work directory
+    char resolved[MAX_PATH];
+    if (!realpath(bin_dir, resolved)) {
+        perror(bin_dir);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(bin_dir, resolved);
+    FILE *out = stdout;
+    if (out_file && !(out = fopen(out_file, "w"))) {
+        perror(out_file);
+        exit(EXIT_FAILURE);
+    }
+    if ((mkdir(work_dir, 0755) < 0 && errno != EEXIST) || chdir(work_dir) < 0) {
+        perror(work_dir);
+        exit(EXIT_FAILURE);
+    }
+    fresh_dir("src");
+    fresh_dir("stage");
+
+    atexit(stop_children);
+    start_server();
+    start_clients();
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, watch_clients, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every client is connected and synced once this reaches all of them
+    make_dir("ready", 1);
+    if (wait_arrived() > 0) {
+        fprintf(stderr, "Not every client connected within %d s; see %s/c*.log\n",
+                timeout_s, work_dir);
+        exit(EXIT_FAILURE);
+    }
+    forget_all();
+
+    static Result results[NWORKLOADS];
+    size_t missing = 0;
+    for (size_t i = 0; i < nchosen; i++) {
+        Result *r = &results[i];
+        run_workload(chosen[i], r);
+        missing += r->missing;
+        double client_cpu = 0;
+        for (int c = 0; c < nclients; c++) client_cpu += r->clients[c].cpu_s;
+        fprintf(stderr, "%-8s %6zu ops %9.2f MB/s %9.1f ops/s  p50 %7.2f  p99 %7.2f  max %7.2f ms"
+                "  cpu server %.2f s, client %.2f s avg%s\n", r->name, r->ops,
+                throughput_mb_s(r), ops_per_s(r), r->latency_ms[0], r->latency_ms[2],
+                r->latency_ms[3], r->server.cpu_s, client_cpu / nclients,
+                r->missing ? "  (missing changes)" : "");
+    }
+
+    watching = 0;
+    pthread_join(watcher, NULL);
+    stop_children();
+    write_results(out, results, nchosen);
+    if (out != stdout) fclose(out);
+
+    if (baseline) {
+        int regressions = compare_baseline(baseline, results, nchosen, percent);
+        if (regressions != 0) return 2;
+    }
+    return missing ? 1 : 0;
+}
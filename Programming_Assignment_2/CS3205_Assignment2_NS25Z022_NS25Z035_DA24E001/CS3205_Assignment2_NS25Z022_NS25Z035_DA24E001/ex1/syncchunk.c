@@ -0,0 +1,487 @@
+// FastCDC chunking and the persistent chunk index (see syncchunk.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "syncchunk.h"
+
+#define INDEX_MAGIC        0x53594e43   // "SYNC"
+#define INDEX_VERSION      1
+#define INDEX_MIN_SLOTS    4096
+#define PATHS_MIN_SIZE     (64 * 1024)
+#define MAX_INDEX_PATH     4096
+
+// FastCDC normalized chunking masks for an 8 KB average
+#define MASK_S  0x0003590703530000ULL
+#define MASK_L  0x0000d90003530000ULL
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;      // number of slots
+    uint64_t count;         // used slots
+    uint64_t paths_len;     // bytes used in chunks.paths
+} IndexHeader;
+
+typedef struct {
+    uint8_t hash[CHUNK_HASH_SIZE];
+    uint64_t offset;
+    uint64_t path_off;      // offset of the path in chunks.paths
+    uint32_t len;
+    uint32_t used;
+} IndexSlot;
+
+struct ChunkIndex {
+    pthread_mutex_t lock;
+    char dir[MAX_INDEX_PATH];
+    int fd;
+    IndexHeader *header;
+    IndexSlot *slots;
+    size_t map_size;
+    int paths_fd;
+    char *paths;
+    size_t paths_cap;
+    uint64_t last_path_off; // most recently appended path, reused while it repeats
+};
+
+/* ---------- SHA-256 ---------- */
+
+static const uint32_t sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_block(uint32_t state[8], const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                      sha_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256_init(Sha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->len = 0;
+}
+
+void sha256_update(Sha256 *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    size_t used = ctx->len % 64;
+    ctx->len += len;
+    if (used) {
+        size_t take = len < 64 - used ? len : 64 - used;
+        memcpy(ctx->block + used, p, take);
+        p += take;
+        len -= take;
+        if (used + take < 64) return;
+        sha256_block(ctx->state, ctx->block);
+    }
+    while (len >= 64) {
+        sha256_block(ctx->state, p);
+        p += 64;
+        len -= 64;
+    }
+    memcpy(ctx->block, p, len);
+}
+
+void sha256_final(Sha256 *ctx, uint8_t out[CHUNK_HASH_SIZE]) {
+    uint8_t tail[128] = {0};
+    size_t left = ctx->len % 64;
+    memcpy(tail, ctx->block, left);
+    tail[left] = 0x80;
+    size_t tail_len = left < 56 ? 64 : 128;
+    uint64_t bits = ctx->len * 8;
+    for (int i = 0; i < 8; i++) tail[tail_len - 1 - i] = bits >> (8 * i);
+    sha256_block(ctx->state, tail);
+    if (tail_len == 128) sha256_block(ctx->state, tail + 64);
+
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = ctx->state[i] >> 24;
+        out[4 * i + 1] = ctx->state[i] >> 16;
+        out[4 * i + 2] = ctx->state[i] >> 8;
+        out[4 * i + 3] = ctx->state[i];
+    }
+}
+
+void chunk_sha256(const void *data, size_t len, uint8_t out[CHUNK_HASH_SIZE]) {
+    Sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, out);
+}
+
+/* ---------- FastCDC ---------- */
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// Both ends must agree on the table, so it is derived from a fixed seed
+static void init_gear(void) {
+    uint64_t x = 0x5359434843444321ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static size_t next_cut(const uint8_t *p, size_t n) {
+    if (n <= CHUNK_MIN_SIZE) return n;
+    if (n > CHUNK_MAX_SIZE) n = CHUNK_MAX_SIZE;
+    size_t normal = n < CHUNK_AVG_SIZE ? n : CHUNK_AVG_SIZE;
+
+    uint64_t fp = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear[p[i]];
+        if (!(fp & MASK_S)) return i;
+    }
+    for (; i < n; i++) {
+        fp = (fp << 1) + gear[p[i]];
+        if (!(fp & MASK_L)) return i;
+    }
+    return n;
+}
+
+int chunk_buffer(const uint8_t *data, size_t size, ChunkRef **chunks, size_t *count) {
+    pthread_once(&gear_once, init_gear);
+
+    size_t cap = size / CHUNK_AVG_SIZE + 1, n = 0;
+    ChunkRef *out = malloc(cap * sizeof(ChunkRef));
+    if (!out) return -1;
+
+    size_t pos = 0;
+    while (pos < size) {
+        if (n == cap) {
+            cap *= 2;
+            ChunkRef *grown = realloc(out, cap * sizeof(ChunkRef));
+            if (!grown) {
+                free(out);
+                return -1;
+            }
+            out = grown;
+        }
+        size_t len = next_cut(data + pos, size - pos);
+        out[n].offset = pos;
+        out[n].len = len;
+        chunk_sha256(data + pos, len, out[n].hash);
+        n++;
+        pos += len;
+    }
+    *chunks = out;
+    *count = n;
+    return 0;
+}
+
+/* ---------- persistent index ---------- */
+
+static uint64_t slot_of(const uint8_t *hash, uint64_t capacity) {
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h));
+    return h & (capacity - 1);
+}
+
+static int map_table(ChunkIndex *index) {
+    struct stat st;
+    if (fstat(index->fd, &st) < 0) return -1;
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, index->fd, 0);
+    if (map == MAP_FAILED) return -1;
+    index->header = map;
+    index->slots = (IndexSlot *)(index->header + 1);
+    index->map_size = st.st_size;
+    return 0;
+}
+
+static int map_paths(ChunkIndex *index, size_t cap) {
+    if (index->paths) munmap(index->paths, index->paths_cap);
+    index->paths = NULL;
+    if (ftruncate(index->paths_fd, cap) < 0) return -1;
+    void *map = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, index->paths_fd, 0);
+    if (map == MAP_FAILED) return -1;
+    index->paths = map;
+    index->paths_cap = cap;
+    return 0;
+}
+
+// Create an empty table file with the given number of slots
+static int create_table(const char *path, uint64_t capacity) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    IndexHeader header = { INDEX_MAGIC, INDEX_VERSION, capacity, 0, 0 };
+    if (ftruncate(fd, sizeof(IndexHeader) + capacity * sizeof(IndexSlot)) < 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+ChunkIndex *chunk_index_open(const char *dir) {
+    ChunkIndex *index = calloc(1, sizeof(ChunkIndex));
+    if (!index) return NULL;
+    pthread_mutex_init(&index->lock, NULL);
+    snprintf(index->dir, sizeof(index->dir), "%s", dir);
+    mkdir(dir, 0755);
+
+    char path[MAX_INDEX_PATH + 32];
+    snprintf(path, sizeof(path), "%s/chunks.idx", dir);
+    index->fd = open(path, O_RDWR);
+    if (index->fd < 0) index->fd = create_table(path, INDEX_MIN_SLOTS);
+
+    snprintf(path, sizeof(path), "%s/chunks.paths", dir);
+    index->paths_fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    struct stat st;
+    if (index->fd < 0 || index->paths_fd < 0 || map_table(index) < 0 ||
+        fstat(index->paths_fd, &st) < 0 ||
+        map_paths(index, st.st_size > PATHS_MIN_SIZE ? st.st_size : PATHS_MIN_SIZE) < 0) {
+        chunk_index_close(index);
+        return NULL;
+    }
+
+    IndexHeader *h = index->header;
+    if (h->magic != INDEX_MAGIC || h->version != INDEX_VERSION ||
+        index->map_size != sizeof(IndexHeader) + h->capacity * sizeof(IndexSlot) ||
+        h->paths_len > index->paths_cap) {
+        fprintf(stderr, "Chunk index in %s is corrupt; starting a new one\n", dir);
+        munmap(index->header, index->map_size);
+        close(index->fd);
+        snprintf(path, sizeof(path), "%s/chunks.idx", dir);
+        index->fd = create_table(path, INDEX_MIN_SLOTS);
+        if (index->fd < 0 || map_table(index) < 0) {
+            chunk_index_close(index);
+            return NULL;
+        }
+    }
+    index->last_path_off = UINT64_MAX;
+    return index;
+}
+
+void chunk_index_close(ChunkIndex *index) {
+    if (!index) return;
+    if (index->header) munmap(index->header, index->map_size);
+    if (index->paths) munmap(index->paths, index->paths_cap);
+    if (index->fd >= 0) close(index->fd);
+    if (index->paths_fd >= 0) close(index->paths_fd);
+    pthread_mutex_destroy(&index->lock);
+    free(index);
+}
+
+static IndexSlot *find_slot(IndexSlot *slots, uint64_t capacity, const uint8_t *hash) {
+    uint64_t i = slot_of(hash, capacity);
+    while (slots[i].used && memcmp(slots[i].hash, hash, CHUNK_HASH_SIZE) != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+// Double the table: build it in a side file, then rename it over the old one
+static int grow_table(ChunkIndex *index) {
+    char path[MAX_INDEX_PATH + 32], temp[MAX_INDEX_PATH + 32];
+    snprintf(path, sizeof(path), "%s/chunks.idx", index->dir);
+    snprintf(temp, sizeof(temp), "%s/chunks.idx.tmp", index->dir);
+
+    uint64_t capacity = index->header->capacity * 2;
+    int fd = create_table(temp, capacity);
+    if (fd < 0) return -1;
+    size_t size = sizeof(IndexHeader) + capacity * sizeof(IndexSlot);
+    IndexHeader *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        close(fd);
+        unlink(temp);
+        return -1;
+    }
+
+    IndexSlot *slots = (IndexSlot *)(header + 1);
+    for (uint64_t i = 0; i < index->header->capacity; i++) {
+        if (index->slots[i].used) {
+            *find_slot(slots, capacity, index->slots[i].hash) = index->slots[i];
+        }
+    }
+    header->count = index->header->count;
+    header->paths_len = index->header->paths_len;
+
+    if (rename(temp, path) < 0) {
+        munmap(header, size);
+        close(fd);
+        unlink(temp);
+        return -1;
+    }
+    munmap(index->header, index->map_size);
+    close(index->fd);
+    index->fd = fd;
+    index->header = header;
+    index->slots = slots;
+    index->map_size = size;
+    return 0;
+}
+
+// Append a path to chunks.paths (or reuse the previous one); caller holds lock
+static int intern_path(ChunkIndex *index, const char *path, uint64_t *off) {
+    size_t len = strlen(path);
+    if (len >= MAX_INDEX_PATH) return -1;
+
+    uint64_t last = index->last_path_off;
+    if (last != UINT64_MAX && last + 2 <= index->header->paths_len) {
+        size_t last_len = (uint8_t)index->paths[last] << 8 | (uint8_t)index->paths[last + 1];
+        if (last_len == len && memcmp(index->paths + last + 2, path, len) == 0) {
+            *off = last;
+            return 0;
+        }
+    }
+
+    uint64_t used = index->header->paths_len;
+    if (used + len + 2 > index->paths_cap) {
+        size_t cap = index->paths_cap * 2;
+        while (used + len + 2 > cap) cap *= 2;
+        if (map_paths(index, cap) < 0) return -1;
+    }
+    index->paths[used] = len >> 8;
+    index->paths[used + 1] = len;
+    memcpy(index->paths + used + 2, path, len);
+    index->header->paths_len = used + len + 2;
+    index->last_path_off = used;
+    *off = used;
+    return 0;
+}
+
+int chunk_index_put(ChunkIndex *index, const uint8_t hash[CHUNK_HASH_SIZE],
+                    const char *path, uint64_t offset, uint32_t len) {
+    pthread_mutex_lock(&index->lock);
+    int rc = -1;
+    if ((index->header->count + 1) * 10 > index->header->capacity * 7 && grow_table(index) < 0) {
+        goto out;
+    }
+
+    uint64_t path_off;
+    if (intern_path(index, path, &path_off) < 0) goto out;
+
+    IndexSlot *slot = find_slot(index->slots, index->header->capacity, hash);
+    if (!slot->used) {
+        memcpy(slot->hash, hash, CHUNK_HASH_SIZE);
+        slot->used = 1;
+        index->header->count++;
+    }
+    slot->offset = offset;
+    slot->path_off = path_off;
+    slot->len = len;
+    rc = 0;
+out:
+    pthread_mutex_unlock(&index->lock);
+    return rc;
+}
+
+int chunk_index_add_file(ChunkIndex *index, const char *base_dir, const char *path) {
+    char filepath[MAX_INDEX_PATH * 2];
+    snprintf(filepath, sizeof(filepath), "%s/%s", base_dir, path);
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    ChunkRef *chunks;
+    size_t count;
+    int rc = chunk_buffer(data, st.st_size, &chunks, &count);
+    munmap(data, st.st_size);
+    if (rc < 0) return -1;
+    for (size_t i = 0; i < count && rc == 0; i++) {
+        rc = chunk_index_put(index, chunks[i].hash, path, chunks[i].offset, chunks[i].len);
+    }
+    free(chunks);
+    return rc;
+}
+
+int chunk_index_read(ChunkIndex *index, const char *base_dir,
+                     const uint8_t hash[CHUNK_HASH_SIZE], uint8_t *buf) {
+    char path[MAX_INDEX_PATH];
+    uint64_t offset;
+    uint32_t len;
+
+    pthread_mutex_lock(&index->lock);
+    IndexSlot *slot = find_slot(index->slots, index->header->capacity, hash);
+    int found = slot->used && slot->len <= CHUNK_MAX_SIZE &&
+                slot->path_off + 2 <= index->header->paths_len;
+    if (found) {
+        const char *p = index->paths + slot->path_off;
+        size_t path_len = (uint8_t)p[0] << 8 | (uint8_t)p[1];
+        found = slot->path_off + 2 + path_len <= index->header->paths_len;
+        if (found) {
+            memcpy(path, p + 2, path_len);
+            path[path_len] = '\0';
+            offset = slot->offset;
+            len = slot->len;
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+    if (!found) return -1;
+
+    char filepath[MAX_INDEX_PATH * 2];
+    snprintf(filepath, sizeof(filepath), "%s/%s", base_dir, path);
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, buf, len, offset);
+    close(fd);
+    if (n != (ssize_t)len) return -1;
+
+    uint8_t actual[CHUNK_HASH_SIZE];
+    chunk_sha256(buf, len, actual);
+    return memcmp(actual, hash, CHUNK_HASH_SIZE) == 0 ? (int)len : -1;
+}
@@ -0,0 +1,72 @@
+/*
+ * Content-addressed chunk store shared by syncserver and syncclient
+ * -----------------------------------------------------------------
+ * Files are split with FastCDC (content-defined boundaries, 2/8/64 KB
+ * min/avg/max) and every chunk is named by its SHA-256. A persistent index
+ * maps a chunk hash to a place it can be read from: (path relative to the
+ * synced directory, offset, length). The index is never trusted blindly;
+ * chunk_index_read re-hashes the bytes, so stale entries left behind by
+ * later edits are simply misses.
+ *
+ * On disk the index is two memory-mapped files in the store directory:
+ *   chunks.idx    header + open-addressing table of fixed-size slots
+ *   chunks.paths  append-only table of length-prefixed path strings
+ *
+ * SYNC_CHUNKS payload:        u64 file_size, u32 count, count x (hash, u32 len)
+ * SYNC_CHUNK_REQUEST payload: n x hash
+ * SYNC_CHUNK_DATA payload:    hash, then the chunk bytes (none = unavailable)
+ */
+
+#ifndef SYNCCHUNK_H
+#define SYNCCHUNK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CHUNK_HASH_SIZE   32
+#define CHUNK_MIN_SIZE    (2 * 1024)
+#define CHUNK_AVG_SIZE    (8 * 1024)
+#define CHUNK_MAX_SIZE    (64 * 1024)
+#define CHUNK_ENTRY_SIZE  (CHUNK_HASH_SIZE + 4)
+
+typedef struct {
+    uint8_t hash[CHUNK_HASH_SIZE];
+    uint64_t offset;
+    uint32_t len;
+} ChunkRef;
+
+typedef struct ChunkIndex ChunkIndex;
+
+// Incremental SHA-256, for hashing whole files without loading them
+typedef struct {
+    uint32_t state[8];
+    uint8_t block[64];
+    uint64_t len;
+} Sha256;
+
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+void sha256_final(Sha256 *ctx, uint8_t out[CHUNK_HASH_SIZE]);
+
+void chunk_sha256(const void *data, size_t len, uint8_t out[CHUNK_HASH_SIZE]);
+
+// Split data into content-defined chunks; *chunks is malloc'd
+int chunk_buffer(const uint8_t *data, size_t size, ChunkRef **chunks, size_t *count);
+
+// Open (creating if needed) the index stored in dir
+ChunkIndex *chunk_index_open(const char *dir);
+void chunk_index_close(ChunkIndex *index);
+
+// Remember that the chunk can be read from path at offset
+int chunk_index_put(ChunkIndex *index, const uint8_t hash[CHUNK_HASH_SIZE],
+                    const char *path, uint64_t offset, uint32_t len);
+
+// Index every chunk of a file; path is relative to base_dir
+int chunk_index_add_file(ChunkIndex *index, const char *base_dir, const char *path);
+
+// Read a chunk into buf[CHUNK_MAX_SIZE] and verify its hash.
+// Returns the chunk length, or -1 if no valid copy is known.
+int chunk_index_read(ChunkIndex *index, const char *base_dir,
+                     const uint8_t hash[CHUNK_HASH_SIZE], uint8_t *buf);
+
+#endif
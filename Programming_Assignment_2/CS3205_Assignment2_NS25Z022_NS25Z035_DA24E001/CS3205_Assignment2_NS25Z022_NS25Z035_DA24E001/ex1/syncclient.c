@@ -6,15 +6,75 @@
  * and maintains a mirrored directory structure.
  *
  * Compile the client
- * gcc -o syncclient syncclient.c -pthread
+ * gcc -o syncclient syncclient.c syncdelta.c syncchunk.c synctree.c syncignore.c syncprefix.c syncuring.c synccoalesce.c syncwatch.c syncversion.c -pthread -lz
  *
  * Usage:
- *   ./syncclient <server_ip> <server_port> <ignore_list_file>
+ *   ./syncclient [-a host:port] [-s prefix]... [-k store_dir] [-z] [-U] [-b] [-w workers]
+ *                [-v seconds] <local_dir> <ignore_list_file>
  *
  * Example:
- *   ./syncclient 127.0.0.1 5000 ignore_list.txt
+ *   ./syncclient -k /var/tmp/clientstore -z client_dir ignore_list.txt
+ *   ./syncclient -a 127.0.0.1:5001 -s photos/2024 -s docs client_dir ignore_list.txt
  *
+ * Messages use the binary frame format described in syncproto.h. Modified
+ * files arrive as deltas against the local copy (syncdelta.h). With -k the
+ * client keeps a chunk index of everything it has written (syncchunk.h) and
+ * only fetches chunks it cannot find locally; keep store_dir outside
+ * local_dir. With -z the server may send files as zlib streams, which are
+ * inflated as they arrive.
+ *
+ * The server is 127.0.0.1:8080 unless -a names another. With -s (repeatable)
+ * the client subscribes to just those subtrees and the server sends nothing
+ * outside them, manifest included. When the tree is split across several
+ * servers, each owning some subtrees, run one client per server into the
+ * same local_dir.
+ *
+ * The receive thread only parses frames: it copies payloads out of the
+ * socket buffer and hands every operation to one of the apply workers (-w,
+ * default 4), so disk latency no longer holds up the socket. Operations on
+ * the same path always go to the same worker and run in order; deletes,
+ * moves and the manifest first wait for every worker to go idle, since
+ * they reach paths anywhere below them. Files are written to a temporary
+ * file next to the target, preallocated with fallocate, and renamed over
+ * it once complete and verified, so nobody sees a half-written file.
+ *
+ * With -U each worker writes file contents through its own io_uring: when
+ * it has been handed several payload blocks of a file at once, they are
+ * queued as writes and submitted with one system call.
+ *
+ * On connect the server sends a manifest of its whole tree (synctree.h).
+ * Files whose size and mtime match are kept as they are; files of the same
+ * size are hashed to be sure; everything else is requested in one batch.
+ * After that, changes arrive as SYNC_BATCH frames of coalesced events.
+ *
+ * If the connection drops, the client keeps retrying (1 s, doubling up to
+ * 30 s). It presents the last journal position it fully applied (from the
+ * server's SYNC_SEQ frames) so the server can send just the events it
+ * missed, along with any file it was cut off in the middle of; the server
+ * then sends only the rest of that file.
+ *
+ * With -b (the server must run with -b too) sync goes both ways: a watcher
+ * thread coalesces local changes made while the client runs, like the
+ * server does, and pushes each one upstream with the file's version vector
+ * (syncversion.h), without waiting for the previous push to be
+ * acknowledged. Writes the workers make for the server are recorded with
+ * their stat, so the watcher does not push them back. If two replicas
+ * changed a file concurrently, the server's -b policy decides, and when its
+ * copy wins it replaces ours. Pushes still unacknowledged when the
+ * connection drops are sent again after reconnecting; a rename cut off that
+ * way goes again as a copy under the new name.
+ *
+ * With -v the client checks its mirror against the server every so many
+ * seconds, once the server has caught it up after connecting. It keeps an
+ * index of local_dir (built on the first run, then refreshed by stat and
+ * rehashing only what changed) and compares Merkle digests with the
+ * server's top down (synctree.h): only directories whose digests differ
+ * are listed, missing or different files are fetched, and anything the
+ * server does not have is removed, or with -b kept, since it may be a
+ * change still to be pushed. A mirror that matches costs one round trip.
+ */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,197 +83,2447 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <ftw.h>
+#include <zlib.h>
+
+#include "syncproto.h"
+#include "syncdelta.h"
+#include "syncchunk.h"
+#include "synctree.h"
+#include "syncignore.h"
+#include "syncprefix.h"
+#include "syncuring.h"
+#include "synccoalesce.h"
+#include "syncwatch.h"
+#include "syncversion.h"
 
 #define MAX_PATH 2048
-#define MAX_IGNORE 256
-#define BUFFER_SIZE 4096
+#define RING_SIZE (1024 * 1024)
+#define CHUNK_WINDOW 128     // chunk requests in flight
+#define WRITE_DEPTH 64       // io_uring entries per worker (-U)
+#define PAYLOAD_BLOCK (256 * 1024)      // payload copied to a worker at a time, at most
+#define PREALLOC_MIN (64 * 1024)        // smaller files are not worth an fallocate
+#define MAX_BUFFERED (32 * 1024 * 1024) // payload handed to workers but not written
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS 64
+#define RETRY_MAX 30         // seconds between reconnect attempts, at most
+#define PUSH_BLOCK (1024 * 1024)        // file contents per SYNC_PUSH_DATA frame
+#define PUSH_WINDOW_MS 50    // local changes are coalesced this long before pushing
+#define PUSH_MAX_HOLD 4      // ... but never for more than this many windows
+#define VERIFY_TIMEOUT_MS 60000         // a verification round unanswered this long is dropped
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE)
 
 // Global variables
 char local_dir[MAX_PATH];
-int server_socket;
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+char ignore_list[MAX_IGNORE + 1];
+size_t ignore_len;
+IgnoreMatcher* ignore;
+char* sub_list;             // -s prefixes, one per line, sent on every connect
+size_t sub_len;
+PrefixSet* subs;
+struct sockaddr_in server_addr;
+int server_socket = -1;     // guarded by send_lock; -1 while reconnecting
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;     // workers send replies too
 
-// Read ignore list from file
-void read_ignore_list(const char* filename, char* ignore_list) {
+// Two-way sync (-b): our replica id, the version vector of every local
+// path, and the watcher that pushes local changes upstream
+int bidir = 0;
+uint64_t replica;
+VersionTable* versions = NULL;
+int inotify_fd = -1;
+WatchTable* watches;        // watcher thread only
+int repush_fd = -1;         // eventfd: reconnected, resend unacknowledged pushes
+
+// Directory MOVED_FROM waiting for its MOVED_TO
+typedef struct DirMove {
+    struct DirMove* next;
+    uint32_t cookie;
+    char path[];
+} DirMove;
+
+DirMove* dir_moves;         // watcher thread only
+
+// Read ignore list from file (patterns separated by commas or newlines)
+void read_ignore_list(const char* filename) {
     FILE* fp = fopen(filename, "r");
     if (!fp) {
         perror("Failed to open ignore list file");
         exit(EXIT_FAILURE);
     }
-    
-    if (fgets(ignore_list, MAX_IGNORE, fp) == NULL) {
-        ignore_list[0] = '\0';
-    } else {
-        size_t len = strlen(ignore_list);
-        if (len > 0 && ignore_list[len-1] == '\n') {
-            ignore_list[len-1] = '\0';
-        }
-    }
+
+    ignore_len = fread(ignore_list, 1, sizeof(ignore_list), fp);
     fclose(fp);
+    if (ignore_len > MAX_IGNORE) {
+        fprintf(stderr, "Ignore list is larger than %d bytes\n", MAX_IGNORE);
+        exit(EXIT_FAILURE);
+    }
+    ignore = ignore_compile(ignore_list, ignore_len);
+    if (!ignore) {
+        fprintf(stderr, "Cannot compile ignore list\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Add one -s prefix to the subscription list
+void add_subscription(const char* prefix) {
+    size_t n = strlen(prefix);
+    sub_list = realloc(sub_list, sub_len + n + 1);
+    if (!sub_list) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(sub_list + sub_len, prefix, n);
+    sub_len += n;
+    sub_list[sub_len++] = '\n';
 }
 
-// Create directory if it doesn't exist
+// Parse -a host:port into server_addr
+void set_server_address(const char* spec) {
+    char host[256];
+    const char* colon = strrchr(spec, ':');
+    if (!colon || (size_t)(colon - spec) >= sizeof(host) || !colon[1]) {
+        fprintf(stderr, "Server address must be host:port\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, colon + 1, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", spec, gai_strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&server_addr, res->ai_addr, sizeof(server_addr));
+    freeaddrinfo(res);
+}
+
+// Create directory if it doesn't exist, along with any missing parents:
+// workers may reach a file before the event that creates its directory
 void ensure_directory(const char* path) {
     struct stat st = {0};
     if (stat(path, &st) == -1) {
-        if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        if (mkdir(path, 0700) == -1 && errno == ENOENT) {
+            char parent[MAX_PATH];
+            snprintf(parent, sizeof(parent), "%s", path);
+            char* last_slash = strrchr(parent, '/');
+            if (last_slash && last_slash != parent) {
+                *last_slash = '\0';
+                ensure_directory(parent);
+            }
+            mkdir(path, 0700);
+        }
+        if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
             perror("mkdir");
             exit(EXIT_FAILURE);
         }
     }
 }
 
-// Handle receiving files from server
-void receive_file(const char* filename) {
-    size_t local_dir_len = strlen(local_dir);
-    size_t filename_len = strlen(filename);
-    size_t filepath_len = local_dir_len + filename_len + 2;
-    
-    char* filepath = malloc(filepath_len);
-    if (!filepath) {
-        perror("malloc");
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path) < 0 ? -1 : 0;
+}
+
+// Remove a file, or a directory with everything below it
+int remove_tree(const char* path) {
+    return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Receive ring buffer. The same memory is mapped twice back to back, so
+// any frame that wraps past the end is still contiguous and can be parsed
+// in place without copying.
+typedef struct {
+    uint8_t* base;
+    size_t size;        // multiple of the page size
+    size_t head;        // next byte to parse (monotonic)
+    size_t tail;        // next byte to fill (monotonic)
+} RingBuffer;
+
+// File, delta, chunk manifest or tree manifest being written by a worker
+typedef struct {
+    int type;           // SYNC_FILE, SYNC_DELTA, SYNC_CHUNKS or SYNC_MANIFEST
+    FILE* spool;        // all but SYNC_FILE: payload is buffered here before applying
+    int fd;
+    char name[MAX_PATH];
+    char temppath[MAX_PATH + 16];   // SYNC_FILE: renamed over the target when done
+    uint64_t size;      // expected final size, for preallocation
+    int verify;
+    uint32_t expected_crc;
+    uint32_t crc;
+    int inflating;      // compressed SYNC_FILE: payload is a zlib stream
+    int stream_end;
+    z_stream zs;
+    uint64_t offset;    // where the next payload byte goes in the file
+    int resumed;        // SYNC_FLAG_OFFSET: rest of a file we partly have
+    int failed;         // a write did not complete
+} Transfer;
+
+// File being rebuilt from a chunk manifest in a temporary file
+enum { CHUNK_MISSING, CHUNK_REQUESTED, CHUNK_DONE };
+
+typedef struct Assembly {
+    struct Assembly* next;
+    char name[MAX_PATH];
+    char temppath[MAX_PATH + 16];
+    int fd;
+    uint64_t size;
+    size_t count;
+    uint8_t* hashes;        // count x CHUNK_HASH_SIZE, in file order
+    uint32_t* lens;
+    uint64_t* offsets;
+    uint8_t* state;
+    size_t* order;          // entries sorted by hash, so duplicates are adjacent
+    size_t next_request;    // position in order
+    size_t missing;
+} Assembly;
+
+// Payload bytes copied out of the receive ring for a worker
+typedef struct Block {
+    struct Block* next;
+    size_t len;
+    uint8_t data[];
+} Block;
+
+// SYNC_SEQ passed to every worker; it counts once the last one reaches it
+typedef struct {
+    uint64_t epoch;
+    uint64_t seq;
+    int left;
+} SeqMark;
+
+enum { JOB_EVENT, JOB_STREAM, JOB_SEQ };
+
+// One operation for an apply worker. A JOB_STREAM's payload is appended
+// block by block while the worker is already writing it.
+typedef struct Job {
+    struct Job* next;
+    int kind;
+    SyncFrame frame;        // path points at name
+    char name[MAX_PATH];
+    uint8_t* payload;       // JOB_EVENT: the control frame's payload
+    uint64_t offset;        // JOB_STREAM with SYNC_FLAG_OFFSET: where it starts
+    uint64_t remaining;     // receive thread: payload bytes still to come
+    struct Worker* worker;
+    Block* blocks;          // guarded by worker->lock
+    Block** blocks_tail;
+    int complete;           // no more blocks will be added
+    int cut;                // ... because the connection dropped
+    SeqMark* mark;
+} Job;
+
+typedef struct Worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // job queued or payload appended
+    pthread_cond_t idle;    // queue drained
+    Job* jobs;
+    Job** jobs_tail;
+    int busy;
+    int use_ring;           // -U and io_uring is available
+    int batching;           // several blocks in hand: write them through the ring
+    Uring ring;
+    unsigned queued;        // writes on the ring not yet reaped
+} Worker;
+
+Worker workers[MAX_WORKERS];
+int nworkers = DEFAULT_WORKERS;
+int use_uring = 0;
+Job* receiving = NULL;      // JOB_STREAM whose payload is arriving
+int barrier_pending = 0;    // the last job dispatched must finish before the next
+
+// Bytes in blocks not yet written, bounded by MAX_BUFFERED
+pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t budget_cond = PTHREAD_COND_INITIALIZER;
+size_t buffered = 0;
+
+// Shared by the workers, under state_lock: chunk assemblies, the journal
+// position and the file left over from a dropped connection
+pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+char full_request[MAX_PATH];    // path we last asked to resend in full
+ChunkIndex* chunk_store = NULL;
+Assembly* assemblies = NULL;
+int chunks_in_flight = 0;
+
+// Position in the server's event journal. seen_seq is the last SYNC_SEQ
+// every worker has got past; it only becomes applied_seq once the delta
+// and chunk replies requested before it are in, since the server will not
+// resend those.
+uint64_t epoch;
+uint64_t applied_seq;
+uint64_t seen_seq;
+int caught_up;              // a SYNC_SEQ arrived since connecting
+int answers_pending;        // SYNC_SIGNATURES sent, SYNC_DELTA not yet received (atomic)
+
+// SYNC_FILE the last connection was cut off in, kept in its temporary file
+char partial_name[MAX_PATH];
+char partial_temp[MAX_PATH + 16];
+uint64_t partial_offset;
+uint32_t partial_crc;
+
+// Mirror verification (-v): an index of local_dir kept for its Merkle
+// digests, the subtrees the server says it owns and the run in progress,
+// all under verify_lock
+int verify_interval = 0;    // seconds between runs, 0 for none
+pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+TreeIndex* mirror = NULL;
+TreeView mirror_view;
+PrefixSet* server_owned = NULL;
+char* server_owned_list = NULL;
+size_t server_owned_len = 0;
+int verify_outstanding = 0; // SYNC_VERIFY sent, SYNC_LISTING not yet applied
+long verify_sent_ms;
+long verify_start_ms;
+size_t verify_rounds, verify_dirs, verify_fetched, verify_removed, verify_kept;
+
+int ring_init(RingBuffer* ring, size_t size) {
+    int fd = memfd_create("syncclient-ring", 0);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+
+    // Reserve 2x the space, then map the file into both halves
+    uint8_t* base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED ||
+        mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("mmap ring");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    ring->base = base;
+    ring->size = size;
+    ring->head = ring->tail = 0;
+    return 0;
+}
+
+// Build local_dir/<path> from a path that is not NUL-terminated
+int make_local_path(char* out, size_t out_len, const char* path, size_t path_len) {
+    int n = snprintf(out, out_len, "%s/%.*s", local_dir, (int)path_len, path);
+    return n < 0 || (size_t)n >= out_len ? -1 : 0;
+}
+
+void close_server_locked(void) {
+    if (server_socket >= 0) close(server_socket);
+    server_socket = -1;
+}
+
+// Send a whole frame to the server (blocking) with send_lock held;
+// msg_flags = MSG_MORE when another frame follows straight away
+int send_frame_locked(int type, int flags, const char* path, size_t path_len,
+                      const void* payload, size_t len, int msg_flags) {
+    uint8_t header[SYNC_HEADER_SIZE];
+    uint32_t crc = sync_crc32(sync_crc32(0, path, path_len), payload, len);
+    sync_encode_header(header, type, flags | SYNC_FLAG_CHECKSUM, path_len, len, crc);
+
+    struct iovec iov[3] = {
+        { header, sizeof(header) },
+        { (void*)path, path_len },
+        { (void*)payload, len },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 3 };
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(server_socket, &msg, MSG_NOSIGNAL | msg_flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("send frame");
+            return -1;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+int send_frame_msg(int type, int flags, const char* path, size_t path_len,
+                   const void* payload, size_t len, int msg_flags) {
+    pthread_mutex_lock(&send_lock);
+    int result = send_frame_locked(type, flags, path, path_len, payload, len, msg_flags);
+    pthread_mutex_unlock(&send_lock);
+    return result;
+}
+
+int send_frame_flags(int type, int flags, const char* path, size_t path_len,
+                     const void* payload, size_t len) {
+    return send_frame_msg(type, flags, path, path_len, payload, len, 0);
+}
+
+int send_frame(int type, const char* path, size_t path_len, const void* payload, size_t len) {
+    return send_frame_flags(type, 0, path, path_len, payload, len);
+}
+
+// Move a finished temp file over name. With two-way sync the rename and
+// the stat it leaves behind are recorded under the entry's lock, so the
+// watcher takes the result for the server's and does not push it back.
+int commit_rename(const char* temppath, const char* filepath, const char* name) {
+    if (!versions) return rename(temppath, filepath);
+    VersionState* s = version_lock(versions, name, 1);
+    int rc = rename(temppath, filepath);
+    struct stat st;
+    if (s) {
+        if (rc == 0 && lstat(filepath, &st) == 0) {
+            version_stamp(s, &st);
+            s->exists = 1;
+            s->is_dir = 0;
+        }
+        version_unlock(versions, s);
+    }
+    return rc;
+}
+
+// Record a directory the server created, before creating it
+void note_local_dir(const char* name) {
+    if (!versions) return;
+    VersionState* s = version_lock(versions, name, 1);
+    if (!s) return;
+    s->exists = 1;
+    s->is_dir = 1;
+    version_unlock(versions, s);
+}
+
+static void tombstone_entry(void* arg, const char* path, VersionState* s) {
+    (void)arg;
+    (void)path;
+    s->exists = 0;
+}
+
+// Record that name, and everything below it, is going away for the
+// server, before removing it
+void tombstone_local(const char* name) {
+    if (!versions) return;
+    VersionState* s = version_lock(versions, name, 1);
+    if (s) {
+        s->exists = 0;
+        version_unlock(versions, s);
+    }
+    version_each(versions, name, tombstone_entry, NULL);
+}
+
+// Reply to SYNC_SIG_REQUEST with the block signatures of our copy
+// (full = 1 asks for the whole file regardless of what we have)
+void send_signatures(const char* path, size_t path_len, int full) {
+    char filepath[MAX_PATH];
+    uint8_t* sig;
+    size_t sig_len;
+    int fd = -1;
+
+    if (!full && make_local_path(filepath, sizeof(filepath), path, path_len) == 0) {
+        fd = open(filepath, O_RDONLY);
+    }
+    int rc = fd >= 0 ? delta_signature(fd, &sig, &sig_len) : delta_empty_signature(&sig, &sig_len);
+    if (fd >= 0) close(fd);
+    if (rc < 0) {
+        printf("Could not compute signature for %.*s\n", (int)path_len, path);
         return;
     }
-    
-    snprintf(filepath, filepath_len, "%s/%s", local_dir, filename);
-    
-    char* dir = strdup(filepath);
-    char* last_slash = strrchr(dir, '/');
-    if (last_slash) {
-        *last_slash = '\0';
-        ensure_directory(dir);
+    if (send_frame(SYNC_SIGNATURES, path, path_len, sig, sig_len) == 0) {
+        __atomic_add_fetch(&answers_pending, 1, __ATOMIC_RELAXED);
     }
-    free(dir);
-    
-    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) {
-        perror("open file");
-        free(filepath);
+    free(sig);
+}
+
+// Rebuild the file from its old copy plus the spooled delta, then swap it in
+void apply_delta(Transfer* t) {
+    char filepath[MAX_PATH];
+    char temppath[MAX_PATH + 16];
+    size_t name_len = strlen(t->name);
+    if (make_local_path(filepath, sizeof(filepath), t->name, name_len) < 0) return;
+
+    int spool_fd = fileno(t->spool);
+    struct stat st;
+    if (fstat(spool_fd, &st) < 0 || st.st_size == 0) return;
+    uint8_t* delta = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, spool_fd, 0);
+    if (delta == MAP_FAILED) {
+        perror("mmap delta");
         return;
     }
-    
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes;
-    while ((bytes = recv(server_socket, buffer, BUFFER_SIZE, 0)) > 0) {
-        if (write(fd, buffer, bytes) != bytes) {
-            perror("write file");
-            break;
+
+    snprintf(temppath, sizeof(temppath), "%s" SYNC_TEMP_MARK "XXXXXX", filepath);
+    int new_fd = mkstemp(temppath);
+    if (new_fd < 0) {
+        perror("mkstemp");
+        munmap(delta, st.st_size);
+        return;
+    }
+    int old_fd = open(filepath, O_RDONLY);
+    struct stat old_st;
+    fchmod(new_fd, old_fd >= 0 && fstat(old_fd, &old_st) == 0 ? old_st.st_mode & 07777 : 0644);
+    int rc = delta_apply(old_fd, delta, st.st_size, new_fd);
+    if (old_fd >= 0) close(old_fd);
+    close(new_fd);
+    munmap(delta, st.st_size);
+
+    if (rc >= 0 && commit_rename(temppath, filepath, t->name) == 0) {
+        pthread_mutex_lock(&state_lock);
+        if (strcmp(full_request, t->name) == 0) full_request[0] = '\0';
+        pthread_mutex_unlock(&state_lock);
+        printf("Applied delta to %s (%ld bytes on the wire)\n", t->name, (long)st.st_size);
+        if (chunk_store) chunk_index_add_file(chunk_store, local_dir, t->name);
+        return;
+    }
+    unlink(temppath);
+
+    // Our copy changed under the delta; fall back to a full transfer once
+    pthread_mutex_lock(&state_lock);
+    int retry = rc == -2 && strcmp(full_request, t->name) != 0;
+    if (retry) strcpy(full_request, t->name);
+    pthread_mutex_unlock(&state_lock);
+    if (retry) {
+        printf("Delta for %s did not verify, requesting full copy\n", t->name);
+        send_signatures(t->name, name_len, 1);
+    } else {
+        printf("Failed to apply delta to %s\n", t->name);
+    }
+}
+
+// Find the in-progress assembly of a path; returns the link pointing to it
+Assembly** find_assembly(const char* path, size_t path_len) {
+    Assembly** link = &assemblies;
+    while (*link && (strlen((*link)->name) != path_len ||
+                     memcmp((*link)->name, path, path_len) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+void free_assembly(Assembly* a) {
+    if (a->fd >= 0) close(a->fd);
+    if (a->temppath[0]) unlink(a->temppath);
+    free(a->hashes);
+    free(a->lens);
+    free(a->offsets);
+    free(a->state);
+    free(a->order);
+    free(a);
+}
+
+// Forget a half-built file, e.g. because the server deleted it; caller
+// holds state_lock
+void abort_assembly(const char* path, size_t path_len) {
+    Assembly** link = find_assembly(path, path_len);
+    if (*link) {
+        Assembly* a = *link;
+        *link = a->next;
+        free_assembly(a);
+    }
+}
+
+static int compare_hash(const void* a, const void* b, void* hashes) {
+    return memcmp((uint8_t*)hashes + *(const size_t*)a * CHUNK_HASH_SIZE,
+                  (uint8_t*)hashes + *(const size_t*)b * CHUNK_HASH_SIZE, CHUNK_HASH_SIZE);
+}
+
+static const uint8_t* order_hash(const Assembly* a, size_t pos) {
+    return a->hashes + a->order[pos] * CHUNK_HASH_SIZE;
+}
+
+// Position in order of the first entry with this hash, or count if none
+size_t find_chunk(const Assembly* a, const uint8_t* hash) {
+    size_t lo = 0, hi = a->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (memcmp(order_hash(a, mid), hash, CHUNK_HASH_SIZE) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < a->count && memcmp(order_hash(a, lo), hash, CHUNK_HASH_SIZE) == 0 ? lo : a->count;
+}
+
+// Write a chunk to every offset it occurs at, starting from order[pos]
+int fill_chunk(Assembly* a, size_t pos, const uint8_t* data, uint32_t len) {
+    const uint8_t* hash = order_hash(a, pos);
+    for (size_t k = pos; k < a->count; k++) {
+        if (memcmp(order_hash(a, k), hash, CHUNK_HASH_SIZE) != 0) break;
+        size_t i = a->order[k];
+        if (a->state[i] == CHUNK_DONE) continue;
+        if (a->lens[i] != len || pwrite(a->fd, data, len, a->offsets[i]) != (ssize_t)len) {
+            return -1;
         }
-        // Check if this is the end of file data (simplified assumption)
-        if (bytes < BUFFER_SIZE) break;
+        a->state[i] = CHUNK_DONE;
+        a->missing--;
     }
-    close(fd);
-    printf("Received and wrote file: %s\n", filename);
-    free(filepath);
+    return 0;
 }
 
-// Thread to receive and process server updates with terminal output
-void* receive_handler(void* arg) {
-    char buffer[BUFFER_SIZE];
-    while (1) {
-        ssize_t bytes = recv(server_socket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes <= 0) {
-            printf("Disconnected from server\n");
-            close(server_socket);
-            exit(0);
-        }
-        
-        buffer[bytes] = '\0';
-        printf("Raw message from server: '%s'\n", buffer);  // Debug output
-        
-        char command[16];
-        char filename[MAX_PATH];
-        if (sscanf(buffer, "%15s %s", command, filename) == 2) {
-            if (strcmp(command, "CREATE") == 0) {
-                printf("Server event: Created %s\n", filename);
-                // File data follows in a separate FILE message
-            } else if (strcmp(command, "DELETE") == 0) {
-                size_t local_dir_len = strlen(local_dir);
-                size_t filename_len = strlen(filename);
-                size_t filepath_len = local_dir_len + filename_len + 2;
-                
-                char* filepath = malloc(filepath_len);
-                if (!filepath) {
-                    perror("malloc");
-                } else {
-                    snprintf(filepath, filepath_len, "%s/%s", local_dir, filename);
-                    if (remove(filepath) == 0) {
-                        printf("Server event: Deleted %s\n", filename);
-                    } else {
-                        printf("Server event: Failed to delete %s (%s)\n", filename, strerror(errno));
-                    }
-                    free(filepath);
-                }
-            } else if (strcmp(command, "MOVED_FROM") == 0) {
-                printf("Server event: Moved from %s\n", filename);
-                size_t local_dir_len = strlen(local_dir);
-                size_t filename_len = strlen(filename);
-                size_t filepath_len = local_dir_len + filename_len + 2;
-                
-                char* filepath = malloc(filepath_len);
-                if (!filepath) {
-                    perror("malloc");
-                } else {
-                    snprintf(filepath, filepath_len, "%s/%s", local_dir, filename);
-                    remove(filepath);
-                    free(filepath);
+// Move a fully assembled file into place and index its chunks
+void complete_assembly(Assembly* a) {
+    char filepath[MAX_PATH];
+    struct stat st;
+    if (make_local_path(filepath, sizeof(filepath), a->name, strlen(a->name)) < 0) return;
+    fchmod(a->fd, stat(filepath, &st) == 0 ? st.st_mode & 07777 : 0644);
+    if (ftruncate(a->fd, a->size) < 0 || commit_rename(a->temppath, filepath, a->name) < 0) {
+        perror("complete chunked file");
+        return;
+    }
+    a->temppath[0] = '\0';
+
+    if (chunk_store) {
+        for (size_t i = 0; i < a->count; i++) {
+            chunk_index_put(chunk_store, a->hashes + i * CHUNK_HASH_SIZE, a->name,
+                            a->offsets[i], a->lens[i]);
+        }
+    }
+    printf("Received and wrote file: %s (%zu chunks)\n", a->name, a->count);
+}
+
+// Ask for missing chunks, keeping at most CHUNK_WINDOW replies outstanding;
+// caller holds state_lock
+void request_chunks(void) {
+    uint8_t hashes[CHUNK_WINDOW * CHUNK_HASH_SIZE];
+    for (Assembly* a = assemblies; a && chunks_in_flight < CHUNK_WINDOW; a = a->next) {
+        int n = 0;
+        while (a->next_request < a->count && chunks_in_flight + n < CHUNK_WINDOW) {
+            const uint8_t* hash = order_hash(a, a->next_request);
+            int wanted = 0;
+            while (a->next_request < a->count &&
+                   memcmp(order_hash(a, a->next_request), hash, CHUNK_HASH_SIZE) == 0) {
+                size_t i = a->order[a->next_request++];
+                if (a->state[i] == CHUNK_MISSING) {
+                    a->state[i] = CHUNK_REQUESTED;
+                    wanted = 1;
                 }
-            } else if (strcmp(command, "MOVED_TO") == 0) {
-                printf("Server event: Moved to %s\n", filename);
-                // Note: No file transfer here; relies on CREATE/FILE for new location
-            } else if (strcmp(command, "FILE") == 0) {
-                receive_file(filename);
-            } else {
-                printf("Received unknown command: %s\n", buffer);
             }
-        } else {
-            printf("Failed to parse message: %s\n", buffer);
+            if (wanted) memcpy(hashes + n++ * CHUNK_HASH_SIZE, hash, CHUNK_HASH_SIZE);
+        }
+        if (n > 0) {
+            send_frame(SYNC_CHUNK_REQUEST, a->name, strlen(a->name), hashes,
+                       (size_t)n * CHUNK_HASH_SIZE);
+            chunks_in_flight += n;
         }
-        
-        pthread_mutex_unlock(&file_mutex);
     }
-    return NULL;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        printf("Usage: %s path_to_local_directory path_to_ignore_list_file\n", argv[0]);
-        exit(EXIT_FAILURE);
+// Build a file from the spooled SYNC_CHUNKS manifest: chunks we already
+// hold anywhere are copied locally, the rest are requested. Caller holds
+// state_lock.
+void start_assembly(Transfer* t) {
+    size_t name_len = strlen(t->name);
+    abort_assembly(t->name, name_len);
+
+    int spool_fd = fileno(t->spool);
+    struct stat st;
+    if (fstat(spool_fd, &st) < 0 || st.st_size < 12) return;
+    uint8_t* manifest = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, spool_fd, 0);
+    if (manifest == MAP_FAILED) {
+        perror("mmap manifest");
+        return;
     }
 
-    strncpy(local_dir, argv[1], MAX_PATH - 1);
-    local_dir[MAX_PATH - 1] = '\0';
-    char ignore_list[MAX_IGNORE] = {0};
-    read_ignore_list(argv[2], ignore_list);
-    
-    ensure_directory(local_dir);
+    Assembly* a = calloc(1, sizeof(Assembly));
+    char filepath[MAX_PATH];
+    uint64_t size = sync_get64(manifest);
+    size_t count = sync_get32(manifest + 8);
+    if (!a || (uint64_t)st.st_size != 12 + (uint64_t)count * CHUNK_ENTRY_SIZE ||
+        make_local_path(filepath, sizeof(filepath), t->name, name_len) < 0) {
+        printf("Bad chunk manifest for %s\n", t->name);
+        free(a);
+        munmap(manifest, st.st_size);
+        return;
+    }
 
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("socket");
-        exit(EXIT_FAILURE);
+    a->fd = -1;
+    a->size = size;
+    a->count = count;
+    strcpy(a->name, t->name);
+    a->hashes = malloc(count * CHUNK_HASH_SIZE + 1);
+    a->lens = malloc(count * sizeof(uint32_t) + 1);
+    a->offsets = malloc(count * sizeof(uint64_t) + 1);
+    a->state = calloc(count + 1, 1);
+    a->order = malloc(count * sizeof(size_t) + 1);
+    uint8_t* buf = malloc(CHUNK_MAX_SIZE);
+    if (!a->hashes || !a->lens || !a->offsets || !a->state || !a->order || !buf) goto fail;
+
+    uint64_t offset = 0;
+    int bad_len = 0;
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* entry = manifest + 12 + i * CHUNK_ENTRY_SIZE;
+        memcpy(a->hashes + i * CHUNK_HASH_SIZE, entry, CHUNK_HASH_SIZE);
+        a->lens[i] = sync_get32(entry + CHUNK_HASH_SIZE);
+        a->offsets[i] = offset;
+        a->order[i] = i;
+        offset += a->lens[i];
+        if (a->lens[i] == 0 || a->lens[i] > CHUNK_MAX_SIZE) bad_len = 1;
+    }
+    if (bad_len || offset != size) {
+        printf("Bad chunk manifest for %s\n", t->name);
+        goto fail;
     }
+    a->missing = count;
+    qsort_r(a->order, count, sizeof(size_t), compare_hash, a->hashes);
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(8080);  // Adjust port as needed
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");  // Adjust IP as needed
+    snprintf(a->temppath, sizeof(a->temppath), "%s" SYNC_TEMP_MARK "XXXXXX", filepath);
+    a->fd = mkstemp(a->temppath);
+    if (a->fd < 0) {
+        perror("mkstemp");
+        a->temppath[0] = '\0';
+        goto fail;
+    }
 
-    if (connect(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect");
-        exit(EXIT_FAILURE);
+    // Copy every chunk the local index can vouch for
+    for (size_t pos = 0; chunk_store && pos < count; pos++) {
+        if (pos > 0 && memcmp(order_hash(a, pos - 1), order_hash(a, pos), CHUNK_HASH_SIZE) == 0) {
+            continue;
+        }
+        int n = chunk_index_read(chunk_store, local_dir, order_hash(a, pos), buf);
+        if (n > 0) fill_chunk(a, pos, buf, n);
+    }
+    free(buf);
+    munmap(manifest, st.st_size);
+
+    printf("Assembling %s: %zu of %zu chunks found locally\n", a->name, count - a->missing, count);
+    if (a->missing == 0) {
+        complete_assembly(a);
+        free_assembly(a);
+        return;
+    }
+    *find_assembly(a->name, name_len) = a;   // append, so files finish in order
+    request_chunks();
+    return;
+
+fail:
+    free(buf);
+    munmap(manifest, st.st_size);
+    free_assembly(a);
+}
+
+// SYNC_CHUNK_DATA: drop the chunk into the assembly that asked for it. A
+// chunk the server no longer has makes us fall back to a full copy. Caller
+// holds state_lock.
+void receive_chunk(const SyncFrame* frame, const uint8_t* payload) {
+    if (chunks_in_flight > 0) chunks_in_flight--;
+    Assembly** link = find_assembly(frame->path, frame->path_len);
+    Assembly* a = *link;
+    size_t pos = a && frame->payload_len >= CHUNK_HASH_SIZE ? find_chunk(a, payload) : 0;
+
+    if (a && pos < a->count) {
+        const uint8_t* data = payload + CHUNK_HASH_SIZE;
+        uint32_t len = frame->payload_len - CHUNK_HASH_SIZE;
+        uint8_t actual[CHUNK_HASH_SIZE];
+        if (len > 0) chunk_sha256(data, len, actual);
+
+        if (len == 0 || memcmp(actual, payload, CHUNK_HASH_SIZE) != 0 ||
+            fill_chunk(a, pos, data, len) < 0) {
+            printf("Chunk of %s unavailable, requesting full copy\n", a->name);
+            *link = a->next;
+            free_assembly(a);
+            send_signatures(frame->path, frame->path_len, 1);
+        } else if (a->missing == 0) {
+            *link = a->next;
+            complete_assembly(a);
+            free_assembly(a);
+        }
+    }
+    request_chunks();
+}
+
+// Decide whether our copy matches a manifest entry: size and mtime first,
+// then the content hash (fixing up the mtime so the next check is cheap)
+int have_file(const char* filepath, const TreeEntry* entry) {
+    struct stat st;
+    if (lstat(filepath, &st) < 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != entry->size) {
+        return 0;
+    }
+    if ((uint64_t)st.st_mtim.tv_sec == entry->mtime_sec &&
+        (uint32_t)st.st_mtim.tv_nsec == entry->mtime_nsec) {
+        return 1;
+    }
+
+    uint8_t hash[CHUNK_HASH_SIZE];
+    int fd = open(filepath, O_RDONLY);
+    int same = fd >= 0 && tree_hash_file(fd, hash) == 0 &&
+               memcmp(hash, entry->hash, CHUNK_HASH_SIZE) == 0;
+    if (same) {
+        struct timespec times[2] = {
+            { .tv_nsec = UTIME_OMIT },
+            { .tv_sec = entry->mtime_sec, .tv_nsec = entry->mtime_nsec },
+        };
+        futimens(fd, times);
+    }
+    if (fd >= 0) close(fd);
+    return same;
+}
+
+// have_file, but with two-way sync a file we have an unacknowledged change
+// to is kept as it is, and one that matches is recorded as the server's
+int keep_local(const char* name, const char* filepath, const TreeEntry* entry) {
+    int have = have_file(filepath, entry);
+    if (!versions) return have;
+    VersionState* s = version_lock(versions, name, 1);
+    if (!s) return have;
+    struct stat st;
+    int pending = s->pending;
+    if (have && !pending && lstat(filepath, &st) == 0) {
+        version_stamp(s, &st);
+        s->exists = 1;
+        s->is_dir = 0;
+    }
+    version_unlock(versions, s);
+    return have || pending;
+}
+
+// Inflate a spooled SYNC_MANIFEST or SYNC_LISTING payload; *raw is malloc'd
+int read_spool(Transfer* t, uint8_t** raw, size_t* raw_len) {
+    int spool_fd = fileno(t->spool);
+    struct stat st;
+    if (fstat(spool_fd, &st) < 0 || st.st_size == 0) return -1;
+    uint8_t* payload = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, spool_fd, 0);
+    if (payload == MAP_FAILED) {
+        perror("mmap spool");
+        return -1;
+    }
+    int rc = tree_decompress(payload, st.st_size, raw, raw_len);
+    munmap(payload, st.st_size);
+    return rc;
+}
+
+// Send the paths in want (n x (u16 path_len, path)) as one SYNC_WANT
+void send_want(const uint8_t* want, size_t want_len) {
+    uint8_t* packed;
+    size_t packed_len;
+    if (tree_compress(want ? want : (const uint8_t*)"", want_len, &packed, &packed_len) == 0) {
+        send_frame(SYNC_WANT, "", 0, packed, packed_len);
+        free(packed);
+    }
+}
+
+// Append n bytes to a growing buffer; returns -1 if out of memory
+int add_bytes(uint8_t** buf, size_t* len, size_t* cap, const void* data, size_t n) {
+    if (*len + n > *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 65536;
+        while (new_cap < *len + n) new_cap *= 2;
+        uint8_t* grown = realloc(*buf, new_cap);
+        if (!grown) return -1;
+        *buf = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+// Add a path to a growing SYNC_WANT list; returns -1 if out of memory
+int add_want(uint8_t** want, size_t* want_len, size_t* want_cap, const char* path,
+             size_t path_len) {
+    uint8_t head[2];
+    sync_put16(head, path_len);
+    if (add_bytes(want, want_len, want_cap, head, 2) < 0) return -1;
+    return add_bytes(want, want_len, want_cap, path, path_len);
+}
+
+// Compare the server's tree manifest with our copy and ask for the
+// missing or different files in a single SYNC_WANT frame
+void apply_manifest(Transfer* t) {
+    uint8_t* raw;
+    size_t raw_len;
+    int rc = read_spool(t, &raw, &raw_len);
+    if (rc < 0 || raw_len < 4) {
+        printf("Bad tree manifest from server\n");
+        if (rc == 0) free(raw);
+        return;
+    }
+
+    uint8_t* want = NULL;
+    size_t want_len = 0, want_cap = 0, wanted = 0, count = sync_get32(raw), pos = 4;
+    TreeEntry entry;
+    for (size_t i = 0; i < count && tree_next_entry(raw, raw_len, &pos, &entry) == 0; i++) {
+        char name[MAX_PATH], filepath[MAX_PATH];
+        if (!sync_path_is_safe(entry.path, entry.path_len) || entry.path_len >= MAX_PATH ||
+            make_local_path(filepath, sizeof(filepath), entry.path, entry.path_len) < 0) {
+            continue;
+        }
+        memcpy(name, entry.path, entry.path_len);
+        name[entry.path_len] = '\0';
+        // The server would skip these too
+        if (ignore_match(ignore, name) || !prefix_match(subs, name, entry.type == TREE_DIR)) {
+            continue;
+        }
+
+        if (entry.type == TREE_DIR) {
+            // A file where the server has a directory is replaced
+            struct stat local;
+            if (lstat(filepath, &local) == 0 && !S_ISDIR(local.st_mode)) {
+                tombstone_local(name);
+                unlink(filepath);
+            }
+            note_local_dir(name);
+            if (mkdir(filepath, 0755) < 0 && errno != EEXIST) perror("mkdir");
+            continue;
+        }
+        if (keep_local(name, filepath, &entry)) continue;
+
+        if (add_want(&want, &want_len, &want_cap, entry.path, entry.path_len) < 0) break;
+        wanted++;
+    }
+    free(raw);
+
+    printf("Server tree has %zu entries, requesting %zu files\n", count, wanted);
+    send_want(want, want_len);
+    free(want);
+}
+
+// tree_rescan reports each difference; the digests are all we need
+static void ignore_change(void* arg, int kind, int is_dir, const char* path) {
+    (void)arg;
+    (void)kind;
+    (void)is_dir;
+    (void)path;
+}
+
+// Paths our digests leave out, as the server's do for us: ignored,
+// outside our subscriptions or the server's subtrees, and temporary files.
+// Caller holds verify_lock.
+static int mirror_skip(void* arg, const char* path, int is_dir) {
+    (void)arg;
+    const char* base = strrchr(path, '/');
+    return ignore_match(ignore, path) || !prefix_match(subs, path, is_dir) ||
+           !prefix_match(server_owned, path, is_dir) || sync_is_temp(base ? base + 1 : path);
+}
+
+// What one SYNC_LISTING leads to
+typedef struct {
+    uint8_t* want;          // files to fetch, as in SYNC_WANT
+    size_t want_len;
+    size_t want_cap;
+    uint8_t* next;          // directories to compare next, as in SYNC_VERIFY
+    size_t next_len;
+    size_t next_cap;
+} VerifyStep;
+
+// Listing entry names, pointing into the SYNC_LISTING payload
+typedef struct {
+    const char* name;
+    size_t len;
+} ListedName;
+
+static int compare_listed(const void* a, const void* b) {
+    const ListedName* x = a;
+    const ListedName* y = b;
+    int c = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+    return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+// Replace whatever is at name (a file where the server has a directory or
+// the other way round) before its proper contents go there
+void clear_local(const char* name, const char* filepath) {
+    tombstone_local(name);
+    remove_tree(filepath);
+}
+
+// Bring one directory in line with the server's listing of it: fetch the
+// files that are missing or differ, queue the subdirectories whose digests
+// differ for the next round and remove what the server does not have.
+// With two-way sync, entries only we have are kept, since they may be
+// changes of ours still to be pushed. Caller holds verify_lock.
+int verify_dir(const char* dir, const uint8_t* raw, size_t raw_len, size_t* pos,
+               VerifyStep* step) {
+    char dirpath[MAX_PATH];
+    if (raw_len - *pos < 4 || make_local_path(dirpath, sizeof(dirpath), dir, strlen(dir)) < 0) {
+        return -1;
+    }
+    size_t count = sync_get32(raw + *pos);
+    *pos += 4;
+    struct stat st;
+    if (dir[0] && (lstat(dirpath, &st) < 0 || !S_ISDIR(st.st_mode))) {
+        clear_local(dir, dirpath);
+        note_local_dir(dir);
+        if (mkdir(dirpath, 0755) < 0 && errno != EEXIST) perror("mkdir");
+    }
+
+    ListedName* listed = malloc((count ? count : 1) * sizeof(ListedName));
+    if (!listed) return -1;
+    size_t n = 0;
+    TreeEntry entry;
+    for (size_t i = 0; i < count; i++) {
+        if (tree_next_entry(raw, raw_len, pos, &entry) < 0) {
+            free(listed);
+            return -1;
+        }
+        char name[MAX_PATH], filepath[MAX_PATH];
+        int len = snprintf(name, sizeof(name), "%s%s%.*s", dir, dir[0] ? "/" : "",
+                           (int)entry.path_len, entry.path);
+        if (len >= (int)sizeof(name) || memchr(entry.path, '/', entry.path_len) ||
+            !sync_path_is_safe(name, len) ||
+            make_local_path(filepath, sizeof(filepath), name, len) < 0) {
+            continue;
+        }
+        listed[n].name = entry.path;
+        listed[n].len = entry.path_len;
+        n++;
+        if (mirror_skip(NULL, name, entry.type == TREE_DIR)) continue;
+
+        int exists = lstat(filepath, &st) == 0;
+        if (entry.type == TREE_DIR) {
+            uint8_t digest[TREE_VERIFY_FIXED - 2];
+            if (exists && !S_ISDIR(st.st_mode)) clear_local(name, filepath);
+            if (!exists || !S_ISDIR(st.st_mode) ||
+                tree_digest(mirror, &mirror_view, name, digest) < 0) {
+                memset(digest, 0, sizeof(digest));
+            }
+            if (memcmp(digest, entry.hash, sizeof(digest)) == 0) continue;
+            if (add_want(&step->next, &step->next_len, &step->next_cap, name, len) < 0 ||
+                add_bytes(&step->next, &step->next_len, &step->next_cap, digest,
+                          sizeof(digest)) < 0) {
+                free(listed);
+                return -1;
+            }
+            continue;
+        }
+        if (exists && S_ISDIR(st.st_mode)) clear_local(name, filepath);
+        if (keep_local(name, filepath, &entry)) continue;
+        if (add_want(&step->want, &step->want_len, &step->want_cap, name, len) < 0) {
+            free(listed);
+            return -1;
+        }
+        verify_fetched++;
+    }
+
+    // Listings come sorted by name
+    DIR* d = opendir(dirpath);
+    struct dirent* de;
+    while (d && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        ListedName key = { de->d_name, strlen(de->d_name) };
+        if (bsearch(&key, listed, n, sizeof(ListedName), compare_listed)) continue;
+
+        char name[MAX_PATH], filepath[MAX_PATH];
+        int len = snprintf(name, sizeof(name), "%s%s%s", dir, dir[0] ? "/" : "", de->d_name);
+        if (len >= (int)sizeof(name) || make_local_path(filepath, sizeof(filepath), name, len) < 0 ||
+            lstat(filepath, &st) < 0 || mirror_skip(NULL, name, S_ISDIR(st.st_mode))) {
+            continue;
+        }
+        if (versions) {
+            verify_kept++;
+            continue;
+        }
+        printf("Removing %s, which the server does not have\n", name);
+        if (remove_tree(filepath) < 0) perror("remove");
+        verify_removed++;
+    }
+    if (d) closedir(d);
+    free(listed);
+    return 0;
+}
+
+// Apply a SYNC_LISTING and carry the verification on: the directories
+// whose digests still differ go back in one SYNC_VERIFY, so a mirror
+// costs one round trip per level that differs. Runs as a barrier, so no
+// worker writes the mirror meanwhile.
+void apply_listing(Transfer* t) {
+    uint8_t* raw;
+    size_t raw_len;
+    int rc = read_spool(t, &raw, &raw_len);
+    size_t owned_len = rc == 0 && raw_len >= 4 ? sync_get32(raw) : 0;
+    if (rc < 0 || raw_len < 8 || raw_len - 8 < owned_len) {
+        printf("Bad directory listing from server\n");
+        if (rc == 0) free(raw);
+        return;
     }
 
-    if (send(server_socket, ignore_list, strlen(ignore_list), 0) < 0) {
-        perror("send ignore list");
+    pthread_mutex_lock(&verify_lock);
+    if (!verify_outstanding || !mirror) {
+        pthread_mutex_unlock(&verify_lock);
+        free(raw);
+        return;     // the run it belongs to was abandoned
+    }
+    verify_rounds++;
+    // A server owning part of the tree names its subtrees, so our digests
+    // leave out the rest from now on
+    if (owned_len != server_owned_len || memcmp(raw + 4, server_owned_list, owned_len) != 0) {
+        PrefixSet* set = owned_len ? prefix_compile((const char*)raw + 4, owned_len) : NULL;
+        char* list = owned_len ? malloc(owned_len) : NULL;
+        if (owned_len && (!set || !list)) {
+            prefix_free(set);
+            free(list);
+        } else {
+            prefix_free(server_owned);
+            free(server_owned_list);
+            server_owned = set;
+            server_owned_list = list;
+            if (list) memcpy(list, raw + 4, owned_len);
+            server_owned_len = owned_len;
+            mirror_view.id++;
+        }
+    }
+
+    VerifyStep step = {0};
+    size_t pos = 4 + owned_len, count = sync_get32(raw + pos);
+    int failed = 0;
+    pos += 4;
+    verify_dirs += count;
+    for (size_t i = 0; i < count && !failed; i++) {
+        size_t path_len = raw_len - pos >= 2 ? sync_get16(raw + pos) : MAX_PATH;
+        const char* path = (const char*)raw + pos + 2;
+        char dir[MAX_PATH];
+        if (path_len >= MAX_PATH || raw_len - pos - 2 < path_len ||
+            (path_len && !sync_path_is_safe(path, path_len))) {
+            failed = 1;
+            break;
+        }
+        pos += 2 + path_len;
+        memcpy(dir, path, path_len);
+        dir[path_len] = '\0';
+        failed = verify_dir(dir, raw, raw_len, &pos, &step) < 0;
+    }
+    free(raw);
+
+    if (step.want_len) send_want(step.want, step.want_len);
+    if (!failed && step.next_len && send_frame(SYNC_VERIFY, "", 0, step.next, step.next_len) == 0) {
+        verify_sent_ms = monotonic_ms();
+    } else if (failed) {
+        verify_outstanding = 0;
+        printf("Bad directory listing from server, verification abandoned\n");
+    } else {
+        verify_outstanding = 0;
+        if (verify_dirs == 0) {
+            printf("Mirror matches the server (%ld ms)\n", monotonic_ms() - verify_start_ms);
+        } else {
+            printf("Mirror verified in %zu round trips (%ld ms): %zu directories differed, "
+                   "%zu files fetched, %zu entries removed, %zu kept\n", verify_rounds,
+                   monotonic_ms() - verify_start_ms, verify_dirs, verify_fetched,
+                   verify_removed, verify_kept);
+        }
+    }
+    pthread_mutex_unlock(&verify_lock);
+    free(step.want);
+    free(step.next);
+}
+
+// CRC-32 of the first len bytes of a file; -1 if it is shorter
+int file_prefix_crc(const char* filepath, uint64_t len, uint32_t* crc_out) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return -1;
+    uint8_t buf[65536];
+    uint32_t crc = 0;
+    uint64_t pos = 0;
+    while (pos < len) {
+        size_t want = len - pos < sizeof(buf) ? len - pos : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, pos);
+        if (n <= 0) break;
+        crc = sync_crc32(crc, buf, n);
+        pos += n;
+    }
+    close(fd);
+    *crc_out = crc;
+    return pos == len ? 0 : -1;
+}
+
+// Open the temporary file a SYNC_FILE is written to. A resumed one
+// continues the file left over from the dropped connection; any other
+// copy of the same file makes that leftover useless.
+int open_temp(Transfer* t, const char* filepath) {
+    pthread_mutex_lock(&state_lock);
+    int mine = partial_temp[0] && strcmp(partial_name, t->name) == 0;
+    if (mine && t->resumed && partial_offset == t->offset) {
+        strcpy(t->temppath, partial_temp);
+        t->fd = open(t->temppath, O_WRONLY);
+    } else if (mine) {
+        unlink(partial_temp);
+    }
+    if (mine) partial_name[0] = partial_temp[0] = '\0';
+    pthread_mutex_unlock(&state_lock);
+    if (t->resumed) {
+        if (t->fd < 0) printf("No partial copy of %s to resume\n", t->name);
+        return t->fd;
+    }
+
+    snprintf(t->temppath, sizeof(t->temppath), "%s" SYNC_TEMP_MARK "XXXXXX", filepath);
+    t->fd = mkstemp(t->temppath);
+    if (t->fd < 0) {
+        perror("mkstemp");
+        t->temppath[0] = '\0';
+        return -1;
+    }
+    struct stat st;
+    fchmod(t->fd, stat(filepath, &st) == 0 ? st.st_mode & 07777 : 0644);
+    return t->fd;
+}
+
+// Set up the transfer for a JOB_STREAM; its payload is written as it
+// arrives
+void begin_transfer(Transfer* t, const Job* job) {
+    char filepath[MAX_PATH];
+    memset(t, 0, sizeof(*t));
+    t->type = job->frame.type;
+    t->fd = -1;
+    t->verify = job->frame.flags & SYNC_FLAG_CHECKSUM;
+    t->expected_crc = job->frame.checksum;
+    t->crc = sync_crc32(0, job->name, job->frame.path_len);
+    strcpy(t->name, job->name);
+    if (job->frame.flags & SYNC_FLAG_OFFSET) {
+        t->resumed = 1;
+        t->offset = job->offset;
+    }
+    t->size = t->offset + job->remaining;
+
+    if (make_local_path(filepath, sizeof(filepath), t->name, strlen(t->name)) < 0) {
+        return;  // payload is still consumed, just not written
+    }
+
+    if (t->type != SYNC_FILE) {
+        t->spool = tmpfile();
+        if (!t->spool) perror("tmpfile");
+        else t->fd = fileno(t->spool);
+        return;
+    }
+
+    char* dir = strdup(filepath);
+    char* last_slash = dir ? strrchr(dir, '/') : NULL;
+    if (last_slash) {
+        *last_slash = '\0';
+        ensure_directory(dir);
+    }
+    free(dir);
+
+    if (open_temp(t, filepath) < 0) return;
+    if (t->resumed) {
+        printf("Resuming %s from byte %llu\n", t->name, (unsigned long long)t->offset);
+    }
+    if (job->frame.flags & SYNC_FLAG_COMPRESS) {
+        if (inflateInit(&t->zs) == Z_OK) {
+            t->inflating = 1;
+        } else {
+            close(t->fd);
+            t->fd = -1;
+        }
+    } else if (t->size - t->offset >= PREALLOC_MIN) {
+        // Reserve the extents up front; not every filesystem can
+        fallocate(t->fd, 0, t->offset, t->size - t->offset);
+    }
+}
+
+// Submit the writes queued on the worker's ring and wait for all of them
+void flush_ring(Worker* w, Transfer* t) {
+    if (w->queued == 0) return;
+    if (uring_submit(&w->ring, w->queued) < 0 && errno != EINTR) {
+        perror("io_uring_enter");
+        exit(EXIT_FAILURE);     // the ring still points into our blocks
+    }
+    while (w->queued > 0) {
+        struct io_uring_cqe* cqe = uring_peek_cqe(&w->ring);
+        if (!cqe) {
+            if (uring_submit(&w->ring, 1) < 0 && errno != EINTR) {
+                perror("io_uring_enter");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (cqe->res < 0 || (uint64_t)cqe->res != cqe->user_data) t->failed = 1;
+        uring_cqe_seen(&w->ring);
+        w->queued--;
+    }
+}
+
+// Write payload bytes to the transfer target, inflating them first for a
+// compressed SYNC_FILE. Returns -1 on a write error or corrupt stream.
+// Writes queued on the ring point into data until flush_ring.
+int transfer_write(Worker* w, Transfer* t, const uint8_t* data, size_t len) {
+    if (!t->inflating && w->batching) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&w->ring);
+        if (!sqe) {
+            flush_ring(w, t);
+            sqe = uring_get_sqe(&w->ring);
+        }
+        uring_prep(sqe, IORING_OP_WRITE, t->fd, data, len, t->offset);
+        sqe->user_data = len;
+        w->queued++;
+        t->offset += len;
+        return 0;
+    }
+    if (!t->inflating) {
+        if (pwrite(t->fd, data, len, t->offset) != (ssize_t)len) return -1;
+        t->offset += len;
+        return 0;
+    }
+
+    uint8_t out[65536];
+    t->zs.next_in = (Bytef*)data;
+    t->zs.avail_in = len;
+    while (!t->stream_end && (t->zs.avail_in > 0 || t->zs.avail_out == 0)) {
+        t->zs.next_out = out;
+        t->zs.avail_out = sizeof(out);
+        int rc = inflate(&t->zs, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) t->stream_end = 1;
+        else if (rc == Z_BUF_ERROR) break;      // needs more input
+        else if (rc != Z_OK) return -1;
+        size_t n = sizeof(out) - t->zs.avail_out;
+        if (n && pwrite(t->fd, out, n, t->offset) != (ssize_t)n) return -1;
+        t->offset += n;
+    }
+    return 0;
+}
+
+// A plain SYNC_FILE cut off by a dropped connection keeps its temporary
+// file, so the next connection can ask for just the rest
+void keep_partial(Transfer* t) {
+    uint32_t crc;
+    if (t->fd < 0 || t->inflating || t->failed || t->offset == 0 ||
+        file_prefix_crc(t->temppath, t->offset, &crc) < 0) {
+        unlink(t->temppath);
+        return;
+    }
+    pthread_mutex_lock(&state_lock);
+    if (partial_temp[0]) unlink(partial_temp);
+    strcpy(partial_name, t->name);
+    strcpy(partial_temp, t->temppath);
+    partial_offset = t->offset;
+    partial_crc = crc;
+    pthread_mutex_unlock(&state_lock);
+    printf("Transfer of %s cut off after %llu bytes\n", t->name, (unsigned long long)t->offset);
+}
+
+void finish_transfer(Transfer* t, int cut) {
+    if (t->type == SYNC_DELTA) __atomic_sub_fetch(&answers_pending, 1, __ATOMIC_RELAXED);
+    if (t->type != SYNC_FILE) {
+        if (!t->spool) return;
+        if (cut) {
+            // Only a complete payload can be applied
+        } else if (t->verify && t->crc != t->expected_crc) {
+            printf("Checksum mismatch for %s, ignoring it\n", t->name);
+        } else if (t->type == SYNC_DELTA) {
+            apply_delta(t);
+        } else if (t->type == SYNC_MANIFEST) {
+            apply_manifest(t);
+        } else if (t->type == SYNC_LISTING) {
+            apply_listing(t);
+        } else {
+            pthread_mutex_lock(&state_lock);
+            start_assembly(t);
+            pthread_mutex_unlock(&state_lock);
+        }
+        fclose(t->spool);
+        return;
+    }
+
+    if (t->inflating) inflateEnd(&t->zs);
+    if (!t->temppath[0]) {
+        printf("Failed to write %s\n", t->name);
+        return;
+    }
+    if (cut) {
+        if (t->fd >= 0) close(t->fd);
+        keep_partial(t);
+        return;
+    }
+    // A resumed file may have been preallocated for a longer version
+    if (t->fd >= 0 && !t->inflating && (t->resumed || t->offset != t->size) &&
+        ftruncate(t->fd, t->offset) < 0) {
+        t->failed = 1;
+    }
+    if (t->fd >= 0) close(t->fd);
+
+    char filepath[MAX_PATH];
+    if (t->verify && t->crc != t->expected_crc) {
+        printf("Checksum mismatch for %s, discarding it\n", t->name);
+    } else if (t->fd < 0 || t->failed || (t->inflating && !t->stream_end) ||
+               make_local_path(filepath, sizeof(filepath), t->name, strlen(t->name)) < 0 ||
+               commit_rename(t->temppath, filepath, t->name) < 0) {
+        printf("Failed to write %s\n", t->name);
+    } else {
+        printf("Received and wrote file: %s\n", t->name);
+        if (chunk_store) chunk_index_add_file(chunk_store, local_dir, t->name);
+        return;
+    }
+    unlink(t->temppath);
+}
+
+// Lock-taking wrapper for the workers
+void forget_assembly(const char* path, size_t path_len) {
+    pthread_mutex_lock(&state_lock);
+    abort_assembly(path, path_len);
+    pthread_mutex_unlock(&state_lock);
+}
+
+// Rename for the server: the entries move along, and the result is
+// recorded like any other write of the server's
+int commit_move(const char* filepath, const char* newpath, const char* name,
+                const char* new_name, int is_dir) {
+    if (!versions) return rename(filepath, newpath);
+    version_move(versions, name, new_name);
+    tombstone_local(name);
+    if (!is_dir) return commit_rename(filepath, newpath, new_name);
+    note_local_dir(new_name);
+    return rename(filepath, newpath);
+}
+
+// SYNC_PUSH_ACK: the server's verdict on one of our pushes
+void receive_ack(const char* name, const uint8_t* payload, size_t len) {
+    VersionVector vv = {0};
+    if (!versions || len < 1 || vv_decode(payload + 1, len - 1, &vv) < 0) return;
+    int status = payload[0];
+    VersionState* s = version_lock(versions, name, 1);
+    if (s) {
+        if (status == PUSH_APPLIED) {
+            // Still pending if we changed it again since
+            vv_merge(&s->vv, &vv);
+            if (vv_compare(&s->vv, &vv) == VV_EQUAL) s->pending = 0;
+        } else {
+            if (status == PUSH_CONFLICT) vv_copy(&s->vv, &vv);
+            s->pending = 0;
+        }
+        version_unlock(versions, s);
+    }
+    if (status == PUSH_CONFLICT) printf("Conflict on %s, the server's copy wins\n", name);
+    else if (status == PUSH_REJECTED) printf("Server rejected our change to %s\n", name);
+    vv_free(&vv);
+}
+
+// SYNC_VECTOR: the server's vector for a path, sent with every change to
+// it. A path with a push in flight waits for that push's ack instead.
+void receive_version(const char* name, const uint8_t* payload, size_t len) {
+    VersionVector vv = {0};
+    if (!versions || vv_decode(payload, len, &vv) < 0) return;
+    VersionState* s = version_lock(versions, name, 1);
+    if (s) {
+        if (!s->pending) vv_copy(&s->vv, &vv);
+        version_unlock(versions, s);
+    }
+    vv_free(&vv);
+}
+
+// Apply a control frame on a worker
+void apply_event(const SyncFrame* frame, const uint8_t* payload) {
+    int len = frame->path_len;
+    const char* name = frame->path;
+    char filepath[MAX_PATH], key[MAX_PATH];
+    if (make_local_path(filepath, sizeof(filepath), name, len) < 0) {
+        printf("Path too long: %.*s\n", len, name);
+        return;
+    }
+    snprintf(key, sizeof(key), "%.*s", len, name);
+
+    switch (frame->type) {
+    case SYNC_CREATE:
+        printf("Server event: Created %.*s\n", len, name);
+        if (frame->flags & SYNC_FLAG_DIR) {
+            note_local_dir(key);
+            ensure_directory(filepath);
+        }
+        // File data follows in a separate SYNC_FILE frame
+        break;
+    case SYNC_DELETE:
+        forget_assembly(name, len);
+        tombstone_local(key);
+        if (remove_tree(filepath) == 0) {
+            printf("Server event: Deleted %.*s\n", len, name);
+        } else {
+            printf("Server event: Failed to delete %.*s (%s)\n", len, name, strerror(errno));
+        }
+        break;
+    case SYNC_MOVED_FROM:
+        printf("Server event: Moved from %.*s\n", len, name);
+        forget_assembly(name, len);
+        tombstone_local(key);
+        remove_tree(filepath);    // a directory leaves with its contents
+        break;
+    case SYNC_MOVED_TO:
+        printf("Server event: Moved to %.*s\n", len, name);
+        if (frame->flags & SYNC_FLAG_DIR) {
+            note_local_dir(key);
+            ensure_directory(filepath);
+        }
+        // File contents follow in a SYNC_FILE or SYNC_CHUNKS frame
+        break;
+    case SYNC_RENAME: {
+        const char* new_name = (const char*)payload;
+        char newpath[MAX_PATH], new_key[MAX_PATH];
+        if (!sync_path_is_safe(new_name, frame->payload_len) ||
+            make_local_path(newpath, sizeof(newpath), new_name, frame->payload_len) < 0) {
+            printf("Rejected rename of %.*s\n", len, name);
+            break;
+        }
+        snprintf(new_key, sizeof(new_key), "%.*s", (int)frame->payload_len, new_name);
+        forget_assembly(name, len);
+        if (commit_move(filepath, newpath, key, new_key, frame->flags & SYNC_FLAG_DIR) == 0) {
+            printf("Server event: Renamed %.*s to %.*s\n", len, name,
+                   (int)frame->payload_len, new_name);
+            if (chunk_store && !(frame->flags & SYNC_FLAG_DIR)) {
+                // Re-point the index at the new name (hashing is local only)
+                char key[MAX_PATH];
+                snprintf(key, sizeof(key), "%.*s", (int)frame->payload_len, new_name);
+                chunk_index_add_file(chunk_store, local_dir, key);
+            }
+        } else if (!(frame->flags & SYNC_FLAG_DIR)) {
+            // We never had the old copy; fetch the file under its new name
+            send_signatures(new_name, frame->payload_len, 1);
+        }
+        break;
+    }
+    case SYNC_CHUNK_DATA:
+        pthread_mutex_lock(&state_lock);
+        receive_chunk(frame, payload);
+        pthread_mutex_unlock(&state_lock);
+        break;
+    case SYNC_SIG_REQUEST:
+        send_signatures(name, len, 0);
+        break;
+    case SYNC_PUSH_ACK:
+        receive_ack(key, payload, frame->payload_len);
+        break;
+    case SYNC_VECTOR:
+        receive_version(key, payload, frame->payload_len);
+        break;
+    default:
+        printf("Received unknown frame type %d for %.*s\n", frame->type, len, name);
+    }
+}
+
+// Record a SYNC_SEQ once every worker has got past it; caller holds
+// state_lock
+void pass_seq_locked(SeqMark* mark) {
+    if (--mark->left > 0) return;
+    if (mark->epoch != epoch) {
+        // A restarted server numbers its events afresh
+        epoch = mark->epoch;
+        applied_seq = 0;
+    }
+    seen_seq = mark->seq;
+    caught_up = 1;
+    free(mark);
+}
+
+// Write a JOB_STREAM's payload as the receive thread hands it over
+void run_stream(Worker* w, Job* job) {
+    Transfer t;
+    begin_transfer(&t, job);
+    int complete = 0;
+    while (!complete) {
+        pthread_mutex_lock(&w->lock);
+        while (!job->blocks && !job->complete) pthread_cond_wait(&w->wake, &w->lock);
+        Block* list = job->blocks;
+        job->blocks = NULL;
+        job->blocks_tail = &job->blocks;
+        complete = job->complete;
+        pthread_mutex_unlock(&w->lock);
+
+        // A single block is cheaper to write directly
+        size_t freed = 0;
+        w->batching = w->use_ring && list && list->next;
+        for (Block* b = list; b; b = b->next) {
+            if (t.verify) t.crc = sync_crc32(t.crc, b->data, b->len);
+            if (t.fd >= 0 && !t.failed && transfer_write(w, &t, b->data, b->len) < 0) {
+                perror("write file");
+                t.failed = 1;
+            }
+        }
+        flush_ring(w, &t);
+        while (list) {
+            Block* next = list->next;
+            freed += list->len;
+            free(list);
+            list = next;
+        }
+        pthread_mutex_lock(&budget_lock);
+        buffered -= freed;
+        pthread_cond_broadcast(&budget_cond);
+        pthread_mutex_unlock(&budget_lock);
+    }
+    finish_transfer(&t, job->cut);
+}
+
+// Apply worker: runs the jobs queued to it in order
+void* apply_worker(void* arg) {
+    Worker* w = (Worker*)arg;
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        while (!w->jobs) {
+            w->busy = 0;
+            pthread_cond_broadcast(&w->idle);
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        Job* job = w->jobs;
+        w->jobs = job->next;
+        if (!w->jobs) w->jobs_tail = &w->jobs;
+        w->busy = 1;
+        pthread_mutex_unlock(&w->lock);
+
+        if (job->kind == JOB_STREAM) {
+            run_stream(w, job);
+        } else if (job->kind == JOB_EVENT) {
+            apply_event(&job->frame, job->payload);
+        }
+
+        pthread_mutex_lock(&state_lock);
+        if (job->kind == JOB_SEQ) pass_seq_locked(job->mark);
+        if (seen_seq > applied_seq && !assemblies &&
+            __atomic_load_n(&answers_pending, __ATOMIC_RELAXED) == 0) {
+            applied_seq = seen_seq;
+        }
+        pthread_mutex_unlock(&state_lock);
+        free(job->payload);
+        free(job);
+    }
+    return NULL;
+}
+
+int start_workers(void) {
+    for (int i = 0; i < nworkers; i++) {
+        Worker* w = &workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, NULL);
+        pthread_cond_init(&w->idle, NULL);
+        w->jobs_tail = &w->jobs;
+        if (use_uring) {
+            w->use_ring = uring_init(&w->ring, WRITE_DEPTH) == 0;
+            if (!w->use_ring && i == 0) perror("io_uring_setup, writing files directly");
+        }
+        if (pthread_create(&w->thread, NULL, apply_worker, w) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Wait until every worker has run everything queued to it
+void drain_workers(void) {
+    for (int i = 0; i < nworkers; i++) {
+        Worker* w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        while (w->jobs || w->busy) pthread_cond_wait(&w->idle, &w->lock);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+// Queue a job to w
+void push_job(Worker* w, Job* job) {
+    job->worker = w;
+    pthread_mutex_lock(&w->lock);
+    *w->jobs_tail = job;
+    w->jobs_tail = &job->next;
+    w->busy = 1;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Hand a job to the worker that owns its path. A barrier job runs alone:
+// on worker 0 once all the others are idle, and before anything after it.
+void dispatch(Job* job, int barrier) {
+    if (barrier || barrier_pending) drain_workers();
+    barrier_pending = barrier;
+
+    uint32_t hash = 2166136261u;
+    for (const char* c = job->name; *c; c++) hash = (hash ^ (uint8_t)*c) * 16777619u;
+    push_job(barrier ? &workers[0] : &workers[hash % nworkers], job);
+}
+
+// Copy a frame (and, for a control frame, its payload) into a new job
+Job* new_job(int kind, const SyncFrame* frame, const uint8_t* payload) {
+    Job* job = calloc(1, sizeof(Job));
+    if (!job || (payload && !(job->payload = malloc(frame->payload_len + 1)))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    job->kind = kind;
+    if (frame) {
+        job->frame = *frame;
+        memcpy(job->name, frame->path, frame->path_len);
+        job->frame.path = job->name;
+    }
+    if (payload) memcpy(job->payload, payload, frame->payload_len);
+    job->blocks_tail = &job->blocks;
+    return job;
+}
+
+// Hand a control frame to the workers. Deletes and moves can reach
+// anything below them, so they run as barriers; SYNC_SEQ is queued to
+// every worker so it only counts once everything before it is done.
+void dispatch_event(const SyncFrame* frame, const uint8_t* payload) {
+    if (frame->type != SYNC_SEQ) {
+        int barrier = frame->type == SYNC_DELETE || frame->type == SYNC_MOVED_FROM ||
+                      frame->type == SYNC_RENAME;
+        dispatch(new_job(JOB_EVENT, frame, payload), barrier);
+        return;
+    }
+    if (frame->payload_len != SYNC_SEQ_SIZE) return;
+
+    SeqMark* mark = malloc(sizeof(SeqMark));
+    if (!mark) return;
+    mark->epoch = sync_get64(payload);
+    mark->seq = sync_get64(payload + 8);
+    mark->left = nworkers;
+    if (barrier_pending) drain_workers();
+    barrier_pending = 0;
+    for (int i = 0; i < nworkers; i++) {
+        Job* job = new_job(JOB_SEQ, NULL, NULL);
+        job->mark = mark;
+        push_job(&workers[i], job);
+    }
+}
+
+// Pass payload bytes of the receiving job to its worker, waiting while
+// the workers are MAX_BUFFERED behind
+void append_block(Job* job, const uint8_t* data, size_t len) {
+    pthread_mutex_lock(&budget_lock);
+    while (buffered > 0 && buffered + len > MAX_BUFFERED) {
+        pthread_cond_wait(&budget_cond, &budget_lock);
+    }
+    buffered += len;
+    pthread_mutex_unlock(&budget_lock);
+
+    Block* b = malloc(sizeof(Block) + len);
+    if (!b) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    b->next = NULL;
+    b->len = len;
+    memcpy(b->data, data, len);
+
+    Worker* w = job->worker;
+    pthread_mutex_lock(&w->lock);
+    *job->blocks_tail = b;
+    job->blocks_tail = &b->next;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// No more payload is coming for the job (cut: the connection dropped)
+void end_stream(Job* job, int cut) {
+    Worker* w = job->worker;
+    pthread_mutex_lock(&w->lock);
+    job->complete = 1;
+    job->cut = cut;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Hand the events of a SYNC_BATCH to the workers in order. Returns -1 if
+// it is malformed.
+int apply_batch(const uint8_t* payload, uint64_t len) {
+    if (len < 4) return -1;
+    uint32_t count = sync_get32(payload);
+    uint64_t pos = 4;
+    for (uint32_t i = 0; i < count; i++) {
+        if (len - pos < SYNC_BATCH_ENTRY_FIXED) return -1;
+        const uint8_t* entry = payload + pos;
+        SyncFrame frame = {0};
+        frame.version = SYNC_VERSION;
+        frame.type = entry[0];
+        frame.flags = sync_get16(entry + 1);
+        frame.path_len = sync_get16(entry + 3);
+        frame.path = (const char*)entry + 5;
+        if (len - pos < SYNC_BATCH_ENTRY_FIXED + (uint64_t)frame.path_len) return -1;
+        frame.payload_len = sync_get16(entry + 5 + frame.path_len);
+        pos += SYNC_BATCH_ENTRY_FIXED + frame.path_len + frame.payload_len;
+        if (pos > len || frame.path_len >= MAX_PATH) return -1;
+
+        if (!sync_path_is_safe(frame.path, frame.path_len)) {
+            printf("Rejected unsafe path from server: %.*s\n", frame.path_len, frame.path);
+            return -1;
+        }
+        if (frame.type == SYNC_BATCH || frame.type == SYNC_SEQ) return -1;
+        dispatch_event(&frame, entry + SYNC_BATCH_ENTRY_FIXED + frame.path_len);
+    }
+    return pos == len ? 0 : -1;
+}
+
+// Parse every complete frame in the ring and pass it, or the file payload
+// bytes that follow one, to the workers. Returns -1 if the stream is corrupt.
+int process_frames(RingBuffer* ring) {
+    while (ring->head < ring->tail) {
+        uint8_t* data = ring->base + ring->head % ring->size;
+        size_t avail = ring->tail - ring->head;
+
+        if (receiving) {
+            size_t chunk = avail < receiving->remaining ? avail : receiving->remaining;
+            if (chunk > PAYLOAD_BLOCK) chunk = PAYLOAD_BLOCK;
+            append_block(receiving, data, chunk);
+            receiving->remaining -= chunk;
+            ring->head += chunk;
+            if (receiving->remaining == 0) {
+                end_stream(receiving, 0);
+                receiving = NULL;
+            }
+            continue;
+        }
+
+        SyncFrame frame;
+        int used = sync_parse_header(data, avail, &frame);
+        if (used < 0) return -1;
+        if (used == 0) break;
+        if (frame.path_len >= MAX_PATH) return -1;     // would not fit a job's name
+        if (frame.type != SYNC_MANIFEST && frame.type != SYNC_BATCH && frame.type != SYNC_SEQ &&
+            frame.type != SYNC_LISTING && !sync_path_is_safe(frame.path, frame.path_len)) {
+            printf("Rejected unsafe path from server: %.*s\n", frame.path_len, frame.path);
+            return -1;
+        }
+
+        if (frame.type == SYNC_FILE || frame.type == SYNC_DELTA || frame.type == SYNC_CHUNKS ||
+            frame.type == SYNC_MANIFEST || frame.type == SYNC_LISTING) {
+            // A resumed file's offset is read in place, like a control frame
+            size_t prefix = frame.type == SYNC_FILE && (frame.flags & SYNC_FLAG_OFFSET) ? 8 : 0;
+            if (frame.payload_len < prefix) return -1;
+            if (avail - used < prefix) break;
+            Job* job = new_job(JOB_STREAM, &frame, NULL);
+            if (prefix) job->offset = sync_get64(data + used);
+            job->remaining = frame.payload_len - prefix;
+            // The manifest and listings decide what to fetch, and what to
+            // remove, across whole directories
+            dispatch(job, frame.type == SYNC_MANIFEST || frame.type == SYNC_LISTING);
+            ring->head += used + prefix;
+            if (job->remaining == 0) end_stream(job, 0);
+            else receiving = job;
+            continue;
+        }
+
+        // Control frames are handled whole, straight out of the ring
+        if (frame.payload_len > ring->size - used) return -1;
+        if (avail - used < frame.payload_len) break;
+        if (frame.flags & SYNC_FLAG_CHECKSUM) {
+            uint32_t crc = sync_crc32(sync_crc32(0, frame.path, frame.path_len),
+                                      data + used, frame.payload_len);
+            if (crc != frame.checksum) return -1;
+        }
+        if (frame.type == SYNC_BATCH) {
+            if (apply_batch(data + used, frame.payload_len) < 0) return -1;
+        } else {
+            dispatch_event(&frame, data + used);
+        }
+        ring->head += used + frame.payload_len;
+    }
+    return 0;
+}
+
+// Connect and say hello, first telling the server which subtrees we want
+// and where we left off if we have been connected before. Returns -1 if the server is unreachable.
+int connect_server(int hello_flags) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    uint8_t resume[SYNC_RESUME_SIZE];
+    pthread_mutex_lock(&state_lock);
+    int resuming = epoch || partial_name[0];
+    sync_put64(resume, epoch);
+    sync_put64(resume + 8, applied_seq);
+    sync_put64(resume + 16, partial_offset);
+    sync_put32(resume + 24, partial_crc);
+    pthread_mutex_unlock(&state_lock);
+
+    // The socket is published and the handshake sent in one go, so no
+    // push can reach the new connection ahead of HELLO
+    pthread_mutex_lock(&send_lock);
+    server_socket = fd;
+    if ((sub_len && send_frame_locked(SYNC_SUBSCRIBE, 0, "", 0, sub_list, sub_len, 0) < 0) ||
+        (resuming && send_frame_locked(SYNC_RESUME, 0, partial_name, strlen(partial_name),
+                                       resume, sizeof(resume), 0) < 0) ||
+        send_frame_locked(SYNC_HELLO, hello_flags, "", 0, ignore_list, ignore_len, 0) < 0) {
+        close_server_locked();
+        pthread_mutex_unlock(&send_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&send_lock);
+    return 0;
+}
+
+// Stop sending on a lost connection: senders see -1 rather than an fd
+// that may already have been reused
+void close_server(void) {
+    pthread_mutex_lock(&send_lock);
+    close_server_locked();
+    pthread_mutex_unlock(&send_lock);
+}
+
+// Drop everything tied to the lost connection once the workers are done
+// with it. A plain SYNC_FILE that was cut off is kept as far as it got,
+// to be resumed from there.
+void reset_connection(RingBuffer* ring) {
+    if (receiving) {
+        end_stream(receiving, 1);
+        receiving = NULL;
+    }
+    drain_workers();
+    barrier_pending = 0;
+
+    pthread_mutex_lock(&state_lock);
+    while (assemblies) {
+        Assembly* a = assemblies;
+        assemblies = a->next;
+        free_assembly(a);
+    }
+    chunks_in_flight = 0;
+    seen_seq = applied_seq;
+    caught_up = 0;
+    full_request[0] = '\0';
+    __atomic_store_n(&answers_pending, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&state_lock);
+
+    pthread_mutex_lock(&verify_lock);
+    verify_outstanding = 0;
+    pthread_mutex_unlock(&verify_lock);
+    ring->head = ring->tail = 0;
+}
+
+// Send a SYNC_PUSH for name; target is the new name of a SYNC_RENAME.
+// MSG_MORE keeps it in the same segment as the contents that follow.
+int send_push(int op, int is_dir, const char* name, const VersionVector* vv,
+              const struct timespec* mtime, uint64_t size, const char* target) {
+    size_t target_len = target ? strlen(target) : 0;
+    size_t len = SYNC_PUSH_FIXED + vv_encoded_size(vv) + target_len;
+    uint8_t* payload = malloc(len);
+    if (!payload) return -1;
+    payload[0] = op;
+    sync_put64(payload + 1, replica);
+    sync_put64(payload + 9, mtime->tv_sec);
+    sync_put32(payload + 17, mtime->tv_nsec);
+    sync_put64(payload + 21, size);
+    vv_encode(vv, payload + SYNC_PUSH_FIXED);
+    if (target_len) memcpy(payload + len - target_len, target, target_len);
+    int rc = send_frame_msg(SYNC_PUSH, is_dir ? SYNC_FLAG_DIR : 0, name, strlen(name),
+                            payload, len, size ? MSG_MORE : 0);
+    free(payload);
+    return rc;
+}
+
+// Push a file's contents as SYNC_PUSH_DATA frames straight after its
+// SYNC_PUSH. Nothing waits for the ack, so pushes of several files
+// pipeline on the connection.
+int push_file(const char* name, const char* filepath, const VersionVector* vv) {
+    int fd = open(filepath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;      // gone again; its delete follows
+    }
+    uint8_t* buf = st.st_size ? malloc(PUSH_BLOCK) : NULL;
+    int rc = st.st_size && !buf ? -1 : send_push(SYNC_FILE, 0, name, vv, &st.st_mtim, st.st_size,
+                                                 NULL);
+    for (off_t pos = 0; rc == 0 && pos < st.st_size; ) {
+        size_t want = st.st_size - pos < PUSH_BLOCK ? st.st_size - pos : PUSH_BLOCK;
+        ssize_t n = pread(fd, buf, want, pos);
+        // A file that shrank meanwhile is padded; its next event resends it
+        if (n < (ssize_t)want) memset(buf + (n > 0 ? n : 0), 0, want - (n > 0 ? n : 0));
+        pos += want;
+        rc = send_frame_msg(SYNC_PUSH_DATA, 0, name, strlen(name), buf, want,
+                            pos < st.st_size ? MSG_MORE : 0);
+    }
+    free(buf);
+    close(fd);
+    return rc;
+}
+
+// A file or directory appeared or changed locally. Unless the stat is the
+// one the workers recorded when they wrote it for the server, it is a new
+// version of ours: bump our counter and push it.
+void push_local_change(const char* name, int is_dir) {
+    char filepath[MAX_PATH];
+    struct stat st;
+    if (make_local_path(filepath, sizeof(filepath), name, strlen(name)) < 0 ||
+        lstat(filepath, &st) < 0 || (is_dir ? !S_ISDIR(st.st_mode) : !S_ISREG(st.st_mode))) {
+        return;
+    }
+    VersionState* s = version_lock(versions, name, 1);
+    if (!s) return;
+    int changed = is_dir ? !(s->exists && s->is_dir) : !(s->exists && version_same(s, &st));
+    VersionVector vv = {0};
+    if (changed) {
+        if (!is_dir) {
+            vv_bump(&s->vv, replica);
+            version_stamp(s, &st);
+        }
+        s->exists = 1;
+        s->is_dir = is_dir;
+        s->pending = 1;
+        vv_copy(&vv, &s->vv);
+    }
+    version_unlock(versions, s);
+    if (!changed) return;
+
+    printf("Pushing %s%s\n", name, is_dir ? "/" : "");
+    if (is_dir) send_push(SYNC_CREATE, 1, name, &vv, &st.st_mtim, 0, NULL);
+    else push_file(name, filepath, &vv);
+    vv_free(&vv);
+}
+
+// Something was removed locally. A tombstone already in place means the
+// workers removed it for the server.
+void push_local_delete(const char* name, int is_dir) {
+    VersionState* s = version_lock(versions, name, 0);
+    if (s && !s->exists) {
+        version_unlock(versions, s);
+        return;
+    }
+    if (!s && !(s = version_lock(versions, name, 1))) return;
+    if (!is_dir) vv_bump(&s->vv, replica);
+    s->exists = 0;
+    s->is_dir = is_dir;
+    s->pending = 1;
+    VersionVector vv = {0};
+    vv_copy(&vv, &s->vv);
+    version_unlock(versions, s);
+    if (is_dir) version_each(versions, name, tombstone_entry, NULL);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    printf("Pushing delete of %s\n", name);
+    send_push(SYNC_DELETE, is_dir, name, &vv, &now, 0, NULL);
+    vv_free(&vv);
+}
+
+// Something was renamed locally. A rename the workers made for the server
+// has moved its entries already, and a name we never synced has nothing
+// to rename upstream: either way the target is pushed as it stands.
+void push_local_rename(const char* old_name, const char* new_name, int is_dir) {
+    VersionState* s = version_lock(versions, old_name, 0);
+    int known = s && s->exists;
+    if (s) version_unlock(versions, s);
+    if (!known) {
+        push_local_change(new_name, is_dir);
+        return;
+    }
+
+    char filepath[MAX_PATH];
+    struct stat st;
+    VersionVector vv = {0};
+    version_move(versions, old_name, new_name);
+    if (make_local_path(filepath, sizeof(filepath), new_name, strlen(new_name)) < 0 ||
+        !(s = version_lock(versions, new_name, 1))) {
+        return;
+    }
+    s->exists = 1;
+    s->is_dir = is_dir;
+    s->pending = 1;
+    if (!is_dir && lstat(filepath, &st) == 0) version_stamp(s, &st);
+    vv_copy(&vv, &s->vv);
+    version_unlock(versions, s);
+    tombstone_local(old_name);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    printf("Pushing rename of %s to %s\n", old_name, new_name);
+    send_push(SYNC_RENAME, is_dir, old_name, &vv, &now, 0, new_name);
+    vv_free(&vv);
+}
+
+void push_local_event(const CoalescedEvent* ev) {
+    switch (ev->kind) {
+    case EV_CREATE:
+    case EV_MODIFY:
+    case EV_MOVED_TO:
+        push_local_change(ev->name, ev->is_dir);
+        break;
+    case EV_DELETE:
+    case EV_MOVED_FROM:
+        push_local_delete(ev->name, ev->is_dir);
+        break;
+    case EV_RENAME:
+        push_local_rename(ev->name, ev->target, ev->is_dir);
+        break;
+    }
+}
+
+typedef struct {
+    char** names;
+    size_t count;
+    size_t cap;
+} NameList;
+
+static void collect_pending(void* arg, const char* path, VersionState* s) {
+    NameList* list = arg;
+    if (!s->pending) return;
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        char** grown = realloc(list->names, cap * sizeof(char*));
+        if (!grown) return;
+        list->names = grown;
+        list->cap = cap;
+    }
+    if ((list->names[list->count] = strdup(path)) != NULL) list->count++;
+}
+
+// After a reconnect, push again whatever the last connection never
+// acknowledged. The server drops what it had applied already as stale.
+void repush_pending(void) {
+    NameList list = {0};
+    version_each(versions, "", collect_pending, &list);
+    if (list.count) printf("Resending %zu unacknowledged changes\n", list.count);
+    for (size_t i = 0; i < list.count; i++) {
+        const char* name = list.names[i];
+        char filepath[MAX_PATH];
+        VersionVector vv = {0};
+        VersionState* s = version_lock(versions, name, 0);
+        int pending = 0, exists = 0, is_dir = 0;
+        if (s) {
+            pending = s->pending;
+            exists = s->exists;
+            is_dir = s->is_dir;
+            vv_copy(&vv, &s->vv);
+            version_unlock(versions, s);
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        // Skipping any acknowledged meanwhile
+        if (pending && make_local_path(filepath, sizeof(filepath), name, strlen(name)) == 0) {
+            if (!exists) send_push(SYNC_DELETE, is_dir, name, &vv, &now, 0, NULL);
+            else if (is_dir) send_push(SYNC_CREATE, 1, name, &vv, &now, 0, NULL);
+            else push_file(name, filepath, &vv);
+        }
+        vv_free(&vv);
+        free(list.names[i]);
+    }
+    free(list.names);
+}
+
+// Watch the local directory at rel and everything below it. With report
+// set, whatever is already there is recorded as created.
+void add_local_watches(const char* rel, Coalescer* report) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s%s%s", local_dir, rel[0] ? "/" : "", rel);
+    int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+    if (wd < 0 || watch_table_set(watches, wd, rel) < 0) return;
+
+    DIR* dir = opendir(path);
+    if (!dir) return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            sync_is_temp(entry->d_name)) {
+            continue;
+        }
+        char subpath[MAX_PATH];
+        struct stat st;
+        if (snprintf(subpath, sizeof(subpath), "%s%s%s", rel, rel[0] ? "/" : "",
+                     entry->d_name) >= (int)sizeof(subpath) ||
+            fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) ||
+            ignore_match(ignore, subpath) || !prefix_match(subs, subpath, S_ISDIR(st.st_mode))) {
+            continue;
+        }
+        if (report) coalescer_add(report, EV_CREATE, S_ISDIR(st.st_mode), 0, subpath);
+        if (S_ISDIR(st.st_mode)) add_local_watches(subpath, report);
+    }
+    closedir(dir);
+}
+
+void remove_local_watch(void* arg, int wd) {
+    (void)arg;
+    inotify_rm_watch(inotify_fd, wd);
+}
+
+// Keep the watch table in step with a local directory event
+void track_local_directory(int mask, uint32_t cookie, const char* name, Coalescer* pending) {
+    if (mask & IN_CREATE) {
+        add_local_watches(name, pending);
+    } else if (mask & IN_MOVED_FROM) {
+        DirMove* move = malloc(sizeof(DirMove) + strlen(name) + 1);
+        if (!move) return;
+        move->cookie = cookie;
+        strcpy(move->path, name);
+        move->next = dir_moves;
+        dir_moves = move;
+    } else if (mask & IN_MOVED_TO) {
+        for (DirMove** link = &dir_moves; *link; link = &(*link)->next) {
+            DirMove* move = *link;
+            if (move->cookie != cookie) continue;
+            watch_table_move(watches, move->path, name);
+            *link = move->next;
+            free(move);
+            return;
+        }
+        add_local_watches(name, pending);     // moved in from outside
+    }
+}
+
+// Watcher thread (-b): collects local changes for PUSH_WINDOW_MS, like
+// the server does, and pushes each one upstream
+void* watch_local(void* arg) {
+    (void)arg;
+    Coalescer* pending = coalescer_new();
+    if (!pending) {
+        perror("watcher");
+        return NULL;
+    }
+    add_local_watches("", NULL);
+
+    char buffer[64 * 1024];
+    long first_ms = 0, last_ms = 0;
+    while (1) {
+        int timeout = -1;
+        if (coalescer_count(pending)) {
+            long now = monotonic_ms();
+            long quiet = last_ms + PUSH_WINDOW_MS - now;
+            long held = first_ms + PUSH_MAX_HOLD * PUSH_WINDOW_MS - now;
+            timeout = quiet < held ? quiet : held;
+            if (timeout < 0) timeout = 0;
+        }
+        struct pollfd pfds[2] = {
+            { .fd = inotify_fd, .events = POLLIN },
+            { .fd = repush_fd, .events = POLLIN },
+        };
+        if (poll(pfds, 2, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            uint64_t n;
+            if (read(repush_fd, &n, sizeof(n)) == sizeof(n)) repush_pending();
+        }
+        if (pfds[0].revents & POLLIN) {
+            ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+            if (length < 0) {
+                perror("read inotify");
+                break;
+            }
+            long now = monotonic_ms();
+            if (!coalescer_count(pending)) first_ms = now;
+            last_ms = now;
+            for (ssize_t i = 0; i < length; ) {
+                struct inotify_event* event = (struct inotify_event*)&buffer[i];
+                i += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    printf("Local inotify queue overflowed; some changes were not pushed\n");
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    watch_table_remove(watches, event->wd);
+                    continue;
+                }
+                const char* parent = watch_table_get(watches, event->wd);
+                if (!event->len || !parent || sync_is_temp(event->name)) continue;
+
+                char name[MAX_PATH];
+                if (snprintf(name, sizeof(name), "%s%s%s", parent, parent[0] ? "/" : "",
+                             event->name) >= (int)sizeof(name)) {
+                    continue;
+                }
+                int is_dir = (event->mask & IN_ISDIR) != 0;
+                int kind;
+                if (event->mask & IN_CREATE) kind = EV_CREATE;
+                else if (event->mask & IN_DELETE) kind = EV_DELETE;
+                else if (event->mask & IN_MOVED_FROM) kind = EV_MOVED_FROM;
+                else if (event->mask & IN_MOVED_TO) kind = EV_MOVED_TO;
+                else if ((event->mask & IN_CLOSE_WRITE) && !is_dir) kind = EV_MODIFY;
+                else continue;
+                // The server would not take these
+                if (ignore_match(ignore, name) || !prefix_match(subs, name, is_dir)) continue;
+
+                coalescer_add(pending, kind, is_dir, event->cookie, name);
+                if (is_dir) track_local_directory(event->mask, event->cookie, name, pending);
+            }
+        }
+
+        long now = monotonic_ms();
+        if (coalescer_count(pending) &&
+            (now - last_ms >= PUSH_WINDOW_MS || now - first_ms >= PUSH_MAX_HOLD * PUSH_WINDOW_MS)) {
+            // Directory moves whose MOVED_TO never came left the tree
+            while (dir_moves) {
+                DirMove* move = dir_moves;
+                dir_moves = move->next;
+                watch_table_remove_under(watches, move->path, remove_local_watch, NULL);
+                free(move);
+            }
+            CoalescedEvent* list = coalescer_take(pending);
+            for (const CoalescedEvent* ev = list; ev; ev = ev->next) push_local_event(ev);
+            coalescer_free_list(list);
+        }
+    }
+    return NULL;
+}
+
+// Verifier thread (-v): every verify_interval seconds, once the server has
+// sent everything it owed us on connecting, bring the mirror's index up to
+// date (a stat of every entry; only files that changed are hashed again)
+// and send the server its root digest. apply_listing takes it from there.
+void* verify_mirror(void* arg) {
+    (void)arg;
+    while (1) {
+        sleep(verify_interval);
+        pthread_mutex_lock(&state_lock);
+        int ready = caught_up;
+        pthread_mutex_unlock(&state_lock);
+
+        pthread_mutex_lock(&verify_lock);
+        if (verify_outstanding && monotonic_ms() - verify_sent_ms > VERIFY_TIMEOUT_MS) {
+            printf("No answer to mirror verification, starting over\n");
+            verify_outstanding = 0;
+        }
+        if (ready && !verify_outstanding) {
+            if (!mirror) mirror = tree_build(local_dir, nworkers, use_uring, subs);
+            else tree_rescan(mirror, ignore_change, NULL);
+            uint8_t request[TREE_VERIFY_FIXED];
+            sync_put16(request, 0);
+            if (mirror && tree_digest(mirror, &mirror_view, "", request + 2) == 0 &&
+                send_frame(SYNC_VERIFY, "", 0, request, sizeof(request)) == 0) {
+                verify_outstanding = 1;
+                verify_start_ms = verify_sent_ms = monotonic_ms();
+                verify_rounds = verify_dirs = verify_fetched = verify_removed = verify_kept = 0;
+            }
+        }
+        pthread_mutex_unlock(&verify_lock);
+    }
+    return NULL;
+}
+
+// Thread to receive server updates and hand them to the apply workers
+void* receive_handler(void* arg) {
+    int hello_flags = *(int*)arg;
+    RingBuffer ring;
+    if (ring_init(&ring, RING_SIZE) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        size_t space = ring.size - (ring.tail - ring.head);
+        ssize_t bytes = recv(server_socket, ring.base + ring.tail % ring.size, space, 0);
+        if (bytes <= 0) {
+            printf("Disconnected from server\n");
+            close_server();
+            reset_connection(&ring);
+            for (int delay = 1; ; delay = delay * 2 < RETRY_MAX ? delay * 2 : RETRY_MAX) {
+                sleep(delay);
+                if (connect_server(hello_flags) == 0) break;
+            }
+            printf("Reconnected to server after event %llu\n", (unsigned long long)applied_seq);
+            uint64_t one = 1;
+            if (bidir && write(repush_fd, &one, sizeof(one)) < 0) perror("write eventfd");
+            continue;
+        }
+        ring.tail += bytes;
+
+        if (process_frames(&ring) < 0) {
+            printf("Corrupt frame from server, disconnecting\n");
+            close(server_socket);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    int opt, compress = 0;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(8080);
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    while ((opt = getopt(argc, argv, "a:s:k:zUbw:v:")) != -1) {
+        if (opt == 'a') {
+            set_server_address(optarg);
+        } else if (opt == 's') {
+            add_subscription(optarg);
+        } else if (opt == 'z') {
+            compress = 1;
+        } else if (opt == 'U') {
+            use_uring = 1;
+        } else if (opt == 'b') {
+            bidir = 1;
+        } else if (opt == 'w') {
+            nworkers = atoi(optarg);
+            if (nworkers < 1 || nworkers > MAX_WORKERS) {
+                fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_WORKERS);
+                exit(EXIT_FAILURE);
+            }
+        } else if (opt == 'v') {
+            verify_interval = atoi(optarg);
+            if (verify_interval < 0) {
+                fprintf(stderr, "Verification interval must be 0 or more seconds\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (opt == 'k') {
+            chunk_store = chunk_index_open(optarg);
+            if (!chunk_store) {
+                fprintf(stderr, "Cannot open chunk store in %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            argc = -1;
+        }
+    }
+    if (argc - optind != 2) {
+        printf("Usage: %s [-a host:port] [-s prefix]... [-k store_dir] [-z] [-U] [-b] "
+               "[-w workers] [-v seconds] path_to_local_directory path_to_ignore_list_file\n",
+               argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (sub_len) {
+        if (sub_len > MAX_PREFIXES) {
+            fprintf(stderr, "Subscriptions are longer than %d bytes\n", MAX_PREFIXES);
+            exit(EXIT_FAILURE);
+        }
+        subs = prefix_compile(sub_list, sub_len);
+        if (!subs) {
+            fprintf(stderr, "Subscriptions must be relative paths without '..'\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    strncpy(local_dir, argv[optind], MAX_PATH - 1);
+    local_dir[MAX_PATH - 1] = '\0';
+    read_ignore_list(argv[optind + 1]);
+    
+    ensure_directory(local_dir);
+
+    int hello_flags = (chunk_store ? SYNC_FLAG_CHUNKS : 0) | (compress ? SYNC_FLAG_COMPRESS : 0) |
+                      (bidir ? SYNC_FLAG_BIDIR : 0);
+    if (bidir) {
+        replica = version_new_replica();
+        versions = version_table_new();
+        watches = watch_table_new();
+        inotify_fd = inotify_init();
+        repush_fd = eventfd(0, 0);
+        if (!versions || !watches || inotify_fd < 0 || repush_fd < 0) {
+            perror("two-way sync");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (start_workers() < 0 || connect_server(hello_flags) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t watch_thread;
+    if (bidir && pthread_create(&watch_thread, NULL, watch_local, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    mirror_view.skip = mirror_skip;
+    mirror_view.id = 1;
+    pthread_t verify_thread;
+    if (verify_interval > 0 && pthread_create(&verify_thread, NULL, verify_mirror, NULL) != 0) {
+        perror("pthread_create");
         exit(EXIT_FAILURE);
     }
 
     pthread_t receive_thread;
-    if (pthread_create(&receive_thread, NULL, receive_handler, NULL) != 0) {
+    if (pthread_create(&receive_thread, NULL, receive_handler, &hello_flags) != 0) {
         perror("pthread_create");
         exit(EXIT_FAILURE);
     }
@@ -0,0 +1,173 @@
+// Per-window event coalescing (see synccoalesce.h)
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "synccoalesce.h"
+
+#define MAP_BUCKETS 4096
+
+// Latest pending event for a name
+typedef struct MapNode {
+    struct MapNode *next;
+    CoalescedEvent *last;
+    char name[];
+} MapNode;
+
+// MOVED_FROM still waiting for the MOVED_TO with its cookie
+typedef struct MoveNode {
+    struct MoveNode *next;
+    CoalescedEvent *event;
+} MoveNode;
+
+struct Coalescer {
+    CoalescedEvent *head;
+    CoalescedEvent *tail;
+    int count;
+    uint64_t seq;
+    MapNode *map[MAP_BUCKETS];
+    MoveNode *moves;
+};
+
+Coalescer *coalescer_new(void) {
+    return calloc(1, sizeof(Coalescer));
+}
+
+static MapNode *map_get(Coalescer *c, const char *name) {
+    unsigned long h = 5381;
+    for (const char *p = name; *p; p++) h = h * 33 + (unsigned char)*p;
+    MapNode **link = &c->map[h % MAP_BUCKETS];
+    while (*link && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+    if (!*link) {
+        MapNode *node = calloc(1, sizeof(MapNode) + strlen(name) + 1);
+        if (!node) return NULL;
+        strcpy(node->name, name);
+        *link = node;
+    }
+    return *link;
+}
+
+static CoalescedEvent *append(Coalescer *c, MapNode *node, int kind, int is_dir,
+                              const char *name) {
+    CoalescedEvent *ev = calloc(1, sizeof(CoalescedEvent) + strlen(name) + 1);
+    if (!ev) return NULL;
+    strcpy(ev->name, name);
+    ev->kind = kind;
+    ev->is_dir = is_dir;
+    ev->seq = c->seq++;
+    ev->prev = c->tail;
+    if (c->tail) c->tail->next = ev;
+    else c->head = ev;
+    c->tail = ev;
+    ev->prev_same = node->last;
+    node->last = ev;
+    c->count++;
+    return ev;
+}
+
+// Drop the latest event for a name
+static void remove_last(Coalescer *c, MapNode *node) {
+    CoalescedEvent *ev = node->last;
+    node->last = ev->prev_same;
+    if (ev->prev) ev->prev->next = ev->next;
+    else c->head = ev->next;
+    if (ev->next) ev->next->prev = ev->prev;
+    else c->tail = ev->prev;
+    c->count--;
+    free(ev);
+}
+
+static int is_new_file(const CoalescedEvent *ev) {
+    return ev && (ev->kind == EV_CREATE || ev->kind == EV_MOVED_TO);
+}
+
+void coalescer_add(Coalescer *c, int kind, int is_dir, uint32_t cookie, const char *name) {
+    MapNode *node = map_get(c, name);
+    if (!node) return;
+    CoalescedEvent *last = node->last;
+
+    switch (kind) {
+    case EV_CREATE:
+        // A new directory is both watched and scanned, so its contents
+        // can be reported twice
+        if (is_new_file(last)) return;
+        break;
+    case EV_MODIFY:
+        // Contents are read when the window is flushed, so one is enough
+        if (is_new_file(last) || (last && last->kind == EV_MODIFY)) return;
+        break;
+    case EV_DELETE:
+        // Only a name created inside the window can vanish without a
+        // trace: one moved over an existing file still has to be deleted
+        while (is_new_file(last) || (last && last->kind == EV_MODIFY)) {
+            int created = last->kind == EV_CREATE;
+            remove_last(c, node);
+            last = node->last;
+            if (created) return;
+        }
+        break;
+    case EV_MOVED_TO:
+        for (MoveNode **link = &c->moves; *link; link = &(*link)->next) {
+            CoalescedEvent *from = (*link)->event;
+            if (from->cookie != cookie) continue;
+            // Only fold into a rename if nothing happened to the target
+            // since the move started; otherwise keep both halves in order
+            if (!last || last->seq < from->seq) {
+                from->target = strdup(name);
+                if (from->target) {
+                    from->kind = EV_RENAME;
+                    node->last = from;
+                    MoveNode *done = *link;
+                    *link = done->next;
+                    free(done);
+                    return;
+                }
+            }
+            break;
+        }
+        break;
+    }
+
+    CoalescedEvent *ev = append(c, node, kind, is_dir, name);
+    if (ev && kind == EV_MOVED_FROM) {
+        MoveNode *move = malloc(sizeof(MoveNode));
+        if (move) {
+            ev->cookie = cookie;
+            move->event = ev;
+            move->next = c->moves;
+            c->moves = move;
+        }
+    }
+}
+
+int coalescer_count(const Coalescer *c) {
+    return c->count;
+}
+
+CoalescedEvent *coalescer_take(Coalescer *c) {
+    CoalescedEvent *list = c->head;
+    c->head = c->tail = NULL;
+    c->count = 0;
+    for (int i = 0; i < MAP_BUCKETS; i++) {
+        while (c->map[i]) {
+            MapNode *next = c->map[i]->next;
+            free(c->map[i]);
+            c->map[i] = next;
+        }
+    }
+    while (c->moves) {
+        MoveNode *next = c->moves->next;
+        free(c->moves);
+        c->moves = next;
+    }
+    return list;
+}
+
+void coalescer_free_list(CoalescedEvent *list) {
+    while (list) {
+        CoalescedEvent *next = list->next;
+        free(list->target);
+        free(list);
+        list = next;
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * Event coalescing between the inotify reader and the fan-out
+ * -----------------------------------------------------------
+ * Events are held for a short window and merged per name before anyone
+ * sees them:
+ *
+ *   CREATE/MOVED_TO + MODIFY ...   -> CREATE/MOVED_TO (contents read later)
+ *   CREATE/MOVED_TO + CREATE       -> the first one
+ *   MODIFY + MODIFY ...            -> one MODIFY
+ *   CREATE + ... + DELETE          -> nothing
+ *   MOVED_TO + ... + DELETE        -> DELETE (it may have replaced a file)
+ *   MODIFY + DELETE                -> DELETE
+ *   MOVED_FROM + MOVED_TO (cookie) -> RENAME, wherever they fall in the window
+ *
+ * RENAME and unpaired MOVED_FROM are never merged across, so the order of
+ * what remains is still the order the changes happened in.
+ */
+
+#ifndef SYNCCOALESCE_H
+#define SYNCCOALESCE_H
+
+#include <stdint.h>
+
+enum {
+    EV_CREATE,
+    EV_DELETE,
+    EV_MODIFY,
+    EV_MOVED_FROM,
+    EV_MOVED_TO,
+    EV_RENAME           // name -> target
+};
+
+typedef struct CoalescedEvent {
+    struct CoalescedEvent *prev;
+    struct CoalescedEvent *next;
+    struct CoalescedEvent *prev_same;   // earlier pending event for name
+    uint64_t seq;
+    int kind;
+    int is_dir;
+    uint32_t cookie;    // MOVED_FROM awaiting its MOVED_TO
+    char *target;       // EV_RENAME only
+    char name[];
+} CoalescedEvent;
+
+typedef struct Coalescer Coalescer;
+
+Coalescer *coalescer_new(void);
+
+// Record one event; cookie is only used for EV_MOVED_FROM/EV_MOVED_TO
+void coalescer_add(Coalescer *c, int kind, int is_dir, uint32_t cookie, const char *name);
+
+// Number of events still pending
+int coalescer_count(const Coalescer *c);
+
+// Detach everything pending, oldest first; free with coalescer_free_list
+CoalescedEvent *coalescer_take(Coalescer *c);
+void coalescer_free_list(CoalescedEvent *list);
+
+#endif
@@ -0,0 +1,332 @@
+// rsync-style rolling checksum delta engine (see syncdelta.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "syncproto.h"
+#include "syncdelta.h"
+
+#define SIG_HEADER_SIZE    16
+#define SIG_ENTRY_SIZE     12
+#define DELTA_HEADER_SIZE  16
+
+// Growable output buffer
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+static int buf_reserve(Buffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 0;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + extra) cap *= 2;
+    uint8_t *data = realloc(buf->data, cap);
+    if (!data) return -1;
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+static int buf_append(Buffer *buf, const void *data, size_t len) {
+    if (buf_reserve(buf, len) < 0) return -1;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+uint32_t delta_block_size(uint64_t file_size) {
+    uint32_t size = DELTA_MIN_BLOCK;
+    while (size < DELTA_MAX_BLOCK && (uint64_t)size * size < file_size) size *= 2;
+    return size;
+}
+
+// rsync weak checksum: a = sum of bytes, b = sum of running a's
+static uint32_t weak_sum(const uint8_t *p, size_t len, uint32_t *a_out, uint32_t *b_out) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    *a_out = a & 0xFFFF;
+    *b_out = b & 0xFFFF;
+    return *a_out | *b_out << 16;
+}
+
+// 64-bit FNV-1a; collisions are caught by the whole-file CRC on apply
+static uint64_t strong_hash(const uint8_t *p, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int map_file(int fd, const uint8_t **data, size_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+    *size = st.st_size;
+    *data = NULL;
+    if (*size == 0) return 0;
+    void *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return -1;
+    *data = map;
+    return 0;
+}
+
+int delta_signature(int fd, uint8_t **out, size_t *out_len) {
+    const uint8_t *data;
+    size_t size;
+    if (map_file(fd, &data, &size) < 0) return -1;
+
+    uint32_t block = delta_block_size(size);
+    uint32_t count = (size + block - 1) / block;
+    size_t len = SIG_HEADER_SIZE + (size_t)count * SIG_ENTRY_SIZE;
+    uint8_t *sig = malloc(len);
+    if (!sig) {
+        if (data) munmap((void *)data, size);
+        return -1;
+    }
+
+    sync_put32(sig, block);
+    sync_put64(sig + 4, size);
+    sync_put32(sig + 12, count);
+    for (uint32_t i = 0; i < count; i++) {
+        size_t off = (size_t)i * block;
+        size_t n = size - off < block ? size - off : block;
+        uint32_t a, b;
+        uint8_t *entry = sig + SIG_HEADER_SIZE + (size_t)i * SIG_ENTRY_SIZE;
+        sync_put32(entry, weak_sum(data + off, n, &a, &b));
+        sync_put64(entry + 4, strong_hash(data + off, n));
+    }
+
+    if (data) munmap((void *)data, size);
+    *out = sig;
+    *out_len = len;
+    return 0;
+}
+
+int delta_empty_signature(uint8_t **out, size_t *out_len) {
+    uint8_t *sig = calloc(1, SIG_HEADER_SIZE);
+    if (!sig) return -1;
+    sync_put32(sig, DELTA_MIN_BLOCK);
+    *out = sig;
+    *out_len = SIG_HEADER_SIZE;
+    return 0;
+}
+
+// Pending COPY run, merged while consecutive blocks keep matching
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} CopyRun;
+
+static int flush_copy(Buffer *out, CopyRun *run) {
+    if (!run->count) return 0;
+    uint8_t op[9];
+    op[0] = DELTA_OP_COPY;
+    sync_put32(op + 1, run->first);
+    sync_put32(op + 5, run->count);
+    run->count = 0;
+    return buf_append(out, op, sizeof(op));
+}
+
+static int emit_literal(Buffer *out, CopyRun *run, const uint8_t *data, size_t len) {
+    if (!len) return 0;
+    if (flush_copy(out, run) < 0) return -1;
+    uint8_t op[5];
+    op[0] = DELTA_OP_LITERAL;
+    sync_put32(op + 1, len);
+    if (buf_append(out, op, sizeof(op)) < 0) return -1;
+    return buf_append(out, data, len);
+}
+
+static int emit_copy(Buffer *out, CopyRun *run, uint32_t block) {
+    if (run->count && run->first + run->count == block) {
+        run->count++;
+        return 0;
+    }
+    if (flush_copy(out, run) < 0) return -1;
+    run->first = block;
+    run->count = 1;
+    return 0;
+}
+
+int delta_compute(const uint8_t *sig, size_t sig_len, const uint8_t *data, size_t size,
+                  uint8_t **out, size_t *out_len) {
+    if (sig_len < SIG_HEADER_SIZE) return -1;
+    uint32_t block = sync_get32(sig);
+    uint64_t old_size = sync_get64(sig + 4);
+    uint32_t count = sync_get32(sig + 12);
+    if (block == 0 || sig_len != SIG_HEADER_SIZE + (size_t)count * SIG_ENTRY_SIZE ||
+        count != (old_size + block - 1) / block) {
+        return -1;
+    }
+    const uint8_t *entries = sig + SIG_HEADER_SIZE;
+
+    // Chained hash table over the weak checksums
+    uint32_t nbuckets = 16;
+    while (nbuckets < 2 * count) nbuckets *= 2;
+    int32_t *heads = malloc(nbuckets * sizeof(int32_t));
+    int32_t *next = malloc((count ? count : 1) * sizeof(int32_t));
+    if (!heads || !next) {
+        free(heads);
+        free(next);
+        return -1;
+    }
+    memset(heads, 0xFF, nbuckets * sizeof(int32_t));
+
+    // Only full-size blocks take part in the rolling match
+    uint32_t full_blocks = old_size / block;
+    for (uint32_t i = 0; i < full_blocks; i++) {
+        uint32_t h = sync_get32(entries + (size_t)i * SIG_ENTRY_SIZE) & (nbuckets - 1);
+        next[i] = heads[h];
+        heads[h] = i;
+    }
+
+    Buffer buf = {0};
+    CopyRun run = {0};
+    uint8_t header[DELTA_HEADER_SIZE];
+    sync_put32(header, block);
+    sync_put64(header + 4, size);
+    sync_put32(header + 12, sync_crc32(0, data, size));
+    if (buf_append(&buf, header, sizeof(header)) < 0) goto fail;
+
+    size_t pos = 0, literal = 0;
+    uint32_t a = 0, b = 0, weak = 0;
+    int window_valid = 0;
+    while (full_blocks && pos + block <= size) {
+        if (!window_valid) {
+            weak = weak_sum(data + pos, block, &a, &b);
+            window_valid = 1;
+        }
+
+        int32_t match = -1;
+        uint64_t strong = 0;
+        int have_strong = 0;
+        for (int32_t i = heads[weak & (nbuckets - 1)]; i >= 0; i = next[i]) {
+            const uint8_t *entry = entries + (size_t)i * SIG_ENTRY_SIZE;
+            if (sync_get32(entry) != weak) continue;
+            if (!have_strong) {
+                strong = strong_hash(data + pos, block);
+                have_strong = 1;
+            }
+            if (sync_get64(entry + 4) == strong) {
+                match = i;
+                break;
+            }
+        }
+
+        if (match >= 0) {
+            if (emit_literal(&buf, &run, data + literal, pos - literal) < 0) goto fail;
+            if (emit_copy(&buf, &run, match) < 0) goto fail;
+            pos += block;
+            literal = pos;
+            window_valid = 0;
+            continue;
+        }
+
+        // Roll the window one byte forward
+        if (pos + block < size) {
+            uint8_t out_byte = data[pos], in_byte = data[pos + block];
+            a = (a - out_byte + in_byte) & 0xFFFF;
+            b = (b - block * out_byte + a) & 0xFFFF;
+            weak = a | b << 16;
+        }
+        pos++;
+    }
+
+    // A short final block can only match the very end of the new data
+    uint32_t tail = old_size % block;
+    if (tail && size - literal >= tail) {
+        const uint8_t *entry = entries + (size_t)full_blocks * SIG_ENTRY_SIZE;
+        const uint8_t *end = data + size - tail;
+        uint32_t ta, tb;
+        if (weak_sum(end, tail, &ta, &tb) == sync_get32(entry) &&
+            strong_hash(end, tail) == sync_get64(entry + 4)) {
+            if (emit_literal(&buf, &run, data + literal, size - tail - literal) < 0) goto fail;
+            if (emit_copy(&buf, &run, full_blocks) < 0) goto fail;
+            literal = size;
+        }
+    }
+
+    if (emit_literal(&buf, &run, data + literal, size - literal) < 0) goto fail;
+    if (flush_copy(&buf, &run) < 0) goto fail;
+
+    free(heads);
+    free(next);
+    *out = buf.data;
+    *out_len = buf.len;
+    return 0;
+
+fail:
+    free(heads);
+    free(next);
+    free(buf.data);
+    return -1;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int delta_apply(int old_fd, const uint8_t *delta, size_t delta_len, int new_fd) {
+    if (delta_len < DELTA_HEADER_SIZE) return -1;
+    uint32_t block = sync_get32(delta);
+    uint64_t new_size = sync_get64(delta + 4);
+    uint32_t expected_crc = sync_get32(delta + 12);
+
+    uint64_t old_size = 0;
+    struct stat st;
+    if (old_fd >= 0 && fstat(old_fd, &st) == 0) old_size = st.st_size;
+
+    uint8_t buffer[65536];
+    uint64_t written = 0;
+    uint32_t crc = 0;
+    int copies = 0;
+    size_t pos = DELTA_HEADER_SIZE;
+
+    while (pos < delta_len) {
+        uint8_t op = delta[pos];
+        if (op == DELTA_OP_COPY && pos + 9 <= delta_len) {
+            uint64_t start = (uint64_t)sync_get32(delta + pos + 1) * block;
+            uint64_t end = start + (uint64_t)sync_get32(delta + pos + 5) * block;
+            if (end > old_size) end = old_size;
+            if (old_fd < 0 || start >= end) return -1;
+            while (start < end) {
+                size_t want = end - start < sizeof(buffer) ? end - start : sizeof(buffer);
+                ssize_t n = pread(old_fd, buffer, want, start);
+                if (n <= 0 || write_all(new_fd, buffer, n) < 0) return -1;
+                crc = sync_crc32(crc, buffer, n);
+                start += n;
+                written += n;
+            }
+            copies++;
+            pos += 9;
+        } else if (op == DELTA_OP_LITERAL && pos + 5 <= delta_len) {
+            uint32_t len = sync_get32(delta + pos + 1);
+            pos += 5;
+            if (len > delta_len - pos) return -1;
+            if (write_all(new_fd, delta + pos, len) < 0) return -1;
+            crc = sync_crc32(crc, delta + pos, len);
+            written += len;
+            pos += len;
+        } else {
+            return -1;
+        }
+    }
+
+    if (written != new_size || crc != expected_crc) return -2;
+    return copies;
+}
@@ -0,0 +1,50 @@
+/*
+ * rsync-style delta transfer shared by syncserver and syncclient
+ * --------------------------------------------------------------
+ * 1. The receiver splits its copy into fixed blocks and sends a signature:
+ *    a rolling weak checksum and a 64-bit strong hash per block.
+ * 2. The sender slides a window over the new contents. Windows whose weak
+ *    checksum (and then strong hash) match a block become COPY ops, and
+ *    everything else becomes LITERAL bytes.
+ * 3. The receiver rebuilds the file from its old copy plus the delta and
+ *    checks the CRC-32 of the result.
+ *
+ * Signature payload: u32 block_size, u64 file_size, u32 count,
+ *                    count x (u32 weak, u64 strong)
+ * Delta payload:     u32 block_size, u64 new_size, u32 crc32, then ops:
+ *                    DELTA_OP_COPY    u32 first_block, u32 block_count
+ *                    DELTA_OP_LITERAL u32 length, length bytes
+ * All integers are big-endian.
+ */
+
+#ifndef SYNCDELTA_H
+#define SYNCDELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DELTA_OP_COPY     1
+#define DELTA_OP_LITERAL  2
+
+#define DELTA_MIN_BLOCK   1024
+#define DELTA_MAX_BLOCK   (128 * 1024)
+
+// Block size for a file of the given size (about sqrt(size), rsync-like)
+uint32_t delta_block_size(uint64_t file_size);
+
+// Signature of the file open on fd; *out is malloc'd
+int delta_signature(int fd, uint8_t **out, size_t *out_len);
+
+// Signature describing an empty/missing file, which asks for a full copy
+int delta_empty_signature(uint8_t **out, size_t *out_len);
+
+// Delta turning the signed file into data[0..size); *out is malloc'd
+int delta_compute(const uint8_t *sig, size_t sig_len, const uint8_t *data, size_t size,
+                  uint8_t **out, size_t *out_len);
+
+// Rebuild the new file into new_fd from old_fd (may be -1) and a delta.
+// Returns -1 on a malformed delta or I/O error, -2 if the result failed
+// its CRC check, otherwise the number of COPY ops that used the old file.
+int delta_apply(int old_fd, const uint8_t *delta, size_t delta_len, int new_fd);
+
+#endif
@@ -0,0 +1,209 @@
+// Aho-Corasick and glob ignore-list matcher (see syncignore.h)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fnmatch.h>
+
+#include "syncignore.h"
+
+typedef struct {
+    char *pattern;
+    int anchored;           // contains '/': match the whole path
+} Glob;
+
+struct IgnoreMatcher {
+    // Substring automaton over a compressed alphabet: bytes that occur in
+    // no pattern all share class 0
+    uint8_t classes[256];
+    int nclasses;
+    int nstates;
+    int32_t *next;          // nstates x nclasses transitions
+    uint8_t *accept;
+
+    Glob *globs;
+    int nglobs;
+};
+
+// Split the list into trimmed patterns; calls fn for each one
+static void for_each_pattern(const char *list, size_t len,
+                             void (*fn)(void *arg, const char *p, size_t n), void *arg) {
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && list[i] != ',' && list[i] != '\n') continue;
+        size_t s = start, e = i;
+        start = i + 1;
+        while (s < e && (list[s] == ' ' || list[s] == '\t')) s++;
+        while (e > s && (list[e - 1] == ' ' || list[e - 1] == '\t' || list[e - 1] == '\r')) e--;
+        if (e > s && list[s] != '#') fn(arg, list + s, e - s);
+    }
+}
+
+static int is_glob(const char *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == '*' || p[i] == '?' || p[i] == '[' || p[i] == '/') return 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    IgnoreMatcher *m;
+    size_t text_len;        // total bytes of plain patterns
+    int failed;
+} Builder;
+
+static void count_pattern(void *arg, const char *p, size_t n) {
+    Builder *b = arg;
+    if (is_glob(p, n)) {
+        b->m->nglobs++;
+        return;
+    }
+    b->text_len += n;
+    for (size_t i = 0; i < n; i++) {
+        uint8_t c = p[i];
+        if (!b->m->classes[c]) b->m->classes[c] = b->m->nclasses++;
+    }
+}
+
+static void add_pattern(void *arg, const char *p, size_t n) {
+    Builder *b = arg;
+    IgnoreMatcher *m = b->m;
+    if (is_glob(p, n)) {
+        while (n > 1 && p[n - 1] == '/') n--;
+        Glob *g = &m->globs[m->nglobs++];
+        g->anchored = memchr(p, '/', n) != NULL;
+        if (p[0] == '/' && n > 1) {
+            p++;
+            n--;
+        }
+        g->pattern = strndup(p, n);
+        if (!g->pattern) b->failed = 1;
+        return;
+    }
+
+    // Insert into the trie; unset transitions are -1 until the BFS pass
+    int state = 0;
+    for (size_t i = 0; i < n; i++) {
+        int32_t *slot = &m->next[state * m->nclasses + m->classes[(uint8_t)p[i]]];
+        if (*slot < 0) *slot = m->nstates++;
+        state = *slot;
+    }
+    m->accept[state] = 1;
+}
+
+// Turn the trie into a DFA by filling in failure transitions breadth first
+static int link_automaton(IgnoreMatcher *m) {
+    int32_t *fail = calloc(m->nstates, sizeof(int32_t));
+    int32_t *queue = malloc(m->nstates * sizeof(int32_t));
+    if (!fail || !queue) {
+        free(fail);
+        free(queue);
+        return -1;
+    }
+
+    int head = 0, tail = 0;
+    for (int c = 0; c < m->nclasses; c++) {
+        int32_t *slot = &m->next[c];
+        if (*slot < 0) {
+            *slot = 0;
+        } else {
+            fail[*slot] = 0;
+            queue[tail++] = *slot;
+        }
+    }
+    while (head < tail) {
+        int u = queue[head++];
+        m->accept[u] |= m->accept[fail[u]];
+        for (int c = 0; c < m->nclasses; c++) {
+            int32_t *slot = &m->next[u * m->nclasses + c];
+            int32_t via_fail = m->next[fail[u] * m->nclasses + c];
+            if (*slot < 0) {
+                *slot = via_fail;
+            } else {
+                fail[*slot] = via_fail;
+                queue[tail++] = *slot;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return 0;
+}
+
+IgnoreMatcher *ignore_compile(const char *list, size_t len) {
+    IgnoreMatcher *m = calloc(1, sizeof(IgnoreMatcher));
+    if (!m) return NULL;
+    m->nclasses = 1;
+
+    Builder b = { .m = m };
+    for_each_pattern(list, len, count_pattern, &b);
+
+    size_t max_states = b.text_len + 1;
+    m->next = malloc(max_states * m->nclasses * sizeof(int32_t));
+    m->accept = calloc(max_states, 1);
+    m->globs = calloc(m->nglobs + 1, sizeof(Glob));
+    if (!m->next || !m->accept || !m->globs) {
+        ignore_free(m);
+        return NULL;
+    }
+    memset(m->next, 0xFF, max_states * m->nclasses * sizeof(int32_t));
+    m->nstates = 1;
+    m->nglobs = 0;
+
+    for_each_pattern(list, len, add_pattern, &b);
+    if (b.failed || link_automaton(m) < 0) {
+        ignore_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void ignore_free(IgnoreMatcher *m) {
+    if (!m) return;
+    for (int i = 0; i < m->nglobs; i++) free(m->globs[i].pattern);
+    free(m->globs);
+    free(m->next);
+    free(m->accept);
+    free(m);
+}
+
+// Match a glob against every component of the path
+static int match_component(const char *pattern, const char *path) {
+    char component[4096];
+    const char *p = path;
+    while (*p) {
+        const char *slash = strchr(p, '/');
+        size_t n = slash ? (size_t)(slash - p) : strlen(p);
+        if (n < sizeof(component)) {
+            memcpy(component, p, n);
+            component[n] = '\0';
+            if (fnmatch(pattern, component, 0) == 0) return 1;
+        }
+        if (!slash) break;
+        p = slash + 1;
+    }
+    return 0;
+}
+
+int ignore_match(const IgnoreMatcher *m, const char *path) {
+    if (!m) return 0;
+
+    if (m->nstates > 1) {
+        int state = 0;
+        for (const uint8_t *p = (const uint8_t *)path; *p; p++) {
+            state = m->next[state * m->nclasses + m->classes[*p]];
+            if (m->accept[state]) return 1;
+        }
+    }
+
+    for (int i = 0; i < m->nglobs; i++) {
+        const Glob *g = &m->globs[i];
+        if (g->anchored ? fnmatch(g->pattern, path, FNM_PATHNAME | FNM_LEADING_DIR) == 0
+                        : match_component(g->pattern, path)) {
+            return 1;
+        }
+    }
+    return 0;
+}
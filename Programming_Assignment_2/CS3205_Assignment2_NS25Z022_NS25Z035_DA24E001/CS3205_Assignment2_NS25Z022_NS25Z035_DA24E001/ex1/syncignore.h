@@ -0,0 +1,36 @@
+/*
+ * Compiled ignore-list matcher shared by syncserver and syncclient
+ * ----------------------------------------------------------------
+ * An ignore list is a set of patterns separated by commas or newlines
+ * (blank lines and lines starting with '#' are skipped):
+ *
+ *   .tmp             plain text: ignore any path containing it
+ *   *.o              glob without '/': matched against every path component,
+ *                    so it also covers everything below a matching directory
+ *   build/           trailing '/' is accepted and means the same as "build"
+ *   logs/2024-*.log  glob with '/': matched against the whole relative path
+ *                    and everything below it; a leading '/' anchors a
+ *                    plain name to the top of the tree
+ *
+ * Plain patterns are compiled into one Aho-Corasick automaton, so checking
+ * a path is a single table walk no matter how many patterns there are.
+ * A compiled matcher is read-only and may be shared between threads.
+ */
+
+#ifndef SYNCIGNORE_H
+#define SYNCIGNORE_H
+
+#include <stddef.h>
+
+#define MAX_IGNORE (64 * 1024)
+
+typedef struct IgnoreMatcher IgnoreMatcher;
+
+// Compile a pattern list of len bytes; NULL if out of memory
+IgnoreMatcher *ignore_compile(const char *list, size_t len);
+void ignore_free(IgnoreMatcher *matcher);
+
+// Does the path (relative to the synced directory) match any pattern?
+int ignore_match(const IgnoreMatcher *matcher, const char *path);
+
+#endif
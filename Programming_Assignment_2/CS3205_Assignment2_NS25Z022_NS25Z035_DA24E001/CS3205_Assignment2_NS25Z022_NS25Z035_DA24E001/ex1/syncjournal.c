@@ -0,0 +1,210 @@
+// Memory-mapped ring of sequence-numbered events (see syncjournal.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "syncjournal.h"
+
+#define JOURNAL_MAGIC "SYNCJRN1"
+#define RECORD_FIXED  18
+#define ALIGN8(n)     (((n) + 7) & ~(size_t)7)
+
+// Kept at the start of the mapping, so a journal file can be inspected
+typedef struct {
+    char magic[8];
+    uint64_t epoch;
+    uint64_t first_seq;     // oldest event still in the ring
+    uint64_t next_seq;
+    uint64_t head;          // offset of the oldest record
+    uint64_t tail;          // offset the next record goes to
+    uint64_t used;          // bytes in use, counting the gap left by a wrap
+    uint64_t cap;
+} JournalHeader;
+
+struct Journal {
+    pthread_mutex_t lock;
+    JournalHeader *hdr;
+    uint8_t *data;
+    size_t map_len;
+};
+
+static uint64_t new_epoch(void) {
+    uint64_t epoch = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &epoch, sizeof(epoch)) != sizeof(epoch)) epoch = 0;
+        close(fd);
+    }
+    if (!epoch) epoch = (uint64_t)time(NULL) << 20 ^ (uint64_t)getpid();
+    return epoch ? epoch : 1;
+}
+
+Journal *journal_open(const char *path, size_t size) {
+    size_t map_len = ALIGN8(sizeof(JournalHeader)) + ALIGN8(size);
+    if (size < 4096) return NULL;
+
+    void *map;
+    if (path) {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0 || ftruncate(fd, map_len) < 0) {
+            perror("journal");
+            if (fd >= 0) close(fd);
+            return NULL;
+        }
+        map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if (map == MAP_FAILED) {
+        perror("mmap journal");
+        return NULL;
+    }
+
+    Journal *j = calloc(1, sizeof(Journal));
+    if (!j) {
+        munmap(map, map_len);
+        return NULL;
+    }
+    pthread_mutex_init(&j->lock, NULL);
+    j->hdr = map;
+    j->data = (uint8_t *)map + ALIGN8(sizeof(JournalHeader));
+    j->map_len = map_len;
+
+    memset(j->hdr, 0, sizeof(JournalHeader));
+    memcpy(j->hdr->magic, JOURNAL_MAGIC, 8);
+    j->hdr->epoch = new_epoch();
+    j->hdr->first_seq = 1;
+    j->hdr->next_seq = 1;
+    j->hdr->cap = ALIGN8(size);
+    return j;
+}
+
+void journal_close(Journal *j) {
+    if (!j) return;
+    munmap(j->hdr, j->map_len);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+}
+
+uint64_t journal_epoch(const Journal *j) {
+    return j->hdr->epoch;
+}
+
+uint64_t journal_last(Journal *j) {
+    pthread_mutex_lock(&j->lock);
+    uint64_t last = j->hdr->next_seq - 1;
+    pthread_mutex_unlock(&j->lock);
+    return last;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Drop the oldest record (or the gap at the end of the ring); caller
+// holds lock
+static void evict_oldest(Journal *j) {
+    JournalHeader *h = j->hdr;
+    uint32_t len = h->cap - h->head >= 4 ? get32(j->data + h->head) : 0;
+    if (len == 0) {
+        h->used -= h->cap - h->head;
+        h->head = 0;
+    } else {
+        h->used -= len;
+        h->head += len;
+        h->first_seq++;
+    }
+    if (h->used == 0) h->head = h->tail = 0;
+}
+
+uint64_t journal_append(Journal *j, int kind, int is_dir, const char *name,
+                        const char *target) {
+    size_t name_len = strlen(name);
+    size_t target_len = target ? strlen(target) : 0;
+    size_t need = ALIGN8(RECORD_FIXED + name_len + 1 + target_len + 1);
+
+    pthread_mutex_lock(&j->lock);
+    JournalHeader *h = j->hdr;
+    uint64_t seq = h->next_seq++;
+    if (need > h->cap || name_len > 0xFFFF || target_len > 0xFFFF) {
+        // Cannot be recorded, so nothing before it can be replayed either
+        h->head = h->tail = h->used = 0;
+        h->first_seq = h->next_seq;
+        pthread_mutex_unlock(&j->lock);
+        return seq;
+    }
+
+    while (1) {
+        if (h->used == 0) h->head = h->tail = 0;
+        if (h->used == 0 || h->tail > h->head) {
+            if (h->cap - h->tail >= need) break;
+            // Not enough room before the end: mark the gap and wrap
+            if (h->cap - h->tail >= 4) memset(j->data + h->tail, 0, 4);
+            h->used += h->cap - h->tail;
+            h->tail = 0;
+        } else if (h->head - h->tail >= need) {
+            break;
+        } else {
+            evict_oldest(j);
+        }
+    }
+
+    uint8_t *p = j->data + h->tail;
+    uint32_t rec_len = need;
+    uint16_t nlen = name_len, tlen = target_len;
+    memcpy(p, &rec_len, 4);
+    p[4] = kind;
+    p[5] = is_dir;
+    memcpy(p + 6, &nlen, 2);
+    memcpy(p + 8, &seq, 8);
+    memcpy(p + 16, &tlen, 2);
+    memcpy(p + RECORD_FIXED, name, name_len + 1);
+    if (target) memcpy(p + RECORD_FIXED + name_len + 1, target, target_len + 1);
+    else p[RECORD_FIXED + name_len + 1] = '\0';
+    h->tail += need;
+    h->used += need;
+    pthread_mutex_unlock(&j->lock);
+    return seq;
+}
+
+int journal_replay(Journal *j, uint64_t seq, JournalFn fn, void *arg) {
+    pthread_mutex_lock(&j->lock);
+    JournalHeader *h = j->hdr;
+    if (seq + 1 < h->first_seq || seq >= h->next_seq) {
+        pthread_mutex_unlock(&j->lock);
+        return -1;
+    }
+
+    uint64_t pos = h->head, left = h->used;
+    while (left > 0) {
+        uint32_t len = h->cap - pos >= 4 ? get32(j->data + pos) : 0;
+        if (len == 0) {
+            left -= h->cap - pos;
+            pos = 0;
+            continue;
+        }
+        const uint8_t *p = j->data + pos;
+        uint64_t rec_seq;
+        uint16_t name_len, target_len;
+        memcpy(&rec_seq, p + 8, 8);
+        memcpy(&name_len, p + 6, 2);
+        memcpy(&target_len, p + 16, 2);
+        if (rec_seq > seq) {
+            const char *name = (const char *)p + RECORD_FIXED;
+            fn(arg, rec_seq, p[4], p[5], name, target_len ? name + name_len + 1 : NULL);
+        }
+        left -= len;
+        pos += len;
+    }
+    pthread_mutex_unlock(&j->lock);
+    return 0;
+}
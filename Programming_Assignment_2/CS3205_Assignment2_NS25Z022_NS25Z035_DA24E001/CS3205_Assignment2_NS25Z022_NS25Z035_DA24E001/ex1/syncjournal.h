@@ -0,0 +1,52 @@
+/*
+ * Sequence-numbered event journal for reconnecting clients
+ * --------------------------------------------------------
+ * Every coalesced event the server sends is also appended here with the
+ * next sequence number. The journal is a fixed-size ring in a shared
+ * memory mapping (backed by a file when one is given); when it is full
+ * the oldest events are dropped. A client that reconnects names the last
+ * sequence number it applied and gets just the events after it, as long
+ * as they are still in the ring.
+ *
+ * Each server run starts a new epoch: sequence numbers are only
+ * meaningful together with the epoch they were handed out in, since
+ * nothing is recorded while the server is down.
+ *
+ * Record layout, 8-byte aligned:
+ *   u32 rec_len, u8 kind, u8 is_dir, u16 name_len, u64 seq,
+ *   u16 target_len, name, target
+ * A rec_len of 0 marks the unused end of the ring before it wraps.
+ */
+
+#ifndef SYNCJOURNAL_H
+#define SYNCJOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct Journal Journal;
+
+// Map a journal of size bytes, in path or (path NULL) in anonymous memory.
+// The contents always start empty with a fresh epoch.
+Journal *journal_open(const char *path, size_t size);
+void journal_close(Journal *j);
+
+uint64_t journal_epoch(const Journal *j);
+
+// Sequence number of the newest event, 0 before the first one
+uint64_t journal_last(Journal *j);
+
+// Record one event (kinds as in synccoalesce.h; target only for renames)
+// and return its sequence number
+uint64_t journal_append(Journal *j, int kind, int is_dir, const char *name,
+                        const char *target);
+
+typedef void (*JournalFn)(void *arg, uint64_t seq, int kind, int is_dir, const char *name,
+                          const char *target);
+
+// Call fn for every event after seq, oldest first. Returns -1 without
+// calling it if any of them has already been dropped, or if seq is ahead
+// of the journal.
+int journal_replay(Journal *j, uint64_t seq, JournalFn fn, void *arg);
+
+#endif
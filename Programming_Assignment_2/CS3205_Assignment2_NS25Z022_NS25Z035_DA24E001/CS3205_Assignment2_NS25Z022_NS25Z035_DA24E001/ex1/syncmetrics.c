@@ -0,0 +1,73 @@
+// Counters and log-linear histograms (see syncmetrics.h)
+
+#include <time.h>
+
+#include "syncmetrics.h"
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Values below HIST_SUB get a bucket each; above that, the bucket is the
+// power of two plus the next HIST_SUB_BITS bits below the top one
+static int bucket_of(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int exp = 63 - __builtin_clzll(v);
+    int sub = (int)(v >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+// Largest value that falls into bucket i
+static uint64_t bucket_top(int i) {
+    if (i < HIST_SUB) return i;
+    int exp = i / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t low = (uint64_t)(HIST_SUB + i % HIST_SUB) << (exp - HIST_SUB_BITS);
+    return low + ((1ULL << (exp - HIST_SUB_BITS)) - 1);
+}
+
+void hist_record(Histogram *h, uint64_t value) {
+    __atomic_fetch_add(&h->counts[bucket_of(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+uint64_t hist_quantile(const Histogram *h, double q) {
+    // Counts may move while we read them; the answer is approximate anyway
+    uint64_t counts[HIST_BUCKETS], total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total) rank = total - 1;
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > rank) {
+            uint64_t top = bucket_top(i);
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+void hist_write(FILE *out, const char *name, const char *help, const Histogram *h) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        fprintf(out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[i],
+                hist_quantile(h, quantiles[i]) / 1e9);
+    }
+    fprintf(out, "%s_sum %.9f\n", name, metrics_get(&h->sum) / 1e9);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long)metrics_get(&h->total));
+}
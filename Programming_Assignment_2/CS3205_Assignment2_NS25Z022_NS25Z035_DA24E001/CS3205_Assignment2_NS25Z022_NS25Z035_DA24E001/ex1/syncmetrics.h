@@ -0,0 +1,49 @@
+/*
+ * Lock-free counters and latency histograms for syncserver
+ * --------------------------------------------------------
+ * Counters are plain uint64_t updated with relaxed atomic adds, so any
+ * thread can bump them without taking a lock. Histograms are log-linear
+ * (HDR style): values are grouped by power of two and each power is split
+ * into 16 linear sub-buckets, so every recorded value is kept to within
+ * 1/16 (6.25%) of its true value across the whole 64-bit range.
+ */
+
+#ifndef SYNCMETRICS_H
+#define SYNCMETRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} Histogram;
+
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_get(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t metrics_now_ns(void);
+
+void hist_record(Histogram *h, uint64_t value);
+
+// Value below which the given fraction (0..1) of recordings fall; the
+// upper edge of its bucket, never more than the largest value seen
+uint64_t hist_quantile(const Histogram *h, double q);
+
+// Write the histogram as a Prometheus summary; values are nanoseconds and
+// are reported in seconds
+void hist_write(FILE *out, const char *name, const char *help, const Histogram *h);
+
+#endif
@@ -0,0 +1,144 @@
+// Sorted path-prefix sets (see syncprefix.h)
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "syncprefix.h"
+#include "syncproto.h"
+
+struct PrefixSet {
+    char **prefixes;        // sorted, without duplicates
+    size_t count;
+    int covers_all;         // one of the prefixes was the root itself
+};
+
+typedef struct {
+    PrefixSet *set;
+    size_t cap;
+    int failed;
+} Builder;
+
+// Normalise one trimmed entry and add it to the set
+static void add_prefix(Builder *b, const char *p, size_t n) {
+    while (n > 0 && p[0] == '/') {
+        p++;
+        n--;
+    }
+    while (n > 0 && p[n - 1] == '/') n--;
+    if (n == 0 || (n == 1 && p[0] == '.')) {
+        b->set->covers_all = 1;
+        return;
+    }
+    if (!sync_path_is_safe(p, n)) {
+        b->failed = 1;
+        return;
+    }
+    if (b->set->count == b->cap) {
+        size_t new_cap = b->cap ? b->cap * 2 : 16;
+        char **grown = realloc(b->set->prefixes, new_cap * sizeof(char *));
+        if (!grown) {
+            b->failed = 1;
+            return;
+        }
+        b->set->prefixes = grown;
+        b->cap = new_cap;
+    }
+    char *copy = strndup(p, n);
+    if (!copy) {
+        b->failed = 1;
+        return;
+    }
+    b->set->prefixes[b->set->count++] = copy;
+}
+
+static int compare_prefixes(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+PrefixSet *prefix_compile(const char *list, size_t len) {
+    PrefixSet *set = calloc(1, sizeof(PrefixSet));
+    if (!set) return NULL;
+
+    Builder b = { .set = set };
+    size_t start = 0;
+    for (size_t i = 0; i <= len && !b.failed; i++) {
+        if (i < len && list[i] != ',' && list[i] != '\n') continue;
+        size_t s = start, e = i;
+        start = i + 1;
+        while (s < e && (list[s] == ' ' || list[s] == '\t')) s++;
+        while (e > s && (list[e - 1] == ' ' || list[e - 1] == '\t' || list[e - 1] == '\r')) e--;
+        if (e > s && list[s] != '#') add_prefix(&b, list + s, e - s);
+    }
+    if (b.failed) {
+        prefix_free(set);
+        return NULL;
+    }
+
+    if (set->covers_all) {
+        for (size_t i = 0; i < set->count; i++) free(set->prefixes[i]);
+        set->count = 0;
+        return set;
+    }
+    qsort(set->prefixes, set->count, sizeof(char *), compare_prefixes);
+    size_t kept = 0;
+    for (size_t i = 0; i < set->count; i++) {
+        if (kept && strcmp(set->prefixes[kept - 1], set->prefixes[i]) == 0) {
+            free(set->prefixes[i]);
+            continue;
+        }
+        set->prefixes[kept++] = set->prefixes[i];
+    }
+    set->count = kept;
+    return set;
+}
+
+void prefix_free(PrefixSet *set) {
+    if (!set) return;
+    for (size_t i = 0; i < set->count; i++) free(set->prefixes[i]);
+    free(set->prefixes);
+    free(set);
+}
+
+size_t prefix_count(const PrefixSet *set) {
+    return set ? set->count : 0;
+}
+
+// Index of the first prefix that compares >= the first n bytes of key
+static size_t lower_bound(const PrefixSet *set, const char *key, size_t n) {
+    size_t lo = 0, hi = set->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *p = set->prefixes[mid];
+        int cmp = strncmp(p, key, n);
+        if (cmp == 0 && p[n] == '\0') return mid;
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int prefix_match(const PrefixSet *set, const char *path, int is_dir) {
+    if (!set || set->count == 0) return 1;
+
+    // The path itself or one of its ancestors is a prefix
+    size_t len = strlen(path);
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && path[i] != '/') continue;
+        size_t at = lower_bound(set, path, i);
+        if (at < set->count && strncmp(set->prefixes[at], path, i) == 0 &&
+            set->prefixes[at][i] == '\0') {
+            return 1;
+        }
+    }
+    if (!is_dir) return 0;
+
+    // A directory on the way to a prefix: the first prefix sorting at or
+    // after "path/" starts with it if any does
+    char key[4096];
+    if (len + 1 >= sizeof(key)) return 0;
+    memcpy(key, path, len);
+    key[len] = '/';
+    size_t at = lower_bound(set, key, len + 1);
+    return at < set->count && strncmp(set->prefixes[at], key, len + 1) == 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Path-prefix sets for shard ownership and client subscriptions
+ * --------------------------------------------------------------
+ * A prefix list names subtrees of the synced directory, separated by
+ * commas or newlines (blank lines and lines starting with '#' are
+ * skipped, leading and trailing '/' are dropped):
+ *
+ *   photos/2024      the directory photos/2024 and everything below it
+ *   docs             docs, and everything below it if it is a directory
+ *
+ * A path is in the set if it is one of the prefixes or lies below one.
+ * Directories that lead to a prefix (here "photos") are in the set as
+ * well, since a client cannot create photos/2024 without them; their
+ * other contents are not. An empty set covers the whole tree.
+ *
+ * The prefixes are kept sorted, so a check costs one binary search per
+ * path component no matter how many prefixes there are. A compiled set is
+ * read-only and may be shared between threads.
+ */
+
+#ifndef SYNCPREFIX_H
+#define SYNCPREFIX_H
+
+#include <stddef.h>
+
+#define MAX_PREFIXES (64 * 1024)
+
+typedef struct PrefixSet PrefixSet;
+
+// Compile a prefix list of len bytes; NULL if out of memory or if a
+// prefix is not a safe relative path (contains "..")
+PrefixSet *prefix_compile(const char *list, size_t len);
+void prefix_free(PrefixSet *set);
+
+// Number of prefixes; 0 means the set covers everything
+size_t prefix_count(const PrefixSet *set);
+
+// Is the path (relative to the synced directory) in the set? A NULL set
+// covers everything.
+int prefix_match(const PrefixSet *set, const char *path, int is_dir);
+
+#endif
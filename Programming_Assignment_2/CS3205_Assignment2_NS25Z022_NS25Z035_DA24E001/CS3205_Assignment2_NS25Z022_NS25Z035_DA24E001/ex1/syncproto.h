@@ -0,0 +1,235 @@
+/*
+ * Wire format shared by syncserver and syncclient
+ * -----------------------------------------------
+ * Every message is a frame: a fixed 24-byte header in network byte order,
+ * followed by path_len bytes of path (not NUL-terminated) and payload_len
+ * bytes of payload.
+ *
+ *   offset  size  field
+ *   0       2     magic        0x5359 ("SY")
+ *   2       1     version      SYNC_VERSION
+ *   3       1     type         SYNC_* frame type
+ *   4       2     flags        SYNC_FLAG_*
+ *   6       2     path_len
+ *   8       4     checksum     CRC-32 of path + payload (SYNC_FLAG_CHECKSUM)
+ *   12      4     reserved     must be zero
+ *   16      8     payload_len
+ */
+
+#ifndef SYNCPROTO_H
+#define SYNCPROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#define SYNC_MAGIC        0x5359
+#define SYNC_VERSION      1
+#define SYNC_HEADER_SIZE  24
+
+// Frame types
+enum {
+    SYNC_HELLO = 1,     // client -> server, ends the handshake (below)
+    SYNC_CREATE,        // path was created (SYNC_FLAG_DIR for directories)
+    SYNC_DELETE,
+    SYNC_MOVED_FROM,
+    SYNC_MOVED_TO,
+    SYNC_FILE,          // payload = full file contents
+    SYNC_SIG_REQUEST,   // server -> client: path changed, send its signature
+    SYNC_SIGNATURES,    // client -> server, payload = delta signature (syncdelta.h)
+    SYNC_DELTA,         // server -> client, payload = delta against that signature
+    SYNC_CHUNKS,        // server -> client, payload = chunk manifest (syncchunk.h)
+    SYNC_CHUNK_REQUEST, // client -> server, payload = hashes it has no copy of
+    SYNC_CHUNK_DATA,    // server -> client, payload = hash + chunk bytes
+    SYNC_RENAME,        // server -> client, path renamed to the payload path
+    SYNC_MANIFEST,      // server -> client, payload = compressed tree manifest (synctree.h)
+    SYNC_WANT,          // client -> server, payload = compressed list of paths to send
+    SYNC_BATCH,         // server -> client, payload = coalesced events (below)
+    SYNC_SEQ,           // server -> client, payload = u64 epoch, u64 seq (below)
+    SYNC_RESUME,        // client -> server, before HELLO (below)
+    SYNC_SUBSCRIBE,     // client -> server, before HELLO, payload = prefix list
+    SYNC_PUSH,          // client -> server, a local change (below)
+    SYNC_PUSH_DATA,     // client -> server, file contents of the SYNC_PUSH before it
+    SYNC_PUSH_ACK,      // server -> client, payload = u8 status, version vector
+    SYNC_VECTOR,        // server -> client, payload = version vector of path
+    SYNC_VERIFY,        // client -> server, payload = directory digests (synctree.h)
+    SYNC_LISTING        // server -> client, payload = compressed listings of the
+                        // directories whose digests differ (synctree.h)
+};
+
+// A SYNC_BATCH payload is a u32 event count followed by that many entries,
+// applied in order as if each had arrived as its own frame:
+//
+//   u8 type, u16 flags, u16 path_len, path, u16 target_len, target
+//
+// target is only non-empty for SYNC_RENAME. File contents for the batch
+// follow it as ordinary frames.
+#define SYNC_BATCH_ENTRY_FIXED 7
+
+// The handshake is an optional SYNC_SUBSCRIBE, then SYNC_RESUME when
+// reconnecting, then SYNC_HELLO. HELLO's payload is the client's ignore
+// list (syncignore.h) and its flags are what the client supports:
+// SYNC_FLAG_CHUNKS, SYNC_FLAG_COMPRESS and SYNC_FLAG_BIDIR. The server
+// drops any of these it is not set up for.
+//
+// SYNC_SEQ says that every event up to seq of the server's journal has
+// been sent, together with the files it names. It is held back while a
+// snapshot or coalesced resend is still on its way.
+//
+// A reconnecting client sends SYNC_RESUME before its HELLO: payload
+// u64 epoch, u64 seq (the last SYNC_SEQ it applied), u64 offset, u32 crc.
+// If the path is not empty, the client holds the first offset bytes of
+// that file, whose CRC-32 is crc, from a SYNC_FILE that was cut off. If the
+// server still has every event after seq it replays them instead of
+// sending a manifest, and resends that file from offset if the bytes still
+// match, as a SYNC_FILE with SYNC_FLAG_OFFSET.
+//
+// SYNC_SUBSCRIBE limits everything the server sends, the manifest included,
+// to the subtrees named in its payload (a list as in syncprefix.h); without
+// it the client gets the whole tree.
+#define SYNC_SEQ_SIZE    16
+#define SYNC_RESUME_SIZE 28
+
+// Two-way sync (SYNC_FLAG_BIDIR in HELLO). A client pushes each local
+// change as SYNC_PUSH: payload u8 op, u64 replica, u64 mtime_sec,
+// u32 mtime_nsec, u64 size, then the path's version vector (syncversion.h)
+// with the client's own counter already bumped, then for SYNC_RENAME the
+// target path. op is one of
+//
+//   SYNC_FILE     new contents: size bytes follow in SYNC_PUSH_DATA frames
+//   SYNC_CREATE   new directory
+//   SYNC_DELETE   file or directory (with everything below it) removed
+//   SYNC_RENAME   path renamed to the target
+//
+// Pushes are not waited for: the server answers each one (a rename under
+// its target path) with SYNC_PUSH_ACK carrying the path's vector as it now
+// stands. When a conflict goes the server's way its copy follows the ack.
+// Other clients get the change as ordinary events, each file event
+// followed by a SYNC_VECTOR.
+#define SYNC_PUSH_FIXED  29
+enum { PUSH_APPLIED, PUSH_CONFLICT, PUSH_REJECTED };
+
+// Temporary files are written next to their target as <name>.synctmp.XXXXXX
+// and renamed over it when complete; watchers skip them
+#define SYNC_TEMP_MARK ".synctmp."
+
+static inline int sync_is_temp(const char *name) {
+    size_t len = strlen(name), mark = sizeof(SYNC_TEMP_MARK) - 1;
+    return len > mark + 6 && memcmp(name + len - 6 - mark, SYNC_TEMP_MARK, mark) == 0;
+}
+
+// Frame flags
+#define SYNC_FLAG_DIR       0x0001
+#define SYNC_FLAG_CHECKSUM  0x0002
+#define SYNC_FLAG_CHUNKS    0x0004  // HELLO: client keeps a chunk store
+#define SYNC_FLAG_COMPRESS  0x0008  // HELLO: client accepts compressed files;
+                                    // SYNC_FILE: payload is a zlib stream
+#define SYNC_FLAG_OFFSET    0x0010  // SYNC_FILE: payload = u64 offset, then
+                                    // the file from offset to its end
+#define SYNC_FLAG_BIDIR     0x0020  // HELLO: client pushes its own changes
+
+typedef struct {
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    uint16_t path_len;
+    uint32_t checksum;
+    uint64_t payload_len;
+    const char *path;   // points into the caller's buffer
+} SyncFrame;
+
+static inline void sync_put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void sync_put32(uint8_t *p, uint32_t v) {
+    sync_put16(p, v >> 16);
+    sync_put16(p + 2, v);
+}
+
+static inline void sync_put64(uint8_t *p, uint64_t v) {
+    sync_put32(p, v >> 32);
+    sync_put32(p + 4, v);
+}
+
+static inline uint16_t sync_get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t sync_get32(const uint8_t *p) {
+    return (uint32_t)sync_get16(p) << 16 | sync_get16(p + 2);
+}
+
+static inline uint64_t sync_get64(const uint8_t *p) {
+    return (uint64_t)sync_get32(p) << 32 | sync_get32(p + 4);
+}
+
+static uint32_t sync_crc_table[256];
+static pthread_once_t sync_crc_once = PTHREAD_ONCE_INIT;
+
+static inline void sync_crc_init(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        sync_crc_table[i] = c;
+    }
+}
+
+// Incremental CRC-32 (IEEE 802.3); start with crc = 0
+static inline uint32_t sync_crc32(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&sync_crc_once, sync_crc_init);
+    const uint8_t *p = data;
+    crc = ~crc;
+    while (len--) crc = sync_crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Write a frame header into out[SYNC_HEADER_SIZE]
+static inline void sync_encode_header(uint8_t *out, int type, int flags, size_t path_len,
+                                      uint64_t payload_len, uint32_t checksum) {
+    sync_put16(out, SYNC_MAGIC);
+    out[2] = SYNC_VERSION;
+    out[3] = type;
+    sync_put16(out + 4, flags);
+    sync_put16(out + 6, path_len);
+    sync_put32(out + 8, checksum);
+    sync_put32(out + 12, 0);
+    sync_put64(out + 16, payload_len);
+}
+
+// Parse a header (and its path) in place.
+// Returns the number of bytes used by header + path, 0 if more data is
+// needed, or -1 if the bytes are not a valid frame.
+static inline int sync_parse_header(const uint8_t *buf, size_t avail, SyncFrame *frame) {
+    if (avail < SYNC_HEADER_SIZE) return 0;
+    if (sync_get16(buf) != SYNC_MAGIC || buf[2] != SYNC_VERSION) return -1;
+
+    frame->version = buf[2];
+    frame->type = buf[3];
+    frame->flags = sync_get16(buf + 4);
+    frame->path_len = sync_get16(buf + 6);
+    frame->checksum = sync_get32(buf + 8);
+    frame->payload_len = sync_get64(buf + 16);
+    if (avail < SYNC_HEADER_SIZE + (size_t)frame->path_len) return 0;
+
+    frame->path = (const char *)buf + SYNC_HEADER_SIZE;
+    return SYNC_HEADER_SIZE + frame->path_len;
+}
+
+// Reject absolute paths and ".." components coming off the wire
+static inline int sync_path_is_safe(const char *path, size_t len) {
+    if (len == 0 || path[0] == '/') return 0;
+    if (memchr(path, '\0', len)) return 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i == len || path[i] == '/') {
+            if (i - start == 2 && path[start] == '.' && path[start + 1] == '.') return 0;
+            start = i + 1;
+        }
+    }
+    return 1;
+}
+
+#endif
@@ -1,5 +1,5 @@
 // Compile the server
-// gcc -o syncserver syncserver.c -pthread
+// gcc -o syncserver syncserver.c syncdelta.c syncchunk.c synctree.c syncignore.c syncprefix.c synccoalesce.c syncwatch.c syncmetrics.c syncuring.c syncjournal.c syncversion.c syncslab.c -pthread -lz
 
 /*
 Example Usage:
@@ -12,243 +12,3782 @@ Ensure the `server_sync_dir` exists. Then, start the server:
 
     server_sync_dir → Path to the directory the server monitors.
     5000 → Port number for communication.
-    5 → Maximum number of clients allowed.
+    5 → Maximum number of clients allowed (0 = unlimited).
+
+2. Event-loop mode
+
+By default every client gets a reader and a writer thread. For large
+fan-outs start the server with the epoll reactor instead, optionally split
+over N shards (one thread and one epoll instance per shard):
+
+    ./syncserver -m epoll -s 4 server_sync_dir 5000 10000
+
+3. Slow consumers
+
+The watcher never writes to sockets; it only appends to a bounded queue per
+client (-q bytes, default 4 MB). When a client's queue is full:
+
+    -p drop      → disconnect it; it resyncs from scratch on reconnect
+    -p coalesce  → remember only which names changed and send their current
+                   state once the queue drains (default)
+
+4. Initial snapshot
+
+At startup the server walks the whole tree with one thread per CPU and
+keeps a manifest (path, size, mtime, SHA-256) that inotify events keep up
+to date. A new client gets that manifest as one compressed frame, replies
+with the paths it lacks, and only those files are streamed.
+
+5. Protocol
+
+Client and server exchange the length-prefixed binary frames described in
+syncproto.h. Control frames always carry a CRC-32; pass -c to checksum file
+payloads too (this costs an extra read of every file sent).
+
+Modified files (IN_CLOSE_WRITE) are sent as rsync-style deltas: the server
+asks the client for block signatures of its copy and replies with only the
+changed ranges (see syncdelta.h). Clients using a chunk store (below) get a
+new chunk manifest instead.
+
+6. Chunk store
+
+With -k the server splits files into content-defined chunks and keeps a
+persistent, memory-mapped chunk index in store_dir (keep it outside the
+synced directory):
+
+    ./syncserver -k /var/tmp/syncstore server_sync_dir 5000 5
+
+Clients that also run with a store receive a list of chunk hashes instead
+of the file and fetch only the chunks they have no copy of, so copies of
+existing data cost a manifest. Renames within the tree are sent as a single
+SYNC_RENAME frame.
+
+7. Event coalescing
+
+Events are held until the tree has been quiet for -w milliseconds (default
+50, 0 sends every read of inotify events straight away), but never longer
+than four windows. In that time a move pair becomes one rename, a file
+created and deleted again is never sent, and repeated writes to a file
+send its contents once. Each client then gets the window as one SYNC_BATCH
+frame, followed by the contents of the files it changed. Each such file is
+opened once per window and every client's writer streams it from that one
+descriptor with sendfile, at its own pace. A file that is deleted or
+rewritten meanwhile still goes out whole with the length it had when it was
+opened; the rewrite then follows as a delta.
+
+8. Nested directories
+
+Every directory in the tree is watched and events carry their full path
+below server_sync_dir. A new directory is scanned as soon as it is
+watched, so files written into it before that are not missed. If the
+kernel's event queue overflows, the tree is compared against the manifest
+by size and mtime and only the differences are sent.
+
+9. Metrics
+
+With -M the server answers every connection to a Unix socket with a
+snapshot of its counters in the Prometheus text format: per-client queue
+depth, bytes and events sent, events dropped for slow clients, inotify
+overflows and latency summaries for the watcher loop and for the time
+from an event to the last byte of its batch on the wire:
+
+    ./syncserver -M /tmp/syncserver.sock server_sync_dir 5000 5
+    socat - UNIX-CONNECT:/tmp/syncserver.sock
+
+The counters are updated with atomic adds, so collecting them takes no
+lock on the event path.
+
+10. Compression
+
+Clients started with -z get whole files as zlib streams, which they
+inflate as the bytes arrive. Each file is compressed once, at -z level
+(default 6, 0 turns compression off), and the one buffer is shared by every
+client until the file changes; the cache keeps the most recently
+sent 64 MB. Files under 512 bytes, over 16 MB, or that shrink by less
+than 10% are sent as they are.
+
+11. io_uring
+
+    ./syncserver -m uring server_sync_dir 5000 5
+
+works like thread mode, but each writer thread owns an io_uring with the
+client's socket registered as a fixed file. It takes up to 64 queued items
+at a time and sends them as one chain of linked SENDs; small file bodies
+are read into registered buffers in the same chain, so a run of small
+files costs one system call instead of two per file. Files over 64 KB
+still go out with sendfile. The startup walk also batches its stat, open,
+read and close calls per directory through a ring per walker thread.
+Where io_uring is unavailable, both fall back to the blocking calls.
+bench_uring.sh compares the two on a tree of 100k small files.
+
+12. Reconnecting
+
+Every event sent is also recorded with a sequence number in a bounded
+journal (-J bytes, default 16 MB, 0 disables it), optionally backed by a
+file (-j journal_file) so it can be inspected:
+
+    ./syncserver -J 67108864 -j /tmp/sync.journal server_sync_dir 5000 5
+
+Once a client has everything up to an event, a SYNC_SEQ frame tells it
+that event's number. A client that loses its connection reconnects with
+SYNC_RESUME carrying the last number it applied; if the journal still
+holds every event after it, those are replayed (coalesced, as one window)
+and the manifest is skipped. Otherwise, or after a server restart, which
+starts a new journal epoch, it gets the manifest as on first connect.
+SYNC_RESUME also names a file that was cut off partway with the CRC of
+the bytes received; if it is sent again and those bytes still match, only
+the rest follows, in a SYNC_FILE with SYNC_FLAG_OFFSET.
+
+13. Splitting the tree across servers
+
+A large tree can be served by several server processes, each owning some
+subtrees of it (-o prefix, repeatable; the default is the whole tree).
+Each one indexes, watches and sends only what it owns, so the inotify
+watches, hashing and network load are spread over as many processes (and
+cores, or machines sharing the directory) as there are owners:
+
+    ./syncserver -o photos server_sync_dir 5001 0
+    ./syncserver -o docs -o src server_sync_dir 5002 0
+
+Clients in turn subscribe to the subtrees they need (syncclient -s) and
+the server filters events, manifests and file contents for them before
+anything is queued, rather than the client discarding them with its
+ignore list. A client mirroring several owners runs once per server into
+the same directory:
+
+    ./syncclient -a 127.0.0.1:5001 -s photos/2024 mirror ignore.txt
+    ./syncclient -a 127.0.0.1:5002 -s docs mirror ignore.txt
+
+Directories leading to an owned or subscribed subtree are sent as well,
+but none of their other contents.
+
+14. Two-way sync
+
+With -b clients started with -b may push their own changes back: each
+client watches its directory and sends every local write, delete, rename
+and new directory upstream, and the server writes it into the tree and
+passes it on to the other clients like any change of its own. The client
+that pushed it gets an acknowledgement instead of its own change back.
+
+    ./syncserver -b copy server_sync_dir 5000 5
+    ./syncclient -b client_dir ignore.txt
+
+Every file carries a version vector (syncversion.h) counting the changes
+each replica made to it. A push whose vector is older than the server's
+was already seen and is dropped; one that saw neither side of the other's
+latest change is a conflict, decided by the policy:
+
+    -b copy    the server's copy stays and the pushed one is saved next to
+               it as name.conflict-<replica>, so no edit is lost; a pushed
+               edit beats a delete (default choice for shared trees)
+    -b server  the server's copy stays and goes back to the client
+    -b client  the pushed copy wins
+    -b newest  the copy with the later mtime wins
+
+Pushes are pipelined: a client never waits for an acknowledgement before
+sending its next change, and the server applies them on the connection's
+own thread, so two clients pushing at once never serialize on the client
+table. Renames and directory deletes are applied as they arrive. Vectors
+live in memory only, so after a server restart every file starts over
+with an empty history.
+
+15. Memory cap
+
+Queued output is allocated from slabs (syncslab.h) rather than malloc:
+each power-of-two size class keeps its own 64 KB slabs, so a burst of
+events costs a pointer pop per frame and the slabs are reused by the next
+window. A batch of events is encoded once per distinct view: clients
+whose subscriptions and ignore lists give the same bytes share one
+reference-counted frame instead of a copy each.
+
+Everything queued to clients counts against a cap (-Q bytes, default
+512 MB, 0 disables it):
+
+    ./syncserver -Q 134217728 server_sync_dir 5000 5
+
+When a window would leave more than that queued, clients are evicted
+until it fits: first those whose socket has taken nothing for 100 ms,
+largest queue first, then the largest of the rest. An evicted client is
+disconnected and its queue freed; it reconnects and catches up from the
+journal or the manifest like a dropped client. Evictions are counted in
+sync_clients_evicted_total, and sync_queue_memory_bytes and
+sync_queue_memory_reserved_bytes report what is queued and what the
+slabs hold from the system.
+
+16. Verifying mirrors
+
+The tree index doubles as a Merkle tree (synctree.h): every directory has
+a digest of its entries' names, sizes and content hashes, subdirectories
+by their own digests, cached and recomputed only above what changed. A
+client started with -v sends its mirror's root digest every so often; if
+it differs, the server lists that directory, the client fixes what it
+holds there and sends back the digests of the subdirectories that still
+differ, and so on down. A matching mirror costs one round trip however
+large it is, and a few stray files one per level above them:
+
+    ./syncclient -v 300 client_dir ignore.txt
+
+Digests are taken over what the client sees (its subscriptions and
+ignore list), and cached per distinct view. A request that arrives while
+changes are still in the coalescing window waits until they are sent.
+sync_verifies_total and sync_verify_dirs_total count requests and the
+directories that had to be listed.
 */
 
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <pthread.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <sys/inotify.h>
-#include <dirent.h>
-#include <errno.h>
-#include <arpa/inet.h>
-#include <sys/sendfile.h>
-#include <sys/stat.h>
-#include <libgen.h>  
-#include <fcntl.h>
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <signal.h>
+#include <ftw.h>
+#include <zlib.h>
+
+#include "syncproto.h"
+#include "syncdelta.h"
+#include "syncchunk.h"
+#include "synctree.h"
+#include "syncignore.h"
+#include "syncprefix.h"
+#include "synccoalesce.h"
+#include "syncwatch.h"
+#include "syncuring.h"
+#include "syncjournal.h"
+#include "syncmetrics.h"
+#include "syncversion.h"
+#include "syncslab.h"
+
+#define EVENT_SIZE  (sizeof(struct inotify_event))
+#define BUF_LEN     (1024 * (EVENT_SIZE + 16))
+#define MAX_PATH    2048
+#define INITIAL_TABLE_SIZE 16
+#define MAX_SHARDS  64
+#define MAX_EVENTS  256
+#define DIRTY_BUCKETS 256
+#define MANIFEST_BUCKETS 1024
+#define PACK_BUCKETS 1024
+#define BROADCAST_BUCKETS 256
+#define IN_BUF_SIZE (SYNC_HEADER_SIZE + MAX_PATH + 256)   // grows for larger frames
+#define MAX_CLIENT_FRAME (64 * 1024 * 1024)   // largest signature we accept
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE)
+
+// Per-client output queue limits (bytes of queued payload)
+#define QUEUE_LOW_WATER       (256 * 1024)
+#define DEFAULT_QUEUE_LIMIT   (4 * 1024 * 1024)
+
+// Memory all queues together may hold before clients are evicted; those
+// that have not taken a byte for STALL_MS go first
+#define DEFAULT_MEMORY_CAP    ((size_t)512 * 1024 * 1024)
+#define STALL_MS              100
+
+// Event coalescing: flush once the tree has been quiet for the window, or
+// after MAX_HOLD windows of continuous activity, or at MAX_PENDING events
+#define DEFAULT_WINDOW_MS     50
+#define MAX_HOLD              4
+#define MAX_PENDING           4096
+#define MAX_BATCH_BYTES       (256 * 1024)
+
+// Compressed copies of files are cached up to PACK_CACHE_BYTES in total.
+// Tiny files are not worth it; huge ones are streamed raw with sendfile.
+#define DEFAULT_COMPRESS_LEVEL 6
+#define PACK_CACHE_BYTES      (64 * 1024 * 1024)
+#define PACK_MIN_SIZE         512
+#define PACK_MAX_SIZE         (16 * 1024 * 1024)
+
+// io_uring writers (-m uring): items per submission, and the registered
+// slots small file bodies are read into before they are sent
+#define URING_DEPTH           64
+#define URING_SLOTS           16
+#define URING_SLOT            (64 * 1024)
+
+#define DEFAULT_JOURNAL_SIZE  (16 * 1024 * 1024)
+
+enum { MODE_THREAD, MODE_EPOLL, MODE_URING };
+enum { POLICY_DROP, POLICY_COALESCE };
+enum { BIDIR_OFF, BIDIR_COPY, BIDIR_SERVER, BIDIR_CLIENT, BIDIR_NEWEST };
+
+// File contents shared by every client they are sent to: the file is
+// opened (or its compressed form built) once, each client's writer streams
+// from it at its own offset, and the last one to finish releases it
+typedef struct Payload {
+    int refs;           // atomic
+    int fd;             // open file, or -1 for an in-memory payload
+    uint8_t *data;      // compressed bytes (owned)
+    off_t size;         // announced length, fixed when the payload was made
+    struct stat st;
+    int flags;          // SYNC_FLAG_* for the SYNC_FILE frame
+    uint32_t crc;
+} Payload;
+
+// One pending chunk of output: either an encoded frame or a range of a
+// shared payload that follows its SYNC_FILE frame
+typedef struct OutItem {
+    struct OutItem *next;
+    char *data;         // frame bytes, or the payload's bytes when in memory
+    size_t len;
+    size_t sent;
+    int fd;             // payload file to stream with sendfile (-1 otherwise)
+    off_t offset;
+    off_t end;
+    int zero_fill;      // file shrank: pad the rest so framing stays intact
+    Payload *payload;   // reference held by this item; owns fd and data
+    uint64_t stamp_ns;  // oldest event this output reports; timed when sent
+} OutItem;
+
+// Name whose events were coalesced while the client's queue was full
+typedef struct DirtyName {
+    struct DirtyName *next;
+    char name[];
+} DirtyName;
+
+// File whose contents (or, with delta set, a signature request) follow a
+// SYNC_BATCH frame
+typedef struct {
+    char *name;
+    int delta;
+} BatchFile;
+
+// One client's share of a flushed window
+typedef struct {
+    uint8_t *buf;               // SYNC_BATCH payload, count patched in last
+    size_t len;
+    size_t cap;
+    uint32_t count;
+    BatchFile *files;
+    int nfiles;
+    int files_cap;
+    const char **vectors;       // names whose SYNC_VECTOR follows the contents
+    int nvectors;
+    int vectors_cap;
+} Batch;
+
+// Server-wide counters for the metrics endpoint (-M); all updates are
+// atomic so no lock is taken on the hot paths
+typedef struct {
+    uint64_t inotify_events;
+    uint64_t inotify_overflows;
+    uint64_t batches;
+    uint64_t events_sent;
+    uint64_t events_dropped;
+    uint64_t bytes_sent;
+    uint64_t clients_dropped;   // disconnected by the drop policy
+    uint64_t clients_evicted;   // disconnected to stay under the memory cap
+    uint64_t resumes;           // reconnects served from the journal
+    uint64_t resume_misses;     // reconnects that needed a manifest after all
+    uint64_t resumed_bytes;     // file bytes not resent thanks to an offset
+    uint64_t pushes_applied;    // client changes written to the tree
+    uint64_t push_conflicts;    // client changes concurrent with another
+    uint64_t verifies;          // SYNC_VERIFY requests answered
+    uint64_t verify_dirs;       // directories listed because their digests differed
+    Histogram watcher_loop;     // one pass: read, coalesce and maybe flush
+    Histogram event_to_wire;    // oldest event of a batch to its last byte
+} ServerMetrics;
+
+// File opened once for a flushed window and shared by all its clients
+typedef struct BroadcastFile {
+    struct BroadcastFile *next;
+    Payload *payload;           // NULL if it could not be opened
+    Payload *packed;            // what clients taking compression get, or NULL
+    OutItem *chunks;            // SYNC_CHUNKS frame for chunked clients
+    int chunked;                // chunks was looked up or built (NULL if neither worked)
+    char name[];
+} BroadcastFile;
+
+// SYNC_BATCH frame encoded once for a window and queued to every client
+// whose batch came out the same (those with no ignores, subscriptions or
+// echoes in it): the queues share one buffer
+typedef struct SharedFrame {
+    struct SharedFrame *next;
+    uint32_t crc;
+    OutItem *item;              // holds a reference to the bytes
+} SharedFrame;
+
+typedef struct {
+    BroadcastFile *buckets[BROADCAST_BUCKETS];
+    SharedFrame *frames[BROADCAST_BUCKETS];
+    Batch batch;                // scratch, reused for every client
+} Broadcast;
+
+// Directory MOVED_FROM waiting for its MOVED_TO
+typedef struct DirMove {
+    struct DirMove *next;
+    uint32_t cookie;
+    char path[];
+} DirMove;
+
+// Structure to hold client information
+typedef struct Client {
+    int socket;
+    struct sockaddr_in address;
+    IgnoreMatcher *ignore;      // compiled once from the HELLO ignore list
+    PrefixSet *subs;            // subtrees from SYNC_SUBSCRIBE, NULL for all
+    uint64_t subs_hash;         // of the SYNC_SUBSCRIBE list, for view.id
+    TreeView view;              // what its digests cover (SYNC_VERIFY)
+    uint8_t *verify_req;        // SYNC_VERIFY held until the window is fanned
+    size_t verify_len;          // out (under out_lock)
+    int verify_due;             // fanned out: the queue's drainer answers it
+    char *chunk_due;            // file a refill stopped at for want of a manifest
+    char *chunk_done;           // and once the drainer chunked it (under out_lock)
+    int active;
+    int handshake_done;
+    int chunked;                // client asked for chunk manifests
+    int compress;               // client accepts zlib-compressed files
+    int shard;
+
+    // Partially received frames from the client (grows for signatures)
+    uint8_t *in_buf;
+    size_t in_len;
+    size_t in_cap;
+
+    // Bounded output queue, filled by the watcher and drained by the
+    // client's writer thread (thread mode) or its shard (epoll mode)
+    pthread_mutex_t out_lock;
+    pthread_cond_t out_cond;
+    OutItem *out_head;
+    OutItem *out_tail;
+    size_t out_bytes;
+    size_t out_mem;             // memory the queued items hold (shared frames in full)
+    size_t evicted_mem;         // out_mem when evicted for the memory cap
+    uint64_t progress_ns;       // atomic: when the socket last took bytes, or
+                                // the queue last went from empty to not
+    int out_pending;            // already linked on the shard's pending list
+    struct Client *pending_next;
+    int closing;                // closed by its shard, freed after the event batch
+    struct Client *closed_next;
+
+    DirtyName *dirty[DIRTY_BUCKETS];
+    int dirty_count;
+
+    // Files the client asked for after the manifest, still being streamed
+    uint8_t *want;
+    size_t want_len;
+    size_t want_pos;
+    pthread_t writer;
+
+    // Updated with atomic adds and read by the metrics endpoint
+    uint64_t bytes_sent;
+    uint64_t events_sent;
+    uint64_t events_dropped;    // coalesced while the queue was full
+
+    // Journal position: events up to seq are queued. SYNC_SEQ goes out once
+    // nothing older is still owed, i.e. no snapshot or dirty names pending.
+    uint64_t seq;
+    uint64_t seq_queued;
+    int seq_announced;          // a SYNC_SEQ has gone out, so seq_queued is valid
+    int snapshot;               // manifest sent, wanted files not all queued
+
+    // From SYNC_RESUME: where a reconnecting client left off
+    int resuming;
+    uint64_t resume_epoch;
+    uint64_t resume_seq;
+    char *resume_name;          // file cut off partway whose bytes still match,
+    uint64_t resume_offset;     // NULL if none
+    struct stat resume_st;      // the copy they were checked against
+
+    // Two-way sync: the client's replica id (from its first push) and the
+    // file push whose contents are still arriving
+    int bidir;
+    uint64_t replica;
+    char *push_name;            // NULL when no file push is in progress
+    int push_fd;                // temp file, or -1 to discard the contents
+    char push_temp[MAX_PATH + 16];
+    uint64_t push_left;
+    VersionVector push_vv;
+    struct timespec push_mtime;
+} Client;
+
+// A SYNC_PUSH as received
+typedef struct {
+    int op;
+    int is_dir;
+    char name[MAX_PATH];
+    char target[MAX_PATH];      // SYNC_RENAME
+    VersionVector vv;
+    struct timespec mtime;
+    uint64_t size;
+} Push;
+
+// Cached chunk manifest of one file, valid while the file's stat matches
+typedef struct Manifest {
+    struct Manifest *next;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint8_t *payload;
+    size_t len;
+    char name[];
+} Manifest;
+
+// Cached zlib output for one file, valid while the file's stat matches.
+// payload is NULL if the file did not compress well enough to bother.
+typedef struct Packed {
+    struct Packed *next;        // hash chain
+    struct Packed *newer;       // LRU list
+    struct Packed *older;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    Payload *payload;
+    char name[];
+} Packed;
+
+// Growable connection table; the limit is a runtime setting
+typedef struct {
+    Client **slots;
+    int capacity;
+    int count;
+    int max_clients;            // 0 means unlimited
+} ClientTable;
+
+// One reactor thread with its own epoll instance
+typedef struct {
+    int id;
+    int epfd;
+    int wake_fd;
+    pthread_t thread;
+    pthread_mutex_t pending_lock;
+    Client *pending_head;
+    Client *closed_head;        // closed this batch, freed once it is done
+} Shard;
+
+ClientTable client_table;
+pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int server_mode = MODE_THREAD;
+int checksum_files = 0;
+int slow_policy = POLICY_COALESCE;
+size_t queue_limit = DEFAULT_QUEUE_LIMIT;
+size_t memory_cap = DEFAULT_MEMORY_CAP;
+size_t evicting_mem;            // atomic: evicted_mem of clients not yet freed
+int shard_count = 1;
+int window_ms = DEFAULT_WINDOW_MS;
+int window_open;                // atomic: the tree holds changes not yet fanned out
+Shard shards[MAX_SHARDS];
+ServerMetrics metrics;
+
+int inotify_fd;
+WatchTable *watches;            // wd -> directory, watcher thread only
+DirMove *dir_moves;
+char sync_dir[MAX_PATH];
+TreeIndex *tree;
+
+// Chunk store (-k); NULL when disabled
+ChunkIndex *chunk_store = NULL;
+Manifest *manifests[MANIFEST_BUCKETS];
+pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Compression (-z level, 0 disables)
+int compress_level = DEFAULT_COMPRESS_LEVEL;
+Packed *packs[PACK_BUCKETS];
+Packed *pack_newest, *pack_oldest;
+size_t pack_bytes;
+pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Event journal for reconnecting clients (-J bytes, 0 disables; -j file)
+Journal *journal = NULL;
+size_t journal_size = DEFAULT_JOURNAL_SIZE;
+char *journal_path = NULL;
+
+// Subtrees this server owns (-o, repeatable); NULL serves the whole tree.
+// The list itself goes out with every SYNC_LISTING.
+PrefixSet *owned = NULL;
+char *owned_list = NULL;
+size_t owned_len = 0;
+
+// Two-way sync (-b policy): the server's replica id and every path's
+// version vector; NULL when clients may not push
+int bidir_policy = BIDIR_OFF;
+uint64_t server_replica;
+VersionTable *versions = NULL;
+
+// Utility function to check if a path (relative to sync_dir) is ignored or
+// outside the client's subscription
+int is_ignored(Client *client, const char *name, int is_dir) {
+    return ignore_match(client->ignore, name) || !prefix_match(client->subs, name, is_dir);
+}
+
+// Paths a client's digests leave out: what it is never sent, and
+// temporary files
+static int verify_skip(void *arg, const char *path, int is_dir) {
+    const char *base = strrchr(path, '/');
+    return is_ignored(arg, path, is_dir) || sync_is_temp(base ? base + 1 : path);
+}
+
+// FNV-1a over len bytes, continuing from h
+static uint64_t fnv64(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while (len--) h = (h ^ *p++) * 1099511628211ull;
+    return h;
+}
+
+#define FNV64_START 14695981039346656037ull
+
+// Add a client to the connection table, growing it when full
+int table_add(ClientTable *table, Client *client) {
+    if (table->max_clients > 0 && table->count >= table->max_clients) {
+        return -1;
+    }
+    if (table->count == table->capacity) {
+        int new_capacity = table->capacity ? table->capacity * 2 : INITIAL_TABLE_SIZE;
+        Client **slots = realloc(table->slots, new_capacity * sizeof(Client *));
+        if (!slots) return -1;
+        table->slots = slots;
+        table->capacity = new_capacity;
+    }
+    table->slots[table->count++] = client;
+    return 0;
+}
+
+// Remove a client from the connection table (order is not preserved)
+void table_remove(ClientTable *table, Client *client) {
+    for (int i = 0; i < table->count; i++) {
+        if (table->slots[i] == client) {
+            table->slots[i] = table->slots[--table->count];
+            return;
+        }
+    }
+}
+
+Client *client_new(int socket, struct sockaddr_in *address) {
+    Client *client = calloc(1, sizeof(Client));
+    if (!client) return NULL;
+    client->socket = socket;
+    client->address = *address;
+    client->active = 1;
+    client->in_cap = IN_BUF_SIZE;
+    client->in_buf = malloc(client->in_cap);
+    if (!client->in_buf) {
+        free(client);
+        return NULL;
+    }
+    client->push_fd = -1;
+    pthread_mutex_init(&client->out_lock, NULL);
+    pthread_cond_init(&client->out_cond, NULL);
+    return client;
+}
+
+Payload *payload_ref(Payload *p) {
+    __atomic_fetch_add(&p->refs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+// Drop a reference; the last one closes the file or frees the buffer
+void payload_release(Payload *p) {
+    if (__atomic_fetch_sub(&p->refs, 1, __ATOMIC_ACQ_REL) != 1) return;
+    if (p->fd >= 0) close(p->fd);
+    free(p->data);
+    free(p);
+}
+
+void free_out_item(OutItem *item) {
+    if (item->payload) {
+        payload_release(item->payload);
+    } else {
+        if (item->fd >= 0) close(item->fd);
+        slab_shared_release((uint8_t *)item->data);
+    }
+    slab_free(item, sizeof(OutItem));
+}
+
+size_t out_item_size(OutItem *item) {
+    return item->fd >= 0 ? (size_t)(item->end - item->offset) : item->len - item->sent;
+}
+
+// Memory an item keeps allocated while queued; payload bytes are shared
+// through the pack cache, which has a limit of its own
+size_t out_item_mem(OutItem *item) {
+    return sizeof(OutItem) + (item->payload ? 0 : item->len);
+}
+
+void client_free(Client *client) {
+    if (client->evicted_mem) __atomic_fetch_sub(&evicting_mem, client->evicted_mem, __ATOMIC_RELAXED);
+    OutItem *item = client->out_head;
+    while (item) {
+        OutItem *next = item->next;
+        free_out_item(item);
+        item = next;
+    }
+    for (int i = 0; i < DIRTY_BUCKETS; i++) {
+        DirtyName *d = client->dirty[i];
+        while (d) {
+            DirtyName *next = d->next;
+            free(d);
+            d = next;
+        }
+    }
+    free(client->want);
+    free(client->verify_req);
+    free(client->chunk_due);
+    free(client->chunk_done);
+    free(client->resume_name);
+    ignore_free(client->ignore);
+    prefix_free(client->subs);
+    if (client->push_fd >= 0) {
+        close(client->push_fd);
+        unlink(client->push_temp);
+    }
+    free(client->push_name);
+    vv_free(&client->push_vv);
+    free(client->in_buf);
+    pthread_mutex_destroy(&client->out_lock);
+    pthread_cond_destroy(&client->out_cond);
+    free(client);
+}
+
+// Append an item to the client's output queue; caller holds out_lock
+void queue_push_locked(Client *client, OutItem *item) {
+    item->next = NULL;
+    if (!client->out_head) __atomic_store_n(&client->progress_ns, metrics_now_ns(), __ATOMIC_RELAXED);
+    if (client->out_tail) client->out_tail->next = item;
+    else client->out_head = item;
+    client->out_tail = item;
+    client->out_bytes += out_item_size(item);
+    client->out_mem += out_item_mem(item);
+}
+
+// Detach the head of the queue; caller holds out_lock
+OutItem *queue_pop_locked(Client *client) {
+    OutItem *item = client->out_head;
+    if (item) {
+        client->out_head = item->next;
+        if (!client->out_head) client->out_tail = NULL;
+        client->out_mem -= out_item_mem(item);
+    }
+    return item;
+}
+
+// Item for a frame of len bytes in a new shared buffer
+OutItem *new_frame_item(size_t len) {
+    OutItem *item = slab_zalloc(sizeof(OutItem));
+    if (!item) return NULL;
+    item->data = (char *)slab_shared_new(len);
+    if (!item->data) {
+        slab_free(item, sizeof(OutItem));
+        return NULL;
+    }
+    item->len = len;
+    item->fd = -1;
+    return item;
+}
+
+// Another item sending the same frame bytes as item, without a copy
+OutItem *share_frame_item(const OutItem *item) {
+    OutItem *copy = slab_zalloc(sizeof(OutItem));
+    if (!copy) return NULL;
+    copy->data = (char *)slab_shared_ref((uint8_t *)item->data);
+    copy->len = item->len;
+    copy->fd = -1;
+    return copy;
+}
+
+// Encode a frame header and path. The payload is copied in when given;
+// otherwise only payload_len is announced and the bytes follow separately.
+// extra bytes are left free at the end for the caller.
+OutItem *make_frame_item_extra(int type, int flags, const char *path, const void *payload,
+                               uint64_t payload_len, uint32_t checksum, size_t extra) {
+    size_t path_len = strlen(path);
+    size_t body_len = payload ? payload_len : 0;
+    OutItem *item = new_frame_item(SYNC_HEADER_SIZE + path_len + body_len + extra);
+    if (!item) return NULL;
+    if (payload) {
+        flags |= SYNC_FLAG_CHECKSUM;
+        checksum = sync_crc32(sync_crc32(0, path, path_len), payload, body_len);
+    }
+    sync_encode_header((uint8_t *)item->data, type, flags, path_len, payload_len, checksum);
+    memcpy(item->data + SYNC_HEADER_SIZE, path, path_len);
+    if (body_len) memcpy(item->data + SYNC_HEADER_SIZE + path_len, payload, body_len);
+    return item;
+}
+
+OutItem *make_frame_item(int type, int flags, const char *path, const void *payload,
+                         uint64_t payload_len, uint32_t checksum) {
+    return make_frame_item_extra(type, flags, path, payload, payload_len, checksum, 0);
+}
+
+// Read size bytes of an open file into memory. Unlike mmap this cannot
+// fault if the file is truncated while we work on it.
+uint8_t *read_fd(int fd, off_t size, size_t *len_out) {
+    uint8_t *data = malloc(size ? size : 1);
+    size_t len = 0;
+    while (data && len < (size_t)size) {
+        ssize_t n = pread(fd, data + len, size - len, len);
+        if (n <= 0) break;
+        len += n;
+    }
+    *len_out = len;
+    return data;
+}
+
+uint8_t *read_whole_file(const char *filepath, size_t *size) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    uint8_t *data = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) data = read_fd(fd, st.st_size, size);
+    close(fd);
+    return data;
+}
+
+// CRC-32 of path + file contents, read with pread so sendfile is unaffected
+int checksum_file(int fd, const char *path, off_t size, uint32_t *crc) {
+    char buffer[65536];
+    off_t offset = 0;
+    *crc = sync_crc32(0, path, strlen(path));
+    while (offset < size) {
+        ssize_t n = pread(fd, buffer, sizeof(buffer), offset);
+        if (n <= 0) return -1;
+        *crc = sync_crc32(*crc, buffer, n);
+        offset += n;
+    }
+    return 0;
+}
+
+// Open a file once for every client it goes to. The fd keeps the contents
+// readable even if the file is deleted or renamed during the fan-out, and
+// its size is fixed here so every client is announced the same length.
+Payload *payload_open(const char *name, const char *filepath) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    Payload *p = calloc(1, sizeof(Payload));
+    if (!p || fstat(fd, &p->st) < 0 || !S_ISREG(p->st.st_mode)) {
+        free(p);
+        close(fd);
+        return NULL;
+    }
+    p->refs = 1;
+    p->fd = fd;
+    p->size = p->st.st_size;
+    if (checksum_files && checksum_file(fd, name, p->size, &p->crc) == 0) {
+        p->flags = SYNC_FLAG_CHECKSUM;
+    }
+    return p;
+}
+
+// Wrap a malloc'd buffer (compressed contents) as a payload; takes data
+Payload *payload_from_memory(uint8_t *data, size_t len, uint32_t crc) {
+    Payload *p = calloc(1, sizeof(Payload));
+    if (!p) return NULL;
+    p->refs = 1;
+    p->fd = -1;
+    p->data = data;
+    p->size = len;
+    p->crc = crc;
+    p->flags = SYNC_FLAG_COMPRESS | SYNC_FLAG_CHECKSUM;
+    return p;
+}
+
+// Remove a cache entry from its hash chain and the LRU list; caller holds
+// pack_lock
+void pack_unlink_locked(Packed *p) {
+    unsigned long h = 5381;
+    for (const char *c = p->name; *c; c++) h = h * 33 + (unsigned char)*c;
+    Packed **link = &packs[h % PACK_BUCKETS];
+    while (*link != p) link = &(*link)->next;
+    *link = p->next;
+
+    if (p->newer) p->newer->older = p->older;
+    else pack_newest = p->older;
+    if (p->older) p->older->newer = p->newer;
+    else pack_oldest = p->newer;
+    pack_bytes -= p->payload ? p->payload->size : 0;
+}
+
+void pack_link_locked(Packed *p) {
+    unsigned long h = 5381;
+    for (const char *c = p->name; *c; c++) h = h * 33 + (unsigned char)*c;
+    p->next = packs[h % PACK_BUCKETS];
+    packs[h % PACK_BUCKETS] = p;
+
+    p->newer = NULL;
+    p->older = pack_newest;
+    if (pack_newest) pack_newest->newer = p;
+    else pack_oldest = p;
+    pack_newest = p;
+    pack_bytes += p->payload ? p->payload->size : 0;
+}
+
+void pack_free(Packed *p) {
+    if (p->payload) payload_release(p->payload);
+    free(p);
+}
+
+// Cached entry for name if it still matches the file; a stale one is
+// dropped. Caller holds pack_lock.
+Packed *pack_lookup_locked(const char *name, const struct stat *st) {
+    unsigned long h = 5381;
+    for (const char *c = name; *c; c++) h = h * 33 + (unsigned char)*c;
+    Packed *p = packs[h % PACK_BUCKETS];
+    while (p && strcmp(p->name, name) != 0) p = p->next;
+    if (!p) return NULL;
+
+    pack_unlink_locked(p);
+    if (p->dev == st->st_dev && p->ino == st->st_ino && p->size == st->st_size &&
+        p->mtime.tv_sec == st->st_mtim.tv_sec && p->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+        pack_link_locked(p);
+        return p;
+    }
+    pack_free(p);
+    return NULL;
+}
+
+// Compress a file into a new cache entry; takes no lock
+Packed *pack_new(const char *name, Payload *file) {
+    size_t size;
+    uint8_t *data = read_fd(file->fd, file->size, &size);
+    if (!data) return NULL;
+    uLongf len = compressBound(size);
+    uint8_t *out = malloc(len);
+    if (out && compress2(out, &len, data, size, compress_level) != Z_OK) {
+        free(out);
+        out = NULL;
+    }
+    free(data);
+
+    Packed *p = calloc(1, sizeof(Packed) + strlen(name) + 1);
+    if (!p) {
+        free(out);
+        return NULL;
+    }
+    strcpy(p->name, name);
+    p->dev = file->st.st_dev;
+    p->ino = file->st.st_ino;
+    p->size = file->st.st_size;
+    p->mtime = file->st.st_mtim;
+    if (out && len < size - size / 10) {
+        uint8_t *shrunk = realloc(out, len);
+        if (shrunk) out = shrunk;
+        uint32_t crc = sync_crc32(sync_crc32(0, name, strlen(name)), out, len);
+        p->payload = payload_from_memory(out, len, crc);
+        if (!p->payload) free(out);
+    } else {
+        free(out);      // not worth it; remembered so we do not try again
+    }
+    return p;
+}
+
+// Is the file in the size range worth compressing for the wire?
+int packable(const Payload *file) {
+    return file->size >= PACK_MIN_SIZE && file->size <= PACK_MAX_SIZE;
+}
+
+// What a client that accepts compression is sent for a file: its cached
+// zlib form, or the file itself if that did not compress well. On a cache
+// miss the file is compressed only if compress is set, and then outside
+// pack_lock; otherwise it goes out as it is. Returns a new reference.
+Payload *get_packed(const char *name, Payload *file, int compress) {
+    pthread_mutex_lock(&pack_lock);
+    Packed *p = pack_lookup_locked(name, &file->st);
+    Payload *chosen = p && p->payload ? p->payload : file;
+    if (p || !compress) {
+        payload_ref(chosen);
+        pthread_mutex_unlock(&pack_lock);
+        return chosen;
+    }
+    pthread_mutex_unlock(&pack_lock);
+
+    p = pack_new(name, file);
+    if (!p) return payload_ref(file);
+
+    pthread_mutex_lock(&pack_lock);
+    Packed *cached = pack_lookup_locked(name, &file->st);
+    if (cached) {
+        // Another thread compressed it meanwhile
+        pack_free(p);
+        p = cached;
+    } else {
+        pack_link_locked(p);
+        while (pack_bytes > PACK_CACHE_BYTES && pack_oldest != p) {
+            Packed *old = pack_oldest;
+            pack_unlink_locked(old);
+            pack_free(old);
+        }
+    }
+    chosen = payload_ref(p->payload ? p->payload : file);
+    pthread_mutex_unlock(&pack_lock);
+    return chosen;
+}
+
+// Item streaming bytes offset..size of p; takes a reference
+OutItem *payload_item(Payload *p, off_t offset) {
+    OutItem *body = slab_zalloc(sizeof(OutItem));
+    if (!body) return NULL;
+    body->payload = payload_ref(p);
+    body->fd = p->fd;
+    body->data = (char *)p->data;
+    body->len = p->data ? (size_t)p->size : 0;
+    body->sent = p->data ? (size_t)offset : 0;
+    body->offset = offset;
+    body->end = p->size;
+    return body;
+}
+
+static int same_copy(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Does our copy of name start with the offset bytes the client has (their
+// CRC is crc)? Runs on the client's own thread when SYNC_RESUME arrives,
+// so the fan-out never reads a prefix; st is the copy that matched.
+int resume_prefix_matches(const char *name, uint64_t offset, uint32_t crc, struct stat *st) {
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, name);
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat after;
+    int match = fstat(fd, st) == 0 && S_ISREG(st->st_mode) && offset > 0 &&
+                offset <= (uint64_t)st->st_size;
+    uint8_t buf[65536];
+    uint32_t sum = 0;
+    for (uint64_t pos = 0; match && pos < offset;) {
+        size_t want = offset - pos < sizeof(buf) ? offset - pos : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, pos);
+        if (n <= 0) {
+            match = 0;
+            break;
+        }
+        sum = sync_crc32(sum, buf, n);
+        pos += n;
+    }
+    // A copy rewritten while it was read proves nothing
+    match = match && sum == crc && fstat(fd, &after) == 0 && same_copy(st, &after);
+    close(fd);
+    return match;
+}
+
+// The client was cut off resume_offset bytes into this file: if p is the
+// copy resume_prefix_matches checked, send only the rest. Returns 1 if
+// queued, 0 if the file should go out whole, -1 if out of memory. Caller
+// holds out_lock.
+int queue_resumed_locked(Client *client, const char *name, Payload *p) {
+    uint64_t offset = client->resume_offset;
+    free(client->resume_name);
+    client->resume_name = NULL;
+    if (p->fd < 0 || !same_copy(&p->st, &client->resume_st)) return 0;
+
+    OutItem *header = make_frame_item_extra(SYNC_FILE, SYNC_FLAG_OFFSET, name, NULL,
+                                            8 + p->size - offset, 0, 8);
+    OutItem *body = header ? payload_item(p, offset) : NULL;
+    if (!body) {
+        if (header) free_out_item(header);
+        return -1;
+    }
+    sync_put64((uint8_t *)header->data + header->len - 8, offset);
+    queue_push_locked(client, header);
+    queue_push_locked(client, body);
+    metrics_add(&metrics.resumed_bytes, offset);
+    return 1;
+}
+
+// Queue a SYNC_FILE frame whose payload streams from p; caller holds
+// out_lock. Clients that accept compression get packed, the form
+// broadcast_packed chose for the window, or without one the cached zlib
+// form when the file compresses well.
+int queue_payload_locked(Client *client, const char *name, Payload *p, Payload *packed) {
+    if (client->resume_name && strcmp(client->resume_name, name) == 0) {
+        int rc = queue_resumed_locked(client, name, p);
+        if (rc != 0) return rc < 0 ? -1 : 0;
+    }
+    if (client->compress && packed) {
+        p = payload_ref(packed);
+    } else if (client->compress && packable(p)) {
+        p = get_packed(name, p, 1);
+    } else {
+        payload_ref(p);
+    }
+
+    OutItem *header = make_frame_item(SYNC_FILE, p->flags, name, NULL, p->size, p->crc);
+    OutItem *body = header ? payload_item(p, 0) : NULL;
+    payload_release(p);
+    if (!body) {
+        if (header) free_out_item(header);
+        return -1;
+    }
+    queue_push_locked(client, header);
+    queue_push_locked(client, body);
+    return 0;
+}
+
+// Queue a SYNC_FILE frame followed by the file contents; caller holds
+// out_lock. A file that disappeared is silently skipped.
+int queue_file_locked(Client *client, const char *name, const char *filepath) {
+    Payload *p = payload_open(name, filepath);
+    if (!p) return 0;
+    int rc = queue_payload_locked(client, name, p, NULL);
+    payload_release(p);
+    return rc;
+}
+
+// Chunk a file, record every chunk in the store and encode the
+// SYNC_CHUNKS payload (u64 size, u32 count, count x (hash, u32 len))
+uint8_t *build_manifest(const char *name, const uint8_t *data, size_t size, size_t *len) {
+    ChunkRef *chunks;
+    size_t count;
+    if (chunk_buffer(data, size, &chunks, &count) < 0) return NULL;
+
+    *len = 12 + count * CHUNK_ENTRY_SIZE;
+    uint8_t *payload = malloc(*len);
+    if (payload) {
+        sync_put64(payload, size);
+        sync_put32(payload + 8, count);
+        for (size_t i = 0; i < count; i++) {
+            uint8_t *entry = payload + 12 + i * CHUNK_ENTRY_SIZE;
+            memcpy(entry, chunks[i].hash, CHUNK_HASH_SIZE);
+            sync_put32(entry + CHUNK_HASH_SIZE, chunks[i].len);
+            chunk_index_put(chunk_store, chunks[i].hash, name, chunks[i].offset, chunks[i].len);
+        }
+    }
+    free(chunks);
+    return payload;
+}
+
+// Cache slot for name; caller holds manifest_lock
+Manifest **manifest_link_locked(const char *name) {
+    unsigned long h = 5381;
+    for (const char *p = name; *p; p++) h = h * 33 + (unsigned char)*p;
+    Manifest **link = &manifests[h % MANIFEST_BUCKETS];
+    while (*link && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+    return link;
+}
+
+// SYNC_CHUNKS frame for the copy of name with this stat. A cached manifest
+// is used if the file has not changed since; otherwise, with build set,
+// the file is chunked with no lock held and the result cached. NULL if
+// there is none (or it cannot be read).
+OutItem *manifest_item(const char *name, int fd, const struct stat *st, int build) {
+    pthread_mutex_lock(&manifest_lock);
+    Manifest *m = *manifest_link_locked(name);
+    int current = m && m->dev == st->st_dev && m->ino == st->st_ino && m->size == st->st_size &&
+                  m->mtime.tv_sec == st->st_mtim.tv_sec && m->mtime.tv_nsec == st->st_mtim.tv_nsec;
+    OutItem *item = current ? make_frame_item(SYNC_CHUNKS, 0, name, m->payload, m->len, 0) : NULL;
+    pthread_mutex_unlock(&manifest_lock);
+    if (current || !build) return item;
+
+    size_t size, len;
+    uint8_t *data = read_fd(fd, st->st_size, &size);
+    uint8_t *payload = data ? build_manifest(name, data, size, &len) : NULL;
+    free(data);
+    if (!payload) return NULL;
+    item = make_frame_item(SYNC_CHUNKS, 0, name, payload, len, 0);
+
+    pthread_mutex_lock(&manifest_lock);
+    Manifest **link = manifest_link_locked(name);
+    if (!*link && (*link = calloc(1, sizeof(Manifest) + strlen(name) + 1)) != NULL) {
+        strcpy((*link)->name, name);
+    }
+    if ((m = *link) != NULL) {
+        free(m->payload);
+        m->dev = st->st_dev;
+        m->ino = st->st_ino;
+        m->size = st->st_size;
+        m->mtime = st->st_mtim;
+        m->payload = payload;
+        m->len = len;
+        payload = NULL;
+    }
+    pthread_mutex_unlock(&manifest_lock);
+    free(payload);
+    return item;
+}
+
+// Chunk the file queue_chunks_locked found no manifest for, with out_lock
+// dropped, so that the refill that stopped at it finds one when it comes
+// back. Called and returns with out_lock held.
+void chunk_due_locked(Client *client) {
+    char *name = client->chunk_due;
+    client->chunk_due = NULL;
+    pthread_mutex_unlock(&client->out_lock);
+
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, name);
+    int fd = open(filepath, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        OutItem *item = manifest_item(name, fd, &st, 1);
+        if (item) free_out_item(item);
+    }
+    if (fd >= 0) close(fd);
+
+    pthread_mutex_lock(&client->out_lock);
+    free(client->chunk_done);
+    client->chunk_done = name;
+}
+
+// SYNC_CHUNKS frame describing the file, for a chunked client. Chunking
+// reads the whole file, so it is never done here: without a cached
+// manifest the file is left to chunk_due_locked and 1 returned, for the
+// caller to stop and come back to it. Otherwise returns 0 with *item NULL
+// if the file should go out whole (one chunked that way and changed
+// again) or is gone, or -1 if out of memory. Caller holds out_lock.
+int chunks_for_locked(Client *client, const char *name, const char *filepath, OutItem **item) {
+    *item = NULL;
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+    *item = manifest_item(name, fd, &st, 0);
+    close(fd);
+
+    int retried = client->chunk_done && strcmp(client->chunk_done, name) == 0;
+    if (retried) {
+        free(client->chunk_done);
+        client->chunk_done = NULL;
+    }
+    if (*item || retried) return 0;
+    if (!client->chunk_due && !(client->chunk_due = strdup(name))) return -1;
+    return 1;
+}
+
+// Queue a SYNC_CHUNKS frame describing the file; the client asks for
+// whatever chunks it is missing. Returns 1 if it must wait for
+// chunk_due_locked. Caller holds out_lock.
+int queue_chunks_locked(Client *client, const char *name, const char *filepath) {
+    OutItem *item;
+    int rc = chunks_for_locked(client, name, filepath, &item);
+    if (rc != 0) return rc;
+    if (!item) return queue_file_locked(client, name, filepath);
+    queue_push_locked(client, item);
+    return 0;
+}
+
+// Queue the contents of a file in whichever form the client negotiated;
+// returns 1 if they must wait for chunk_due_locked
+int queue_contents_locked(Client *client, const char *name, const char *filepath) {
+    if (client->chunked) return queue_chunks_locked(client, name, filepath);
+    return queue_file_locked(client, name, filepath);
+}
+
+// Record a coalesced name; caller holds out_lock
+void mark_dirty_locked(Client *client, const char *name) {
+    unsigned long h = 5381;
+    for (const char *p = name; *p; p++) h = h * 33 + (unsigned char)*p;
+    DirtyName **bucket = &client->dirty[h % DIRTY_BUCKETS];
+
+    for (DirtyName *d = *bucket; d; d = d->next) {
+        if (strcmp(d->name, name) == 0) return;
+    }
+    DirtyName *d = malloc(sizeof(DirtyName) + strlen(name) + 1);
+    if (!d) {
+        client->active = 0;
+        return;
+    }
+    strcpy(d->name, name);
+    d->next = *bucket;
+    *bucket = d;
+    client->dirty_count++;
+}
+
+// Queue an event describing the current state of name, followed by its
+// contents if it is a file. Returns 1, with nothing queued, if a chunked
+// client's manifest must wait for chunk_due_locked. Caller holds out_lock.
+int queue_state_locked(Client *client, const char *name) {
+    char filepath[MAX_PATH];
+    struct stat st = {0};
+    OutItem *item, *chunks = NULL;
+    snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, name);
+    int rc = stat(filepath, &st);
+    int contents = rc == 0 && S_ISREG(st.st_mode) && !is_ignored(client, name, 0);
+    if (contents && client->chunked) {
+        int later = chunks_for_locked(client, name, filepath, &chunks);
+        if (later < 0) client->active = 0;
+        if (later != 0) return later > 0;
+    }
+    if (rc < 0) {
+        item = make_frame_item(SYNC_DELETE, 0, name, "", 0, 0);
+    } else {
+        item = make_frame_item(SYNC_CREATE, S_ISDIR(st.st_mode) ? SYNC_FLAG_DIR : 0,
+                               name, "", 0, 0);
+    }
+
+    if (!item) {
+        if (chunks) free_out_item(chunks);
+        client->active = 0;
+        return 0;
+    }
+    queue_push_locked(client, item);
+    if (chunks) queue_push_locked(client, chunks);
+    else if (contents && queue_file_locked(client, name, filepath) < 0) client->active = 0;
+    return 0;
+}
+
+// Encode a SYNC_VECTOR frame for one entry, NULL if it has no vector
+OutItem *version_item(const char *name, const VersionState *s) {
+    if (s->is_dir || !s->vv.count) return NULL;
+    size_t len = vv_encoded_size(&s->vv);
+    uint8_t *payload = malloc(len);
+    if (!payload) return NULL;
+    vv_encode(&s->vv, payload);
+    OutItem *item = make_frame_item(SYNC_VECTOR, 0, name, payload, len, 0);
+    free(payload);
+    return item;
+}
+
+// Follow an event about name with its version vector, for clients that
+// push changes back; caller holds out_lock
+void queue_version_locked(Client *client, const char *name) {
+    if (!client->bidir) return;
+    VersionState *s = version_lock(versions, name, 0);
+    if (!s) return;
+    OutItem *item = version_item(name, s);
+    version_unlock(versions, s);
+    if (item) queue_push_locked(client, item);
+}
+
+// Turn coalesced names back into events describing their current state.
+// Caller holds out_lock.
+void flush_dirty_locked(Client *client) {
+    for (int i = 0; i < DIRTY_BUCKETS && client->out_bytes < QUEUE_LOW_WATER; i++) {
+        while (client->dirty[i] && client->out_bytes < QUEUE_LOW_WATER && client->active) {
+            DirtyName *d = client->dirty[i];
+            if (queue_state_locked(client, d->name)) return;    // after chunk_due_locked
+            client->dirty[i] = d->next;
+            client->dirty_count--;
+            queue_version_locked(client, d->name);
+            free(d);
+        }
+    }
+}
+
+// Stream more of the files the client asked for while the queue is below
+// its low-water mark, so a large snapshot never sits in memory all at once.
+// Caller holds out_lock.
+void refill_snapshot_locked(Client *client) {
+    while (client->want && client->out_bytes < QUEUE_LOW_WATER) {
+        if (client->want_len - client->want_pos < 2) {
+            free(client->want);
+            client->want = NULL;
+            client->snapshot = 0;
+            break;
+        }
+        const uint8_t *p = client->want + client->want_pos;
+        size_t len = sync_get16(p);
+        client->want_pos += 2 + len;
+        if (client->want_pos > client->want_len) continue;
+        if (!sync_path_is_safe((const char *)p + 2, len) || len >= MAX_PATH) continue;
+
+        char name[MAX_PATH], filepath[MAX_PATH];
+        memcpy(name, p + 2, len);
+        name[len] = '\0';
+        snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, name);
+        if (is_ignored(client, name, 0)) continue;
+        int rc = queue_contents_locked(client, name, filepath);
+        if (rc < 0) {
+            client->active = 0;
+            return;
+        }
+        if (rc > 0) {
+            client->want_pos -= 2 + len;    // back to it after chunk_due_locked
+            return;
+        }
+    }
+}
+
+// Queue SYNC_SEQ for the client's journal position if it moved; caller
+// holds out_lock
+void queue_seq_locked(Client *client) {
+    if (!journal || (client->seq_announced && client->seq <= client->seq_queued)) return;
+    uint8_t payload[SYNC_SEQ_SIZE];
+    sync_put64(payload, journal_epoch(journal));
+    sync_put64(payload + 8, client->seq);
+    OutItem *item = make_frame_item(SYNC_SEQ, 0, "", payload, sizeof(payload), 0);
+    if (!item) {
+        client->active = 0;
+        return;
+    }
+    queue_push_locked(client, item);
+    client->seq_queued = client->seq;
+    client->seq_announced = 1;
+}
+
+// Everything up to seq is queued; tell the client once nothing older is
+// still owed to it. Caller holds out_lock.
+void note_seq_locked(Client *client, uint64_t seq) {
+    if (seq > client->seq) client->seq = seq;
+    if (!client->snapshot && !client->dirty_count) queue_seq_locked(client);
+}
+
+// Produce deferred output once the queue has room; caller holds out_lock
+void refill_locked(Client *client) {
+    if (client->dirty_count) flush_dirty_locked(client);
+    if (!client->dirty_count) refill_snapshot_locked(client);
+    if (!client->snapshot && !client->dirty_count) queue_seq_locked(client);
+}
+
+// Put the client on its shard's pending list and wake the reactor
+void wake_shard(Client *client) {
+    Shard *shard = &shards[client->shard];
+    pthread_mutex_lock(&shard->pending_lock);
+    if (!client->out_pending && !client->closing) {
+        client->out_pending = 1;
+        client->pending_next = shard->pending_head;
+        shard->pending_head = client;
+    }
+    pthread_mutex_unlock(&shard->pending_lock);
+    uint64_t one = 1;
+    if (write(shard->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write eventfd");
+    }
+}
+
+// Tell whoever drains this client's queue that there is work
+void notify_client(Client *client) {
+    if (server_mode == MODE_EPOLL) {
+        wake_shard(client);
+    } else {
+        pthread_cond_signal(&client->out_cond);
+    }
+}
+
+void count_dropped(Client *client, uint64_t events) {
+    metrics_add(&client->events_dropped, events);
+    metrics_add(&metrics.events_dropped, events);
+    if (slow_policy == POLICY_DROP && client->active) metrics_add(&metrics.clients_dropped, 1);
+}
+
+// Apply the slow-consumer policy before queueing an event about name.
+// Returns 1 if the event may be queued; caller holds out_lock.
+int admit_event_locked(Client *client, const char *name) {
+    if (!client->dirty_count && client->out_bytes < queue_limit) return 1;
+    count_dropped(client, 1);
+    if (slow_policy == POLICY_DROP) {
+        client->active = 0;
+    } else {
+        mark_dirty_locked(client, name);
+    }
+    return 0;
+}
+
+// Append one event to a batch payload; returns -1 if out of memory
+int batch_add(Batch *batch, int type, int flags, const char *name, const char *target) {
+    size_t name_len = strlen(name);
+    size_t target_len = target ? strlen(target) : 0;
+    size_t need = (batch->len ? batch->len : 4) + SYNC_BATCH_ENTRY_FIXED + name_len + target_len;
+    if (need > batch->cap) {
+        size_t cap = batch->cap ? batch->cap : 4096;
+        while (cap < need) cap *= 2;
+        uint8_t *buf = realloc(batch->buf, cap);
+        if (!buf) return -1;
+        batch->buf = buf;
+        batch->cap = cap;
+    }
+    if (!batch->len) batch->len = 4;
+
+    uint8_t *p = batch->buf + batch->len;
+    p[0] = type;
+    sync_put16(p + 1, flags);
+    sync_put16(p + 3, name_len);
+    memcpy(p + 5, name, name_len);
+    sync_put16(p + 5 + name_len, target_len);
+    if (target_len) memcpy(p + 7 + name_len, target, target_len);
+    batch->len = need;
+    batch->count++;
+    return 0;
+}
+
+// Remember a file whose contents go out after the batch
+int batch_add_file(Batch *batch, const char *name, int delta) {
+    if (batch->nfiles == batch->files_cap) {
+        int cap = batch->files_cap ? batch->files_cap * 2 : 16;
+        BatchFile *files = realloc(batch->files, cap * sizeof(BatchFile));
+        if (!files) return -1;
+        batch->files = files;
+        batch->files_cap = cap;
+    }
+    char *copy = strdup(name);
+    if (!copy) return -1;
+    batch->files[batch->nfiles].name = copy;
+    batch->files[batch->nfiles].delta = delta;
+    batch->nfiles++;
+    return 0;
+}
+
+// name points into the window's event list, which outlives the batch
+int batch_add_vector(Batch *batch, const char *name) {
+    if (batch->nvectors == batch->vectors_cap) {
+        int cap = batch->vectors_cap ? batch->vectors_cap * 2 : 16;
+        const char **vectors = realloc(batch->vectors, cap * sizeof(char *));
+        if (!vectors) return -1;
+        batch->vectors = vectors;
+        batch->vectors_cap = cap;
+    }
+    batch->vectors[batch->nvectors++] = name;
+    return 0;
+}
+
+static int path_is_under(const char *path, const char *dir, size_t dir_len) {
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '\0' || path[dir_len] == '/');
+}
+
+// Contents are read after the whole batch is applied, so pending files must
+// follow later renames and forget later deletes (of them or a parent)
+int batch_move_files(Batch *batch, const char *old_name, const char *new_name) {
+    size_t old_len = strlen(old_name);
+    for (int i = 0; i < batch->nfiles; i++) {
+        BatchFile *f = &batch->files[i];
+        if (!f->name || !path_is_under(f->name, old_name, old_len)) continue;
+        char *moved = NULL;
+        if (new_name) {
+            size_t len = strlen(new_name) + strlen(f->name + old_len) + 1;
+            moved = malloc(len);
+            if (!moved) return -1;
+            snprintf(moved, len, "%s%s", new_name, f->name + old_len);
+        }
+        free(f->name);
+        f->name = moved;
+    }
+    return 0;
+}
+
+void batch_reset(Batch *batch) {
+    for (int i = 0; i < batch->nfiles; i++) free(batch->files[i].name);
+    batch->nfiles = 0;
+    batch->nvectors = 0;
+    batch->len = 0;
+    batch->count = 0;
+}
+
+void batch_free(Batch *batch) {
+    batch_reset(batch);
+    free(batch->files);
+    free(batch->vectors);
+    free(batch->buf);
+}
+
+// Translate one coalesced event into batch entries for a client that can
+// see name (from_visible) and/or the rename target (to_visible)
+int batch_add_event(Batch *batch, Client *client, const CoalescedEvent *ev,
+                    int from_visible, int to_visible) {
+    int flags = ev->is_dir ? SYNC_FLAG_DIR : 0;
+    switch (ev->kind) {
+    case EV_CREATE:
+        if (batch_add(batch, SYNC_CREATE, flags, ev->name, NULL) < 0) return -1;
+        return ev->is_dir ? 0 : batch_add_file(batch, ev->name, 0);
+    case EV_MODIFY:
+        // Chunked clients get a fresh manifest, the others a delta
+        return batch_add_file(batch, ev->name, !client->chunked);
+    case EV_DELETE:
+    case EV_MOVED_FROM:
+        if (batch_move_files(batch, ev->name, NULL) < 0) return -1;
+        return batch_add(batch, ev->kind == EV_DELETE ? SYNC_DELETE : SYNC_MOVED_FROM,
+                         flags, ev->name, NULL);
+    case EV_MOVED_TO:
+        // Moved in from outside the tree: the contents are new
+        if (batch_add(batch, SYNC_MOVED_TO, flags, ev->name, NULL) < 0) return -1;
+        return ev->is_dir ? 0 : batch_add_file(batch, ev->name, 0);
+    case EV_RENAME:
+        // Clients that see only one side of a rename get the equivalent
+        // delete or create instead
+        if (from_visible && to_visible) {
+            if (batch_move_files(batch, ev->name, ev->target) < 0) return -1;
+            return batch_add(batch, SYNC_RENAME, flags, ev->name, ev->target);
+        }
+        if (from_visible) {
+            if (batch_move_files(batch, ev->name, NULL) < 0) return -1;
+            return batch_add(batch, SYNC_MOVED_FROM, flags, ev->name, NULL);
+        }
+        if (batch_add(batch, SYNC_MOVED_TO, flags, ev->target, NULL) < 0) return -1;
+        return ev->is_dir ? 0 : batch_add_file(batch, ev->target, 0);
+    }
+    return 0;
+}
+
+// Entry for a file named in the window, opened by the first client that
+// needs it (or by broadcast_prepare, before any client does)
+BroadcastFile *broadcast_file(Broadcast *bc, const char *name) {
+    unsigned long h = 5381;
+    for (const char *c = name; *c; c++) h = h * 33 + (unsigned char)*c;
+    BroadcastFile **link = &bc->buckets[h % BROADCAST_BUCKETS];
+    while (*link && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+    if (*link) return *link;
+
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, name);
+    Payload *p = payload_open(name, filepath);
+    BroadcastFile *f = calloc(1, sizeof(BroadcastFile) + strlen(name) + 1);
+    if (!f) {
+        if (p) payload_release(p);
+        return NULL;
+    }
+    f->payload = p;
+    strcpy(f->name, name);
+    *link = f;
+    return f;
+}
+
+// SYNC_CHUNKS frame for the file. broadcast_prepare chunks it (build
+// set); the fan-out only consults the cache, and a chunked client that
+// finds nothing there gets the file whole.
+OutItem *broadcast_chunks(BroadcastFile *f, int build) {
+    if (!f->chunked && f->payload) {
+        f->chunks = manifest_item(f->name, f->payload->fd, &f->payload->st, build);
+        f->chunked = build || f->chunks;
+    }
+    return f->chunks;
+}
+
+// Form of the file for clients that take compression. Unless
+// broadcast_prepare compressed it already, only the cache is consulted:
+// the fan-out never compresses.
+Payload *broadcast_packed(BroadcastFile *f) {
+    if (!f->packed && f->payload && packable(f->payload)) {
+        f->packed = get_packed(f->name, f->payload, 0);
+    }
+    return f->packed;
+}
+
+// Open (and chunk or compress, if any client takes manifests or zlib)
+// every file whose contents the window may send, so that the fan-out
+// under client_mutex only looks them up
+void broadcast_prepare(Broadcast *bc, const CoalescedEvent *list, int chunked, int compress) {
+    for (const CoalescedEvent *ev = list; ev; ev = ev->next) {
+        if (ev->is_dir || ev->kind == EV_DELETE || ev->kind == EV_MOVED_FROM) continue;
+        if (ev->kind == EV_MODIFY && !chunked) continue;   // the others get a delta
+        BroadcastFile *f = broadcast_file(bc, ev->kind == EV_RENAME ? ev->target : ev->name);
+        if (!f || !f->payload) continue;
+        if (chunked) broadcast_chunks(f, 1);
+        if (compress && !f->packed && packable(f->payload)) {
+            f->packed = get_packed(f->name, f->payload, 1);
+        }
+    }
+}
+
+void broadcast_free(Broadcast *bc) {
+    for (int i = 0; i < BROADCAST_BUCKETS; i++) {
+        while (bc->buckets[i]) {
+            BroadcastFile *f = bc->buckets[i];
+            bc->buckets[i] = f->next;
+            if (f->payload) payload_release(f->payload);
+            if (f->packed) payload_release(f->packed);
+            if (f->chunks) free_out_item(f->chunks);
+            free(f);
+        }
+        while (bc->frames[i]) {
+            SharedFrame *f = bc->frames[i];
+            bc->frames[i] = f->next;
+            free_out_item(f->item);
+            free(f);
+        }
+    }
+    batch_free(&bc->batch);
+}
+
+// SYNC_BATCH item for a finished batch, sharing the bytes of an identical
+// frame already encoded in this window when there is one
+OutItem *batch_frame_item(Broadcast *bc, const Batch *batch) {
+    uint32_t crc = sync_crc32(0, batch->buf, batch->len);
+    SharedFrame **link = &bc->frames[crc % BROADCAST_BUCKETS];
+    for (SharedFrame *f = *link; f; f = f->next) {
+        if (f->crc == crc && f->item->len == SYNC_HEADER_SIZE + batch->len &&
+            memcmp(f->item->data + SYNC_HEADER_SIZE, batch->buf, batch->len) == 0) {
+            return share_frame_item(f->item);
+        }
+    }
+
+    OutItem *item = make_frame_item(SYNC_BATCH, 0, "", batch->buf, batch->len, 0);
+    SharedFrame *f = item ? malloc(sizeof(SharedFrame)) : NULL;
+    if (f && (f->item = share_frame_item(item)) != NULL) {
+        f->crc = crc;
+        f->next = *link;
+        *link = f;
+    } else {
+        free(f);
+    }
+    return item;
+}
+
+// Queue the SYNC_BATCH frame, the contents that follow it and then the
+// vectors of the files it changed, so a client never holds a vector ahead
+// of the copy it describes; caller holds out_lock. The last item queued
+// carries stamp_ns for the latency histogram.
+int queue_batch_locked(Client *client, Batch *batch, uint64_t stamp_ns, Broadcast *bc) {
+    int rc = 0;
+    OutItem *before = client->out_tail;
+    if (batch->count) {
+        sync_put32(batch->buf, batch->count);
+        OutItem *item = batch_frame_item(bc, batch);
+        if (!item) rc = -1;
+        else queue_push_locked(client, item);
+    }
+    for (int i = 0; i < batch->nfiles && rc == 0; i++) {
+        BatchFile *f = &batch->files[i];
+        if (!f->name) continue;
+        if (f->delta) {
+            OutItem *item = make_frame_item(SYNC_SIG_REQUEST, 0, f->name, "", 0, 0);
+            if (!item) rc = -1;
+            else queue_push_locked(client, item);
+            continue;
+        }
+        BroadcastFile *file = broadcast_file(bc, f->name);
+        if (!file || !file->payload) continue;     // gone already
+        OutItem *chunks = client->chunked ? broadcast_chunks(file, 0) : NULL;
+        if (chunks) {
+            OutItem *item = share_frame_item(chunks);
+            if (!item) rc = -1;
+            else queue_push_locked(client, item);
+        } else {
+            Payload *packed = client->compress ? broadcast_packed(file) : NULL;
+            rc = queue_payload_locked(client, f->name, file->payload, packed);
+        }
+    }
+    for (int i = 0; i < batch->nvectors && rc == 0; i++) {
+        queue_version_locked(client, batch->vectors[i]);
+    }
+    if (client->out_tail && client->out_tail != before) {
+        client->out_tail->stamp_ns = stamp_ns;
+        metrics_add(&metrics.batches, 1);
+    }
+    batch_reset(batch);
+    return rc;
+}
+
+// Did the client's own push make the current state of name? The event
+// about it is then an echo of that push and is not sent back.
+int is_echo(Client *client, const char *name) {
+    if (!versions || !client->replica) return 0;
+    VersionState *s = version_lock(versions, name, 0);
+    if (!s) return 0;
+    int echo = s->origin == client->replica;
+    version_unlock(versions, s);
+    return echo;
+}
+
+// Queue one flushed window for a client as SYNC_BATCH frames of at most
+// MAX_BATCH_BYTES, applying the slow-consumer policy between them. seq is
+// the journal position the window ends at (0 without a journal).
+void send_batch_to_client(Client *client, const CoalescedEvent *list, uint64_t stamp_ns,
+                          Broadcast *bc, uint64_t seq) {
+    Batch *batch = &bc->batch;
+    pthread_mutex_lock(&client->out_lock);
+    int admitted = !client->dirty_count && client->out_bytes < queue_limit;
+    for (const CoalescedEvent *ev = list; ev && client->active; ev = ev->next) {
+        int from_visible = !is_ignored(client, ev->name, ev->is_dir);
+        int to_visible = ev->kind == EV_RENAME && !is_ignored(client, ev->target, ev->is_dir);
+        if (!from_visible && !to_visible) continue;
+        if (is_echo(client, ev->kind == EV_RENAME ? ev->target : ev->name)) continue;
+
+        if (!admitted) {
+            count_dropped(client, 1);
+            if (slow_policy == POLICY_DROP) {
+                client->active = 0;
+                break;
+            }
+            if (from_visible) mark_dirty_locked(client, ev->name);
+            if (to_visible) mark_dirty_locked(client, ev->target);
+            continue;
+        }
+        if (batch_add_event(batch, client, ev, from_visible, to_visible) < 0) {
+            client->active = 0;
+            break;
+        }
+        // A modified file's contents come as the answer to a signature
+        // request, and its vector with them (send_delta)
+        int delta = ev->kind == EV_MODIFY && !client->chunked;
+        if (!ev->is_dir && !delta && client->bidir &&
+            batch_add_vector(batch, to_visible ? ev->target : ev->name) < 0) {
+            client->active = 0;
+            break;
+        }
+        metrics_add(&client->events_sent, 1);
+        metrics_add(&metrics.events_sent, 1);
+        if (batch->len >= MAX_BATCH_BYTES) {
+            if (queue_batch_locked(client, batch, stamp_ns, bc) < 0) client->active = 0;
+            admitted = !client->dirty_count && client->out_bytes < queue_limit;
+        }
+    }
+    if (client->active && queue_batch_locked(client, batch, stamp_ns, bc) < 0) client->active = 0;
+    if (client->active && seq) note_seq_locked(client, seq);
+    pthread_mutex_unlock(&client->out_lock);
+    batch_reset(batch);
+    notify_client(client);
+}
+
+static void tombstone_entry(void *arg, const char *path, VersionState *s) {
+    (void)path;
+    uint64_t origin = *(const uint64_t *)arg;
+    if (s->exists) {
+        s->exists = 0;
+        s->origin = origin;
+    }
+}
+
+// Bring name's entry in line with the disk. A change no push accounts for
+// (the stat differs from the copy the vector describes) was made on the
+// server, and counts as a new version by it.
+void observe_path(const char *name, int is_dir) {
+    char filepath[MAX_PATH];
+    struct stat st;
+    snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, name);
+    int exists = lstat(filepath, &st) == 0 && (is_dir ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode));
+
+    VersionState *s = version_lock(versions, name, exists);
+    if (!s) return;
+    int removed = 0;
+    if (is_dir) {
+        // Directories have no vector, only existence
+        if (s->exists != exists) {
+            removed = s->exists;
+            s->exists = exists;
+            s->is_dir = 1;
+            s->origin = 0;
+        }
+    } else if (exists ? !s->exists || !version_same(s, &st) : s->exists) {
+        vv_bump(&s->vv, server_replica);
+        s->exists = exists;
+        s->is_dir = 0;
+        if (exists) version_stamp(s, &st);
+        s->origin = 0;
+    }
+    version_unlock(versions, s);
+
+    // What was below a directory that went away went with it
+    uint64_t origin = 0;
+    if (removed) version_each(versions, name, tombstone_entry, &origin);
+}
+
+// Update the version table for one event of a flushed window
+void observe_event(const CoalescedEvent *ev) {
+    if (ev->kind == EV_RENAME) {
+        // A no-op if a push made the rename and moved the entries already
+        version_move(versions, ev->name, ev->target);
+        observe_path(ev->target, ev->is_dir);
+    } else {
+        observe_path(ev->name, ev->is_dir);
+    }
+}
+
+typedef struct {
+    Client *client;
+    size_t mem;
+    int stalled;
+} QueueWeight;
+
+static int evict_first(const void *a, const void *b) {
+    const QueueWeight *x = a, *y = b;
+    if (x->stalled != y->stalled) return y->stalled - x->stalled;
+    return x->mem < y->mem ? 1 : x->mem > y->mem ? -1 : 0;
+}
+
+// Memory cap (-Q): once the queues together hold more than memory_cap,
+// disconnect clients until what their queues hold covers the excess:
+// first the stalled ones (nothing sent for STALL_MS), heaviest first, so
+// a client merely busy with a burst is not punished for a stuck one. Like
+// dropped clients, they resync when they reconnect. Clients already
+// evicted count as freed, since their queues go as soon as their
+// connection is torn down. Caller holds client_mutex.
+void enforce_memory_cap(void) {
+    size_t used = slab_in_use();
+    size_t freeing = __atomic_load_n(&evicting_mem, __ATOMIC_RELAXED);
+    if (memory_cap == 0 || used <= memory_cap + freeing || client_table.count == 0) return;
+    QueueWeight *weights = malloc(client_table.count * sizeof(QueueWeight));
+    if (!weights) return;
+    uint64_t now = metrics_now_ns();
+    int n = 0;
+    for (int i = 0; i < client_table.count; i++) {
+        Client *client = client_table.slots[i];
+        pthread_mutex_lock(&client->out_lock);
+        if (client->active && client->out_mem > 0) {
+            uint64_t last = __atomic_load_n(&client->progress_ns, __ATOMIC_RELAXED);
+            weights[n].client = client;
+            weights[n].mem = client->out_mem;
+            weights[n].stalled = now - last > (uint64_t)STALL_MS * 1000000;
+            n++;
+        }
+        pthread_mutex_unlock(&client->out_lock);
+    }
+    qsort(weights, n, sizeof(QueueWeight), evict_first);
+
+    size_t excess = used - memory_cap - freeing;
+    for (int i = 0; i < n && excess > 0; i++) {
+        Client *client = weights[i].client;
+        pthread_mutex_lock(&client->out_lock);
+        client->active = 0;
+        client->evicted_mem = weights[i].mem;
+        pthread_mutex_unlock(&client->out_lock);
+        __atomic_fetch_add(&evicting_mem, weights[i].mem, __ATOMIC_RELAXED);
+        metrics_add(&metrics.clients_evicted, 1);
+        printf("Client %s:%d evicted with %zu bytes queued%s (memory cap %zu)\n",
+               inet_ntoa(client->address.sin_addr), ntohs(client->address.sin_port),
+               weights[i].mem, weights[i].stalled ? ", stalled" : "", memory_cap);
+        // A writer thread blocked on a full socket only notices once the
+        // send fails; a shard closes the client as soon as it is woken
+        if (server_mode != MODE_EPOLL) shutdown(client->socket, SHUT_RDWR);
+        notify_client(client);
+        excess -= weights[i].mem < excess ? weights[i].mem : excess;
+    }
+    free(weights);
+}
+
+// Append len bytes to a growing buffer
+static int append_bytes(uint8_t **buf, size_t *len, size_t *cap, const void *data, size_t n) {
+    if (*len + n > *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 4096;
+        while (new_cap < *len + n) new_cap *= 2;
+        uint8_t *grown = realloc(*buf, new_cap);
+        if (!grown) return -1;
+        *buf = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+// Answer SYNC_VERIFY: compare each directory digest the client sent with
+// ours for its view and list the entries of those that differ, so the
+// client can fix what it has there and descend only into subdirectories
+// whose digests differ in turn. The listing is queued behind everything
+// already sent, so the client applies it after those events; changes
+// still in the coalescing window only show up as differences that the
+// events fix anyway. Returns -1 if the request is malformed.
+int answer_verify(Client *client, const uint8_t *payload, size_t len) {
+    uint8_t *raw = NULL, word[4];
+    size_t raw_len = 0, raw_cap = 0, pos = 0;
+    uint32_t listed = 0;
+    int rc = 0;
+
+    sync_put32(word, owned_len);
+    if (append_bytes(&raw, &raw_len, &raw_cap, word, 4) < 0 ||
+        append_bytes(&raw, &raw_len, &raw_cap, owned_list, owned_len) < 0 ||
+        append_bytes(&raw, &raw_len, &raw_cap, word, 4) < 0) {
+        free(raw);
+        return -1;
+    }
+    size_t count_at = raw_len - 4;
+    while (rc == 0 && pos < len) {
+        if (len - pos < TREE_VERIFY_FIXED) {
+            rc = -1;
+            break;
+        }
+        size_t path_len = sync_get16(payload + pos);
+        const char *path = (const char *)payload + pos + 2;
+        const uint8_t *theirs = payload + pos + 2 + path_len;
+        pos += TREE_VERIFY_FIXED + path_len;
+        if (pos > len || path_len >= MAX_PATH ||
+            (path_len && !sync_path_is_safe(path, path_len))) {
+            rc = -1;
+            break;
+        }
+        char name[MAX_PATH];
+        memcpy(name, path, path_len);
+        name[path_len] = '\0';
+
+        uint8_t ours[CHUNK_HASH_SIZE];
+        if (tree_digest(tree, &client->view, name, ours) == 0 &&
+            memcmp(ours, theirs, CHUNK_HASH_SIZE) == 0) {
+            continue;
+        }
+        uint8_t *listing;
+        size_t listing_len;
+        uint8_t head[2];
+        sync_put16(head, path_len);
+        if (tree_list(tree, &client->view, name, &listing, &listing_len) < 0) {
+            rc = -1;
+            break;
+        }
+        if (append_bytes(&raw, &raw_len, &raw_cap, head, 2) < 0 ||
+            append_bytes(&raw, &raw_len, &raw_cap, name, path_len) < 0 ||
+            append_bytes(&raw, &raw_len, &raw_cap, listing, listing_len) < 0) {
+            rc = -1;
+        }
+        free(listing);
+        listed++;
+    }
+
+    uint8_t *packed = NULL;
+    size_t packed_len;
+    OutItem *item = NULL;
+    if (rc == 0) {
+        sync_put32(raw + count_at, listed);
+        if (tree_compress(raw, raw_len, &packed, &packed_len) < 0) rc = -1;
+    }
+    if (rc == 0) item = make_frame_item(SYNC_LISTING, 0, "", packed, packed_len, 0);
+    free(raw);
+    free(packed);
+    if (!item) return -1;
+
+    pthread_mutex_lock(&client->out_lock);
+    queue_push_locked(client, item);
+    pthread_mutex_unlock(&client->out_lock);
+    notify_client(client);
+    metrics_add(&metrics.verifies, 1);
+    metrics_add(&metrics.verify_dirs, listed);
+    return 0;
+}
+
+// Fan a flushed window out to every client that finished its handshake;
+// stamp_ns is when its oldest event was read. The window is journaled
+// under client_mutex, so a client joining the stream sees each event
+// either in its replay or live, never both or neither.
+void flush_events(Coalescer *pending, uint64_t stamp_ns) {
+    CoalescedEvent *list = coalescer_take(pending);
+    Broadcast bc = {0};
+    uint64_t seq = 0;
+    for (const CoalescedEvent *ev = list; ev && versions; ev = ev->next) observe_event(ev);
+
+    // Chunking and compressing read whole files: do it before the clients
+    // are locked
+    int chunked = 0, compress = 0;
+    if (chunk_store || compress_level) {
+        pthread_mutex_lock(&client_mutex);
+        for (int i = 0; i < client_table.count; i++) {
+            chunked |= client_table.slots[i]->chunked;
+            compress |= client_table.slots[i]->compress;
+        }
+        pthread_mutex_unlock(&client_mutex);
+    }
+    broadcast_prepare(&bc, list, chunked, compress);
+
+    pthread_mutex_lock(&client_mutex);
+    for (const CoalescedEvent *ev = list; ev && journal; ev = ev->next) {
+        seq = journal_append(journal, ev->kind, ev->is_dir, ev->name, ev->target);
+    }
+    for (int i = 0; i < client_table.count; i++) {
+        Client *client = client_table.slots[i];
+        if (client->active && client->handshake_done) {
+            send_batch_to_client(client, list, stamp_ns, &bc, seq);
+        }
+    }
+    enforce_memory_cap();
+
+    // The tree and what clients were sent agree again: release the
+    // verifications that waited for that. Listing walks the tree, so it is
+    // left to the thread draining each queue rather than done here.
+    __atomic_store_n(&window_open, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < client_table.count; i++) {
+        Client *client = client_table.slots[i];
+        pthread_mutex_lock(&client->out_lock);
+        int due = client->verify_req && !client->verify_due;
+        if (due) client->verify_due = 1;
+        pthread_mutex_unlock(&client->out_lock);
+        if (due) notify_client(client);
+    }
+    pthread_mutex_unlock(&client_mutex);
+    broadcast_free(&bc);
+    coalescer_free_list(list);
+}
+
+// Journal events being folded back into coalesced form for a replay
+typedef struct {
+    Coalescer *coalescer;
+    uint32_t cookie;            // synthetic move cookies, unique per replay
+    uint64_t last;
+} Replay;
+
+void replay_event(void *arg, uint64_t seq, int kind, int is_dir, const char *name,
+                  const char *target) {
+    Replay *r = (Replay *)arg;
+    r->last = seq;
+    if (kind == EV_RENAME) {
+        r->cookie++;
+        coalescer_add(r->coalescer, EV_MOVED_FROM, is_dir, r->cookie, name);
+        coalescer_add(r->coalescer, EV_MOVED_TO, is_dir, r->cookie, target);
+    } else {
+        // Unpaired halves of moves each get a cookie nothing else has
+        coalescer_add(r->coalescer, kind, is_dir, ++r->cookie, name);
+    }
+}
+
+// Queue the journaled events after seq for a client that is joining the
+// stream, then let flush_events include it. Returns -1, leaving the client
+// out of the stream, if the journal no longer reaches back to seq and
+// force is not set.
+int join_stream(Client *client, uint64_t seq, int force) {
+    Replay replay = { .last = seq };
+    pthread_mutex_lock(&client_mutex);
+    if (journal) {
+        replay.coalescer = coalescer_new();
+        int rc = replay.coalescer ? journal_replay(journal, seq, replay_event, &replay) : -1;
+        CoalescedEvent *list = replay.coalescer ? coalescer_take(replay.coalescer) : NULL;
+        free(replay.coalescer);
+        if (rc < 0 && !force) {
+            coalescer_free_list(list);
+            pthread_mutex_unlock(&client_mutex);
+            return -1;
+        }
+        if (list) {
+            Broadcast bc = {0};
+            send_batch_to_client(client, list, metrics_now_ns(), &bc, 0);
+            broadcast_free(&bc);
+            coalescer_free_list(list);
+        }
+    }
+
+    pthread_mutex_lock(&client->out_lock);
+    if (journal) note_seq_locked(client, replay.last > seq ? replay.last : seq);
+    client->handshake_done = 1;
+    pthread_cond_signal(&client->out_cond);
+    pthread_mutex_unlock(&client->out_lock);
+    pthread_mutex_unlock(&client_mutex);
+    return 0;
+}
+
+// Watch the directory at rel and everything below it. With report set,
+// whatever is already there is recorded as created: files can appear in a
+// new directory before its watch is in place.
+void add_watches(const char *rel, Coalescer *report) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s%s%s", sync_dir, rel[0] ? "/" : "", rel);
+    int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+    if (wd < 0 || watch_table_set(watches, wd, rel) < 0) return;
+
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char subpath[MAX_PATH];
+        struct stat st;
+        if (snprintf(subpath, sizeof(subpath), "%s%s%s", rel, rel[0] ? "/" : "",
+                     entry->d_name) >= (int)sizeof(subpath) ||
+            fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) ||
+            !prefix_match(owned, subpath, S_ISDIR(st.st_mode))) {
+            continue;
+        }
+        if (report) coalescer_add(report, EV_CREATE, S_ISDIR(st.st_mode), 0, subpath);
+        if (S_ISDIR(st.st_mode)) add_watches(subpath, report);
+    }
+    closedir(dir);
+}
+
+void remove_watch(void *arg, int wd) {
+    (void)arg;
+    inotify_rm_watch(inotify_fd, wd);
+}
+
+// Forget directory moves whose MOVED_TO never came: they left the tree
+void drop_dir_moves(void) {
+    while (dir_moves) {
+        DirMove *move = dir_moves;
+        dir_moves = move->next;
+        watch_table_remove_under(watches, move->path, remove_watch, NULL);
+        free(move);
+    }
+}
+
+// Keep the watch table in step with a directory event
+void track_directory(int mask, uint32_t cookie, const char *name, Coalescer *pending) {
+    if (mask & IN_CREATE) {
+        add_watches(name, pending);
+    } else if (mask & IN_MOVED_FROM) {
+        DirMove *move = malloc(sizeof(DirMove) + strlen(name) + 1);
+        if (!move) return;
+        move->cookie = cookie;
+        strcpy(move->path, name);
+        move->next = dir_moves;
+        dir_moves = move;
+    } else if (mask & IN_MOVED_TO) {
+        for (DirMove **link = &dir_moves; *link; link = &(*link)->next) {
+            DirMove *move = *link;
+            if (move->cookie != cookie) continue;
+            // Renamed within the tree: its watches are still valid
+            watch_table_move(watches, move->path, name);
+            *link = move->next;
+            free(move);
+            return;
+        }
+        add_watches(name, pending);     // moved in from outside
+    }
+}
+
+// tree_rescan callback: turn each difference into a coalesced event
+void rescan_change(void *arg, int kind, int is_dir, const char *path) {
+    Coalescer *pending = arg;
+    if (kind == TREE_CREATED) {
+        if (is_dir) {
+            char fullpath[MAX_PATH];
+            snprintf(fullpath, sizeof(fullpath), "%s/%s", sync_dir, path);
+            int wd = inotify_add_watch(inotify_fd, fullpath, WATCH_MASK);
+            if (wd >= 0) watch_table_set(watches, wd, path);
+        }
+        coalescer_add(pending, EV_CREATE, is_dir, 0, path);
+    } else if (kind == TREE_CHANGED) {
+        coalescer_add(pending, EV_MODIFY, 0, 0, path);
+    } else {
+        if (is_dir) watch_table_remove_under(watches, path, remove_watch, NULL);
+        coalescer_add(pending, EV_DELETE, is_dir, 0, path);
+    }
+}
+
+long monotonic_ms(void) {
+    return metrics_now_ns() / 1000000;
+}
+
+// Watch the whole tree; called before it is indexed, so that whatever
+// changes while tree_build walks it is still reported. Returns -1 on error.
+int start_watches(void) {
+    inotify_fd = inotify_init();
+    if (inotify_fd < 0) {
+        perror("inotify_init");
+        return -1;
+    }
+    watches = watch_table_new();
+    if (!watches) {
+        perror("watch table");
+        return -1;
+    }
+    add_watches("", NULL);
+    return 0;
+}
+
+// Directory monitoring thread: collects inotify events into the coalescer
+// and fans each window out as one batch per client; it never blocks on a
+// client socket
+void *watch_directory(void *arg) {
+    (void)arg;
+    Coalescer *pending = coalescer_new();
+    if (!pending) {
+        perror("watcher");
+        return NULL;
+    }
+
+    char buffer[BUF_LEN];
+    long first_ms = 0, last_ms = 0;
+    uint64_t first_ns = 0;
+    while (1) {
+        int timeout = -1;
+        if (coalescer_count(pending)) {
+            long now = monotonic_ms();
+            long quiet = last_ms + window_ms - now;
+            long held = first_ms + (long)MAX_HOLD * window_ms - now;
+            timeout = quiet < held ? quiet : held;
+            if (timeout < 0) timeout = 0;
+        }
+
+        struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        uint64_t start_ns = metrics_now_ns();
+
+        if (ready > 0) {
+            int length = read(inotify_fd, buffer, BUF_LEN);
+            if (length < 0) {
+                perror("read");
+                break;
+            }
+            long now = monotonic_ms();
+            if (!coalescer_count(pending)) {
+                first_ms = now;
+                first_ns = start_ns;
+            }
+            int overflow = 0;
+            for (int i = 0; i < length; ) {
+                struct inotify_event *event = (struct inotify_event *)&buffer[i];
+                i += EVENT_SIZE + event->len;
+                metrics_add(&metrics.inotify_events, 1);
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflow = 1;
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    watch_table_remove(watches, event->wd);
+                    continue;
+                }
+                const char *parent = watch_table_get(watches, event->wd);
+                if (!event->len || !parent || sync_is_temp(event->name)) continue;
+
+                char name[MAX_PATH];
+                if (snprintf(name, sizeof(name), "%s%s%s", parent, parent[0] ? "/" : "",
+                             event->name) >= (int)sizeof(name)) {
+                    continue;
+                }
+
+                int is_dir = (event->mask & IN_ISDIR) != 0;
+                int kind;
+                if (event->mask & IN_CREATE) kind = EV_CREATE;
+                else if (event->mask & IN_DELETE) kind = EV_DELETE;
+                else if (event->mask & IN_MOVED_FROM) kind = EV_MOVED_FROM;
+                else if (event->mask & IN_MOVED_TO) kind = EV_MOVED_TO;
+                else if ((event->mask & IN_CLOSE_WRITE) && !is_dir) kind = EV_MODIFY;
+                else continue;
+                if (!prefix_match(owned, name, is_dir)) continue;
+
+                // The manifest tracks the tree as it is now; only the
+                // fan-out waits for the window
+                __atomic_store_n(&window_open, 1, __ATOMIC_RELEASE);
+                tree_update(tree, name);
+                coalescer_add(pending, kind, is_dir, event->cookie, name);
+                if (is_dir) track_directory(event->mask, event->cookie, name, pending);
+            }
+            if (overflow) {
+                // Events were lost: diff the disk against the index and
+                // send only what changed
+                printf("inotify queue overflowed, rescanning %s\n", sync_dir);
+                metrics_add(&metrics.inotify_overflows, 1);
+                __atomic_store_n(&window_open, 1, __ATOMIC_RELEASE);
+                tree_rescan(tree, rescan_change, pending);
+            }
+            last_ms = now;
+        }
+
+        int count = coalescer_count(pending);
+        long now = monotonic_ms();
+        if (count && (now - last_ms >= window_ms || now - first_ms >= (long)MAX_HOLD * window_ms ||
+                      count >= MAX_PENDING)) {
+            drop_dir_moves();
+            flush_events(pending, first_ns);
+        } else if (ready <= 0) {
+            continue;   // poll timed out early; nothing was done
+        }
+        hist_record(&metrics.watcher_loop, metrics_now_ns() - start_ns);
+    }
+    close(inotify_fd);
+    return NULL;
+}
+
+// Make one send attempt for an item and record the progress.
+// Returns the number of bytes written, or -1 with errno set.
+ssize_t send_item_bytes(Client *client, OutItem *item) {
+    static const char zeros[4096];
+    ssize_t n;
+
+    if (item->fd < 0) {
+        n = send(client->socket, item->data + item->sent, item->len - item->sent,
+                 MSG_NOSIGNAL);
+        if (n > 0) item->sent += n;
+        return n;
+    }
+    if (!item->zero_fill) {
+        n = sendfile(client->socket, item->fd, &item->offset, item->end - item->offset);
+        if (n != 0) return n;
+        // The file shrank after its length was announced
+        item->zero_fill = 1;
+    }
+    size_t left = item->end - item->offset;
+    n = send(client->socket, zeros, left < sizeof(zeros) ? left : sizeof(zeros), MSG_NOSIGNAL);
+    if (n > 0) item->offset += n;
+    return n;
+}
+
+// Count n bytes of item as sent for the metrics endpoint
+void account_sent(Client *client, OutItem *item, size_t n) {
+    __atomic_store_n(&client->progress_ns, metrics_now_ns(), __ATOMIC_RELAXED);
+    metrics_add(&client->bytes_sent, n);
+    metrics_add(&metrics.bytes_sent, n);
+    if (item->stamp_ns && out_item_size(item) == 0) {
+        hist_record(&metrics.event_to_wire, metrics_now_ns() - item->stamp_ns);
+    }
+}
+
+// send_item_bytes plus accounting for the metrics endpoint
+ssize_t send_item_chunk(Client *client, OutItem *item) {
+    ssize_t n = send_item_bytes(client, item);
+    if (n > 0) account_sent(client, item, n);
+    return n;
+}
+
+// Write one queued item with blocking calls; returns -1 on socket error
+int write_item_blocking(Client *client, OutItem *item) {
+    while (out_item_size(item) > 0) {
+        if (send_item_chunk(client, item) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Answer the SYNC_VERIFY flush_events released, from the thread that
+// drains the client's queue. Called and returns with out_lock held.
+void answer_due_verify_locked(Client *client) {
+    uint8_t *req = client->verify_req;
+    size_t len = client->verify_len;
+    client->verify_req = NULL;
+    client->verify_due = 0;
+    pthread_mutex_unlock(&client->out_lock);
+    answer_verify(client, req, len);
+    free(req);
+    pthread_mutex_lock(&client->out_lock);
+}
+
+// Writer thread (thread mode): drains the client's queue so a slow socket
+// only ever stalls this thread
+void *client_writer(void *arg) {
+    Client *client = (Client *)arg;
+
+    pthread_mutex_lock(&client->out_lock);
+    while (client->active) {
+        if (client->verify_due) answer_due_verify_locked(client);
+        if (client->chunk_due) chunk_due_locked(client);
+        if (!client->out_head && client->handshake_done) refill_locked(client);
+        OutItem *item = queue_pop_locked(client);
+        if (!item) {
+            if (client->chunk_due) continue;
+            pthread_cond_wait(&client->out_cond, &client->out_lock);
+            continue;
+        }
+        size_t size = out_item_size(item);
+        pthread_mutex_unlock(&client->out_lock);
+
+        int rc = write_item_blocking(client, item);
+        free_out_item(item);
+
+        pthread_mutex_lock(&client->out_lock);
+        client->out_bytes -= size;
+        if (rc < 0) client->active = 0;
+    }
+    pthread_mutex_unlock(&client->out_lock);
+
+    // Wake the reader so the connection is torn down
+    shutdown(client->socket, SHUT_RDWR);
+    return NULL;
+}
+
+// A writer's io_uring (-m uring). The client's socket is registered as
+// fixed file 0 and file bodies are read into registered slots, so a run of
+// queued items goes out as one chain of linked SENDs with one syscall.
+typedef struct {
+    Uring ring;
+    int fixed_file;             // socket registered as fixed file 0
+    int fixed_bufs;             // slots registered, so reads use READ_FIXED
+    uint8_t *slots;             // URING_SLOTS x URING_SLOT
+} WriterRing;
+
+int writer_ring_init(WriterRing *wr, int socket) {
+    if (uring_init(&wr->ring, URING_DEPTH * 2) < 0) return -1;
+    wr->slots = malloc((size_t)URING_SLOTS * URING_SLOT);
+    if (!wr->slots) {
+        uring_exit(&wr->ring);
+        return -1;
+    }
+    struct iovec iov = { wr->slots, (size_t)URING_SLOTS * URING_SLOT };
+    wr->fixed_bufs = uring_register_buffers(&wr->ring, &iov, 1) == 0;
+    wr->fixed_file = uring_register_files(&wr->ring, &socket, 1) == 0;
+    return 0;
+}
+
+void writer_ring_free(WriterRing *wr) {
+    uring_exit(&wr->ring);
+    free(wr->slots);
+}
+
+// Items that can go through the ring: frames and in-memory payloads, and
+// file bodies small enough for a slot. Larger files use sendfile.
+int ring_sendable(OutItem *item) {
+    return item->fd < 0 || (!item->zero_fill && item->end - item->offset <= URING_SLOT);
+}
+
+// Send items through the ring as one linked chain, in order. A SEND stops
+// the chain if it comes up short or fails (and a READ does if the file
+// shrank), so whatever is left over is finished with blocking calls.
+// Returns -1 on socket error.
+int ring_send_items(Client *client, WriterRing *wr, OutItem **items, int count) {
+    struct io_uring_sqe *sqe = NULL;
+    int sock = wr->fixed_file ? 0 : client->socket;
+    int sock_flags = wr->fixed_file ? IOSQE_FIXED_FILE : 0;
+    int slot = 0;
+    unsigned queued = 0;
+
+    for (int i = 0; i < count; i++) {
+        OutItem *item = items[i];
+        const void *buf = item->data + item->sent;
+        size_t len = item->len - item->sent;
+        if (item->fd >= 0) {
+            // Zeroed first: if the file shrank the rest goes out as padding
+            len = item->end - item->offset;
+            uint8_t *dst = wr->slots + (size_t)slot * URING_SLOT;
+            memset(dst, 0, len);
+            sqe = uring_get_sqe(&wr->ring);
+            uring_prep(sqe, wr->fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ, item->fd,
+                       dst, len, item->offset);
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = (uint64_t)i << 1 | 1;
+            queued++;
+            buf = dst;
+            slot++;
+        }
+        sqe = uring_get_sqe(&wr->ring);
+        uring_prep(sqe, IORING_OP_SEND, sock, buf, len, 0);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = sock_flags | IOSQE_IO_LINK;
+        sqe->user_data = (uint64_t)i << 1;
+        queued++;
+    }
+    if (sqe) sqe->flags &= ~IOSQE_IO_LINK;
+
+    int failed = 0;
+    if (uring_submit(&wr->ring, queued) < 0) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    for (unsigned seen = 0; seen < queued;) {
+        struct io_uring_cqe *cqe = uring_peek_cqe(&wr->ring);
+        if (!cqe) {
+            if (uring_submit(&wr->ring, 1) < 0 && errno != EINTR) return -1;
+            continue;
+        }
+        OutItem *item = items[cqe->user_data >> 1];
+        int res = cqe->res;
+        int is_send = !(cqe->user_data & 1);
+        uring_cqe_seen(&wr->ring);
+        seen++;
+
+        if (!is_send || res == -ECANCELED) continue;
+        if (res < 0) {
+            errno = -res;
+            failed = 1;
+            continue;
+        }
+        if (item->fd >= 0) item->offset += res;
+        else item->sent += res;
+        if (res > 0) account_sent(client, item, res);
+    }
+    if (failed) return -1;
+
+    for (int i = 0; i < count; i++) {
+        if (write_item_blocking(client, items[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+// Writer thread for -m uring: like client_writer, but takes up to
+// URING_DEPTH queued items at a time and sends them through the ring
+void *uring_writer(void *arg) {
+    Client *client = (Client *)arg;
+    WriterRing wr;
+    if (writer_ring_init(&wr, client->socket) < 0) {
+        perror("io_uring_setup");
+        return client_writer(arg);
+    }
+
+    OutItem *items[URING_DEPTH];
+    pthread_mutex_lock(&client->out_lock);
+    while (client->active) {
+        if (client->verify_due) answer_due_verify_locked(client);
+        if (client->chunk_due) chunk_due_locked(client);
+        if (!client->out_head && client->handshake_done) refill_locked(client);
+        int count = 0, slots = 0;
+        size_t size = 0;
+        while (count < URING_DEPTH && client->out_head) {
+            OutItem *item = client->out_head;
+            int ringable = ring_sendable(item);
+            if (ringable && item->fd >= 0 && slots == URING_SLOTS) break;
+            // A large file goes on its own, with sendfile
+            if (!ringable && count > 0) break;
+            queue_pop_locked(client);
+            items[count++] = item;
+            size += out_item_size(item);
+            if (!ringable) break;
+            if (item->fd >= 0) slots++;
+            if (!client->out_head && client->handshake_done) refill_locked(client);
+        }
+        if (count == 0) {
+            if (client->chunk_due) continue;
+            pthread_cond_wait(&client->out_cond, &client->out_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&client->out_lock);
+
+        int rc;
+        if (count == 1 && !ring_sendable(items[0])) rc = write_item_blocking(client, items[0]);
+        else rc = ring_send_items(client, &wr, items, count);
+        for (int i = 0; i < count; i++) free_out_item(items[i]);
+
+        pthread_mutex_lock(&client->out_lock);
+        client->out_bytes -= size;
+        if (rc < 0) client->active = 0;
+    }
+    pthread_mutex_unlock(&client->out_lock);
+
+    writer_ring_free(&wr);
+    shutdown(client->socket, SHUT_RDWR);
+    return NULL;
+}
+
+// Answer a client's block signatures with a delta of our current copy,
+// followed by its vector for clients that push changes back.
+// Every request gets exactly one SYNC_DELTA back, empty if there is
+// nothing to send, so the client knows when it has caught up. Like chunk
+// replies these skip the slow-consumer policy: each answers an event that
+// was already admitted.
+void send_delta(Client *client, const char *name, const uint8_t *sig, size_t sig_len) {
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, name);
+
+    size_t size;
+    uint8_t *data = is_ignored(client, name, 0) ? NULL : read_whole_file(filepath, &size);
+    uint8_t *delta = NULL;
+    size_t delta_len = 0;
+    // A file deleted since has a DELETE event on its way
+    if (data && delta_compute(sig, sig_len, data, size, &delta, &delta_len) < 0) {
+        delta = NULL;
+        delta_len = 0;
+    }
+    free(data);
+
+    OutItem *item = make_frame_item(SYNC_DELTA, 0, name, delta ? delta : (uint8_t *)"",
+                                    delta_len, 0);
+    free(delta);
+
+    pthread_mutex_lock(&client->out_lock);
+    if (!item) client->active = 0;
+    else if (client->active) {
+        queue_push_locked(client, item);
+        queue_version_locked(client, name);
+    } else {
+        free_out_item(item);
+    }
+    pthread_mutex_unlock(&client->out_lock);
+    notify_client(client);
+}
+
+// Answer a SYNC_CHUNK_REQUEST. Replies skip the slow-consumer policy: the
+// client bounds how many chunks it has outstanding.
+void send_chunks(Client *client, const char *name, const uint8_t *hashes, size_t len) {
+    uint8_t *buf = malloc(CHUNK_HASH_SIZE + CHUNK_MAX_SIZE);
+    if (!buf) return;
+
+    for (size_t pos = 0; pos + CHUNK_HASH_SIZE <= len; pos += CHUNK_HASH_SIZE) {
+        memcpy(buf, hashes + pos, CHUNK_HASH_SIZE);
+        int n = chunk_index_read(chunk_store, sync_dir, buf, buf + CHUNK_HASH_SIZE);
+        // A bare hash tells the client we have no valid copy any more
+        OutItem *item = make_frame_item(SYNC_CHUNK_DATA, 0, name, buf,
+                                        CHUNK_HASH_SIZE + (n > 0 ? n : 0), 0);
+        pthread_mutex_lock(&client->out_lock);
+        if (!item) client->active = 0;
+        else if (client->active) queue_push_locked(client, item);
+        else free_out_item(item);
+        pthread_mutex_unlock(&client->out_lock);
+    }
+    free(buf);
+    notify_client(client);
+}
+
+// Acknowledge a push with the path's vector as it now stands. With
+// send_copy the server's own copy follows, replacing the client's. Like
+// delta replies these skip the slow-consumer policy.
+void answer_push(Client *client, const char *name, int status, const VersionVector *vv,
+                 int send_copy) {
+    size_t len = 1 + vv_encoded_size(vv);
+    uint8_t *payload = malloc(len);
+    OutItem *item = NULL;
+    if (payload) {
+        payload[0] = status;
+        vv_encode(vv, payload + 1);
+        item = make_frame_item(SYNC_PUSH_ACK, 0, name, payload, len, 0);
+        free(payload);
+    }
+
+    pthread_mutex_lock(&client->out_lock);
+    if (!item) {
+        client->active = 0;
+    } else if (!client->active) {
+        free_out_item(item);
+    } else {
+        queue_push_locked(client, item);
+        if (send_copy && queue_state_locked(client, name)) mark_dirty_locked(client, name);
+    }
+    pthread_mutex_unlock(&client->out_lock);
+    notify_client(client);
+}
+
+// Record that a push created or removed a directory, so the event it
+// causes is not taken for a change made on the server
+void note_dir(const char *name, int exists, uint64_t origin) {
+    VersionState *s = version_lock(versions, name, 1);
+    if (!s) return;
+    s->is_dir = 1;
+    s->exists = exists;
+    s->origin = origin;
+    version_unlock(versions, s);
+}
+
+// Create the directories leading to name for a push from origin
+void make_parents(const char *name, uint64_t origin) {
+    char dir[MAX_PATH], path[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s", name);
+    for (char *p = dir; (p = strchr(p, '/')) != NULL; *p++ = '/') {
+        *p = '\0';
+        snprintf(path, sizeof(path), "%s/%s", sync_dir, dir);
+        struct stat st;
+        if (stat(path, &st) == 0) continue;
+        note_dir(dir, 1, origin);
+        mkdir(path, 0755);
+    }
+}
+
+// Lock name's entry, filling a new one in from the file on disk
+VersionState *lock_entry(const char *name, const char *filepath) {
+    VersionState *s = version_lock(versions, name, 1);
+    struct stat st;
+    if (s && !s->vv.count && !s->exists && lstat(filepath, &st) == 0 && S_ISREG(st.st_mode)) {
+        s->exists = 1;
+        version_stamp(s, &st);
+    }
+    return s;
+}
+
+// Does a push comparing to the server's entry as cmp win? Conflicts go by
+// the -b policy; for newest the pushed mtime is that of the change.
+int push_wins(int cmp, const VersionState *s, const struct timespec *mtime) {
+    if (cmp == VV_AFTER) return 1;
+    if (cmp != VV_CONCURRENT) return 0;
+    switch (bidir_policy) {
+    case BIDIR_CLIENT:
+        return 1;
+    case BIDIR_NEWEST:
+        return !s->exists || mtime->tv_sec > s->mtime.tv_sec ||
+               (mtime->tv_sec == s->mtime.tv_sec && mtime->tv_nsec > s->mtime.tv_nsec);
+    case BIDIR_COPY:
+        return !s->exists;      // an edit beats a delete
+    default:
+        return 0;
+    }
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path) < 0 ? -1 : 0;
+}
+
+// Keep the losing side of a conflict next to the file as
+// name.conflict-<replica>, so that no edit is lost under -b copy
+void save_conflict_copy(Client *client, const char *name, const char *temp) {
+    char copy[MAX_PATH], filepath[MAX_PATH];
+    struct stat st;
+    if (snprintf(copy, sizeof(copy), "%s.conflict-%016llx", name,
+                 (unsigned long long)client->replica) >= (int)sizeof(copy) ||
+        snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, copy) >= (int)sizeof(filepath)) {
+        unlink(temp);
+        return;
+    }
+    VersionState *s = version_lock(versions, copy, 1);
+    if (!s) {
+        unlink(temp);
+        return;
+    }
+    if (rename(temp, filepath) < 0) {
+        perror("rename conflict copy");
+        unlink(temp);
+    } else if (lstat(filepath, &st) == 0) {
+        // A new file of the server's, so every client gets it
+        vv_bump(&s->vv, server_replica);
+        s->exists = 1;
+        version_stamp(s, &st);
+        s->origin = 0;
+        printf("Conflict on %s, kept the client's copy as %s\n", name, copy);
+    }
+    version_unlock(versions, s);
+}
+
+// All of a file push has arrived: decide it against the server's copy
+void commit_push_file(Client *client) {
+    const char *name = client->push_name;
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, name);
+    struct timespec times[2] = { client->push_mtime, client->push_mtime };
+    futimens(client->push_fd, times);
+    close(client->push_fd);
+    client->push_fd = -1;
+    make_parents(name, client->replica);
+
+    VersionVector reply = {0};
+    int status = PUSH_APPLIED, send_copy = 0, save_copy = 0;
+    VersionState *s = lock_entry(name, filepath);
+    if (!s) {
+        unlink(client->push_temp);
+        answer_push(client, name, PUSH_REJECTED, &reply, 0);
+        return;
+    }
+    int cmp = vv_compare(&client->push_vv, &s->vv);
+    struct stat st;
+    if (cmp == VV_CONCURRENT) metrics_add(&metrics.push_conflicts, 1);
+    if (push_wins(cmp, s, &client->push_mtime)) {
+        if (rename(client->push_temp, filepath) == 0 && lstat(filepath, &st) == 0) {
+            vv_merge(&s->vv, &client->push_vv);
+            s->exists = 1;
+            s->is_dir = 0;
+            version_stamp(s, &st);
+            s->origin = client->replica;
+            metrics_add(&metrics.pushes_applied, 1);
+        } else {
+            perror("rename push");
+            unlink(client->push_temp);
+            status = PUSH_REJECTED;
+        }
+    } else if (cmp == VV_CONCURRENT) {
+        // The server's copy stays and goes back to the client
+        status = PUSH_CONFLICT;
+        send_copy = 1;
+        save_copy = bidir_policy == BIDIR_COPY;
+        if (!save_copy) unlink(client->push_temp);
+    } else {
+        unlink(client->push_temp);     // a push the server has already seen
+    }
+    vv_copy(&reply, &s->vv);
+    version_unlock(versions, s);
+
+    if (save_copy) save_conflict_copy(client, name, client->push_temp);
+    answer_push(client, name, status, &reply, send_copy);
+    vv_free(&reply);
+}
+
+// Drop the file push in progress, committing it if all of it arrived
+void finish_push_file(Client *client) {
+    if (client->push_fd >= 0) {
+        if (client->push_left == 0) {
+            commit_push_file(client);
+        } else {
+            close(client->push_fd);
+            unlink(client->push_temp);
+            client->push_fd = -1;
+        }
+    }
+    free(client->push_name);
+    client->push_name = NULL;
+    vv_free(&client->push_vv);
+}
+
+// Start receiving a file push into a temp file next to its target
+void begin_push_file(Client *client, Push *push, int rejected) {
+    client->push_name = strdup(push->name);
+    client->push_left = push->size;
+    client->push_mtime = push->mtime;
+    client->push_vv = push->vv;
+    push->vv.dots = NULL;
+    push->vv.count = 0;
+    if (!client->push_name) {
+        client->active = 0;
+        return;
+    }
+    if (!rejected) {
+        snprintf(client->push_temp, sizeof(client->push_temp), "%s/%s" SYNC_TEMP_MARK "XXXXXX",
+                 sync_dir, push->name);
+        make_parents(push->name, client->replica);
+        client->push_fd = mkstemp(client->push_temp);
+        if (client->push_fd < 0) {
+            perror("mkstemp");
+            VersionVector none = {0};
+            answer_push(client, push->name, PUSH_REJECTED, &none, 0);
+        } else {
+            fchmod(client->push_fd, 0644);
+        }
+    }
+    if (client->push_left == 0) finish_push_file(client);
+}
+
+// Append file contents to the push in progress
+int receive_push_data(Client *client, const uint8_t *data, size_t len) {
+    if (len > client->push_left) return -1;
+    client->push_left -= len;
+    while (client->push_fd >= 0 && len > 0) {
+        ssize_t n = write(client->push_fd, data, len);
+        if (n < 0) {
+            perror("write push");
+            close(client->push_fd);
+            unlink(client->push_temp);
+            client->push_fd = -1;
+            VersionVector none = {0};
+            answer_push(client, client->push_name, PUSH_REJECTED, &none, 0);
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    if (client->push_left == 0) finish_push_file(client);
+    return 0;
+}
 
-#define EVENT_SIZE  (sizeof(struct inotify_event))
-#define BUF_LEN     (1024 * (EVENT_SIZE + 16))
-#define MAX_PATH    2048
-#define MAX_IGNORE  256
-#define MAX_CLIENTS 10
+// A file pushed as deleted: decided like a write. A directory is removed
+// with everything below it, whatever happened there meanwhile.
+void push_delete(Client *client, Push *push, const char *filepath) {
+    VersionVector reply = {0};
+    if (push->is_dir) {
+        note_dir(push->name, 0, client->replica);
+        version_each(versions, push->name, tombstone_entry, &client->replica);
+        if (nftw(filepath, remove_entry, 16, FTW_DEPTH | FTW_PHYS) < 0 && errno != ENOENT) {
+            perror("remove pushed directory");
+        }
+        metrics_add(&metrics.pushes_applied, 1);
+        answer_push(client, push->name, PUSH_APPLIED, &reply, 0);
+        return;
+    }
+
+    VersionState *s = lock_entry(push->name, filepath);
+    if (!s) {
+        answer_push(client, push->name, PUSH_REJECTED, &reply, 0);
+        return;
+    }
+    int cmp = vv_compare(&push->vv, &s->vv);
+    int status = PUSH_APPLIED;
+    if (cmp == VV_CONCURRENT && s->exists) metrics_add(&metrics.push_conflicts, 1);
+    if (push_wins(cmp, s, &push->mtime) || (cmp == VV_CONCURRENT && !s->exists)) {
+        if (unlink(filepath) < 0 && errno != ENOENT) perror("unlink push");
+        vv_merge(&s->vv, &push->vv);
+        s->exists = 0;
+        s->origin = client->replica;
+        metrics_add(&metrics.pushes_applied, 1);
+    } else if (cmp == VV_CONCURRENT) {
+        status = PUSH_CONFLICT;
+    }
+    vv_copy(&reply, &s->vv);
+    version_unlock(versions, s);
+    answer_push(client, push->name, status, &reply, status == PUSH_CONFLICT);
+    vv_free(&reply);
+}
+
+// A pushed rename is applied as it comes; if its source is already gone
+// here, the server's state of the target goes back instead
+void push_rename(Client *client, Push *push, const char *filepath) {
+    char targetpath[MAX_PATH];
+    VersionVector reply = {0};
+    snprintf(targetpath, sizeof(targetpath), "%s/%s", sync_dir, push->target);
+    make_parents(push->target, client->replica);
+    if (rename(filepath, targetpath) < 0) {
+        answer_push(client, push->target, PUSH_CONFLICT, &reply, 1);
+        return;
+    }
+
+    version_move(versions, push->name, push->target);
+    VersionState *s = version_lock(versions, push->target, 1);
+    struct stat st;
+    if (s) {
+        if (push->is_dir) {
+            s->is_dir = 1;
+        } else if (lstat(targetpath, &st) == 0) {
+            version_stamp(s, &st);
+        }
+        s->exists = 1;
+        s->origin = client->replica;
+        vv_copy(&reply, &s->vv);
+        version_unlock(versions, s);
+    }
+    metrics_add(&metrics.pushes_applied, 1);
+    answer_push(client, push->target, PUSH_APPLIED, &reply, 0);
+    vv_free(&reply);
+}
+
+// Act on a SYNC_PUSH. Returns -1 on a malformed frame.
+int handle_push(Client *client, SyncFrame *frame, const uint8_t *payload) {
+    if (frame->payload_len < SYNC_PUSH_FIXED || frame->path_len >= MAX_PATH ||
+        !sync_path_is_safe(frame->path, frame->path_len) || client->push_name) {
+        return -1;
+    }
+    Push push = {0};
+    memcpy(push.name, frame->path, frame->path_len);
+    push.name[frame->path_len] = '\0';
+    push.op = payload[0];
+    push.is_dir = (frame->flags & SYNC_FLAG_DIR) != 0;
+    uint64_t replica = sync_get64(payload + 1);
+    push.mtime.tv_sec = sync_get64(payload + 9);
+    push.mtime.tv_nsec = sync_get32(payload + 17);
+    push.size = sync_get64(payload + 21);
+    int used = vv_decode(payload + SYNC_PUSH_FIXED, frame->payload_len - SYNC_PUSH_FIXED,
+                         &push.vv);
+    if (used < 0 || push.mtime.tv_nsec >= 1000000000 ||
+        (push.op != SYNC_FILE && push.op != SYNC_CREATE && push.op != SYNC_DELETE &&
+         push.op != SYNC_RENAME)) {
+        vv_free(&push.vv);
+        return -1;
+    }
+    size_t target_len = frame->payload_len - SYNC_PUSH_FIXED - used;
+    if (push.op == SYNC_RENAME) {
+        const char *target = (const char *)payload + SYNC_PUSH_FIXED + used;
+        if (target_len >= MAX_PATH || !sync_path_is_safe(target, target_len)) {
+            vv_free(&push.vv);
+            return -1;
+        }
+        memcpy(push.target, target, target_len);
+        push.target[target_len] = '\0';
+    }
+    if (!client->replica) {
+        pthread_mutex_lock(&client->out_lock);
+        client->replica = replica;
+        pthread_mutex_unlock(&client->out_lock);
+    }
+
+    // Only paths this server owns and the client sees may be pushed
+    int rejected = !client->bidir || !replica || sync_is_temp(push.name) ||
+                   !prefix_match(owned, push.name, push.is_dir) ||
+                   is_ignored(client, push.name, push.is_dir);
+    if (push.op == SYNC_RENAME) {
+        rejected = rejected || sync_is_temp(push.target) ||
+                   !prefix_match(owned, push.target, push.is_dir) ||
+                   is_ignored(client, push.target, push.is_dir);
+    }
+    if (rejected) {
+        VersionVector none = {0};
+        answer_push(client, push.op == SYNC_RENAME ? push.target : push.name, PUSH_REJECTED,
+                    &none, 0);
+    }
+
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, push.name);
+    if (push.op == SYNC_FILE) {
+        // The contents follow even when rejected, and are discarded
+        begin_push_file(client, &push, rejected);
+    } else if (!rejected && push.op == SYNC_CREATE) {
+        VersionVector none = {0};
+        make_parents(push.name, client->replica);
+        note_dir(push.name, 1, client->replica);
+        if (mkdir(filepath, 0755) < 0 && errno != EEXIST) perror("mkdir push");
+        answer_push(client, push.name, PUSH_APPLIED, &none, 0);
+    } else if (!rejected && push.op == SYNC_DELETE) {
+        push_delete(client, &push, filepath);
+    } else if (!rejected && push.op == SYNC_RENAME) {
+        push_rename(client, &push, filepath);
+    }
+    vv_free(&push.vv);
+    return 0;
+}
+
+// Answer SYNC_VERIFY now, or, if the tree already holds changes still in
+// the coalescing window, once they are fanned out: a listing that ran
+// ahead of the client's events would fetch what those events bring anyway
+int take_verify(Client *client, const uint8_t *payload, size_t len) {
+    pthread_mutex_lock(&client_mutex);
+    if (__atomic_load_n(&window_open, __ATOMIC_ACQUIRE)) {
+        uint8_t *copy = malloc(len ? len : 1);
+        if (!copy) {
+            pthread_mutex_unlock(&client_mutex);
+            return -1;
+        }
+        memcpy(copy, payload, len);
+        pthread_mutex_lock(&client->out_lock);
+        free(client->verify_req);   // clients have one round out at a time
+        client->verify_req = copy;
+        client->verify_len = len;
+        client->verify_due = 0;
+        pthread_mutex_unlock(&client->out_lock);
+        pthread_mutex_unlock(&client_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&client_mutex);
+    return answer_verify(client, payload, len);
+}
 
-// Structure to hold client information
 typedef struct {
-    int socket;
-    struct sockaddr_in address;
-    char ignore_list[MAX_IGNORE];
-    int active;
-} Client;
+    Client *client;
+    OutItem *head;
+    OutItem *tail;
+} VersionDump;
 
-Client clients[MAX_CLIENTS];
-int client_count = 0;
-pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void dump_version(void *arg, const char *path, VersionState *s) {
+    VersionDump *dump = arg;
+    if (!s->exists || is_ignored(dump->client, path, 0)) return;
+    OutItem *item = version_item(path, s);
+    if (!item) return;
+    if (dump->tail) dump->tail->next = item;
+    else dump->head = item;
+    dump->tail = item;
+}
 
-int inotify_fd;
-char sync_dir[MAX_PATH];
+// After the manifest, give a two-way client the vector of every file it
+// sees, so its first pushes compare against the right history
+void queue_all_versions(Client *client) {
+    VersionDump dump = { .client = client };
+    version_each(versions, "", dump_version, &dump);
+    pthread_mutex_lock(&client->out_lock);
+    while (dump.head) {
+        OutItem *item = dump.head;
+        dump.head = item->next;
+        queue_push_locked(client, item);
+    }
+    pthread_mutex_unlock(&client->out_lock);
+}
+
+// Act on one complete frame from the client
+int handle_client_frame(Client *client, SyncFrame *frame, const uint8_t *payload) {
+    if (frame->flags & SYNC_FLAG_CHECKSUM) {
+        uint32_t crc = sync_crc32(sync_crc32(0, frame->path, frame->path_len),
+                                  payload, frame->payload_len);
+        if (crc != frame->checksum) return -1;
+    }
+
+    if (frame->type == SYNC_RESUME && !client->handshake_done) {
+        if (frame->payload_len != SYNC_RESUME_SIZE || frame->path_len >= MAX_PATH ||
+            (frame->path_len && !sync_path_is_safe(frame->path, frame->path_len))) {
+            return -1;
+        }
+        client->resuming = 1;
+        client->resume_epoch = sync_get64(payload);
+        client->resume_seq = sync_get64(payload + 8);
+        client->resume_offset = sync_get64(payload + 16);
+        free(client->resume_name);
+        client->resume_name = frame->path_len ? strndup(frame->path, frame->path_len) : NULL;
+        if (client->resume_name &&
+            !resume_prefix_matches(client->resume_name, client->resume_offset,
+                                   sync_get32(payload + 24), &client->resume_st)) {
+            free(client->resume_name);
+            client->resume_name = NULL;
+        }
+    } else if (frame->type == SYNC_SUBSCRIBE && !client->handshake_done) {
+        if (frame->payload_len > MAX_PREFIXES) return -1;
+        PrefixSet *subs = prefix_compile((const char *)payload, frame->payload_len);
+        if (!subs) return -1;
 
-// Utility function to check if a file is in the ignore list
-int is_ignored(Client *client, const char *filename) {
-    char *token = strtok(strdup(client->ignore_list), ",");
-    while (token) {
-        if (strstr(filename, token) != NULL) {
-            free(token);
-            return 1;
+        pthread_mutex_lock(&client->out_lock);
+        prefix_free(client->subs);
+        client->subs = subs;
+        client->subs_hash = fnv64(FNV64_START, payload, frame->payload_len);
+        pthread_mutex_unlock(&client->out_lock);
+    } else if (frame->type == SYNC_HELLO && !client->handshake_done) {
+        if (frame->payload_len > MAX_IGNORE) return -1;
+        IgnoreMatcher *ignore = ignore_compile((const char *)payload, frame->payload_len);
+        if (!ignore) return -1;
+
+        // Clients sent the same subtrees and ignore list share cached digests
+        uint64_t id = fnv64(fnv64(FNV64_START, &client->subs_hash, sizeof(client->subs_hash)),
+                            payload, frame->payload_len);
+
+        pthread_mutex_lock(&client->out_lock);
+        client->ignore = ignore;
+        client->view.skip = verify_skip;
+        client->view.arg = client;
+        client->view.id = id ? id : 1;
+        client->chunked = chunk_store && (frame->flags & SYNC_FLAG_CHUNKS);
+        client->compress = compress_level > 0 && (frame->flags & SYNC_FLAG_COMPRESS);
+        client->bidir = versions && (frame->flags & SYNC_FLAG_BIDIR);
+        pthread_mutex_unlock(&client->out_lock);
+
+        // A reconnecting client whose position is still in the journal
+        // gets only the events it missed
+        if (client->resuming && journal && client->resume_epoch == journal_epoch(journal) &&
+            join_stream(client, client->resume_seq, 0) == 0) {
+            metrics_add(&metrics.resumes, 1);
+            printf("Client %s resumed after event %llu\n", inet_ntoa(client->address.sin_addr),
+                   (unsigned long long)client->resume_seq);
+            return 0;
+        }
+        if (client->resuming) metrics_add(&metrics.resume_misses, 1);
+
+        // Otherwise the manifest goes out first; live events queue up
+        // behind it, starting from the journal position read before it
+        uint64_t seq = journal ? journal_last(journal) : 0;
+        uint8_t *manifest;
+        size_t manifest_len;
+        if (tree_manifest(tree, client->subs, &manifest, &manifest_len) < 0) return -1;
+        OutItem *item = make_frame_item(SYNC_MANIFEST, 0, "", manifest, manifest_len, 0);
+        free(manifest);
+        if (!item) return -1;
+
+        pthread_mutex_lock(&client->out_lock);
+        queue_push_locked(client, item);
+        client->snapshot = 1;
+        pthread_mutex_unlock(&client->out_lock);
+        if (client->bidir) queue_all_versions(client);
+        join_stream(client, seq, 1);
+    } else if (frame->type == SYNC_WANT && client->handshake_done) {
+        uint8_t *want;
+        size_t want_len;
+        if (tree_decompress(payload, frame->payload_len, &want, &want_len) < 0) return -1;
+
+        // Paths still to be sent from an earlier request go first
+        pthread_mutex_lock(&client->out_lock);
+        if (client->want && client->want_pos < client->want_len) {
+            size_t left = client->want_len - client->want_pos;
+            uint8_t *joined = malloc(left + want_len);
+            if (!joined) {
+                pthread_mutex_unlock(&client->out_lock);
+                free(want);
+                return -1;
+            }
+            memcpy(joined, client->want + client->want_pos, left);
+            memcpy(joined + left, want, want_len);
+            free(want);
+            want = joined;
+            want_len += left;
         }
-        token = strtok(NULL, ",");
+        free(client->want);
+        client->want = want;
+        client->want_len = want_len;
+        client->want_pos = 0;
+        pthread_mutex_unlock(&client->out_lock);
+        notify_client(client);
+    } else if (frame->type == SYNC_VERIFY && client->handshake_done) {
+        if (take_verify(client, payload, frame->payload_len) < 0) return -1;
+    } else if (frame->type == SYNC_SIGNATURES && client->handshake_done) {
+        if (!sync_path_is_safe(frame->path, frame->path_len) || frame->path_len >= MAX_PATH) {
+            return -1;
+        }
+        char name[MAX_PATH];
+        memcpy(name, frame->path, frame->path_len);
+        name[frame->path_len] = '\0';
+        send_delta(client, name, payload, frame->payload_len);
+    } else if (frame->type == SYNC_PUSH && client->handshake_done) {
+        if (handle_push(client, frame, payload) < 0) return -1;
+    } else if (frame->type == SYNC_PUSH_DATA && client->push_name) {
+        if (receive_push_data(client, payload, frame->payload_len) < 0) return -1;
+    } else if (frame->type == SYNC_CHUNK_REQUEST && client->chunked) {
+        if (frame->path_len >= MAX_PATH || frame->payload_len % CHUNK_HASH_SIZE) return -1;
+        char name[MAX_PATH];
+        memcpy(name, frame->path, frame->path_len);
+        name[frame->path_len] = '\0';
+        send_chunks(client, name, payload, frame->payload_len);
     }
     return 0;
 }
 
-// Send file to client
-void send_file_to_client(Client* client, const char* filepath) {
-    if (is_ignored(client, filepath)) return;
-    
-    int fd = open(filepath, O_RDONLY);
-    if (fd < 0) return;
+// Make room for a frame of the given total size in the input buffer
+int reserve_input(Client *client, size_t frame_size) {
+    if (frame_size <= client->in_cap) return 0;
+    if (frame_size > MAX_CLIENT_FRAME) return -1;
+    uint8_t *buf = realloc(client->in_buf, frame_size);
+    if (!buf) return -1;
+    client->in_buf = buf;
+    client->in_cap = frame_size;
+    return 0;
+}
 
-    // Copy filepath because basename() may modify the string
-    char* filepath_copy = strdup(filepath);
-    if (!filepath_copy) {
-        close(fd);
-        return;
+// Parse every complete frame sitting in the client's input buffer.
+// Returns -1 on a protocol error.
+int process_client_input(Client *client) {
+    size_t pos = 0;
+    while (pos < client->in_len) {
+        SyncFrame frame;
+        int used = sync_parse_header(client->in_buf + pos, client->in_len - pos, &frame);
+        if (used < 0) return -1;
+        if (used == 0) break;
+        if (frame.payload_len > MAX_CLIENT_FRAME) return -1;
+        if (client->in_len - pos - used < frame.payload_len) {
+            // Move the partial frame to the front and make room for the rest
+            memmove(client->in_buf, client->in_buf + pos, client->in_len - pos);
+            client->in_len -= pos;
+            return reserve_input(client, used + frame.payload_len);
+        }
+
+        if (handle_client_frame(client, &frame, client->in_buf + pos + used) < 0) return -1;
+        pos += used + frame.payload_len;
     }
+    memmove(client->in_buf, client->in_buf + pos, client->in_len - pos);
+    client->in_len -= pos;
+    return 0;
+}
 
-    char* filename = basename(filepath_copy);  // Extract just the filename
+// Client handling thread
+void *handle_client(void *arg) {
+    Client *client = (Client *)arg;
 
-    char cmd[MAX_PATH];
-    snprintf(cmd, sizeof(cmd), "FILE %s\n", filename);
-    send(client->socket, cmd, strlen(cmd), 0);
+    void *(*writer)(void *) = server_mode == MODE_URING ? uring_writer : client_writer;
+    if (pthread_create(&client->writer, NULL, writer, client) != 0) {
+        perror("pthread_create writer");
+        client->active = 0;
+    }
 
-    off_t offset = 0;
-    struct stat stat_buf;
-    fstat(fd, &stat_buf);
-    sendfile(client->socket, fd, &offset, stat_buf.st_size);
+    while (client->active) {
+        ssize_t n = recv(client->socket, client->in_buf + client->in_len,
+                         client->in_cap - client->in_len, 0);
+        if (n <= 0) break;
+        client->in_len += n;
+        if (process_client_input(client) < 0) {
+            fprintf(stderr, "Protocol error from %s\n", inet_ntoa(client->address.sin_addr));
+            break;
+        }
+    }
 
-    free(filepath_copy);  // Free the duplicated string
-    close(fd);
+    // Cleanup
+    pthread_mutex_lock(&client_mutex);
+    table_remove(&client_table, client);
+    pthread_mutex_unlock(&client_mutex);
+
+    pthread_mutex_lock(&client->out_lock);
+    client->active = 0;
+    pthread_cond_signal(&client->out_cond);
+    pthread_mutex_unlock(&client->out_lock);
+    pthread_join(client->writer, NULL);
+
+    close(client->socket);
+    client_free(client);
+    return NULL;
 }
 
-// Send message to all clients except ignored files
-void send_to_clients(const char *message, const char *filename) {
+// Tear down a client owned by an epoll shard. Later events in the same
+// batch may still point at it, so it is only unhooked here and freed by
+// reap_closed once the batch is done.
+void close_epoll_client(Shard *shard, Client *client) {
+    if (client->closing) return;
+
     pthread_mutex_lock(&client_mutex);
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].active && (filename == NULL || !is_ignored(&clients[i], filename))) {
-            send(clients[i].socket, message, strlen(message), 0);
+    table_remove(&client_table, client);
+    pthread_mutex_unlock(&client_mutex);
+
+    // Unlink from the pending list so the shard never touches it again
+    pthread_mutex_lock(&shard->pending_lock);
+    client->closing = 1;
+    Client **link = &shard->pending_head;
+    while (*link) {
+        if (*link == client) {
+            *link = client->pending_next;
+            break;
         }
+        link = &(*link)->pending_next;
     }
-    pthread_mutex_unlock(&client_mutex);
+    pthread_mutex_unlock(&shard->pending_lock);
+
+    epoll_ctl(shard->epfd, EPOLL_CTL_DEL, client->socket, NULL);
+    client->closed_next = shard->closed_head;
+    shard->closed_head = client;
 }
 
-// Recursively add directory watches
-void add_recursive_watches(int fd, const char* path) {
-    int wd = inotify_add_watch(fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
-    if (wd < 0) return;
+// Free the clients closed during the last event batch
+void reap_closed(Shard *shard) {
+    while (shard->closed_head) {
+        Client *client = shard->closed_head;
+        shard->closed_head = client->closed_next;
+        close(client->socket);
+        client_free(client);
+    }
+}
 
-    DIR* dir = opendir(path);
-    if (!dir) return;
-    
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && 
-            strcmp(entry->d_name, "..") != 0) {
-            char subpath[MAX_PATH];
-            snprintf(subpath, sizeof(subpath), "%s/%s", path, entry->d_name);
-            add_recursive_watches(fd, subpath);
+// Write as much queued output as the socket accepts without blocking.
+// Returns -1 if the client was closed.
+int flush_client(Shard *shard, Client *client) {
+    pthread_mutex_lock(&client->out_lock);
+    while (client->active) {
+        if (client->verify_due) answer_due_verify_locked(client);
+        if (client->chunk_due) chunk_due_locked(client);
+        OutItem *item = client->out_head;
+        if (!item) {
+            refill_locked(client);
+            if (!client->out_head && !client->chunk_due) break;
+            continue;
+        }
+
+        ssize_t n = send_item_chunk(client, item);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;  // wait for EPOLLOUT
+            if (errno == EINTR) continue;
+            client->active = 0;
+            break;
+        }
+        client->out_bytes -= n;
+
+        if (out_item_size(item) == 0) {
+            queue_pop_locked(client);
+            free_out_item(item);
         }
     }
-    closedir(dir);
+    int active = client->active;
+    pthread_mutex_unlock(&client->out_lock);
+
+    if (!active) {
+        close_epoll_client(shard, client);
+        return -1;
+    }
+    return 0;
 }
 
-// Directory monitoring thread
-void *watch_directory(void *arg) {
-    char *sync_dir = (char *)arg;
-    inotify_fd = inotify_init();
-    if (inotify_fd < 0) {
-        perror("inotify_init");
-        return NULL;
+// Read from a client socket until it would block.
+// Returns -1 if the client was closed.
+int read_epoll_client(Shard *shard, Client *client) {
+    while (1) {
+        ssize_t n = recv(client->socket, client->in_buf + client->in_len,
+                         client->in_cap - client->in_len, 0);
+        if (n > 0) {
+            int was_ready = client->handshake_done;
+            client->in_len += n;
+            if (process_client_input(client) < 0) {
+                fprintf(stderr, "Protocol error from %s\n", inet_ntoa(client->address.sin_addr));
+                close_epoll_client(shard, client);
+                return -1;
+            }
+            if (!was_ready && client->handshake_done && flush_client(shard, client) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        close_epoll_client(shard, client);
+        return -1;
     }
+}
 
-    add_recursive_watches(inotify_fd, sync_dir);
+// Reactor thread: owns every client socket assigned to this shard
+void *shard_loop(void *arg) {
+    Shard *shard = (Shard *)arg;
+    struct epoll_event events[MAX_EVENTS];
 
-    char buffer[BUF_LEN];
     while (1) {
-        int length = read(inotify_fd, buffer, BUF_LEN);
-        if (length < 0) {
-            perror("read");
+        int n = epoll_wait(shard->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
             break;
         }
-        int i = 0;
-        while (i < length) {
-            struct inotify_event *event = (struct inotify_event *)&buffer[i];
-            if (event->len) {
-                char message[MAX_PATH];
-                char filepath[MAX_PATH];
-                snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, event->name);
-
-                if (event->mask & IN_CREATE) {
-                    snprintf(message, sizeof(message), "CREATE %s", event->name);
-                    send_to_clients(message, event->name);
-                    if (!(event->mask & IN_ISDIR)) {
-                        pthread_mutex_lock(&client_mutex);
-                        for (int j = 0; j < client_count; j++) {
-                            if (clients[j].active) {
-                                send_file_to_client(&clients[j], filepath);
-                            }
-                        }
-                        pthread_mutex_unlock(&client_mutex);
-                    } else {
-                        add_recursive_watches(inotify_fd, filepath);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t count;
+                while (read(shard->wake_fd, &count, sizeof(count)) > 0) {
+                }
+
+                // Drain every client the watcher queued output for
+                while (1) {
+                    pthread_mutex_lock(&shard->pending_lock);
+                    Client *client = shard->pending_head;
+                    if (client) {
+                        shard->pending_head = client->pending_next;
+                        client->out_pending = 0;
                     }
-                } else if (event->mask & IN_DELETE) {
-                    snprintf(message, sizeof(message), "DELETE %s", event->name);
-                    send_to_clients(message, event->name);
-                } else if (event->mask & IN_MOVED_FROM) {
-                    snprintf(message, sizeof(message), "MOVED_FROM %s", event->name);
-                    send_to_clients(message, event->name);
-                } else if (event->mask & IN_MOVED_TO) {
-                    snprintf(message, sizeof(message), "MOVED_TO %s", event->name);
-                    send_to_clients(message, event->name);
+                    pthread_mutex_unlock(&shard->pending_lock);
+                    if (!client) break;
+                    flush_client(shard, client);
                 }
+                continue;
+            }
+
+            Client *client = events[i].data.ptr;
+            if (client->closing) continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_epoll_client(shard, client);
+                continue;
+            }
+            if ((events[i].events & EPOLLIN) && read_epoll_client(shard, client) < 0) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_client(shard, client);
             }
-            i += EVENT_SIZE + event->len;
         }
+        reap_closed(shard);
     }
-    close(inotify_fd);
     return NULL;
 }
 
-// Send initial directory state to client
-void send_initial_state(Client *client, const char *sync_dir) {
-    DIR *dir = opendir(sync_dir);
-    if (!dir) return;
+void start_shards(void) {
+    for (int i = 0; i < shard_count; i++) {
+        Shard *shard = &shards[i];
+        shard->id = i;
+        shard->epfd = epoll_create1(0);
+        shard->wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (shard->epfd < 0 || shard->wake_fd < 0) {
+            perror("epoll/eventfd");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&shard->pending_lock, NULL);
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        epoll_ctl(shard->epfd, EPOLL_CTL_ADD, shard->wake_fd, &ev);
+
+        if (pthread_create(&shard->thread, NULL, shard_loop, shard) != 0) {
+            perror("pthread_create shard");
+            exit(EXIT_FAILURE);
         }
-        
-        char filepath[MAX_PATH];
-        snprintf(filepath, sizeof(filepath), "%s/%s", sync_dir, entry->d_name);
-        
-        char message[MAX_PATH];
-        snprintf(message, sizeof(message), "CREATE %s", entry->d_name);
-        send(client->socket, message, strlen(message), 0);
-        
-        if (entry->d_type != DT_DIR) {
-            send_file_to_client(client, filepath);
+    }
+}
+
+// Hand an accepted socket to a shard (round robin)
+void add_epoll_client(Client *client) {
+    static int next_shard = 0;
+    client->shard = next_shard;
+    next_shard = (next_shard + 1) % shard_count;
+
+    int flags = fcntl(client->socket, F_GETFL, 0);
+    fcntl(client->socket, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = client };
+    if (epoll_ctl(shards[client->shard].epfd, EPOLL_CTL_ADD, client->socket, &ev) < 0) {
+        perror("epoll_ctl");
+        pthread_mutex_lock(&client_mutex);
+        table_remove(&client_table, client);
+        pthread_mutex_unlock(&client_mutex);
+        close(client->socket);
+        client_free(client);
+    }
+}
+
+// One labelled per-client series; caller holds client_mutex
+void write_client_series(FILE *out, const char *name, const char *help, const char *type,
+                         int field) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (int i = 0; i < client_table.count; i++) {
+        Client *client = client_table.slots[i];
+        uint64_t value;
+        switch (field) {
+        case 0: value = __atomic_load_n(&client->out_bytes, __ATOMIC_RELAXED); break;
+        case 1: value = __atomic_load_n(&client->dirty_count, __ATOMIC_RELAXED); break;
+        case 2: value = metrics_get(&client->bytes_sent); break;
+        case 3: value = metrics_get(&client->events_sent); break;
+        default: value = metrics_get(&client->events_dropped); break;
         }
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client->address.sin_addr, addr, sizeof(addr));
+        fprintf(out, "%s{client=\"%s:%d\"} %llu\n", name, addr,
+                ntohs(client->address.sin_port), (unsigned long long)value);
     }
-    closedir(dir);
 }
 
-// Client handling thread
-void *handle_client(void *arg) {
-    Client *client = (Client *)arg;
-    
-    // Receive ignore list
-    int bytes = recv(client->socket, client->ignore_list, sizeof(client->ignore_list) - 1, 0);
-    if (bytes > 0) {
-        client->ignore_list[bytes] = '\0';
-    }
-    
-    // Send initial directory state
-    send_initial_state(client, sync_dir);
-    
-    char buffer[256];
-    while (recv(client->socket, buffer, sizeof(buffer), 0) > 0) {
-        // Handle client messages if needed
-    }
-    
-    // Cleanup
+// Render every metric in the Prometheus text format
+void write_metrics(FILE *out) {
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+        { "sync_inotify_events_total", "inotify events read",
+          offsetof(ServerMetrics, inotify_events) },
+        { "sync_inotify_overflows_total", "inotify queue overflows (each forces a rescan)",
+          offsetof(ServerMetrics, inotify_overflows) },
+        { "sync_batches_total", "SYNC_BATCH windows queued to clients",
+          offsetof(ServerMetrics, batches) },
+        { "sync_events_sent_total", "events queued to clients",
+          offsetof(ServerMetrics, events_sent) },
+        { "sync_events_dropped_total", "events coalesced or dropped for slow clients",
+          offsetof(ServerMetrics, events_dropped) },
+        { "sync_bytes_sent_total", "bytes written to client sockets",
+          offsetof(ServerMetrics, bytes_sent) },
+        { "sync_clients_dropped_total", "clients disconnected by the drop policy",
+          offsetof(ServerMetrics, clients_dropped) },
+        { "sync_clients_evicted_total", "clients disconnected to stay under the memory cap",
+          offsetof(ServerMetrics, clients_evicted) },
+        { "sync_resumes_total", "reconnects served from the event journal",
+          offsetof(ServerMetrics, resumes) },
+        { "sync_resume_misses_total", "reconnects the journal no longer covered",
+          offsetof(ServerMetrics, resume_misses) },
+        { "sync_resumed_bytes_total", "file bytes not resent after a reconnect",
+          offsetof(ServerMetrics, resumed_bytes) },
+        { "sync_pushes_applied_total", "client changes written to the tree",
+          offsetof(ServerMetrics, pushes_applied) },
+        { "sync_push_conflicts_total", "client changes concurrent with another change",
+          offsetof(ServerMetrics, push_conflicts) },
+        { "sync_verifies_total", "SYNC_VERIFY requests answered",
+          offsetof(ServerMetrics, verifies) },
+        { "sync_verify_dirs_total", "directories listed because a client's digest differed",
+          offsetof(ServerMetrics, verify_dirs) },
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        const uint64_t *value = (const uint64_t *)((const char *)&metrics + counters[i].offset);
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counters[i].name,
+                counters[i].help, counters[i].name, counters[i].name,
+                (unsigned long long)metrics_get(value));
+    }
+    hist_write(out, "sync_watcher_loop_seconds", "time for one pass of the watcher loop",
+               &metrics.watcher_loop);
+    hist_write(out, "sync_event_to_wire_seconds",
+               "oldest event of a batch to the last byte of it on the wire",
+               &metrics.event_to_wire);
+
+    fprintf(out, "# HELP sync_queue_memory_bytes memory held by queued output\n"
+                 "# TYPE sync_queue_memory_bytes gauge\nsync_queue_memory_bytes %zu\n"
+                 "# HELP sync_queue_memory_reserved_bytes memory taken from the system for it\n"
+                 "# TYPE sync_queue_memory_reserved_bytes gauge\n"
+                 "sync_queue_memory_reserved_bytes %zu\n", slab_in_use(), slab_reserved());
+
     pthread_mutex_lock(&client_mutex);
-    client->socket = -1;
-    client->active = 0;
-    client_count--;
+    fprintf(out, "# HELP sync_clients connected clients\n# TYPE sync_clients gauge\n"
+                 "sync_clients %d\n", client_table.count);
+    write_client_series(out, "sync_client_queue_bytes", "bytes queued for the client",
+                        "gauge", 0);
+    write_client_series(out, "sync_client_dirty_names",
+                        "names waiting to be resent once the queue drains", "gauge", 1);
+    write_client_series(out, "sync_client_bytes_sent_total", "bytes written to the client",
+                        "counter", 2);
+    write_client_series(out, "sync_client_events_sent_total", "events queued to the client",
+                        "counter", 3);
+    write_client_series(out, "sync_client_events_dropped_total",
+                        "events coalesced or dropped while the client was behind",
+                        "counter", 4);
     pthread_mutex_unlock(&client_mutex);
-    close(client->socket);
+}
+
+// Metrics endpoint (-M): every connection to the Unix socket gets one
+// snapshot and is closed
+void *metrics_server(void *arg) {
+    const char *path = (const char *)arg;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("metrics socket");
+        return NULL;
+    }
+
+    while (1) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            perror("accept metrics");
+            break;
+        }
+        char *text = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&text, &len);
+        if (out) {
+            write_metrics(out);
+            fclose(out);
+            for (size_t sent = 0; sent < len; ) {
+                ssize_t n = send(conn, text + sent, len - sent, MSG_NOSIGNAL);
+                if (n <= 0) break;
+                sent += n;
+            }
+            free(text);
+        }
+        close(conn);
+    }
+    close(fd);
     return NULL;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        printf("Usage: %s <sync_dir> <port> <max_clients>\n", argv[0]);
+    int opt;
+    char *metrics_path = NULL;
+    while ((opt = getopt(argc, argv, "m:s:p:q:Q:k:w:M:z:j:J:o:b:c")) != -1) {
+        switch (opt) {
+        case 'c':
+            checksum_files = 1;
+            break;
+        case 'k':
+            chunk_store = chunk_index_open(optarg);
+            if (!chunk_store) {
+                fprintf(stderr, "Cannot open chunk store in %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            if (strcmp(optarg, "epoll") == 0) server_mode = MODE_EPOLL;
+            else if (strcmp(optarg, "thread") == 0) server_mode = MODE_THREAD;
+            else if (strcmp(optarg, "uring") == 0) server_mode = MODE_URING;
+            else {
+                fprintf(stderr, "Unknown mode '%s' (use thread, epoll or uring)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            shard_count = atoi(optarg);
+            if (shard_count < 1 || shard_count > MAX_SHARDS) {
+                fprintf(stderr, "Shard count must be between 1 and %d\n", MAX_SHARDS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0) slow_policy = POLICY_DROP;
+            else if (strcmp(optarg, "coalesce") == 0) slow_policy = POLICY_COALESCE;
+            else {
+                fprintf(stderr, "Unknown policy '%s' (use drop or coalesce)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M':
+            metrics_path = optarg;
+            break;
+        case 'b':
+            if (strcmp(optarg, "copy") == 0) bidir_policy = BIDIR_COPY;
+            else if (strcmp(optarg, "server") == 0) bidir_policy = BIDIR_SERVER;
+            else if (strcmp(optarg, "client") == 0) bidir_policy = BIDIR_CLIENT;
+            else if (strcmp(optarg, "newest") == 0) bidir_policy = BIDIR_NEWEST;
+            else {
+                fprintf(stderr, "Unknown conflict policy '%s' (use copy, server, client or newest)\n",
+                        optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o': {
+            size_t n = strlen(optarg);
+            owned_list = realloc(owned_list, owned_len + n + 1);
+            if (!owned_list) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(owned_list + owned_len, optarg, n);
+            owned_len += n;
+            owned_list[owned_len++] = '\n';
+            break;
+        }
+        case 'j':
+            journal_path = optarg;
+            break;
+        case 'J':
+            journal_size = strtoul(optarg, NULL, 10);
+            if (journal_size != 0 && journal_size < 4096) {
+                fprintf(stderr, "Journal size must be 0 or at least 4096 bytes\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            compress_level = atoi(optarg);
+            if (compress_level < 0 || compress_level > 9) {
+                fprintf(stderr, "Compression level must be between 0 and 9\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            window_ms = atoi(optarg);
+            if (window_ms < 0) {
+                fprintf(stderr, "Coalescing window must be 0 or more milliseconds\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            queue_limit = strtoul(optarg, NULL, 10);
+            if (queue_limit == 0) {
+                fprintf(stderr, "Queue limit must be a positive number of bytes\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Q':
+            memory_cap = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            argc = -1;
+        }
+    }
+
+    if (argc - optind != 3) {
+        printf("Usage: %s [-m thread|epoll|uring] [-s shards] [-p drop|coalesce] [-q queue_bytes] "
+               "[-Q memory_bytes] [-k store_dir] [-w window_ms] [-M metrics_socket] [-z level] "
+               "[-J journal_bytes] [-j journal_file] [-o owned_prefix]... "
+               "[-b copy|server|client|newest] [-c] "
+               "<sync_dir> <port> <max_clients>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    strncpy(sync_dir, argv[1], MAX_PATH - 1);
-    int port = atoi(argv[2]);
-    int max_clients = atoi(argv[3]);
+    if (memory_cap && (memory_cap <= queue_limit || memory_cap <= journal_size)) {
+        // One client within its own queue limit, or a replay of the whole
+        // journal, would get itself evicted
+        fprintf(stderr, "Memory cap must be 0 or more than the queue limit and journal size\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (owned_list) {
+        owned = prefix_compile(owned_list, owned_len);
+        if (!owned) {
+            fprintf(stderr, "Owned subtrees must be relative paths without '..'\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    strncpy(sync_dir, argv[optind], MAX_PATH - 1);
+    int port = atoi(argv[optind + 1]);
+    int max_clients = atoi(argv[optind + 2]);
+    client_table.max_clients = max_clients > 0 ? max_clients : 0;
 
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
@@ -258,18 +3797,61 @@ int main(int argc, char *argv[]) {
         perror("bind");
         exit(EXIT_FAILURE);
     }
-    if (listen(server_fd, max_clients) < 0) {
-        perror("listen");
+
+    // sendfile has no MSG_NOSIGNAL; a client resetting its connection must
+    // not take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    if (bidir_policy != BIDIR_OFF) {
+        server_replica = version_new_replica();
+        versions = version_table_new();
+        if (!versions) {
+            perror("version table");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (journal_size && !(journal = journal_open(journal_path, journal_size))) {
+        fprintf(stderr, "Cannot create the event journal\n");
         exit(EXIT_FAILURE);
     }
 
+    // Watches first: a change made while the tree is indexed is then either
+    // in the index or in the inotify queue, and usually both
+    if (start_watches() < 0) exit(EXIT_FAILURE);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    tree = tree_build(sync_dir, cpus < 1 ? 1 : cpus > 16 ? 16 : cpus, server_mode == MODE_URING,
+                      owned);
+    if (!tree) {
+        fprintf(stderr, "Cannot index %s\n", sync_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    if (server_mode == MODE_EPOLL) {
+        start_shards();
+    }
+
     pthread_t watcher_thread;
     if (pthread_create(&watcher_thread, NULL, watch_directory, sync_dir) != 0) {
         perror("pthread_create");
         exit(EXIT_FAILURE);
     }
 
-    printf("Server listening on port %d...\n", port);
+    pthread_t metrics_thread;
+    if (metrics_path && pthread_create(&metrics_thread, NULL, metrics_server, metrics_path) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only now can a client be given a manifest nothing is missing from
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    static const char *mode_names[] = { "thread", "epoll", "uring" };
+    printf("Server listening on port %d (%s mode)...\n", port, mode_names[server_mode]);
     while (1) {
         struct sockaddr_in client_addr;
         socklen_t addr_len = sizeof(client_addr);
@@ -279,34 +3861,32 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
+        Client *client = client_new(new_socket, &client_addr);
         pthread_mutex_lock(&client_mutex);
-        if (client_count >= max_clients) {
-            close(new_socket);
+        if (!client || table_add(&client_table, client) < 0) {
             pthread_mutex_unlock(&client_mutex);
+            close(new_socket);
+            if (client) client_free(client);
             continue;
         }
+        pthread_mutex_unlock(&client_mutex);
 
-        int i;
-        for (i = 0; i < MAX_CLIENTS; i++) {
-            if (!clients[i].active) {
-                clients[i].socket = new_socket;
-                clients[i].address = client_addr;
-                clients[i].active = 1;
-                client_count++;
-                break;
-            }
+        if (server_mode == MODE_EPOLL) {
+            add_epoll_client(client);
+            continue;
         }
-        pthread_mutex_unlock(&client_mutex);
 
         pthread_t client_thread;
-        if (pthread_create(&client_thread, NULL, handle_client, &clients[i]) != 0) {
+        if (pthread_create(&client_thread, NULL, handle_client, client) != 0) {
             perror("pthread_create client");
             pthread_mutex_lock(&client_mutex);
-            clients[i].active = 0;
-            client_count--;
-            close(new_socket);
+            table_remove(&client_table, client);
             pthread_mutex_unlock(&client_mutex);
+            close(new_socket);
+            client_free(client);
+            continue;
         }
+        pthread_detach(client_thread);
     }
     close(server_fd);
     return 0;
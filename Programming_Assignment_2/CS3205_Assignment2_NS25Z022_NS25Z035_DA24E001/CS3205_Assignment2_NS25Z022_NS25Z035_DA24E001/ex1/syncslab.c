@@ -0,0 +1,168 @@
+// Slab allocator and shared buffers (see syncslab.h)
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "syncslab.h"
+
+#define MIN_SHIFT 5             // smallest class: 32 bytes
+#define MAX_SHIFT 13            // largest: SLAB_MAX_BLOCK
+#define NCLASSES (MAX_SHIFT - MIN_SHIFT + 1)
+
+// Header at the start of every slab; slabs are SLAB_SIZE aligned, so a
+// block finds its slab by masking its address
+typedef struct Slab {
+    struct Slab *next;          // on the class's partial list
+    struct Slab *prev;
+    void *free;                 // freed blocks, linked through their first word
+    unsigned used;
+    unsigned fresh;             // blocks never handed out start at this index
+    unsigned capacity;
+    unsigned cls;
+} Slab;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Slab *partial;              // slabs with at least one block free
+    unsigned empty;             // of those, how many have none in use
+} SizeClass;
+
+typedef struct {
+    uint32_t refs;              // atomic
+    uint32_t pad;
+    size_t len;
+} Shared;
+
+#define HEADER_SIZE ((sizeof(Slab) + 63) & ~(size_t)63)
+
+static SizeClass classes[NCLASSES] = {
+    [0 ... NCLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+static size_t in_use;           // atomic
+static size_t reserved;         // atomic
+
+static unsigned class_of(size_t size) {
+    unsigned cls = 0;
+    while (((size_t)1 << (cls + MIN_SHIFT)) < size) cls++;
+    return cls;
+}
+
+static void unlink_slab(SizeClass *c, Slab *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else c->partial = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static void push_slab(SizeClass *c, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = c->partial;
+    if (c->partial) c->partial->prev = slab;
+    c->partial = slab;
+}
+
+void *slab_alloc(size_t size) {
+    if (size > SLAB_MAX_BLOCK) {
+        void *p = malloc(size);
+        if (p) {
+            __atomic_fetch_add(&in_use, size, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&reserved, size, __ATOMIC_RELAXED);
+        }
+        return p;
+    }
+    unsigned cls = class_of(size ? size : 1);
+    size_t block = (size_t)1 << (cls + MIN_SHIFT);
+    SizeClass *c = &classes[cls];
+
+    pthread_mutex_lock(&c->lock);
+    Slab *slab = c->partial;
+    if (!slab) {
+        if (posix_memalign((void **)&slab, SLAB_SIZE, SLAB_SIZE) != 0) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        memset(slab, 0, sizeof(Slab));
+        slab->capacity = (SLAB_SIZE - HEADER_SIZE) / block;
+        slab->cls = cls;
+        push_slab(c, slab);
+        c->empty++;
+        __atomic_fetch_add(&reserved, SLAB_SIZE, __ATOMIC_RELAXED);
+    }
+    void *p;
+    if (slab->free) {
+        p = slab->free;
+        slab->free = *(void **)p;
+    } else {
+        p = (char *)slab + HEADER_SIZE + (size_t)slab->fresh++ * block;
+    }
+    if (slab->used++ == 0) c->empty--;
+    if (slab->used == slab->capacity) unlink_slab(c, slab);
+    pthread_mutex_unlock(&c->lock);
+
+    __atomic_fetch_add(&in_use, block, __ATOMIC_RELAXED);
+    return p;
+}
+
+void *slab_zalloc(size_t size) {
+    void *p = slab_alloc(size);
+    if (p) memset(p, 0, size);
+    return p;
+}
+
+void slab_free(void *p, size_t size) {
+    if (!p) return;
+    if (size > SLAB_MAX_BLOCK) {
+        free(p);
+        __atomic_fetch_sub(&in_use, size, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&reserved, size, __ATOMIC_RELAXED);
+        return;
+    }
+    Slab *slab = (Slab *)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1));
+    SizeClass *c = &classes[slab->cls];
+    __atomic_fetch_sub(&in_use, (size_t)1 << (slab->cls + MIN_SHIFT), __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&c->lock);
+    *(void **)p = slab->free;
+    slab->free = p;
+    if (slab->used-- == slab->capacity) push_slab(c, slab);
+    if (slab->used == 0 && ++c->empty > 1) {
+        // Keep one spare per class; the rest go back
+        unlink_slab(c, slab);
+        c->empty--;
+        pthread_mutex_unlock(&c->lock);
+        free(slab);
+        __atomic_fetch_sub(&reserved, SLAB_SIZE, __ATOMIC_RELAXED);
+        return;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+uint8_t *slab_shared_new(size_t len) {
+    Shared *s = slab_alloc(sizeof(Shared) + len);
+    if (!s) return NULL;
+    s->refs = 1;
+    s->len = len;
+    return (uint8_t *)(s + 1);
+}
+
+uint8_t *slab_shared_ref(uint8_t *buf) {
+    Shared *s = (Shared *)buf - 1;
+    __atomic_fetch_add(&s->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+void slab_shared_release(uint8_t *buf) {
+    if (!buf) return;
+    Shared *s = (Shared *)buf - 1;
+    if (__atomic_fetch_sub(&s->refs, 1, __ATOMIC_ACQ_REL) != 1) return;
+    slab_free(s, sizeof(Shared) + s->len);
+}
+
+size_t slab_in_use(void) {
+    return __atomic_load_n(&in_use, __ATOMIC_RELAXED);
+}
+
+size_t slab_reserved(void) {
+    return __atomic_load_n(&reserved, __ATOMIC_RELAXED);
+}
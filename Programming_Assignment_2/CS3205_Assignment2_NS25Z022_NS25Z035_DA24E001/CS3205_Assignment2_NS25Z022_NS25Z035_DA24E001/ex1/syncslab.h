@@ -0,0 +1,45 @@
+/*
+ * Slab allocator for queued output
+ * --------------------------------
+ * Small blocks (up to SLAB_MAX_BLOCK bytes) are carved out of 64 KB slabs,
+ * one list of slabs per power-of-two size class, so the frames and queue
+ * items a burst of events creates cost a pointer pop each instead of a
+ * trip through malloc, and freeing them puts them straight back for the
+ * next window. A slab whose blocks are all free is kept as a spare (one
+ * per class); any more go back to the system. Larger blocks come from
+ * malloc. Each class has its own lock.
+ *
+ * Every block counts towards slab_in_use() until it is freed, which is
+ * what the server's memory cap (-Q) is checked against.
+ *
+ * Shared buffers carry a reference count in front of their bytes: a frame
+ * queued to many clients is encoded once, each queue holds a reference and
+ * the last one to release it frees it.
+ */
+
+#ifndef SYNCSLAB_H
+#define SYNCSLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_SIZE      (64 * 1024)
+#define SLAB_MAX_BLOCK 8192
+
+// A block of at least size bytes, NULL if out of memory. It must be freed
+// with the same size.
+void *slab_alloc(size_t size);
+void *slab_zalloc(size_t size);
+void slab_free(void *p, size_t size);
+
+// Shared buffer of len bytes holding one reference
+uint8_t *slab_shared_new(size_t len);
+uint8_t *slab_shared_ref(uint8_t *buf);
+void slab_shared_release(uint8_t *buf);
+
+// Bytes handed out and not yet freed (rounded up to their class), and
+// bytes held from the system (slabs, spare ones included, plus large blocks)
+size_t slab_in_use(void);
+size_t slab_reserved(void);
+
+#endif
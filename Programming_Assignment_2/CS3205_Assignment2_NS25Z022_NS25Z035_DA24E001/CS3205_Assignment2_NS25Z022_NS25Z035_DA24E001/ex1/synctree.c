@@ -0,0 +1,1049 @@
+// Parallel tree walker and cached snapshot manifest (see synctree.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/stat.h>
+#include <zlib.h>
+
+#include "synctree.h"
+#include "syncuring.h"
+#include "syncprefix.h"
+
+#define TREE_MAX_PATH 4096
+#define TREE_MIN_BUCKETS 1024
+#define WALK_BATCH 64               // entries statted, opened and read per submission
+#define WALK_SLOT  (64 * 1024)      // leading bytes of each file read in that pass
+#define DIGEST_SLOTS 2              // views whose digests a directory caches
+
+// Digests of a directory for the views that last asked for one; a slot
+// with view 0 is empty
+typedef struct {
+    uint64_t view[DIGEST_SLOTS];
+    uint8_t hash[DIGEST_SLOTS][CHUNK_HASH_SIZE];
+    unsigned next;          // slot to reuse when no view matches
+} Digests;
+
+typedef struct Node {
+    struct Node *next;      // hash chain
+    struct Node *parent;    // NULL until linked under its directory
+    struct Node *child;     // directories: first entry directly inside
+    struct Node *prev_sibling;
+    struct Node *next_sibling;
+    Digests *digests;       // directories: NULL until a digest is taken
+    int type;
+    uint64_t size;
+    struct timespec mtime;
+    int hashed;             // hash is current (files are rehashed lazily)
+    uint64_t seen;          // scan_epoch of the last rescan that found it
+    uint8_t hash[CHUNK_HASH_SIZE];
+    char path[];
+} Node;
+
+struct TreeIndex {
+    pthread_mutex_t lock;
+    char root[TREE_MAX_PATH];
+    Node **buckets;
+    size_t nbuckets;
+    size_t count;
+    Node *top;              // the root directory; not in the buckets
+    uint64_t generation;    // bumped on every change
+    uint8_t *cached;        // last encoded manifest
+    size_t cached_len;
+    uint64_t cached_generation;
+    uint64_t scan_epoch;
+    int use_uring;          // walkers batch their syscalls through io_uring
+    const PrefixSet *scope; // paths outside it are never indexed
+};
+
+// Directories still to be read, shared by the walker threads
+typedef struct DirJob {
+    struct DirJob *next;
+    char path[];
+} DirJob;
+
+typedef struct {
+    TreeIndex *tree;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    DirJob *jobs;
+    int busy;               // walkers currently reading a directory
+} Walk;
+
+// A walker's io_uring and the buffers its file reads land in
+typedef struct {
+    Uring ring;
+    uint8_t *slots;         // WALK_BATCH x WALK_SLOT
+    int fixed;              // slots are registered, so reads use READ_FIXED
+} WalkRing;
+
+// One directory entry on its way through the batched stat/open/read
+typedef struct {
+    char *name;
+    struct statx stx;
+    int ok;                 // statx succeeded
+    int fd;
+    int got;                // bytes read into the slot, or -1
+} WalkEntry;
+
+static size_t path_hash(const char *path, size_t nbuckets) {
+    unsigned long h = 5381;
+    for (const char *p = path; *p; p++) h = h * 33 + (unsigned char)*p;
+    return h % nbuckets;
+}
+
+// Hash fd from offset onwards into a context that already holds the bytes
+// before it
+static int hash_rest(int fd, Sha256 *ctx, off_t offset, uint8_t out[CHUNK_HASH_SIZE]) {
+    uint8_t buffer[65536];
+    while (1) {
+        ssize_t n = pread(fd, buffer, sizeof(buffer), offset);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        sha256_update(ctx, buffer, n);
+        offset += n;
+    }
+    sha256_final(ctx, out);
+    return 0;
+}
+
+int tree_hash_file(int fd, uint8_t out[CHUNK_HASH_SIZE]) {
+    Sha256 ctx;
+    sha256_init(&ctx);
+    return hash_rest(fd, &ctx, 0, out);
+}
+
+// Double the bucket array; caller holds lock
+static void grow_buckets(TreeIndex *tree) {
+    size_t nbuckets = tree->nbuckets * 2;
+    Node **buckets = calloc(nbuckets, sizeof(Node *));
+    if (!buckets) return;
+    for (size_t i = 0; i < tree->nbuckets; i++) {
+        Node *node = tree->buckets[i];
+        while (node) {
+            Node *next = node->next;
+            size_t b = path_hash(node->path, nbuckets);
+            node->next = buckets[b];
+            buckets[b] = node;
+            node = next;
+        }
+    }
+    free(tree->buckets);
+    tree->buckets = buckets;
+    tree->nbuckets = nbuckets;
+}
+
+static Node *find_locked(TreeIndex *tree, const char *path) {
+    if (!path[0]) return tree->top;
+    Node *node = tree->buckets[path_hash(path, tree->nbuckets)];
+    while (node && strcmp(node->path, path) != 0) node = node->next;
+    return node;
+}
+
+// Drop the cached digests of dir and of every directory above it. One
+// that has none cached already had its ancestors' dropped when it lost
+// them (and any taken since left it out), so the walk stops there.
+static void invalidate_from(Node *dir) {
+    for (; dir; dir = dir->parent) {
+        if (!dir->digests) return;
+        int cached = 0;
+        for (int i = 0; i < DIGEST_SLOTS; i++) {
+            cached |= dir->digests->view[i] != 0;
+            dir->digests->view[i] = 0;
+        }
+        if (!cached) return;
+    }
+}
+
+// Hang a new node under its directory, if that is indexed; caller holds lock
+static void link_node(TreeIndex *tree, Node *node) {
+    char parent[TREE_MAX_PATH];
+    const char *slash = strrchr(node->path, '/');
+    size_t len = slash ? (size_t)(slash - node->path) : 0;
+    if (len >= sizeof(parent)) return;
+    memcpy(parent, node->path, len);
+    parent[len] = '\0';
+    Node *dir = find_locked(tree, parent);
+    if (!dir || dir->type != TREE_DIR) return;
+
+    node->parent = dir;
+    node->prev_sibling = NULL;
+    node->next_sibling = dir->child;
+    if (dir->child) dir->child->prev_sibling = node;
+    dir->child = node;
+}
+
+// Take a node (and so the subtree below it) out of its directory; caller
+// holds lock
+static void unlink_node(Node *node) {
+    Node *dir = node->parent;
+    if (!dir) return;
+    if (node->prev_sibling) node->prev_sibling->next_sibling = node->next_sibling;
+    else dir->child = node->next_sibling;
+    if (node->next_sibling) node->next_sibling->prev_sibling = node->prev_sibling;
+    node->parent = node->prev_sibling = node->next_sibling = NULL;
+    invalidate_from(dir);
+}
+
+static void free_node(Node *node) {
+    free(node->digests);
+    free(node);
+}
+
+// Insert or refresh a path; hash may be NULL to rehash later.
+// Caller holds lock.
+static Node *upsert_locked(TreeIndex *tree, const char *path, const struct stat *st,
+                           const uint8_t *hash) {
+    Node **link = &tree->buckets[path_hash(path, tree->nbuckets)];
+    while (*link && strcmp((*link)->path, path) != 0) link = &(*link)->next;
+
+    Node *node = *link;
+    if (!node) {
+        node = calloc(1, sizeof(Node) + strlen(path) + 1);
+        if (!node) return NULL;
+        strcpy(node->path, path);
+        *link = node;
+        tree->count++;
+        link_node(tree, node);
+    }
+    node->type = S_ISDIR(st->st_mode) ? TREE_DIR : TREE_FILE;
+    node->size = node->type == TREE_DIR ? 0 : (uint64_t)st->st_size;
+    node->mtime = st->st_mtim;
+    node->hashed = node->type == TREE_DIR || hash != NULL;
+    if (hash) memcpy(node->hash, hash, CHUNK_HASH_SIZE);
+    invalidate_from(node->parent);
+    tree->generation++;
+    if (tree->count > tree->nbuckets) grow_buckets(tree);
+    return node;
+}
+
+// Drop a path and, if it was a directory, everything below it.
+// Caller holds lock.
+static void remove_locked(TreeIndex *tree, const char *path) {
+    size_t len = strlen(path);
+    Node *top = find_locked(tree, path);
+    if (top) unlink_node(top);
+    for (size_t i = 0; i < tree->nbuckets; i++) {
+        Node **link = &tree->buckets[i];
+        while (*link) {
+            Node *node = *link;
+            if (strcmp(node->path, path) == 0 ||
+                (strncmp(node->path, path, len) == 0 && node->path[len] == '/')) {
+                *link = node->next;
+                free_node(node);
+                tree->count--;
+                tree->generation++;
+            } else {
+                link = &node->next;
+            }
+        }
+    }
+}
+
+static void push_job(Walk *walk, const char *path) {
+    DirJob *job = malloc(sizeof(DirJob) + strlen(path) + 1);
+    if (!job) return;
+    strcpy(job->path, path);
+    pthread_mutex_lock(&walk->lock);
+    job->next = walk->jobs;
+    walk->jobs = job;
+    pthread_cond_signal(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// Cheap check before an entry is statted: d_type is enough to rule out
+// most paths outside the scope, the rest are checked again afterwards
+static int maybe_in_scope(const TreeIndex *tree, const char *path,
+                          const struct dirent *entry) {
+    int is_dir = entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN;
+    return prefix_match(tree->scope, path, is_dir);
+}
+
+// Read one directory: record its entries, hash its files and queue its
+// subdirectories for any free walker
+static void walk_dir(Walk *walk, const char *rel) {
+    TreeIndex *tree = walk->tree;
+    char dirpath[TREE_MAX_PATH * 2];
+    snprintf(dirpath, sizeof(dirpath), "%s%s%s", tree->root, rel[0] ? "/" : "", rel);
+    DIR *dir = opendir(dirpath);
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char path[TREE_MAX_PATH];
+        int n = snprintf(path, sizeof(path), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name);
+        struct stat st;
+        if (n >= (int)sizeof(path) || !maybe_in_scope(tree, path, entry) ||
+            fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !prefix_match(tree->scope, path, S_ISDIR(st.st_mode))) {
+            continue;
+        }
+
+        uint8_t hash[CHUNK_HASH_SIZE];
+        const uint8_t *hash_ptr = NULL;
+        if (S_ISREG(st.st_mode)) {
+            int fd = openat(dirfd(dir), entry->d_name, O_RDONLY);
+            if (fd >= 0 && tree_hash_file(fd, hash) == 0) hash_ptr = hash;
+            if (fd >= 0) close(fd);
+        } else if (!S_ISDIR(st.st_mode)) {
+            continue;   // symlinks and special files are not synced
+        }
+
+        pthread_mutex_lock(&tree->lock);
+        upsert_locked(tree, path, &st, hash_ptr);
+        pthread_mutex_unlock(&tree->lock);
+        if (S_ISDIR(st.st_mode)) push_job(walk, path);
+    }
+    closedir(dir);
+}
+
+// Submit the queued entries and wait for all of them; res[user_data] gets
+// each result (a negative errno on failure)
+static void ring_run(Uring *ring, unsigned queued, int *res) {
+    if (queued == 0) return;
+    if (uring_submit(ring, queued) < 0) {
+        perror("io_uring_enter");
+        for (unsigned i = 0; i < queued; i++) res[i] = -1;
+        return;
+    }
+    unsigned seen = 0;
+    while (seen < queued) {
+        struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+        if (!cqe) {
+            if (uring_submit(ring, 1) < 0) break;
+            continue;
+        }
+        res[cqe->user_data] = cqe->res;
+        uring_cqe_seen(ring);
+        seen++;
+    }
+}
+
+// Stat, open, read and close up to WALK_BATCH entries of one directory
+// with four submissions instead of four or more syscalls per entry
+static void walk_batch(Walk *walk, WalkRing *wr, int dfd, const char *rel,
+                       WalkEntry *entries, int count) {
+    TreeIndex *tree = walk->tree;
+    int res[WALK_BATCH];
+    unsigned queued = 0;
+    struct io_uring_sqe *sqe;
+
+    for (int i = 0; i < count; i++) {
+        sqe = uring_get_sqe(&wr->ring);
+        uring_prep(sqe, IORING_OP_STATX, dfd, entries[i].name, STATX_BASIC_STATS,
+                   (uint64_t)(uintptr_t)&entries[i].stx);
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = queued++;
+    }
+    ring_run(&wr->ring, queued, res);
+
+    queued = 0;
+    int index[WALK_BATCH];
+    for (int i = 0; i < count; i++) {
+        entries[i].ok = res[i] == 0;
+        entries[i].fd = -1;
+        entries[i].got = -1;
+        if (!entries[i].ok || !S_ISREG(entries[i].stx.stx_mode)) continue;
+        sqe = uring_get_sqe(&wr->ring);
+        uring_prep(sqe, IORING_OP_OPENAT, dfd, entries[i].name, 0, 0);
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        index[queued] = i;
+        sqe->user_data = queued++;
+    }
+    ring_run(&wr->ring, queued, res);
+
+    unsigned opened = queued;
+    queued = 0;
+    for (unsigned k = 0; k < opened; k++) {
+        WalkEntry *e = &entries[index[k]];
+        if (res[k] < 0) continue;
+        e->fd = res[k];
+        uint8_t *slot = wr->slots + (size_t)index[k] * WALK_SLOT;
+        sqe = uring_get_sqe(&wr->ring);
+        uring_prep(sqe, wr->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, e->fd, slot,
+                   WALK_SLOT, 0);
+        sqe->user_data = index[k];
+        queued++;
+    }
+    // Results are indexed by entry here, so clear the ones not submitted
+    for (int i = 0; i < count; i++) res[i] = -1;
+    ring_run(&wr->ring, queued, res);
+
+    queued = 0;
+    for (int i = 0; i < count; i++) {
+        WalkEntry *e = &entries[i];
+        if (!e->ok) continue;
+        if (!S_ISREG(e->stx.stx_mode) && !S_ISDIR(e->stx.stx_mode)) continue;
+
+        char path[TREE_MAX_PATH];
+        int n = snprintf(path, sizeof(path), "%s%s%s", rel, rel[0] ? "/" : "", e->name);
+        if (n >= (int)sizeof(path) ||
+            !prefix_match(tree->scope, path, S_ISDIR(e->stx.stx_mode))) {
+            continue;
+        }
+
+        uint8_t hash[CHUNK_HASH_SIZE];
+        const uint8_t *hash_ptr = NULL;
+        if (e->fd >= 0 && res[i] >= 0) {
+            Sha256 ctx;
+            sha256_init(&ctx);
+            sha256_update(&ctx, wr->slots + (size_t)i * WALK_SLOT, res[i]);
+            if (res[i] < WALK_SLOT) {
+                sha256_final(&ctx, hash);
+                hash_ptr = hash;
+            } else if (hash_rest(e->fd, &ctx, res[i], hash) == 0) {
+                hash_ptr = hash;
+            }
+        }
+
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_mode = e->stx.stx_mode;
+        st.st_size = e->stx.stx_size;
+        st.st_mtim.tv_sec = e->stx.stx_mtime.tv_sec;
+        st.st_mtim.tv_nsec = e->stx.stx_mtime.tv_nsec;
+        pthread_mutex_lock(&tree->lock);
+        upsert_locked(tree, path, &st, hash_ptr);
+        pthread_mutex_unlock(&tree->lock);
+        if (S_ISDIR(st.st_mode)) push_job(walk, path);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (entries[i].fd < 0) continue;
+        sqe = uring_get_sqe(&wr->ring);
+        uring_prep(sqe, IORING_OP_CLOSE, entries[i].fd, NULL, 0, 0);
+        sqe->user_data = queued++;
+    }
+    ring_run(&wr->ring, queued, res);
+}
+
+// walk_dir through io_uring: the names are read first, then handled in
+// batches of WALK_BATCH
+static void walk_dir_uring(Walk *walk, WalkRing *wr, const char *rel) {
+    TreeIndex *tree = walk->tree;
+    char dirpath[TREE_MAX_PATH * 2];
+    snprintf(dirpath, sizeof(dirpath), "%s%s%s", tree->root, rel[0] ? "/" : "", rel);
+    DIR *dir = opendir(dirpath);
+    if (!dir) return;
+
+    WalkEntry entries[WALK_BATCH];
+    int count = 0;
+    struct dirent *entry;
+    while (1) {
+        entry = readdir(dir);
+        if (entry && (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)) {
+            continue;
+        }
+        if (entry) {
+            char path[TREE_MAX_PATH];
+            int n = snprintf(path, sizeof(path), "%s%s%s", rel, rel[0] ? "/" : "",
+                             entry->d_name);
+            if (n >= (int)sizeof(path) || !maybe_in_scope(tree, path, entry)) continue;
+            entries[count].name = strdup(entry->d_name);
+            if (entries[count].name) count++;
+        }
+        if (count == WALK_BATCH || (!entry && count > 0)) {
+            walk_batch(walk, wr, dirfd(dir), rel, entries, count);
+            for (int i = 0; i < count; i++) free(entries[i].name);
+            count = 0;
+        }
+        if (!entry) break;
+    }
+    closedir(dir);
+}
+
+// Set up a walker's ring; returns -1 (and the walker reads directories
+// with plain syscalls) if io_uring is unavailable
+static int walk_ring_init(WalkRing *wr) {
+    if (uring_init(&wr->ring, WALK_BATCH) < 0) return -1;
+    wr->slots = malloc((size_t)WALK_BATCH * WALK_SLOT);
+    if (!wr->slots) {
+        uring_exit(&wr->ring);
+        return -1;
+    }
+    struct iovec iov = { wr->slots, (size_t)WALK_BATCH * WALK_SLOT };
+    wr->fixed = uring_register_buffers(&wr->ring, &iov, 1) == 0;
+    return 0;
+}
+
+static void *walker(void *arg) {
+    Walk *walk = (Walk *)arg;
+    WalkRing wr;
+    int use_uring = walk->tree->use_uring && walk_ring_init(&wr) == 0;
+
+    pthread_mutex_lock(&walk->lock);
+    while (1) {
+        while (!walk->jobs && walk->busy > 0) pthread_cond_wait(&walk->cond, &walk->lock);
+        if (!walk->jobs) break;     // nothing queued and nobody can queue more
+
+        DirJob *job = walk->jobs;
+        walk->jobs = job->next;
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        if (use_uring) walk_dir_uring(walk, &wr, job->path);
+        else walk_dir(walk, job->path);
+        free(job);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->busy--;
+        if (!walk->jobs && walk->busy == 0) pthread_cond_broadcast(&walk->cond);
+    }
+    pthread_mutex_unlock(&walk->lock);
+
+    if (use_uring) {
+        uring_exit(&wr.ring);
+        free(wr.slots);
+    }
+    return NULL;
+}
+
+// Walk the subtree at rel ("" for the root) with the given thread count
+static void walk_tree(TreeIndex *tree, const char *rel, int threads) {
+    Walk walk = { .tree = tree };
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    push_job(&walk, rel);
+
+    pthread_t ids[64];
+    int started = 0;
+    for (int i = 1; i < threads && i < 64; i++) {
+        if (pthread_create(&ids[started], NULL, walker, &walk) == 0) started++;
+    }
+    walker(&walk);
+    for (int i = 0; i < started; i++) pthread_join(ids[i], NULL);
+
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.cond);
+}
+
+TreeIndex *tree_build(const char *root, int threads, int use_uring, const PrefixSet *scope) {
+    TreeIndex *tree = calloc(1, sizeof(TreeIndex));
+    if (!tree) return NULL;
+    tree->nbuckets = TREE_MIN_BUCKETS;
+    tree->buckets = calloc(tree->nbuckets, sizeof(Node *));
+    tree->top = calloc(1, sizeof(Node) + 1);
+    if (!tree->buckets || !tree->top) {
+        free(tree->buckets);
+        free(tree->top);
+        free(tree);
+        return NULL;
+    }
+    tree->top->type = TREE_DIR;
+    tree->top->hashed = 1;
+    pthread_mutex_init(&tree->lock, NULL);
+    snprintf(tree->root, sizeof(tree->root), "%s", root);
+    tree->use_uring = use_uring;
+    tree->scope = scope;
+    walk_tree(tree, "", threads);
+    return tree;
+}
+
+void tree_update(TreeIndex *tree, const char *path) {
+    char fullpath[TREE_MAX_PATH * 2];
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", tree->root, path);
+    struct stat st;
+    int exists = lstat(fullpath, &st) == 0 && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) &&
+                 prefix_match(tree->scope, path, S_ISDIR(st.st_mode));
+
+    pthread_mutex_lock(&tree->lock);
+    if (exists) upsert_locked(tree, path, &st, NULL);
+    else remove_locked(tree, path);
+    pthread_mutex_unlock(&tree->lock);
+
+    if (exists && S_ISDIR(st.st_mode)) walk_tree(tree, path, 1);
+}
+
+// Path that disappeared during a rescan, reported once the lock is dropped
+typedef struct {
+    char *path;
+    int is_dir;
+} Removed;
+
+// Mark everything below rel as seen by the current rescan and report what
+// is new or different from the index
+static void rescan_dir(TreeIndex *tree, const char *rel, TreeChangeFn fn, void *arg) {
+    char dirpath[TREE_MAX_PATH * 2];
+    snprintf(dirpath, sizeof(dirpath), "%s%s%s", tree->root, rel[0] ? "/" : "", rel);
+    DIR *dir = opendir(dirpath);
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char path[TREE_MAX_PATH];
+        int n = snprintf(path, sizeof(path), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name);
+        struct stat st;
+        if (n >= (int)sizeof(path) || !maybe_in_scope(tree, path, entry) ||
+            fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) ||
+            !prefix_match(tree->scope, path, S_ISDIR(st.st_mode))) {
+            continue;
+        }
+        int is_dir = S_ISDIR(st.st_mode);
+
+        int kind = -1, replaced = -1;
+        pthread_mutex_lock(&tree->lock);
+        Node *node = find_locked(tree, path);
+        if (node && node->type != (is_dir ? TREE_DIR : TREE_FILE)) {
+            // A file became a directory or the other way round
+            replaced = node->type == TREE_DIR;
+            remove_locked(tree, path);
+            node = NULL;
+        }
+        if (!node) {
+            kind = TREE_CREATED;
+        } else if (!is_dir && (node->size != (uint64_t)st.st_size ||
+                               node->mtime.tv_sec != st.st_mtim.tv_sec ||
+                               node->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+            kind = TREE_CHANGED;
+        }
+        if (kind >= 0) node = upsert_locked(tree, path, &st, NULL);
+        if (node) node->seen = tree->scan_epoch;
+        pthread_mutex_unlock(&tree->lock);
+
+        if (replaced >= 0) fn(arg, TREE_REMOVED, replaced, path);
+        if (kind >= 0) fn(arg, kind, is_dir, path);
+        if (is_dir) rescan_dir(tree, path, fn, arg);
+    }
+    closedir(dir);
+}
+
+void tree_rescan(TreeIndex *tree, TreeChangeFn fn, void *arg) {
+    pthread_mutex_lock(&tree->lock);
+    uint64_t epoch = ++tree->scan_epoch;
+    tree->top->seen = epoch;
+    pthread_mutex_unlock(&tree->lock);
+
+    rescan_dir(tree, "", fn, arg);
+
+    // Whatever the walk did not reach is gone
+    Removed *removed = NULL;
+    size_t nremoved = 0, cap = 0;
+    pthread_mutex_lock(&tree->lock);
+    for (size_t i = 0; i < tree->nbuckets; i++) {
+        for (Node *node = tree->buckets[i]; node; node = node->next) {
+            if (node->seen == epoch) continue;
+
+            // Only the top of a removed subtree is reported
+            char parent[TREE_MAX_PATH];
+            char *slash = strrchr(node->path, '/');
+            if (slash && (size_t)(slash - node->path) < sizeof(parent)) {
+                memcpy(parent, node->path, slash - node->path);
+                parent[slash - node->path] = '\0';
+                Node *up = find_locked(tree, parent);
+                if (up && up->seen != epoch) continue;
+            }
+            if (nremoved == cap) {
+                size_t new_cap = cap ? cap * 2 : 64;
+                Removed *grown = realloc(removed, new_cap * sizeof(Removed));
+                if (!grown) continue;
+                removed = grown;
+                cap = new_cap;
+            }
+            removed[nremoved].path = strdup(node->path);
+            removed[nremoved].is_dir = node->type == TREE_DIR;
+            if (removed[nremoved].path) nremoved++;
+        }
+    }
+    // Cut each removed subtree loose from the directory that survives it
+    // before anything in it is freed
+    for (size_t i = 0; i < tree->nbuckets; i++) {
+        for (Node *node = tree->buckets[i]; node; node = node->next) {
+            if (node->seen != epoch && node->parent && node->parent->seen == epoch) {
+                unlink_node(node);
+            }
+        }
+    }
+    for (size_t i = 0; i < tree->nbuckets; i++) {
+        Node **link = &tree->buckets[i];
+        while (*link) {
+            Node *node = *link;
+            if (node->seen != epoch) {
+                *link = node->next;
+                free_node(node);
+                tree->count--;
+                tree->generation++;
+            } else {
+                link = &node->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&tree->lock);
+
+    for (size_t i = 0; i < nremoved; i++) {
+        fn(arg, TREE_REMOVED, removed[i].is_dir, removed[i].path);
+        free(removed[i].path);
+    }
+    free(removed);
+}
+
+static int compare_nodes(const void *a, const void *b) {
+    return strcmp((*(Node *const *)a)->path, (*(Node *const *)b)->path);
+}
+
+// File the index has not hashed since it changed, with the size and
+// mtime it was indexed at; hashed with the lock dropped
+typedef struct {
+    char *path;
+    uint64_t size;
+    struct timespec mtime;
+    int ok;                 // hash is of a copy that still matches them
+    uint8_t hash[CHUNK_HASH_SIZE];
+} Unhashed;
+
+typedef struct {
+    Unhashed *files;
+    size_t count;
+    size_t cap;
+} HashList;
+
+static void note_unhashed(HashList *list, Node *node) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        Unhashed *grown = realloc(list->files, cap * sizeof(Unhashed));
+        if (!grown) return;
+        list->files = grown;
+        list->cap = cap;
+    }
+    Unhashed *f = &list->files[list->count];
+    if (!(f->path = strdup(node->path))) return;
+    f->size = node->size;
+    f->mtime = node->mtime;
+    f->ok = 0;
+    list->count++;
+}
+
+// Digest of dir cached for the view, or NULL
+static const uint8_t *cached_digest(Node *dir, const TreeView *view) {
+    Digests *d = dir->digests;
+    for (int i = 0; d && i < DIGEST_SLOTS; i++) {
+        if (d->view[i] == view->id) return d->hash[i];
+    }
+    return NULL;
+}
+
+// Unhashed files below dir that a digest for the view would read. A
+// cached digest means nothing below it changed since. Caller holds lock.
+static void collect_view_locked(HashList *list, Node *dir, const TreeView *view) {
+    if (cached_digest(dir, view)) return;
+    for (Node *child = dir->child; child; child = child->next_sibling) {
+        if (view->skip && view->skip(view->arg, child->path, child->type == TREE_DIR)) continue;
+        if (child->type == TREE_DIR) collect_view_locked(list, child, view);
+        else if (!child->hashed) note_unhashed(list, child);
+    }
+}
+
+// Unhashed files in filter (all of them if it is NULL). Caller holds lock.
+static void collect_filter_locked(HashList *list, TreeIndex *tree, const PrefixSet *filter) {
+    for (size_t i = 0; i < tree->nbuckets; i++) {
+        for (Node *node = tree->buckets[i]; node; node = node->next) {
+            if (node->type == TREE_DIR || node->hashed) continue;
+            if (prefix_match(filter, node->path, 0)) note_unhashed(list, node);
+        }
+    }
+}
+
+// Hash the collected files without the lock, so the watcher's
+// tree_update never waits on a read of a whole file, then install each
+// hash whose node still has the size and mtime it was collected with.
+// Called and returns with the lock held; frees the list.
+static void hash_collected(TreeIndex *tree, HashList *list) {
+    if (!list->count) {
+        free(list->files);
+        return;
+    }
+    pthread_mutex_unlock(&tree->lock);
+    for (size_t i = 0; i < list->count; i++) {
+        Unhashed *f = &list->files[i];
+        char fullpath[TREE_MAX_PATH * 2];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", tree->root, f->path);
+        int fd = open(fullpath, O_RDONLY);
+        struct stat st;
+        f->ok = fd >= 0 && tree_hash_file(fd, f->hash) == 0 && fstat(fd, &st) == 0 &&
+                (uint64_t)st.st_size == f->size && st.st_mtim.tv_sec == f->mtime.tv_sec &&
+                st.st_mtim.tv_nsec == f->mtime.tv_nsec;
+        if (fd >= 0) close(fd);
+    }
+    pthread_mutex_lock(&tree->lock);
+    for (size_t i = 0; i < list->count; i++) {
+        Unhashed *f = &list->files[i];
+        Node *node = f->ok ? find_locked(tree, f->path) : NULL;
+        if (node && node->type == TREE_FILE && !node->hashed && node->size == f->size &&
+            node->mtime.tv_sec == f->mtime.tv_sec && node->mtime.tv_nsec == f->mtime.tv_nsec) {
+            memcpy(node->hash, f->hash, CHUNK_HASH_SIZE);
+            node->hashed = 1;
+        }
+        free(f->path);
+    }
+    free(list->files);
+}
+
+// Hash of a file as last taken. One that could not be read, or changed
+// again while hash_collected had the lock dropped, reads as all zeroes
+// and sets *partial: its event follows anyway, and nothing built on it
+// is cached. Caller holds lock.
+static const uint8_t *file_hash(Node *node, int *partial) {
+    static const uint8_t none[CHUNK_HASH_SIZE];
+    if (node->hashed) return node->hash;
+    *partial = 1;
+    return none;
+}
+
+// Entries directly inside dir that the view covers, sorted by name; *out
+// is malloc'd. Caller holds lock.
+static int children_locked(Node *dir, const TreeView *view, Node ***out) {
+    size_t n = 0, cap = 0;
+    Node **nodes = NULL;
+    for (Node *child = dir->child; child; child = child->next_sibling) {
+        if (view->skip && view->skip(view->arg, child->path, child->type == TREE_DIR)) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            Node **grown = realloc(nodes, cap * sizeof(Node *));
+            if (!grown) {
+                free(nodes);
+                return -1;
+            }
+            nodes = grown;
+        }
+        nodes[n++] = child;
+    }
+    qsort(nodes, n, sizeof(Node *), compare_nodes);
+    *out = nodes;
+    return n;
+}
+
+// Hash of an entry as its directory's digest sees it: a file's contents,
+// or a directory's own digest. Sets *partial if a file below had no hash.
+// Caller holds lock.
+static int digest_locked(TreeIndex *tree, Node *node, const TreeView *view,
+                         uint8_t out[CHUNK_HASH_SIZE], int *partial) {
+    if (node->type != TREE_DIR) {
+        memcpy(out, file_hash(node, partial), CHUNK_HASH_SIZE);
+        return 0;
+    }
+    const uint8_t *cached = cached_digest(node, view);
+    if (cached) {
+        memcpy(out, cached, CHUNK_HASH_SIZE);
+        return 0;
+    }
+
+    Node **children;
+    int n = children_locked(node, view, &children);
+    if (n < 0) return -1;
+    int below = 0;
+    Sha256 ctx;
+    sha256_init(&ctx);
+    for (int i = 0; i < n; i++) {
+        uint8_t entry[1 + 8 + 2], hash[CHUNK_HASH_SIZE];
+        const char *name = children[i]->path + (node->path[0] ? strlen(node->path) + 1 : 0);
+        size_t len = strlen(name);
+        if (digest_locked(tree, children[i], view, hash, &below) < 0) {
+            free(children);
+            return -1;
+        }
+        entry[0] = children[i]->type;
+        sync_put64(entry + 1, children[i]->size);
+        sync_put16(entry + 9, len);
+        sha256_update(&ctx, entry, sizeof(entry));
+        sha256_update(&ctx, (const uint8_t *)name, len);
+        sha256_update(&ctx, hash, CHUNK_HASH_SIZE);
+    }
+    free(children);
+    sha256_final(&ctx, out);
+
+    if (below) {
+        *partial = 1;
+        return 0;
+    }
+    Digests *d = node->digests;
+    if (!d && !(d = node->digests = calloc(1, sizeof(Digests)))) return 0;
+    unsigned slot = d->next++ % DIGEST_SLOTS;
+    d->view[slot] = view->id;
+    memcpy(d->hash[slot], out, CHUNK_HASH_SIZE);
+    return 0;
+}
+
+int tree_digest(TreeIndex *tree, const TreeView *view, const char *dir,
+                uint8_t out[CHUNK_HASH_SIZE]) {
+    pthread_mutex_lock(&tree->lock);
+    Node *node = find_locked(tree, dir);
+    int rc = -1, partial = 0;
+    if (node && node->type == TREE_DIR &&
+        !(dir[0] && view->skip && view->skip(view->arg, dir, 1))) {
+        HashList list = {0};
+        collect_view_locked(&list, node, view);
+        hash_collected(tree, &list);
+        node = find_locked(tree, dir);      // it may have gone meanwhile
+        if (node && node->type == TREE_DIR) rc = digest_locked(tree, node, view, out, &partial);
+    }
+    pthread_mutex_unlock(&tree->lock);
+    return rc;
+}
+
+int tree_list(TreeIndex *tree, const TreeView *view, const char *dir, uint8_t **out,
+              size_t *out_len) {
+    pthread_mutex_lock(&tree->lock);
+    Node *node = find_locked(tree, dir);
+    Node **children = NULL;
+    int n = 0, partial = 0;
+    if (node && node->type == TREE_DIR &&
+        !(dir[0] && view->skip && view->skip(view->arg, dir, 1))) {
+        HashList list = {0};
+        collect_view_locked(&list, node, view);
+        hash_collected(tree, &list);
+        node = find_locked(tree, dir);
+        if (node && node->type == TREE_DIR) n = children_locked(node, view, &children);
+    }
+    size_t prefix = dir[0] ? strlen(dir) + 1 : 0, raw_len = 4;
+    for (int i = 0; i < n; i++) raw_len += TREE_ENTRY_FIXED + strlen(children[i]->path) - prefix;
+    uint8_t *raw = n >= 0 ? malloc(raw_len) : NULL;
+    if (!raw) {
+        pthread_mutex_unlock(&tree->lock);
+        free(children);
+        return -1;
+    }
+
+    sync_put32(raw, n);
+    size_t pos = 4;
+    for (int i = 0; i < n; i++) {
+        Node *child = children[i];
+        const char *name = child->path + prefix;
+        size_t len = strlen(name);
+        if (digest_locked(tree, child, view, raw + pos + 21, &partial) < 0) {
+            pthread_mutex_unlock(&tree->lock);
+            free(children);
+            free(raw);
+            return -1;
+        }
+        raw[pos] = child->type;
+        sync_put64(raw + pos + 1, child->size);
+        sync_put64(raw + pos + 9, child->mtime.tv_sec);
+        sync_put32(raw + pos + 17, child->mtime.tv_nsec);
+        sync_put16(raw + pos + 21 + CHUNK_HASH_SIZE, len);
+        memcpy(raw + pos + TREE_ENTRY_FIXED, name, len);
+        pos += TREE_ENTRY_FIXED + len;
+    }
+    pthread_mutex_unlock(&tree->lock);
+    free(children);
+    *out = raw;
+    *out_len = raw_len;
+    return 0;
+}
+
+// Encode every entry in filter (all of them if it is NULL), with the hashes
+// hash_collected took. Sets *partial if a file had none. Caller holds lock.
+static int encode_locked(TreeIndex *tree, const PrefixSet *filter, uint8_t **out,
+                         size_t *out_len, int *partial) {
+    Node **nodes = malloc((tree->count + 1) * sizeof(Node *));
+    if (!nodes) return -1;
+    size_t n = 0, raw_len = 4;
+    for (size_t i = 0; i < tree->nbuckets; i++) {
+        for (Node *node = tree->buckets[i]; node; node = node->next) {
+            if (!prefix_match(filter, node->path, node->type == TREE_DIR)) continue;
+            nodes[n++] = node;
+            raw_len += TREE_ENTRY_FIXED + strlen(node->path);
+        }
+    }
+    qsort(nodes, n, sizeof(Node *), compare_nodes);
+
+    uint8_t *raw = malloc(raw_len);
+    if (!raw) {
+        free(nodes);
+        return -1;
+    }
+    sync_put32(raw, n);
+    size_t pos = 4;
+    for (size_t i = 0; i < n; i++) {
+        Node *node = nodes[i];
+        size_t len = strlen(node->path);
+        raw[pos] = node->type;
+        sync_put64(raw + pos + 1, node->size);
+        sync_put64(raw + pos + 9, node->mtime.tv_sec);
+        sync_put32(raw + pos + 17, node->mtime.tv_nsec);
+        memcpy(raw + pos + 21, file_hash(node, partial), CHUNK_HASH_SIZE);
+        sync_put16(raw + pos + 21 + CHUNK_HASH_SIZE, len);
+        memcpy(raw + pos + TREE_ENTRY_FIXED, node->path, len);
+        pos += TREE_ENTRY_FIXED + len;
+    }
+    free(nodes);
+
+    int rc = tree_compress(raw, raw_len, out, out_len);
+    free(raw);
+    return rc;
+}
+
+int tree_manifest(TreeIndex *tree, const PrefixSet *filter, uint8_t **out, size_t *out_len) {
+    int partial = 0;
+    pthread_mutex_lock(&tree->lock);
+    if (prefix_count(filter) > 0 || !tree->cached ||
+        tree->cached_generation != tree->generation) {
+        // Rehash files changed since the last manifest
+        HashList list = {0};
+        collect_filter_locked(&list, tree, filter);
+        hash_collected(tree, &list);
+    }
+    if (prefix_count(filter) > 0) {
+        // Subscriptions differ between clients, so these are not cached
+        int rc = encode_locked(tree, filter, out, out_len, &partial);
+        pthread_mutex_unlock(&tree->lock);
+        return rc;
+    }
+    if (!tree->cached || tree->cached_generation != tree->generation) {
+        free(tree->cached);
+        tree->cached = NULL;
+        if (encode_locked(tree, NULL, &tree->cached, &tree->cached_len, &partial) < 0) {
+            pthread_mutex_unlock(&tree->lock);
+            return -1;
+        }
+        tree->cached_generation = tree->generation;
+    }
+    *out = malloc(tree->cached_len);
+    if (*out) memcpy(*out, tree->cached, tree->cached_len);
+    *out_len = tree->cached_len;
+    if (partial) {
+        // One with a file missing its hash is used once, not cached
+        free(tree->cached);
+        tree->cached = NULL;
+    }
+    pthread_mutex_unlock(&tree->lock);
+    return *out ? 0 : -1;
+}
+
+int tree_compress(const uint8_t *raw, size_t raw_len, uint8_t **out, size_t *out_len) {
+    uLongf len = compressBound(raw_len);
+    uint8_t *buf = malloc(8 + len);
+    if (!buf) return -1;
+    if (compress2(buf + 8, &len, raw, raw_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        free(buf);
+        return -1;
+    }
+    sync_put64(buf, raw_len);
+    *out = buf;
+    *out_len = 8 + len;
+    return 0;
+}
+
+int tree_decompress(const uint8_t *payload, size_t len, uint8_t **raw, size_t *raw_len) {
+    if (len < 8) return -1;
+    uint64_t expected = sync_get64(payload);
+    if (expected > TREE_MAX_RAW) return -1;
+    uint8_t *buf = malloc(expected ? expected : 1);
+    if (!buf) return -1;
+    uLongf got = expected;
+    if (uncompress(buf, &got, payload + 8, len - 8) != Z_OK || got != expected) {
+        free(buf);
+        return -1;
+    }
+    *raw = buf;
+    *raw_len = got;
+    return 0;
+}
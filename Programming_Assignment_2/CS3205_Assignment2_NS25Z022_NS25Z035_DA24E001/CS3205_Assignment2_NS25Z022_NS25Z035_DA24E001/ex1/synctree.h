@@ -0,0 +1,145 @@
+/*
+ * Recursive tree manifest used for the initial snapshot
+ * -----------------------------------------------------
+ * The server keeps one TreeIndex for the synced directory: every path with
+ * its type, size, mtime and SHA-256. It is built once at startup by a pool
+ * of walker threads and then kept current from inotify events, so a new
+ * client costs one (cached) compressed manifest instead of a full walk.
+ *
+ * The client compares the manifest against its own copy and answers with
+ * the paths it lacks; only those are streamed.
+ *
+ * SYNC_MANIFEST payload: u64 raw_len, then zlib-compressed entries:
+ *   u32 count, count x (u8 type, u64 size, u64 mtime_sec, u32 mtime_nsec,
+ *                       hash[32], u16 path_len, path)
+ * SYNC_WANT payload:     u64 raw_len, then zlib-compressed
+ *                        n x (u16 path_len, path)
+ * Entries are sorted by path, so directories precede their contents.
+ *
+ * The index is also a Merkle tree: a directory's digest is the SHA-256 of
+ * its entries in name order, each as (u8 type, u64 size, u16 name_len,
+ * name, hash), where a file's hash is that of its contents and a
+ * subdirectory's is its own digest. mtimes are left out, since a mirror's
+ * files carry the times they were written there. Digests are cached per
+ * directory and dropped up the parent chain when anything below changes,
+ * so after an event only the directories above it are hashed again.
+ *
+ * Anti-entropy compares two trees top down, one level per round trip:
+ *
+ * SYNC_VERIFY payload:   n x (u16 path_len, path, digest[32]) of the
+ *                        client's directories ("" is the root)
+ * SYNC_LISTING payload:  u64 raw_len, then zlib-compressed
+ *                        u32 owned_len, owned (the server's -o list),
+ *                        u32 count, count x (u16 path_len, path, listing)
+ *                        for each directory whose digest differs
+ *
+ * A listing is a u32 entry count followed by entries as in the manifest,
+ * but with the entry's name in place of its path and, for directories,
+ * the digest in place of the hash. An empty SYNC_LISTING means every
+ * directory in the request matched.
+ */
+
+#ifndef SYNCTREE_H
+#define SYNCTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "syncproto.h"
+#include "syncchunk.h"
+#include "syncprefix.h"
+
+#define TREE_FILE   0
+#define TREE_DIR    1
+#define TREE_ENTRY_FIXED (1 + 8 + 8 + 4 + CHUNK_HASH_SIZE + 2)
+#define TREE_MAX_RAW (512 * 1024 * 1024)
+#define TREE_VERIFY_FIXED (2 + CHUNK_HASH_SIZE)
+
+typedef struct {
+    int type;
+    uint64_t size;
+    uint64_t mtime_sec;
+    uint32_t mtime_nsec;
+    const uint8_t *hash;
+    const char *path;       // not NUL-terminated
+    size_t path_len;
+} TreeEntry;
+
+typedef struct TreeIndex TreeIndex;
+
+// The paths a digest or listing covers: skip returns nonzero for those to
+// leave out (NULL leaves out none). Digests are cached per view id, so
+// views sharing an id must skip the same paths; 0 is not a valid id.
+typedef struct {
+    int (*skip)(void *arg, const char *path, int is_dir);
+    void *arg;
+    uint64_t id;
+} TreeView;
+
+// Walk root with the given number of threads and hash every file. With
+// use_uring each walker stats, opens, reads and closes a directory's
+// entries in batches through its own io_uring (falling back to plain
+// syscalls where io_uring is unavailable); new directories found later by
+// tree_update are walked the same way. Only paths in scope are indexed (a
+// NULL scope covers the whole tree); the set must outlive the index.
+TreeIndex *tree_build(const char *root, int threads, int use_uring, const PrefixSet *scope);
+
+// Re-examine one path (relative to root) after an event: a new directory
+// is walked, a changed file is rehashed lazily, a vanished path and
+// everything below it is dropped
+void tree_update(TreeIndex *tree, const char *path);
+
+// Kinds of difference reported by tree_rescan
+enum { TREE_CREATED, TREE_CHANGED, TREE_REMOVED };
+
+typedef void (*TreeChangeFn)(void *arg, int kind, int is_dir, const char *path);
+
+// Compare the tree on disk against the index after events were lost (for
+// example on inotify queue overflow), bring the index up to date and report
+// each difference: created and changed paths first, parents before their
+// contents, then removed paths (only the topmost of a removed subtree).
+// Files are compared by size and mtime, so nothing is rehashed here.
+void tree_rescan(TreeIndex *tree, TreeChangeFn fn, void *arg);
+
+// Compressed SYNC_MANIFEST payload of the entries in filter (NULL for all of
+// them); *out is malloc'd. The unfiltered encoding is cached until the tree
+// next changes.
+int tree_manifest(TreeIndex *tree, const PrefixSet *filter, uint8_t **out, size_t *out_len);
+
+// Merkle digest of a directory ("" for the root) as the view sees it;
+// returns -1 if the index has no such directory in the view
+int tree_digest(TreeIndex *tree, const TreeView *view, const char *dir,
+                uint8_t out[CHUNK_HASH_SIZE]);
+
+// Listing of the entries directly inside a directory, as carried in
+// SYNC_LISTING; one the index lacks lists as empty. *out is malloc'd.
+int tree_list(TreeIndex *tree, const TreeView *view, const char *dir, uint8_t **out,
+              size_t *out_len);
+
+// zlib helpers for SYNC_MANIFEST, SYNC_WANT and SYNC_LISTING payloads
+int tree_compress(const uint8_t *raw, size_t raw_len, uint8_t **out, size_t *out_len);
+int tree_decompress(const uint8_t *payload, size_t len, uint8_t **raw, size_t *raw_len);
+
+// Hash a whole file with pread; returns -1 if it cannot be read
+int tree_hash_file(int fd, uint8_t out[CHUNK_HASH_SIZE]);
+
+// Parse the manifest entry at *pos in raw; returns 0, or -1 at the end or
+// on a malformed entry
+static inline int tree_next_entry(const uint8_t *raw, size_t raw_len, size_t *pos,
+                                  TreeEntry *entry) {
+    size_t p = *pos;
+    if (raw_len - p < TREE_ENTRY_FIXED) return -1;
+    entry->type = raw[p];
+    entry->size = sync_get64(raw + p + 1);
+    entry->mtime_sec = sync_get64(raw + p + 9);
+    entry->mtime_nsec = sync_get32(raw + p + 17);
+    entry->hash = raw + p + 21;
+    entry->path_len = sync_get16(raw + p + 21 + CHUNK_HASH_SIZE);
+    p += TREE_ENTRY_FIXED;
+    if (raw_len - p < entry->path_len) return -1;
+    entry->path = (const char *)raw + p;
+    *pos = p + entry->path_len;
+    return 0;
+}
+
+#endif
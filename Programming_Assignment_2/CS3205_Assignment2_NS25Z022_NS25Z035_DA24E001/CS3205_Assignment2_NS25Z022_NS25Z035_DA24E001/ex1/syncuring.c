@@ -0,0 +1,116 @@
+// io_uring setup and queue handling over raw syscalls (see syncuring.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "syncuring.h"
+
+int uring_init(Uring *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) return -1;
+
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_len > ring->sq_map_len) ring->sq_map_len = ring->cq_map_len;
+        ring->cq_map_len = ring->sq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) goto fail;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    char *cq = ring->cq_map;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        uring_exit(ring);
+        errno = saved;
+    }
+    return -1;
+}
+
+void uring_exit(Uring *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if (ring->sq_map && ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_len);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) return NULL;
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+int uring_submit(Uring *ring, unsigned wait_nr) {
+    unsigned tail = *ring->sq_tail;
+    unsigned count = ring->sq_local_tail - tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    while (1) {
+        int rc = syscall(__NR_io_uring_enter, ring->fd, count, wait_nr, flags, NULL, 0);
+        if (rc >= 0) return rc;
+        if (errno != EINTR) return -1;
+        count = 0;  // already consumed by the kernel; just wait again
+    }
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_files(Uring *ring, const int *fds, unsigned count) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, count);
+}
+
+int uring_register_buffers(Uring *ring, const struct iovec *iov, unsigned count) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count);
+}
@@ -0,0 +1,74 @@
+/*
+ * Minimal io_uring wrapper (raw syscalls, no liburing)
+ * ----------------------------------------------------
+ * Just enough of the interface for batching: get submission entries, fill
+ * them in with uring_prep(), submit them all with one io_uring_enter and
+ * reap the completions. A ring belongs to one thread.
+ *
+ *   struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+ *   uring_prep(sqe, IORING_OP_STATX, dirfd, name, mask, buf);
+ *   sqe->user_data = i;
+ *   uring_submit(&ring, queued);           // one syscall for the batch
+ *   while ((cqe = uring_peek_cqe(&ring))) { ...; uring_cqe_seen(&ring); }
+ *
+ * uring_init fails (returns -1) on kernels without io_uring or where it is
+ * disabled, so callers can fall back to their blocking path.
+ */
+
+#ifndef SYNCURING_H
+#define SYNCURING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     // entries handed out but not yet submitted
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+} Uring;
+
+int uring_init(Uring *ring, unsigned entries);
+void uring_exit(Uring *ring);
+
+// Next free submission entry, zeroed; NULL when the queue is full
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+// Submit everything queued and wait until at least wait_nr completions
+// are available; returns the number submitted or -1 with errno set
+int uring_submit(Uring *ring, unsigned wait_nr);
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+void uring_cqe_seen(Uring *ring);
+
+int uring_register_files(Uring *ring, const int *fds, unsigned count);
+int uring_register_buffers(Uring *ring, const struct iovec *iov, unsigned count);
+
+static inline void uring_prep(struct io_uring_sqe *sqe, int op, int fd, const void *addr,
+                              unsigned len, uint64_t off) {
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+}
+
+#endif
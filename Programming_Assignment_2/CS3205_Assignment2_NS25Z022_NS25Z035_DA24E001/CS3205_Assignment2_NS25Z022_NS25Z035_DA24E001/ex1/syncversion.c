@@ -0,0 +1,347 @@
+// Version vectors and the striped path table (see syncversion.h)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "syncversion.h"
+#include "syncproto.h"
+
+#define STRIPES 64
+#define STRIPE_MIN_BUCKETS 64
+
+int vv_compare(const VersionVector *a, const VersionVector *b) {
+    int a_newer = 0, b_newer = 0;
+    size_t i = 0, j = 0;
+    while (i < a->count || j < b->count) {
+        uint64_t ca = 0, cb = 0;
+        if (j >= b->count || (i < a->count && a->dots[i].replica < b->dots[j].replica)) {
+            ca = a->dots[i++].counter;
+        } else if (i >= a->count || b->dots[j].replica < a->dots[i].replica) {
+            cb = b->dots[j++].counter;
+        } else {
+            ca = a->dots[i++].counter;
+            cb = b->dots[j++].counter;
+        }
+        if (ca > cb) a_newer = 1;
+        if (cb > ca) b_newer = 1;
+    }
+    if (a_newer && b_newer) return VV_CONCURRENT;
+    if (a_newer) return VV_AFTER;
+    if (b_newer) return VV_BEFORE;
+    return VV_EQUAL;
+}
+
+// Slot of replica in vv, inserting a zero counter there if it is missing
+static VersionDot *find_dot(VersionVector *vv, uint64_t replica) {
+    size_t i = 0;
+    while (i < vv->count && vv->dots[i].replica < replica) i++;
+    if (i < vv->count && vv->dots[i].replica == replica) return &vv->dots[i];
+    if (vv->count == UINT16_MAX) return NULL;
+
+    VersionDot *dots = realloc(vv->dots, (vv->count + 1) * sizeof(VersionDot));
+    if (!dots) return NULL;
+    memmove(dots + i + 1, dots + i, (vv->count - i) * sizeof(VersionDot));
+    dots[i].replica = replica;
+    dots[i].counter = 0;
+    vv->dots = dots;
+    vv->count++;
+    return &dots[i];
+}
+
+int vv_merge(VersionVector *dst, const VersionVector *src) {
+    for (size_t i = 0; i < src->count; i++) {
+        VersionDot *dot = find_dot(dst, src->dots[i].replica);
+        if (!dot) return -1;
+        if (src->dots[i].counter > dot->counter) dot->counter = src->dots[i].counter;
+    }
+    return 0;
+}
+
+int vv_bump(VersionVector *vv, uint64_t replica) {
+    VersionDot *dot = find_dot(vv, replica);
+    if (!dot) return -1;
+    dot->counter++;
+    return 0;
+}
+
+int vv_copy(VersionVector *dst, const VersionVector *src) {
+    VersionDot *dots = NULL;
+    if (src->count) {
+        dots = malloc(src->count * sizeof(VersionDot));
+        if (!dots) return -1;
+        memcpy(dots, src->dots, src->count * sizeof(VersionDot));
+    }
+    free(dst->dots);
+    dst->dots = dots;
+    dst->count = src->count;
+    return 0;
+}
+
+void vv_free(VersionVector *vv) {
+    free(vv->dots);
+    vv->dots = NULL;
+    vv->count = 0;
+}
+
+size_t vv_encoded_size(const VersionVector *vv) {
+    return 2 + (size_t)vv->count * 16;
+}
+
+void vv_encode(const VersionVector *vv, uint8_t *out) {
+    sync_put16(out, vv->count);
+    for (size_t i = 0; i < vv->count; i++) {
+        sync_put64(out + 2 + i * 16, vv->dots[i].replica);
+        sync_put64(out + 10 + i * 16, vv->dots[i].counter);
+    }
+}
+
+int vv_decode(const uint8_t *p, size_t len, VersionVector *vv) {
+    if (len < 2) return -1;
+    size_t count = sync_get16(p);
+    if (len - 2 < count * 16) return -1;
+    VersionDot *dots = count ? malloc(count * sizeof(VersionDot)) : NULL;
+    if (count && !dots) return -1;
+    for (size_t i = 0; i < count; i++) {
+        dots[i].replica = sync_get64(p + 2 + i * 16);
+        dots[i].counter = sync_get64(p + 10 + i * 16);
+        if (i > 0 && dots[i].replica <= dots[i - 1].replica) {
+            free(dots);
+            return -1;
+        }
+    }
+    free(vv->dots);
+    vv->dots = dots;
+    vv->count = count;
+    return 2 + count * 16;
+}
+
+uint64_t version_new_replica(void) {
+    uint64_t id = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &id, sizeof(id)) != sizeof(id)) id = 0;
+        close(fd);
+    }
+    if (!id) id = (uint64_t)time(NULL) << 20 ^ (uint64_t)getpid();
+    return id ? id : 1;
+}
+
+typedef struct Node {
+    struct Node *next;
+    uint32_t hash;
+    VersionState s;
+    char path[];
+} Node;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Node **buckets;
+    size_t nbuckets;
+    size_t count;
+} Stripe;
+
+struct VersionTable {
+    Stripe stripes[STRIPES];
+};
+
+static uint32_t hash_path(const char *path) {
+    uint32_t h = 2166136261u;
+    for (const char *c = path; *c; c++) h = (h ^ (uint8_t)*c) * 16777619u;
+    return h;
+}
+
+VersionTable *version_table_new(void) {
+    VersionTable *t = calloc(1, sizeof(VersionTable));
+    if (!t) return NULL;
+    for (int i = 0; i < STRIPES; i++) {
+        Stripe *stripe = &t->stripes[i];
+        pthread_mutex_init(&stripe->lock, NULL);
+        stripe->nbuckets = STRIPE_MIN_BUCKETS;
+        stripe->buckets = calloc(stripe->nbuckets, sizeof(Node *));
+        if (!stripe->buckets) {
+            version_table_free(t);
+            return NULL;
+        }
+    }
+    return t;
+}
+
+static void free_node(Node *node) {
+    vv_free(&node->s.vv);
+    free(node);
+}
+
+void version_table_free(VersionTable *t) {
+    if (!t) return;
+    for (int i = 0; i < STRIPES; i++) {
+        Stripe *stripe = &t->stripes[i];
+        for (size_t b = 0; stripe->buckets && b < stripe->nbuckets; b++) {
+            while (stripe->buckets[b]) {
+                Node *node = stripe->buckets[b];
+                stripe->buckets[b] = node->next;
+                free_node(node);
+            }
+        }
+        free(stripe->buckets);
+        pthread_mutex_destroy(&stripe->lock);
+    }
+    free(t);
+}
+
+// Link a node into its stripe, doubling the buckets when chains get long;
+// caller holds the stripe lock
+static void insert_locked(Stripe *stripe, Node *node) {
+    if (stripe->count >= stripe->nbuckets * 2) {
+        size_t nbuckets = stripe->nbuckets * 2;
+        Node **buckets = calloc(nbuckets, sizeof(Node *));
+        if (buckets) {
+            for (size_t b = 0; b < stripe->nbuckets; b++) {
+                while (stripe->buckets[b]) {
+                    Node *n = stripe->buckets[b];
+                    stripe->buckets[b] = n->next;
+                    n->next = buckets[(n->hash / STRIPES) % nbuckets];
+                    buckets[(n->hash / STRIPES) % nbuckets] = n;
+                }
+            }
+            free(stripe->buckets);
+            stripe->buckets = buckets;
+            stripe->nbuckets = nbuckets;
+        }
+    }
+    Node **bucket = &stripe->buckets[(node->hash / STRIPES) % stripe->nbuckets];
+    node->next = *bucket;
+    *bucket = node;
+    stripe->count++;
+}
+
+static Node *new_node(const char *path, uint32_t hash) {
+    size_t len = strlen(path);
+    Node *node = calloc(1, sizeof(Node) + len + 1);
+    if (!node) return NULL;
+    node->hash = hash;
+    node->s.stripe = hash % STRIPES;
+    memcpy(node->path, path, len + 1);
+    return node;
+}
+
+VersionState *version_lock(VersionTable *t, const char *path, int create) {
+    uint32_t hash = hash_path(path);
+    Stripe *stripe = &t->stripes[hash % STRIPES];
+    pthread_mutex_lock(&stripe->lock);
+    Node *node = stripe->buckets[(hash / STRIPES) % stripe->nbuckets];
+    while (node && (node->hash != hash || strcmp(node->path, path) != 0)) node = node->next;
+    if (!node && create && (node = new_node(path, hash)) != NULL) insert_locked(stripe, node);
+    if (!node) {
+        pthread_mutex_unlock(&stripe->lock);
+        return NULL;
+    }
+    return &node->s;
+}
+
+void version_unlock(VersionTable *t, VersionState *s) {
+    pthread_mutex_unlock(&t->stripes[s->stripe].lock);
+}
+
+void version_stamp(VersionState *s, const struct stat *st) {
+    s->ino = st->st_ino;
+    s->size = st->st_size;
+    s->mtime = st->st_mtim;
+    s->ctime = st->st_ctim;
+}
+
+int version_same(const VersionState *s, const struct stat *st) {
+    return s->ino == st->st_ino && s->size == st->st_size &&
+           s->mtime.tv_sec == st->st_mtim.tv_sec && s->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           s->ctime.tv_sec == st->st_ctim.tv_sec && s->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static int path_is_under(const char *path, const char *dir, size_t dir_len) {
+    if (dir_len == 0) return 1;
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '\0' || path[dir_len] == '/');
+}
+
+void version_move(VersionTable *t, const char *old_path, const char *new_path) {
+    size_t old_len = strlen(old_path), new_len = strlen(new_path);
+    if (old_len == 0) return;
+    for (int i = 0; i < STRIPES; i++) pthread_mutex_lock(&t->stripes[i].lock);
+
+    // Nothing to move (already moved, or never seen): leave new_path alone
+    int found = 0;
+    for (int i = 0; i < STRIPES && !found; i++) {
+        Stripe *stripe = &t->stripes[i];
+        for (size_t b = 0; b < stripe->nbuckets && !found; b++) {
+            for (Node *node = stripe->buckets[b]; node && !found; node = node->next) {
+                found = path_is_under(node->path, old_path, old_len);
+            }
+        }
+    }
+
+    // Detach what is moving, and drop whatever it lands on
+    Node *moving = NULL;
+    for (int i = 0; found && i < STRIPES; i++) {
+        Stripe *stripe = &t->stripes[i];
+        for (size_t b = 0; b < stripe->nbuckets; b++) {
+            Node **link = &stripe->buckets[b];
+            while (*link) {
+                Node *node = *link;
+                if (path_is_under(node->path, old_path, old_len)) {
+                    *link = node->next;
+                    node->next = moving;
+                    moving = node;
+                    stripe->count--;
+                } else if (path_is_under(node->path, new_path, new_len)) {
+                    *link = node->next;
+                    free_node(node);
+                    stripe->count--;
+                } else {
+                    link = &node->next;
+                }
+            }
+        }
+    }
+
+    while (moving) {
+        Node *node = moving;
+        moving = node->next;
+        size_t len = new_len + strlen(node->path + old_len) + 1;
+        char *path = malloc(len);
+        Node *moved = NULL;
+        if (path) {
+            snprintf(path, len, "%s%s", new_path, node->path + old_len);
+            moved = new_node(path, hash_path(path));
+            free(path);
+        }
+        if (moved) {
+            unsigned stripe = moved->s.stripe;
+            moved->s = node->s;
+            moved->s.stripe = stripe;
+            moved->s.origin = 0;
+            node->s.vv.dots = NULL;     // now owned by the moved copy
+            insert_locked(&t->stripes[stripe], moved);
+        }
+        free_node(node);
+    }
+
+    for (int i = STRIPES - 1; i >= 0; i--) pthread_mutex_unlock(&t->stripes[i].lock);
+}
+
+void version_each(VersionTable *t, const char *path,
+                  void (*fn)(void *arg, const char *path, VersionState *s), void *arg) {
+    size_t len = strlen(path);
+    for (int i = 0; i < STRIPES; i++) {
+        Stripe *stripe = &t->stripes[i];
+        pthread_mutex_lock(&stripe->lock);
+        for (size_t b = 0; b < stripe->nbuckets; b++) {
+            for (Node *node = stripe->buckets[b]; node; node = node->next) {
+                if (path_is_under(node->path, path, len)) fn(arg, node->path, &node->s);
+            }
+        }
+        pthread_mutex_unlock(&stripe->lock);
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * Per-file version vectors for two-way sync
+ * -----------------------------------------
+ * Every replica (the server and each client run) has a random 64-bit id.
+ * A file's version vector counts, per replica, the changes that replica
+ * made to it; a replica bumps its own counter whenever it changes the
+ * file. Comparing two vectors tells whether one copy is a newer version
+ * of the other or whether both were changed without seeing each other's
+ * change (a conflict):
+ *
+ *   {A:2, B:1} vs {A:1, B:1}   after: the first one saw everything the
+ *                              second did, plus one more change by A
+ *   {A:2, B:1} vs {A:1, B:2}   concurrent: A and B both changed it
+ *
+ * A VersionTable maps paths to their vector, whether the path currently
+ * exists (deletes are kept as tombstones so they can conflict too) and the
+ * stat of the copy the vector describes, which is how a watcher tells
+ * writes it made itself from new local changes. It is split into stripes
+ * with a lock each, so threads working on different paths rarely meet.
+ *
+ * Wire encoding of a vector: u16 count, count x (u64 replica, u64 counter),
+ * sorted by replica.
+ */
+
+#ifndef SYNCVERSION_H
+#define SYNCVERSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+
+typedef struct {
+    uint64_t replica;
+    uint64_t counter;
+} VersionDot;
+
+typedef struct {
+    VersionDot *dots;   // sorted by replica
+    uint16_t count;
+} VersionVector;
+
+enum { VV_EQUAL, VV_BEFORE, VV_AFTER, VV_CONCURRENT };
+
+// How a compares to b
+int vv_compare(const VersionVector *a, const VersionVector *b);
+
+// dst = the element-wise maximum of dst and src; -1 if out of memory
+int vv_merge(VersionVector *dst, const VersionVector *src);
+
+// Count one more change by replica; -1 if out of memory
+int vv_bump(VersionVector *vv, uint64_t replica);
+
+int vv_copy(VersionVector *dst, const VersionVector *src);
+void vv_free(VersionVector *vv);
+
+size_t vv_encoded_size(const VersionVector *vv);
+void vv_encode(const VersionVector *vv, uint8_t *out);
+
+// Decode a vector at the start of p; returns the bytes used, or -1 if it
+// is malformed or out of memory
+int vv_decode(const uint8_t *p, size_t len, VersionVector *vv);
+
+// Random non-zero replica id
+uint64_t version_new_replica(void);
+
+typedef struct {
+    VersionVector vv;
+    int exists;         // 0: tombstone of a deleted path
+    int is_dir;         // directories carry no vector, only existence
+    int pending;        // client: pushed but not yet acknowledged
+    uint64_t origin;    // server: replica whose push made the current state
+    // stat of the copy vv describes (files only)
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned stripe;
+} VersionState;
+
+typedef struct VersionTable VersionTable;
+
+VersionTable *version_table_new(void);
+void version_table_free(VersionTable *t);
+
+// Look up path and lock its stripe. With create, a missing path gets a
+// fresh entry (no vector, not existing). Returns NULL, with nothing held,
+// if the path is unknown or out of memory; otherwise the caller must call
+// version_unlock.
+VersionState *version_lock(VersionTable *t, const char *path, int create);
+void version_unlock(VersionTable *t, VersionState *s);
+
+// Remember st as the copy s describes, or check whether st still is it
+void version_stamp(VersionState *s, const struct stat *st);
+int version_same(const VersionState *s, const struct stat *st);
+
+// Re-key every entry at or below old_path to sit below new_path (a rename
+// carries its history along, though not its origin); entries already
+// there are replaced. Does nothing if no entry is at or below old_path.
+void version_move(VersionTable *t, const char *old_path, const char *new_path);
+
+// Call fn for every entry at or below path ("" for all of them) with its
+// stripe locked. fn must not call back into the table.
+void version_each(VersionTable *t, const char *path,
+                  void (*fn)(void *arg, const char *path, VersionState *s), void *arg);
+
+#endif
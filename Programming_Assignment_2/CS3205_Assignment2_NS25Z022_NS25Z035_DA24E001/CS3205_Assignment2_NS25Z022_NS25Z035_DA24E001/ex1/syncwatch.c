@@ -0,0 +1,156 @@
+// Watch-descriptor to path table (see syncwatch.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "syncwatch.h"
+
+#define MIN_BUCKETS 256
+
+typedef struct WatchNode {
+    struct WatchNode *next;
+    int wd;
+    char *path;
+} WatchNode;
+
+struct WatchTable {
+    WatchNode **buckets;
+    size_t nbuckets;
+    size_t count;
+};
+
+WatchTable *watch_table_new(void) {
+    WatchTable *table = calloc(1, sizeof(WatchTable));
+    if (!table) return NULL;
+    table->nbuckets = MIN_BUCKETS;
+    table->buckets = calloc(table->nbuckets, sizeof(WatchNode *));
+    if (!table->buckets) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+void watch_table_free(WatchTable *table) {
+    if (!table) return;
+    for (size_t i = 0; i < table->nbuckets; i++) {
+        WatchNode *node = table->buckets[i];
+        while (node) {
+            WatchNode *next = node->next;
+            free(node->path);
+            free(node);
+            node = next;
+        }
+    }
+    free(table->buckets);
+    free(table);
+}
+
+static WatchNode **find_link(const WatchTable *table, int wd) {
+    WatchNode **link = &table->buckets[(unsigned)wd % table->nbuckets];
+    while (*link && (*link)->wd != wd) link = &(*link)->next;
+    return link;
+}
+
+// Double the bucket array
+static void grow(WatchTable *table) {
+    size_t nbuckets = table->nbuckets * 2;
+    WatchNode **buckets = calloc(nbuckets, sizeof(WatchNode *));
+    if (!buckets) return;
+    for (size_t i = 0; i < table->nbuckets; i++) {
+        WatchNode *node = table->buckets[i];
+        while (node) {
+            WatchNode *next = node->next;
+            size_t b = (unsigned)node->wd % nbuckets;
+            node->next = buckets[b];
+            buckets[b] = node;
+            node = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->nbuckets = nbuckets;
+}
+
+int watch_table_set(WatchTable *table, int wd, const char *path) {
+    char *copy = strdup(path);
+    if (!copy) return -1;
+
+    WatchNode **link = find_link(table, wd);
+    if (*link) {
+        free((*link)->path);
+        (*link)->path = copy;
+        return 0;
+    }
+    WatchNode *node = malloc(sizeof(WatchNode));
+    if (!node) {
+        free(copy);
+        return -1;
+    }
+    node->wd = wd;
+    node->path = copy;
+    node->next = NULL;
+    *link = node;
+    if (++table->count > table->nbuckets) grow(table);
+    return 0;
+}
+
+const char *watch_table_get(const WatchTable *table, int wd) {
+    WatchNode *node = *find_link(table, wd);
+    return node ? node->path : NULL;
+}
+
+void watch_table_remove(WatchTable *table, int wd) {
+    WatchNode **link = find_link(table, wd);
+    WatchNode *node = *link;
+    if (!node) return;
+    *link = node->next;
+    free(node->path);
+    free(node);
+    table->count--;
+}
+
+static int is_under(const char *path, const char *dir, size_t dir_len) {
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '\0' || path[dir_len] == '/');
+}
+
+int watch_table_move(WatchTable *table, const char *old_path, const char *new_path) {
+    size_t old_len = strlen(old_path);
+    for (size_t i = 0; i < table->nbuckets; i++) {
+        for (WatchNode *node = table->buckets[i]; node; node = node->next) {
+            if (!is_under(node->path, old_path, old_len)) continue;
+            size_t len = strlen(new_path) + strlen(node->path + old_len) + 1;
+            char *moved = malloc(len);
+            if (!moved) return -1;
+            snprintf(moved, len, "%s%s", new_path, node->path + old_len);
+            free(node->path);
+            node->path = moved;
+        }
+    }
+    return 0;
+}
+
+void watch_table_remove_under(WatchTable *table, const char *path,
+                              void (*fn)(void *arg, int wd), void *arg) {
+    size_t len = strlen(path);
+    for (size_t i = 0; i < table->nbuckets; i++) {
+        WatchNode **link = &table->buckets[i];
+        while (*link) {
+            WatchNode *node = *link;
+            if (is_under(node->path, path, len)) {
+                *link = node->next;
+                if (fn) fn(arg, node->wd);
+                free(node->path);
+                free(node);
+                table->count--;
+            } else {
+                link = &node->next;
+            }
+        }
+    }
+}
+
+size_t watch_table_count(const WatchTable *table) {
+    return table->count;
+}
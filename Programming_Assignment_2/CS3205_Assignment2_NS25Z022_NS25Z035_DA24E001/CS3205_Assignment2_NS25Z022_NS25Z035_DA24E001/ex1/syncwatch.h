@@ -0,0 +1,43 @@
+/*
+ * Watch-descriptor table for the inotify watchers
+ * -----------------------------------------------
+ * inotify reports events as (wd, name), where name is relative to the
+ * watched directory. The table maps every wd back to that directory's path
+ * relative to the synced root ("" for the root itself), so each event can
+ * be turned into a full relative path.
+ *
+ * Watches follow the directory inode, so when a directory is renamed its
+ * wd and the wds below it stay valid and only their paths are rewritten.
+ * A table is only used by its watcher thread and is not locked.
+ */
+
+#ifndef SYNCWATCH_H
+#define SYNCWATCH_H
+
+#include <stddef.h>
+
+typedef struct WatchTable WatchTable;
+
+WatchTable *watch_table_new(void);
+void watch_table_free(WatchTable *table);
+
+// Insert or re-point a watch; returns -1 if out of memory
+int watch_table_set(WatchTable *table, int wd, const char *path);
+
+// Path of a watched directory, or NULL if the wd is unknown
+const char *watch_table_get(const WatchTable *table, int wd);
+
+void watch_table_remove(WatchTable *table, int wd);
+
+// A directory was renamed: rewrite it and every watched path below it
+int watch_table_move(WatchTable *table, const char *old_path, const char *new_path);
+
+// Drop the directory and everything below it, calling fn for each wd so
+// the caller can remove the kernel watch
+void watch_table_remove_under(WatchTable *table, const char *path,
+                              void (*fn)(void *arg, int wd), void *arg);
+
+// Number of watched directories
+size_t watch_table_count(const WatchTable *table);
+
+#endif
@@ -2,42 +2,77 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <ncurses.h>
 
-#define WIDTH 80
-#define HEIGHT 30
-#define OFFSETX 10
-#define OFFSETY 5
-#define paddle_width 10
+#include "pong_proto.h"
+#include "pong_sim.h"
+#include "pong_draw.h"
+
+#define UDP_TIMEOUT_SEC 5     // Silence after which the server counts as gone
+#define INPUT_HISTORY 64      // Inputs kept for replaying over the server's paddle
+#define INTERP_DELAY 0.06     // Seconds the ball and opponent are drawn behind the server
 
 int server_socket;
 int ball_x, ball_y; // Ball position
-int paddle_x = 45;       // Paddle position
+int paddle_x = PADDLE_START_X;       // Paddle position (predicted, over UDP)
 int penalty;        // Penalty count
-int paddle2_x = 45;       // Paddle position
+int paddle2_x = PADDLE_START_X;       // Paddle position
 int penalty_2;        // Penalty count
 
+Renderer renderer = RENDERER_INITIALIZER;
+
+int udp_mode = 0;     // Snapshots and inputs over UDP instead of text over TCP
+
 pthread_mutex_t lock; // Mutex for thread-safe access to shared variables
 
+// UDP snapshots received, by seq % SNAPSHOT_HISTORY, as bases for deltas
+Snapshot received[SNAPSHOT_HISTORY];
+uint16_t received_seq[SNAPSHOT_HISTORY];
+int received_valid[SNAPSHOT_HISTORY];
+int have_snapshot = 0;      // Whether anything has arrived yet
+uint16_t ack_seq;           // Newest snapshot received (0, which the server skips, until then)
+uint32_t ack_bits;          // Which of the 32 before it arrived too
+
+// Inputs sent over UDP; those after input_acked are sent again with each packet
+int8_t input_history[INPUT_HISTORY];
+uint32_t input_seq = 0;
+uint32_t input_acked = 0;
+unsigned long corrections = 0;  // Snapshots that moved the predicted paddle
+
+// Local clock minus server game time, as low as it has been seen (that is,
+// as of the fastest snapshot), so snapshots can be placed on our clock
+double clock_offset;
+
 // Function declarations
 void *render_game(void *args);
 void *receive_data(void *args);
+void *receive_snapshots(void *args);
 void *send_data(void *args);
-void draw(WINDOW *game_window);
+void send_input(int move);
+void interpolate(double now);
+void draw(Frame *frame);
 
 int main(int argc, char *argv[]) {
     // Validate command-line arguments for client
 
-    // Number of arguments should be 2
-    if (argc != 2) {
-        printf("Usage: %s <server_ip>\n", argv[0]);
+    // -u selects UDP; then the server's address
+    int opt;
+    while ((opt = getopt(argc, argv, "u")) != -1) {
+        if (opt == 'u') udp_mode = 1;
+        else break;
+    }
+    if (opt != -1 || argc - optind != 1) {
+        printf("Usage: %s [-u] <server_ip>\n", argv[0]);
         return -1;
     }
 
     // Connect to server
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    server_socket = socket(AF_INET, udp_mode ? SOCK_DGRAM : SOCK_STREAM, 0);
     if (server_socket == -1) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
@@ -48,16 +83,22 @@ int main(int argc, char *argv[]) {
     server_addr.sin_port = htons(12345); // Server port
 
     // Check if the IP address is valid
-    if (inet_pton(AF_INET, argv[1], &server_addr.sin_addr) <= 0) {
+    if (inet_pton(AF_INET, argv[optind], &server_addr.sin_addr) <= 0) {
         perror("Invalid address or address not supported");
         exit(EXIT_FAILURE);
     }
 
-    // Connect to server
+    // Connect to server (for UDP this only fixes where packets go; the
+    // server takes the first one to arrive as its client)
     if (connect(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
         perror("Connection to server failed");
         exit(EXIT_FAILURE);
     }
+    if (udp_mode) {
+        struct timeval timeout = {UDP_TIMEOUT_SEC, 0};
+        setsockopt(server_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        send_input(0);
+    }
 
     printf("Connected to server!\n");
 
@@ -67,10 +108,6 @@ int main(int argc, char *argv[]) {
     init_pair(1, COLOR_BLUE, COLOR_WHITE);
     init_pair(2, COLOR_YELLOW, COLOR_YELLOW);
 
-    // Create a new window for the game
-    WINDOW *game_window = newwin(HEIGHT, WIDTH, 0, 0);
-    box(game_window, 0, 0);  // Draw border initially
-
     curs_set(FALSE);            // Hide cursor
     keypad(stdscr, TRUE);       // Enable special keys like arrow keys
     timeout(10);                // Non-blocking input with a timeout of 10ms
@@ -84,7 +121,7 @@ int main(int argc, char *argv[]) {
     pthread_create(&render_thread, NULL, render_game, NULL);
 
     // Thread for receiving data from the server
-    pthread_create(&receive_thread, NULL, receive_data, NULL);
+    pthread_create(&receive_thread, NULL, udp_mode ? receive_snapshots : receive_data, NULL);
 
     // Thread for sending user input to the server
     pthread_create(&send_thread, NULL, send_data, NULL);
@@ -104,19 +141,28 @@ int main(int argc, char *argv[]) {
 }
 
 
-// Thread function to render the game state
-void *render_game(void *args) {
-    while (1) {
-        pthread_mutex_lock(&lock); // Lock shared variables
+// Seconds on the monotonic clock
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-        WINDOW *game_window = newwin(HEIGHT, WIDTH, 0, 0);
-        box(game_window, 0, 0);  // Draw border initially
+// Thread function to render the game state, a frame each time there is
+// something new to show
+void *render_game(void *args) {
+    render_init(&renderer);
 
-        draw(game_window); // Render the game state
+    while (1) {
+        render_wait(&renderer);
 
+        Frame frame;
+        pthread_mutex_lock(&lock); // Lock shared variables
+        if (udp_mode && have_snapshot) interpolate(now_seconds());
+        draw(&frame); // Take the game state
         pthread_mutex_unlock(&lock); // Unlock shared variables
 
-        usleep(20000); // Control rendering speed
+        render_frame(&renderer, &frame); // Render it
     }
 }
 
@@ -150,6 +196,7 @@ void *receive_data(void *args) {
             penalty_2 = temp_penalty_2;
 
             pthread_mutex_unlock(&lock);
+            render_kick(&renderer);
         } else {
             printf("Warning: Received malformed data -> %s\n", buffer);
         }
@@ -160,32 +207,179 @@ void *receive_data(void *args) {
 
 
 
+// Game time of a snapshot, in seconds
+static double snapshot_time(Snapshot *snap) {
+    return (double)snap->tick / snap->tick_rate;
+}
+
+// Set the ball and opponent to where they were INTERP_DELAY ago, on the
+// server's clock, blending the two snapshots either side of that moment:
+// snapshots then arrive ahead of when they are needed, so the motion stays
+// smooth through jitter and the odd lost packet. If none is that recent
+// yet, the newest is held; across a goal the ball jumps rather than
+// sweeping over the board. Caller holds the lock.
+void interpolate(double now) {
+    double t = now - clock_offset - INTERP_DELAY;
+    Snapshot *before = NULL, *after = NULL;
+    for (int i = 0; i < SNAPSHOT_HISTORY; i++) {
+        if (!received_valid[i]) continue;
+        double when = snapshot_time(&received[i]);
+        if (when <= t && (!before || when > snapshot_time(before))) before = &received[i];
+        if (when > t && (!after || when < snapshot_time(after))) after = &received[i];
+    }
+    if (!before) before = after;
+    if (!after || before->penalty != after->penalty || before->penalty_2 != after->penalty_2)
+        after = before;
+
+    double f = 0;
+    if (after != before) f = (t - snapshot_time(before)) / (snapshot_time(after) - snapshot_time(before));
+    double x = before->ball_x + (after->ball_x - before->ball_x) * f;
+    double y = before->ball_y + (after->ball_y - before->ball_y) * f;
+    ball_x = (int)(x / BALL_SCALE + 0.5);
+    ball_y = (int)(y / BALL_SCALE + 0.5);
+    paddle2_x = (int)(before->paddle2_x + (after->paddle2_x - before->paddle2_x) * f + 0.5);
+    penalty = before->penalty;
+    penalty_2 = before->penalty_2;
+}
+
+// Take the server's paddle as of the newest input it has applied, and
+// replay on it the moves sent since, as the server will. Caller holds the
+// lock.
+static void reconcile(Snapshot *snap) {
+    int predicted = paddle_x;
+    if (input_seq - snap->input_ack < INPUT_HISTORY) {
+        paddle_x = snap->paddle_x;
+        for (uint32_t seq = snap->input_ack + 1; seq <= input_seq; seq++)
+            paddle_x = paddle_move(paddle_x, input_history[seq % INPUT_HISTORY]);
+    } else {
+        paddle_x = snap->paddle_x;
+    }
+    if (paddle_x != predicted) corrections++;
+}
+
+// Thread function to receive UDP snapshots. Each is rebuilt against its base
+// from the ones kept, stored (for deltas and for interpolation), and
+// acknowledged with the next input packet; the newest also corrects the
+// predicted paddle.
+void *receive_snapshots(void *args) {
+    uint8_t buffer[MAX_PACKET];
+    double last_heard = now_seconds();
+
+    while (1) {
+        ssize_t n = recv(server_socket, buffer, sizeof(buffer), 0);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+            perror("Error receiving data from server");
+            break;
+        }
+        // Timed out, or refused (nothing on the server's port yet)
+        if (n == -1) {
+            if (now_seconds() - last_heard < UDP_TIMEOUT_SEC) continue;
+            clear();
+            refresh();
+            endwin(); // End ncurses mode
+            printf("No data from server for %d seconds\n", UDP_TIMEOUT_SEC);
+            exit(0);
+        }
+
+        SnapshotPacket pkt;
+        if (decode_snapshot(buffer, n, &pkt) == -1) continue;
+
+        pthread_mutex_lock(&lock);
+        int base = pkt.base_seq % SNAPSHOT_HISTORY;
+        if ((pkt.flags & SNAP_DELTA) &&
+            (!received_valid[base] || received_seq[base] != pkt.base_seq)) {
+            // Base no longer held; leave it unacknowledged
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        int slot = pkt.seq % SNAPSHOT_HISTORY;
+        Snapshot snap;
+        apply_snapshot(&pkt, &received[base], &snap);
+        received[slot] = snap;
+        received_seq[slot] = pkt.seq;
+        received_valid[slot] = 1;
+        last_heard = now_seconds();
+
+        double offset = last_heard - snapshot_time(&snap);
+        if (!have_snapshot || offset < clock_offset) clock_offset = offset;
+        else clock_offset += (offset - clock_offset) * 0.001;  // Follow clock drift
+
+        if (!have_snapshot || seq_newer(pkt.seq, ack_seq)) {
+            uint16_t shift = pkt.seq - ack_seq;
+            if (!have_snapshot || shift > 32) ack_bits = 0;
+            else ack_bits = (uint64_t)ack_bits << shift | (uint64_t)1 << (shift - 1);
+            ack_seq = pkt.seq;
+            have_snapshot = 1;
+            reconcile(&snap);
+        } else {
+            uint16_t back = ack_seq - pkt.seq;
+            if (back >= 1 && back <= 32) ack_bits |= 1u << (back - 1);
+        }
+        if (pkt.input_ack > input_acked) input_acked = pkt.input_ack;
+        pthread_mutex_unlock(&lock);
+        render_kick(&renderer);
+    }
+
+    return NULL;
+}
+
+// Move the paddle at once, without waiting for the server, and send the
+// move as the next input over UDP, along with every earlier input the
+// server has not acknowledged and the acks for its snapshots
+void send_input(int move) {
+    InputPacket pkt;
+    uint8_t buffer[MAX_PACKET];
+
+    pthread_mutex_lock(&lock);
+    paddle_x = paddle_move(paddle_x, move);
+    input_seq++;
+    input_history[input_seq % INPUT_HISTORY] = move;
+    uint32_t unacked = input_seq - input_acked;
+    pkt.count = unacked < 1 ? 1 : unacked > INPUT_REDUNDANCY ? INPUT_REDUNDANCY : unacked;
+    pkt.input_seq = input_seq;
+    for (int i = 0; i < pkt.count; i++)
+        pkt.move[i] = input_history[(input_seq - i) % INPUT_HISTORY];
+    pkt.ack_seq = ack_seq;
+    pkt.ack_bits = ack_bits;
+    pthread_mutex_unlock(&lock);
+    if (move != 0) render_kick(&renderer);
+
+    size_t len = encode_input(buffer, &pkt);
+    send(server_socket, buffer, len, 0);  // A lost or refused packet is covered by the next
+}
+
 // Thread function to send user input to the server
 void *send_data(void *args) {
 
     while (1) {
         int key = getch(); // Capture key press
+        int move = 0;
         pthread_mutex_lock(&lock);
 
-        if (key == KEY_LEFT && paddle_x > 1) {
-            paddle_x -= 1; // Move left
-        } else if (key == KEY_RIGHT && paddle_x < WIDTH - 11) {
-            
-            paddle_x += 1; // Move right
+        if (key == KEY_LEFT) {
+            move = -1; // Move left
+        } else if (key == KEY_RIGHT) {
+            move = 1; // Move right
         } else if (key == 'q') { 
             printf("Quitting game...\n");
             close(server_socket); // Close socket connection
             endwin();             // End ncurses mode
+            print_render_stats(&renderer);
             exit(0);              // Exit the program
         } else if (key == 'c') {
             // Clear the screen
             clear();
             refresh();
+            render_redraw(&renderer);
         }
+        if (!udp_mode) paddle_x = paddle_move(paddle_x, move);
+        int paddle = paddle_x;
         pthread_mutex_unlock(&lock);
+        if (!udp_mode && move != 0) render_kick(&renderer);
 
         // Send the updated paddle position to the server
-        write(server_socket, &paddle_x, sizeof(int));
+        if (udp_mode) send_input(move);
+        else write(server_socket, &paddle, sizeof(int));
         usleep(30000); // Add a small delay to control input rate
     }
 
@@ -193,39 +387,19 @@ void *send_data(void *args) {
 }
 
 
-void draw(WINDOW *game_window) {
-    clear();  // Clear the screen
-    attron(COLOR_PAIR(1));
-    for (int i = OFFSETX; i <= OFFSETX + WIDTH; i++) {
-        mvprintw(OFFSETY-1, i, " ");
-    }
-    mvprintw(OFFSETY-1, OFFSETX + 3, "CS3205 NetPong, Ball: %d, %d", ball_x, ball_y);
-    mvprintw(OFFSETY-1, OFFSETX + WIDTH-25, "Server: %d, Client: %d", penalty, penalty_2);
+// Fill frame from the game state. Caller holds the lock.
+void draw(Frame *frame) {
+    frame->ball_x = ball_x;
+    frame->ball_y = ball_y;
+    frame->paddle_x = paddle_x;
+    frame->paddle2_x = paddle2_x;
+    frame->penalty = penalty;
+    frame->penalty_2 = penalty_2;
     
-    for (int i = OFFSETY; i < OFFSETY + HEIGHT; i++) {
-        mvprintw(i, OFFSETX, "  ");
-        mvprintw(i, OFFSETX + WIDTH - 1, "  ");
+    frame->status[0] = '\0';
+    if (udp_mode) {
+        snprintf(frame->status, sizeof(frame->status), "UDP: %u inputs unacknowledged, %lu corrections",
+                 input_seq - input_acked, corrections);
     }
-    for (int i = OFFSETX; i < OFFSETX + WIDTH; i++) {
-        mvprintw(OFFSETY, i, " ");
-        mvprintw(OFFSETY + HEIGHT - 1, i, " ");
-    }
-    attroff(COLOR_PAIR(1));
-    
-    // Draw the ball
-    mvprintw(OFFSETY + ball_y, OFFSETX + ball_x, "o");
-
-    // Draw the paddle
-    attron(COLOR_PAIR(2));
-    for (int i = 0; i < paddle_width; i++) {
-        mvprintw(OFFSETY + HEIGHT - 4, OFFSETX + paddle_x + i, " ");
-    }
-    for (int i = 0; i < paddle_width; i++) {
-        mvprintw(OFFSETY + 3, OFFSETX + paddle2_x + i, " ");
-    }
-    attroff(COLOR_PAIR(2));
-    
-    refresh();
-
 }
 
@@ -2,37 +2,47 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <ncurses.h>
 
-#define WIDTH 80
-#define HEIGHT 30
-#define OFFSETX 10
-#define OFFSETY 5
-
-int paddle2_x = 45;       // Paddle position
-
-// Structures for game state
-typedef struct {
-    int x, y;       // Ball position
-    int dx, dy;     // Ball velocity
-} Ball;
-
+#include "pong_proto.h"
+#include "pong_sim.h"
+#include "pong_tick.h"
+#include "pong_rooms.h"
+#include "pong_draw.h"
+
+#define DEFAULT_TICK_RATE 60    // Simulation ticks per second
+#define SEND_INTERVAL_NS 20000000L
+#define SNAPSHOT_RING 16        // Snapshots kept for the network and render stages
+#define UDP_TIMEOUT_SEC 5       // Silence after which a UDP client counts as gone
+
+// Latest paddle positions from the two players; written by the input
+// threads, read by the simulation at the start of each tick (atomic). The
+// client's goes with the sequence number of the input that put it there
+// (always 0 over TCP), in one word so the two are never seen apart.
 typedef struct {
-    int x;          // Paddle position
-    int width;      // Paddle width
-} Paddle;
+    uint64_t client;    // Client's paddle: input seq << 32 | position
+    int paddle2_x;      // Server's paddle, from the keyboard
+} Inputs;
 
-// Structure for unified game state
+// Snapshots sent to a UDP client, kept as delta bases, and the newest of
+// its inputs applied; shared by the UDP send and receive threads
 typedef struct {
-    Ball ball;
-    Paddle paddle;
-    int penalty;
-    Paddle paddle2;
-    pthread_mutex_t lock; // Mutex for thread-safe access to game state
-    int penalty_2;
-} GameState;
+    pthread_mutex_t lock;
+    uint16_t next_seq;
+    Snapshot sent[SNAPSHOT_HISTORY];        // By seq % SNAPSHOT_HISTORY
+    uint16_t sent_seq[SNAPSHOT_HISTORY];
+    int sent_state[SNAPSHOT_HISTORY];       // SLOT_EMPTY, SLOT_SENT or SLOT_ACKED
+    uint32_t input_seq;                     // Newest input applied
+    int paddle_x;                           // Client's paddle after it
+    unsigned long packets, full, bytes;     // Snapshots sent, how many full, total size
+} UdpLink;
+
+enum { SLOT_EMPTY, SLOT_SENT, SLOT_ACKED };
 
 // Structure for thread arguments
 typedef struct {
@@ -41,25 +51,67 @@ typedef struct {
     int server_socket;
 } ThreadArgs;
 
+Inputs inputs = {PADDLE_START_X, PADDLE_START_X};
+int tick_rate = DEFAULT_TICK_RATE;
+int udp_mode = 0;
+TickStats tick_stats;
+UdpLink udp_link = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                    .next_seq = 1,      // Seq 0 would look acked by a new client
+                    .paddle_x = PADDLE_START_X};
+
+// Ring of published snapshots; published_tick is the newest (atomic). A
+// slot's seq is odd while publish_snapshot is rewriting it (atomic)
+typedef struct {
+    unsigned long seq;
+    Snapshot snap;
+} SnapshotSlot;
+
+SnapshotSlot snapshots[SNAPSHOT_RING];
+unsigned long published_tick;
+
+Renderer renderer = RENDERER_INITIALIZER;
+
 // Function declarations
-void *move_ball(void *args);
+void *run_simulation(void *args);
 void *send_game_state(void *args);
 void *receive_client_input(void *args);
-void reset_ball(GameState *state);
-void draw(WINDOW *game_window, GameState *state);
+void *send_snapshots(void *args);
+void *receive_inputs(void *args);
+void handle_input(InputPacket *pkt);
+void publish_snapshot(GameState *state, uint32_t input_ack);
+void read_snapshot(Snapshot *snap);
+void draw(Snapshot *snap);
 void *render_game(void *args);
 void *move_paddle(void *args);
+void print_tick_stats(void);
+void print_udp_stats(void);
 
 int main(int argc, char *argv[]) {
     // Validate command-line arguments for server
 
-    // Number of arguments should be 2
-    if (argc != 2) {
-        printf("Usage: %s server <port>\n", argv[0]);
+    // -u selects UDP, -d a dedicated server for many UDP games (with -w
+    // worker threads and up to -n rooms); then a port, and optionally a
+    // tick rate
+    int opt, dedicated = 0;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN), max_rooms = DEFAULT_ROOMS;
+    while ((opt = getopt(argc, argv, "udw:n:")) != -1) {
+        if (opt == 'u') udp_mode = 1;
+        else if (opt == 'd') dedicated = 1;
+        else if (opt == 'w') workers = atoi(optarg);
+        else if (opt == 'n') max_rooms = atoi(optarg);
+        else break;
+    }
+    if (opt != -1 || (argc - optind != 1 && argc - optind != 2)) {
+        printf("Usage: %s [-u] <port> [tick_rate]\n"
+               "       %s -d [-w workers] [-n rooms] <port> [tick_rate]\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (workers < 1 || max_rooms < 1) {
+        printf("Invalid worker or room count. Both should be at least 1.\n");
         return 1;
     }
     // Convert port number to integer
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
 
     // Port number should be between 1 and 65535
     if (port < 1 || port > 65535) {
@@ -67,29 +119,33 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    
-    // Create a new window for the game
-    WINDOW *game_window = newwin(HEIGHT, WIDTH, 0, 0);
-    box(game_window, 0, 0);  // Draw border initially
+    // Tick rate should be 60, 120 or 240
+    if (argc - optind == 2) {
+        tick_rate = atoi(argv[optind + 1]);
+        if (tick_rate != 60 && tick_rate != 120 && tick_rate != 240) {
+            printf("Invalid tick rate. Tick rate should be 60, 120 or 240.\n");
+            return 1;
+        }
+    }
+
+    // A dedicated server has no board or player of its own
+    if (dedicated) return run_dedicated(port, tick_rate, workers, max_rooms);
+
     
     // Initialize game state
     GameState state;
-    state.ball = (Ball){WIDTH / 2, HEIGHT / 2, 1, 1};
-    state.paddle = (Paddle){WIDTH / 2 - 5, 10};
-    state.penalty = 0;
-
-    // Initialize mutex for thread-safe access to game state
-    pthread_mutex_init(&state.lock, NULL);
+    init_game(&state);
+    publish_snapshot(&state, 0);
     
     // Set up server socket
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int server_socket = socket(AF_INET, udp_mode ? SOCK_DGRAM : SOCK_STREAM, 0);
     if (server_socket == -1) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
 
     // Set socket options to reuse address
-    int opt = 1;
+    opt = 1;
     if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
         perror("Setsockopt failed");
         exit(EXIT_FAILURE);
@@ -107,19 +163,48 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
     
-    // Listen for incoming connections
-    if (listen(server_socket, 1) == -1) {
-        perror("Listen failed");
-        exit(EXIT_FAILURE);
-    }
+    int client_socket;
+    if (udp_mode) {
+        // The first input packet to arrive picks the client; the socket is
+        // then connected to it, so nothing from anyone else gets through
+        printf("Waiting for client to connect...\n");
+        uint8_t buffer[MAX_PACKET];
+        struct sockaddr_in client_addr;
+        socklen_t addr_len;
+        InputPacket pkt;
+        while (1) {
+            addr_len = sizeof(client_addr);
+            ssize_t n = recvfrom(server_socket, buffer, sizeof(buffer), 0,
+                                 (struct sockaddr *)&client_addr, &addr_len);
+            if (n == -1) {
+                perror("Receive failed");
+                exit(EXIT_FAILURE);
+            }
+            if (decode_input(buffer, n, &pkt) == 0) break;
+        }
+        if (connect(server_socket, (struct sockaddr *)&client_addr, addr_len) == -1) {
+            perror("Connect failed");
+            exit(EXIT_FAILURE);
+        }
+        struct timeval timeout = {UDP_TIMEOUT_SEC, 0};
+        setsockopt(server_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        handle_input(&pkt);
+        client_socket = server_socket;
+    } else {
+        // Listen for incoming connections
+        if (listen(server_socket, 1) == -1) {
+            perror("Listen failed");
+            exit(EXIT_FAILURE);
+        }
     
-    printf("Waiting for client to connect...\n");
+        printf("Waiting for client to connect...\n");
     
-    // Accept client connection
-    int client_socket = accept(server_socket, NULL, NULL);
-    if (client_socket == -1) {
-        perror("Accept failed");
-        exit(EXIT_FAILURE);
+        // Accept client connection
+        client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket == -1) {
+            perror("Accept failed");
+            exit(EXIT_FAILURE);
+        }
     }
     printf("Client connected!\n");
     
@@ -133,28 +218,28 @@ int main(int argc, char *argv[]) {
     init_pair(2, COLOR_YELLOW, COLOR_YELLOW);
 
     // Create threads for different tasks
-    pthread_t ball_thread, send_thread, receive_thread, render_thread, move_paddle_thread;
+    pthread_t sim_thread, send_thread, receive_thread, render_thread, move_paddle_thread;
     
     // Create argument structure for threads
     ThreadArgs args = {&state, client_socket, server_socket};
     
     // Thread for moving paddle
-    pthread_create(&move_paddle_thread, NULL, move_paddle, &state);
+    pthread_create(&move_paddle_thread, NULL, move_paddle, NULL);
     
     // Thread for rendering the game
-    pthread_create(&render_thread, NULL, render_game, &state);
+    pthread_create(&render_thread, NULL, render_game, NULL);
 
-    // Thread for moving ball and updating game logic
-    pthread_create(&ball_thread, NULL, move_ball, &state);
+    // Thread for stepping the simulation at the tick rate
+    pthread_create(&sim_thread, NULL, run_simulation, &state);
 
     // Thread for sending game state to client
-    pthread_create(&send_thread, NULL, send_game_state, &args);
+    pthread_create(&send_thread, NULL, udp_mode ? send_snapshots : send_game_state, &args);
 
     // Thread for receiving input from client
-    pthread_create(&receive_thread, NULL, receive_client_input, &args);
+    pthread_create(&receive_thread, NULL, udp_mode ? receive_inputs : receive_client_input, &args);
 
     // Wait for threads to finish (optional)
-    pthread_join(ball_thread, NULL);
+    pthread_join(sim_thread, NULL);
     pthread_join(send_thread, NULL);
     pthread_join(receive_thread, NULL);
     pthread_join(render_thread, NULL);
@@ -162,124 +247,157 @@ int main(int argc, char *argv[]) {
 
     endwin();  // End ncurses mode
     // Clean up resources
-    close(client_socket);
+    if (client_socket != server_socket) close(client_socket);
     close(server_socket);
-    pthread_mutex_destroy(&state.lock);
     
     return 0;
 }
 
 // Thread function to move the paddle2
 void *move_paddle(void *args) {
-    WINDOW *win = newwin(HEIGHT, WIDTH, 0, 0);
+    int paddle2_x = inputs.paddle2_x;
 
     while (1) {
         int key = getch(); // Capture key press
 
-        if (key == 'a' && paddle2_x > 1) {
-            paddle2_x -= 1; // Move left
-        } else if (key == 'd' && paddle2_x < WIDTH - 11) {
-            
-            paddle2_x += 1; // Move right
+        if (key == 'a') {
+            paddle2_x = paddle_move(paddle2_x, -1); // Move left
+        } else if (key == 'd') {
+            paddle2_x = paddle_move(paddle2_x, 1); // Move right
         } else if (key == 'q') { 
-            printf("Quitting game...\n");
             endwin();             // End ncurses mode
+            printf("Quitting game...\n");
+            print_tick_stats();
+            if (udp_mode) print_udp_stats();
+            print_render_stats(&renderer);
             exit(EXIT_FAILURE);
         } else if (key == 'c') {
             // Clear the screen
             clear();
             refresh();
+            render_redraw(&renderer);
         }
+        __atomic_store_n(&inputs.paddle2_x, paddle2_x, __ATOMIC_RELAXED);
     }
-    usleep(30000);
+    return NULL;
 }
 
-// Thread function to render the game state
+// Thread function to render the game state, a frame per new snapshot
 void *render_game(void *args) {
-    GameState *state = (GameState *)args;
-    while (1) {
-        pthread_mutex_lock(&state->lock); // Lock shared variables
-
-        WINDOW *game_window = newwin(HEIGHT, WIDTH, 0, 0);
-        box(game_window, 0, 0);  // Draw border initially
-
-        draw(game_window, state); // Render the game state
+    render_init(&renderer);
 
-        pthread_mutex_unlock(&state->lock); // Unlock shared variables
+    while (1) {
+        render_wait(&renderer);
 
-        usleep(20000); // Control rendering speed
+        Snapshot snap;
+        read_snapshot(&snap);
+        draw(&snap); // Render the game state
     }
 }
 
-// Thread function to move the ball and handle game logic
-void *move_ball(void *args) {
+// Thread function to step the game at a fixed rate (see pong_tick.h)
+void *run_simulation(void *args) {
     GameState *state = (GameState *)args;
+    double dt = 1.0 / tick_rate;
 
-    while (1) {
+    Ticker ticker;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ticker_start(&ticker, tick_rate, &start, &tick_stats) == -1) {
+        perror("Timer setup failed");
+        exit(EXIT_FAILURE);
+    }
 
-        // Lock the game state for thread-safe access
-        pthread_mutex_lock(&state->lock);
-
-        // Move ball
-        state->ball.x += state->ball.dx;
-        state->ball.y += state->ball.dy;
-
-        // Bounce off walls
-        // Prevent ball from overlapping the walls before bouncing
-        if (state->ball.x <= 2 || state->ball.x >= WIDTH - 2)  
-            state->ball.dx = -state->ball.dx;
-
-        // Bounce off the Bottom and Top Paddle
-        if (state->ball.y == HEIGHT - 5 && 
-            state->ball.x >= state->paddle.x - 1 && 
-            state->ball.x < state->paddle.x + state->paddle.width + 1) {
-            state->ball.dy = -state->ball.dy;
-        }else if (state->ball.y == 3 &&
-            state->ball.x >= paddle2_x &&
-            state->ball.x < paddle2_x + state->paddle.width) {
-            state->ball.dy = -state->ball.dy; // Bounce off paddle
-        } else if (state->ball.y >= HEIGHT - 1) { // Missed paddle
-            reset_ball(state);               // Reset ball position
-            state->penalty++;                // Increment penalty count
-            // reset paddle position
-
-        } else if (state->ball.y <= 2 ) {
-            reset_ball(state);               // Reset ball position
-            state->penalty_2++;                // Increment penalty count
-            // reset paddle position
+    uint32_t input_ack = 0;         // Client input the paddle reflects
+    while (1) {
+        int ticks = ticker_wait(&ticker);
+        if (ticks == -1) {
+            perror("Timer read failed");
+            exit(EXIT_FAILURE);
+        }
 
+        for (int i = 0; i < ticks; i++) {
+            uint64_t client = __atomic_load_n(&inputs.client, __ATOMIC_RELAXED);
+            state->paddle.x = (int32_t)client;
+            input_ack = client >> 32;
+            state->paddle2.x = __atomic_load_n(&inputs.paddle2_x, __ATOMIC_RELAXED);
+            step_ball(state, dt);
+            state->tick++;
         }
+        publish_snapshot(state, input_ack);
+        render_kick(&renderer);
+        ticker_done(&ticker);
+    }
+    return NULL;
+}
+
+// Make the current state visible to the network and render stages. The
+// snapshot goes into the ring slot for its tick before the tick is
+// published, so readers never need the simulation to stop for them.
+void publish_snapshot(GameState *state, uint32_t input_ack) {
+    SnapshotSlot *slot = &snapshots[state->tick % SNAPSHOT_RING];
+    Snapshot *snap = &slot->snap;
+    unsigned long seq = slot->seq;      // Only this thread writes it
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    snap->tick = state->tick;
+    snap->tick_rate = tick_rate;
+    snap->input_ack = input_ack;
+    snap->ball_x = (int)(state->ball.x * BALL_SCALE + 0.5);
+    snap->ball_y = (int)(state->ball.y * BALL_SCALE + 0.5);
+    snap->paddle_x = state->paddle.x;
+    snap->paddle2_x = state->paddle2.x;
+    snap->penalty = state->penalty;
+    snap->penalty_2 = state->penalty_2;
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&published_tick, state->tick, __ATOMIC_RELEASE);
+}
 
-        pthread_mutex_unlock(&state->lock);
-        usleep(80000); // Control ball speed
+// Copy out the newest snapshot. One publish can cover several caught-up
+// ticks, so how far published_tick moved says nothing about whether the
+// slot was reused; its seq does. If that was odd or changed while the
+// slot was copied, the copy may be torn, so take the newest one again.
+void read_snapshot(Snapshot *snap) {
+    while (1) {
+        unsigned long tick = __atomic_load_n(&published_tick, __ATOMIC_ACQUIRE);
+        SnapshotSlot *slot = &snapshots[tick % SNAPSHOT_RING];
+        unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        *snap = slot->snap;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) return;
     }
 }
 
-// Reset the ball to its initial position
-void reset_ball(GameState *state) {
-    state->ball.x = WIDTH / 3;
-    state->ball.y = HEIGHT / 3;
-    state->ball.dx = 1;
-    state->ball.dy = 1;
+// Print the tick counters (after ncurses has ended)
+void print_tick_stats(void) {
+    printf("Ticks: %lu at %d Hz, overruns: %lu, missed: %lu, dropped: %lu, "
+           "worst late: %ld us, worst step: %ld us\n",
+           __atomic_load_n(&tick_stats.ticks, __ATOMIC_RELAXED), tick_rate,
+           __atomic_load_n(&tick_stats.overruns, __ATOMIC_RELAXED),
+           __atomic_load_n(&tick_stats.missed, __ATOMIC_RELAXED),
+           __atomic_load_n(&tick_stats.dropped, __ATOMIC_RELAXED),
+           __atomic_load_n(&tick_stats.worst_late_us, __ATOMIC_RELAXED),
+           __atomic_load_n(&tick_stats.worst_step_us, __ATOMIC_RELAXED));
 }
 
 // Thread function to send game state to client
 void *send_game_state(void *args) {
     ThreadArgs *thread_args = (ThreadArgs *)args;
-    GameState *state = thread_args->state;
     int client_socket = thread_args->client_socket;
 
     char buffer[256];
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
     
 	while (1) {
         
-        pthread_mutex_lock(&state->lock);
+        Snapshot snap;
+        read_snapshot(&snap);
 
         // write game state to buffer
         snprintf(buffer, sizeof(buffer), "%d,%d,%d,%d,%d\n",
-                 state->ball.x, state->ball.y, state->penalty,paddle2_x,state->penalty_2);
-
-        pthread_mutex_unlock(&state->lock);
+                 BALL_CELL(snap.ball_x), BALL_CELL(snap.ball_y), snap.penalty, snap.paddle2_x, snap.penalty_2);
 
         // Send game state to client
         if (send(client_socket, buffer, strlen(buffer), 0) == -1) {
@@ -287,7 +405,13 @@ void *send_game_state(void *args) {
             break;
         }
 
-        usleep(20000); // Send data at a controlled rate
+        // Send data at a controlled rate
+        next.tv_nsec += SEND_INTERVAL_NS;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
 	}
 
 	return NULL; 
@@ -295,7 +419,6 @@ void *send_game_state(void *args) {
 
 void *receive_client_input(void *args) {
     ThreadArgs *thread_args = (ThreadArgs *)args; // Cast argument to ThreadArgs structure
-    GameState *state = thread_args->state;       // Extract GameState pointer
     int client_socket = thread_args->client_socket; // Extract client socket
     int server_socket = thread_args->server_socket; // Extract server socket
 
@@ -303,14 +426,15 @@ void *receive_client_input(void *args) {
 
     while (1) {
         // Receive the updated paddle position from the client
-        int bytes_received = recv(client_socket, &new_paddle_x, sizeof(int), 0);
+        int bytes_received = recv(client_socket, &new_paddle_x, sizeof(int), MSG_WAITALL);
         
         if (bytes_received > 0) {
-            pthread_mutex_lock(&state->lock); // Lock the game state for thread-safe access
-            
-            state->paddle.x = new_paddle_x; // Directly update the paddle position
-
-            pthread_mutex_unlock(&state->lock); // Unlock the game state
+            // Directly update the paddle position; the simulation picks it up
+            // next tick. A short read or an off-board position is not
+            // trusted: the position ends up in every snapshot drawn.
+            if (bytes_received != sizeof(int)) continue;
+            new_paddle_x = paddle_move(new_paddle_x, 0);
+            __atomic_store_n(&inputs.client, (uint32_t)new_paddle_x, __ATOMIC_RELAXED);
         } else if (bytes_received == 0) {
             clear(); // Clear the screen
             refresh(); // Refresh the screen
@@ -318,6 +442,8 @@ void *receive_client_input(void *args) {
             close(client_socket); // Close the client socket
             close(server_socket);
             printf("Client disconnected.\n");
+            print_tick_stats();
+            print_render_stats(&renderer);
             exit(0);  // Exit the program
 
             break; // Exit the loop if the client disconnects
@@ -330,39 +456,145 @@ void *receive_client_input(void *args) {
     return NULL; // Exit the thread
 }
 
+// Thread function to send snapshots to a UDP client, each as a delta
+// against the newest snapshot the client has acknowledged
+void *send_snapshots(void *args) {
+    ThreadArgs *thread_args = (ThreadArgs *)args;
+    int client_socket = thread_args->client_socket;
+    UdpLink *link = &udp_link;
+
+    uint8_t buffer[MAX_PACKET];
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
 
-void draw(WINDOW *game_window, GameState *state) {
-    clear();  // Clear the screen
-    attron(COLOR_PAIR(1));
-    for (int i = OFFSETX; i <= OFFSETX + WIDTH; i++) {
-        mvprintw(OFFSETY-1, i, " ");
-    }
-    mvprintw(OFFSETY-1, OFFSETX + 3, "CS3205 NetPong, Ball: %d, %d", state->ball.x, state->ball.y);
-    mvprintw(OFFSETY-1, OFFSETX + WIDTH-25, "Server: %d, Client: %d", state->penalty, state->penalty_2);
-    
-    for (int i = OFFSETY; i < OFFSETY + HEIGHT; i++) {
-        mvprintw(i, OFFSETX, "  ");
-        mvprintw(i, OFFSETX + WIDTH - 1, "  ");
+    while (1) {
+        Snapshot snap;
+        read_snapshot(&snap);
+
+        pthread_mutex_lock(&link->lock);
+        int base = -1;
+        for (int i = 0; i < SNAPSHOT_HISTORY; i++) {
+            if (link->sent_state[i] == SLOT_ACKED &&
+                (base == -1 || seq_newer(link->sent_seq[i], link->sent_seq[base])))
+                base = i;
+        }
+        uint16_t seq = link->next_seq++;
+        size_t len = encode_snapshot(buffer, seq, &snap,
+                                     base == -1 ? 0 : link->sent_seq[base],
+                                     base == -1 ? NULL : &link->sent[base]);
+        int slot = seq % SNAPSHOT_HISTORY;
+        link->sent[slot] = snap;
+        link->sent_seq[slot] = seq;
+        link->sent_state[slot] = SLOT_SENT;
+        link->packets++;
+        if (base == -1) link->full++;
+        link->bytes += len;
+        pthread_mutex_unlock(&link->lock);
+
+        // A refused send means the client has gone; the receive thread
+        // notices that too
+        if (send(client_socket, buffer, len, 0) == -1 && errno != ECONNREFUSED) {
+            perror("Error sending data to client");
+            break;
+        }
+
+        // Send data at a controlled rate
+        next.tv_nsec += SEND_INTERVAL_NS;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
     }
-    for (int i = OFFSETX; i < OFFSETX + WIDTH; i++) {
-        mvprintw(OFFSETY, i, " ");
-        mvprintw(OFFSETY + HEIGHT - 1, i, " ");
+
+    return NULL;
+}
+
+// Take in one input packet: note which snapshots it acknowledges, and
+// apply whichever of its moves are new, oldest first, to the client's paddle
+void handle_input(InputPacket *pkt) {
+    UdpLink *link = &udp_link;
+    pthread_mutex_lock(&link->lock);
+
+    for (int i = -1; i < 32; i++) {
+        if (i >= 0 && !(pkt->ack_bits & (1u << i))) continue;
+        uint16_t seq = pkt->ack_seq - 1 - i;
+        int slot = seq % SNAPSHOT_HISTORY;
+        if (link->sent_state[slot] == SLOT_SENT && link->sent_seq[slot] == seq)
+            link->sent_state[slot] = SLOT_ACKED;
     }
-    attroff(COLOR_PAIR(1));
-    
-    // Draw the ball
-    mvprintw(OFFSETY + state->ball.y, OFFSETX + state->ball.x, "o");
 
-    // Draw the paddle
-    attron(COLOR_PAIR(2));
-    for (int i = 0; i < state->paddle.width; i++) {
-        mvprintw(OFFSETY + HEIGHT - 4, OFFSETX + state->paddle.x + i, " ");
+    int applied = 0;
+    for (int i = pkt->count - 1; i >= 0; i--) {
+        uint32_t seq = pkt->input_seq - i;
+        if (seq <= link->input_seq) continue;
+        link->paddle_x = paddle_move(link->paddle_x, pkt->move[i]);
+        link->input_seq = seq;
+        applied = 1;
     }
-    for (int i = 0; i < state->paddle.width; i++) {
-        mvprintw(OFFSETY + 3, OFFSETX + paddle2_x + i, " ");
+    if (applied) {
+        __atomic_store_n(&inputs.client, (uint64_t)link->input_seq << 32 | (uint32_t)link->paddle_x,
+                         __ATOMIC_RELAXED);
     }
-    attroff(COLOR_PAIR(2));
-    
-    refresh();
+
+    pthread_mutex_unlock(&link->lock);
 }
 
+// Thread function to receive input packets from a UDP client; it counts as
+// gone once it stops sending for UDP_TIMEOUT_SEC, or its port is closed
+void *receive_inputs(void *args) {
+    ThreadArgs *thread_args = (ThreadArgs *)args;
+    int client_socket = thread_args->client_socket;
+
+    uint8_t buffer[MAX_PACKET];
+    while (1) {
+        ssize_t n = recv(client_socket, buffer, sizeof(buffer), 0);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+            perror("Error receiving data from client");
+            break;
+        }
+        if (n == -1) {
+            clear(); // Clear the screen
+            refresh(); // Refresh the screen
+            endwin(); // End ncurses mode
+            close(client_socket);
+            printf("Client disconnected.\n");
+            print_tick_stats();
+            print_udp_stats();
+            print_render_stats(&renderer);
+            exit(0);
+        }
+
+        InputPacket pkt;
+        if (decode_input(buffer, n, &pkt) == 0) handle_input(&pkt);
+    }
+
+    return NULL;
+}
+
+// Print how much the UDP snapshots took (after ncurses has ended)
+void print_udp_stats(void) {
+    UdpLink *link = &udp_link;
+    pthread_mutex_lock(&link->lock);
+    printf("Snapshots: %lu sent, %lu full, %.1f bytes on average\n",
+           link->packets, link->full, link->packets ? (double)link->bytes / link->packets : 0.0);
+    pthread_mutex_unlock(&link->lock);
+}
+
+
+void draw(Snapshot *snap) {
+    Frame frame = {
+        .ball_x = BALL_CELL(snap->ball_x), .ball_y = BALL_CELL(snap->ball_y),
+        .paddle_x = snap->paddle_x, .paddle2_x = snap->paddle2_x,
+        .penalty = snap->penalty, .penalty_2 = snap->penalty_2,
+    };
+
+    // Tick timing
+    snprintf(frame.status, sizeof(frame.status), "Tick %d Hz: %lu ticks, %lu overruns, %lu missed, worst late %ld us",
+             tick_rate, __atomic_load_n(&tick_stats.ticks, __ATOMIC_RELAXED),
+             __atomic_load_n(&tick_stats.overruns, __ATOMIC_RELAXED),
+             __atomic_load_n(&tick_stats.missed, __ATOMIC_RELAXED),
+             __atomic_load_n(&tick_stats.worst_late_us, __ATOMIC_RELAXED));
+    
+    render_frame(&renderer, &frame);
+}
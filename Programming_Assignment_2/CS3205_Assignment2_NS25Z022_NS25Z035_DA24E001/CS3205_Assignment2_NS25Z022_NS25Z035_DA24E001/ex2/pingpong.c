@@ -6,21 +6,23 @@
 int main(int argc, char *argv[]) {
     // Validate command-line arguments
 
-    // Number of arguments should be 3
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server|client> <port|server_ip>\n", argv[0]);
+    // Number of arguments should be 3, or 4 with "udp"
+    if (argc != 3 && !(argc == 4 && strcmp(argv[3], "udp") == 0)) {
+        fprintf(stderr, "Usage: %s <server|client> <port|server_ip> [udp]\n", argv[0]);
         return 1;
     }
+    // Passed on as -u, or as "--" (no options) for TCP
+    char *mode = argc == 4 ? "-u" : "--";
     
     if (strcmp(argv[1], "server") == 0) {
         // If the first argument is "server"
         char *port = argv[2];
-        execl("./p_server", "./p_server", port, (char *)NULL);
+        execl("./p_server", "./p_server", mode, port, (char *)NULL);
         perror("Error executing server");
     } else if (strcmp(argv[1], "client") == 0) {
         // If the first argument is "client"
         char *server_ip = argv[2];
-        execl("./p_client", "./p_client", server_ip, (char *)NULL);
+        execl("./p_client", "./p_client", mode, server_ip, (char *)NULL);
         perror("Error executing client");
     } else {
         fprintf(stderr, "Invalid first argument. Use 'server' or 'client'.\n");
@@ -0,0 +1,174 @@
+// NetPong renderer (see pong_draw.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "pong_draw.h"
+
+// Microseconds from a to b
+static long elapsed_us(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+// Bytes the calling thread has written so far, from its I/O counters
+static unsigned long read_written(Renderer *r) {
+    char buffer[512];
+    if (r->io_fd == -1) return 0;
+    ssize_t n = pread(r->io_fd, buffer, sizeof(buffer) - 1, 0);
+    if (n <= 0) return 0;
+    buffer[n] = '\0';
+    char *wchar = strstr(buffer, "wchar:");
+    return wchar ? strtoul(wchar + 6, NULL, 10) : 0;
+}
+
+void render_init(Renderer *r) {
+    // Nothing is drawn on stdscr, but getch refreshes it; have its first
+    // refresh, which clears the screen, now rather than over the board
+    refresh();
+    leaveok(stdscr, TRUE);
+
+    r->rows = FRAME_ROWS;
+    if (r->rows > LINES - (OFFSETY - 1)) r->rows = LINES - (OFFSETY - 1);
+    r->cols = FRAME_COLS;
+    if (r->cols > COLS - OFFSETX) r->cols = COLS - OFFSETX;
+    r->window = NULL;
+    if (r->rows > 0 && r->cols > 0) r->window = newwin(r->rows, r->cols, OFFSETY - 1, OFFSETX);
+    if (r->window) leaveok(r->window, TRUE);
+    memset(r->cells, 0, sizeof(r->cells));     // Matches no cell, so all are drawn first
+
+    r->io_fd = open("/proc/thread-self/io", O_RDONLY);
+    r->written = read_written(r);
+    r->report[0] = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &r->reported);
+}
+
+void render_kick(Renderer *r) {
+    pthread_mutex_lock(&r->lock);
+    r->kicks++;
+    pthread_cond_signal(&r->kicked);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void render_wait(Renderer *r) {
+    pthread_mutex_lock(&r->lock);
+    while (r->kicks == 0) pthread_cond_wait(&r->kicked, &r->lock);
+    r->kicks = 0;
+    pthread_mutex_unlock(&r->lock);
+}
+
+void render_redraw(Renderer *r) {
+    __atomic_store_n(&r->redraw, 1, __ATOMIC_RELAXED);
+    render_kick(r);
+}
+
+// Write text into a row of the grid from col, as far as it fits
+static void put_text(chtype grid[FRAME_ROWS][FRAME_COLS], int row, int col,
+                     const char *text, chtype attr) {
+    for (; *text && col < FRAME_COLS; text++, col++) grid[row][col] = (unsigned char)*text | attr;
+}
+
+// Lay frame out as cells, in the order the old full redraw painted them:
+// title bar, border, ball, then paddles over the ball
+static void layout(chtype grid[FRAME_ROWS][FRAME_COLS], const Frame *frame, const char *report) {
+    char text[FRAME_COLS + 1];
+    for (int y = 0; y < FRAME_ROWS; y++)
+        for (int x = 0; x < FRAME_COLS; x++) grid[y][x] = ' ';
+
+    chtype bar = COLOR_PAIR(1);
+    for (int x = 0; x < FRAME_COLS; x++) grid[0][x] = ' ' | bar;
+    snprintf(text, sizeof(text), "CS3205 NetPong, Ball: %d, %d", frame->ball_x, frame->ball_y);
+    put_text(grid, 0, 3, text, bar);
+    snprintf(text, sizeof(text), "Server: %d, Client: %d", frame->penalty, frame->penalty_2);
+    put_text(grid, 0, WIDTH - 25, text, bar);
+
+    // Board row y is grid row 1 + y
+    for (int y = 1; y <= HEIGHT; y++) {
+        grid[y][0] = grid[y][1] = ' ' | bar;
+        grid[y][WIDTH - 1] = grid[y][WIDTH] = ' ' | bar;
+    }
+    for (int x = 0; x < WIDTH; x++) {
+        grid[1][x] = ' ' | bar;
+        grid[HEIGHT][x] = ' ' | bar;
+    }
+
+    if (frame->ball_y >= 0 && frame->ball_y < HEIGHT && frame->ball_x >= 0 && frame->ball_x < FRAME_COLS)
+        grid[1 + frame->ball_y][frame->ball_x] = 'o';
+
+    // Paddle positions come off the wire: clip them like curses would
+    for (int i = 0; i < PADDLE_WIDTH; i++) {
+        int x = frame->paddle_x + i, x2 = frame->paddle2_x + i;
+        if (x >= 0 && x < FRAME_COLS) grid[1 + HEIGHT - 4][x] = ' ' | COLOR_PAIR(2);
+        if (x2 >= 0 && x2 < FRAME_COLS) grid[1 + 3][x2] = ' ' | COLOR_PAIR(2);
+    }
+
+    put_text(grid, HEIGHT + 1, 0, frame->status, A_NORMAL);
+    put_text(grid, HEIGHT + 2, 0, report, A_NORMAL);
+}
+
+// Renew the stats line, at most once a second so that it does not itself
+// cost a few bytes every frame
+static void update_report(Renderer *r, const struct timespec *now) {
+    if (r->report[0] && elapsed_us(&r->reported, now) < 1000000) return;
+    r->reported = *now;
+
+    unsigned long frames = r->frames;
+    long avg_us = frames ? r->total_us / frames : 0;
+    if (r->io_fd == -1) {
+        snprintf(r->report, sizeof(r->report), "Frames: %lu, %ld us avg, %ld us worst",
+                 frames, avg_us, r->worst_us);
+    } else {
+        snprintf(r->report, sizeof(r->report),
+                 "Frames: %lu, %ld us avg, %ld us worst; terminal: %lu bytes, %lu a frame",
+                 frames, avg_us, r->worst_us, r->bytes, frames ? r->bytes / frames : 0);
+    }
+}
+
+void render_frame(Renderer *r, const Frame *frame) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!r->window) return;
+
+    update_report(r, &start);
+    chtype grid[FRAME_ROWS][FRAME_COLS];
+    layout(grid, frame, r->report);
+
+    if (__atomic_exchange_n(&r->redraw, 0, __ATOMIC_RELAXED))
+        memset(r->cells, 0, sizeof(r->cells));
+
+    unsigned long changed = 0;
+    for (int y = 0; y < r->rows; y++) {
+        for (int x = 0; x < r->cols; x++) {
+            if (grid[y][x] == r->cells[y][x]) continue;
+            mvwaddch(r->window, y, x, grid[y][x]);
+            r->cells[y][x] = grid[y][x];
+            changed++;
+        }
+    }
+    if (changed) {
+        wnoutrefresh(r->window);
+        doupdate();
+    }
+
+    unsigned long written = read_written(r);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long us = elapsed_us(&start, &end);
+    __atomic_store_n(&r->frames, r->frames + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->cells_drawn, r->cells_drawn + changed, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->bytes, r->bytes + (written - r->written), __ATOMIC_RELAXED);
+    __atomic_store_n(&r->total_us, r->total_us + us, __ATOMIC_RELAXED);
+    if (us > r->worst_us) __atomic_store_n(&r->worst_us, us, __ATOMIC_RELAXED);
+    r->written = written;
+}
+
+void print_render_stats(Renderer *r) {
+    unsigned long frames = __atomic_load_n(&r->frames, __ATOMIC_RELAXED);
+    printf("Frames: %lu, %ld us average, %ld us worst, %lu cells drawn, %lu bytes to the terminal\n",
+           frames, frames ? __atomic_load_n(&r->total_us, __ATOMIC_RELAXED) / (long)frames : 0,
+           __atomic_load_n(&r->worst_us, __ATOMIC_RELAXED),
+           __atomic_load_n(&r->cells_drawn, __ATOMIC_RELAXED),
+           __atomic_load_n(&r->bytes, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,85 @@
+/*
+ * NetPong renderer
+ * ----------------
+ * Draws the board into one window kept for the whole game. Each frame is
+ * laid out as a grid of cells and compared with the grid last drawn; only
+ * the cells that differ are handed to ncurses, and nothing is cleared, so
+ * a frame in which the ball moves one cell costs a few bytes of terminal
+ * output instead of a repaint of every border cell.
+ *
+ * Frames are drawn in step with the game rather than on a timer: whatever
+ * has something new to show (a snapshot, a predicted paddle move) calls
+ * render_kick, and the render thread, blocked in render_wait, draws one
+ * frame for however many kicks came in meanwhile.
+ *
+ * Under the board the renderer reports how long frames take and how many
+ * bytes they write to the terminal (the render thread's own write count,
+ * from /proc/thread-self/io).
+ */
+
+#ifndef PONG_DRAW_H
+#define PONG_DRAW_H
+
+#include <pthread.h>
+#include <ncurses.h>
+
+#include "pong_sim.h"
+
+#define OFFSETX 10
+#define OFFSETY 5
+
+// Grid drawn: the title bar, the board, a caller's status line and the
+// renderer's own, from (OFFSETY - 1, OFFSETX)
+#define FRAME_ROWS (HEIGHT + 3)
+#define FRAME_COLS (WIDTH + 1)
+
+// What one frame shows; ball and paddles in cells
+typedef struct {
+    int ball_x, ball_y;
+    int paddle_x, paddle2_x;    // Bottom and top
+    int penalty, penalty_2;
+    char status[FRAME_COLS + 1];
+} Frame;
+
+typedef struct {
+    // Kicks not yet drawn, and the render thread waiting on them
+    pthread_mutex_t lock;
+    pthread_cond_t kicked;
+    unsigned long kicks;
+    int redraw;                 // Screen was cleared: draw every cell
+
+    WINDOW *window;
+    int rows, cols;             // Of the grid, as much as fits on the screen
+    chtype cells[FRAME_ROWS][FRAME_COLS];   // As last drawn
+    int io_fd;                  // Render thread's I/O counters, -1 if unavailable
+    unsigned long written;      // Render thread's bytes written so far
+
+    // Updated by the render thread (atomic)
+    unsigned long frames;
+    unsigned long cells_drawn;
+    unsigned long bytes;        // Written to the terminal
+    long total_us, worst_us;    // Time to lay out, compare and draw a frame
+
+    char report[FRAME_COLS + 1];    // Stats line, renewed once a second
+    struct timespec reported;
+} Renderer;
+
+#define RENDERER_INITIALIZER {.lock = PTHREAD_MUTEX_INITIALIZER, .kicked = PTHREAD_COND_INITIALIZER}
+
+// Set up the window; call from the thread that will draw, after ncurses
+void render_init(Renderer *r);
+
+// There is something new to draw; render_wait returns once there has been
+// a kick since it last returned
+void render_kick(Renderer *r);
+void render_wait(Renderer *r);
+
+// Draw every cell next frame, as after the screen has been cleared
+void render_redraw(Renderer *r);
+
+// Draw frame, changing only the cells that differ from the last one
+void render_frame(Renderer *r, const Frame *frame);
+
+void print_render_stats(Renderer *r);
+
+#endif
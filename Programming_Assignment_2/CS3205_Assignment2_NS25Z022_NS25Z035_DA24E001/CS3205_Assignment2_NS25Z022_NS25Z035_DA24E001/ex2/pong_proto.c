@@ -0,0 +1,128 @@
+// NetPong UDP wire format (see pong_proto.h)
+
+#include <stddef.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "pong_proto.h"
+
+static void put16(uint8_t *p, uint16_t v) {
+    v = htons(v);
+    memcpy(p, &v, 2);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static uint16_t get16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return ntohs(v);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+// Snapshot fields in wire order
+static const size_t field_offsets[SNAP_FIELDS] = {
+    offsetof(Snapshot, ball_x), offsetof(Snapshot, ball_y), offsetof(Snapshot, paddle_x),
+    offsetof(Snapshot, paddle2_x), offsetof(Snapshot, penalty), offsetof(Snapshot, penalty_2),
+};
+
+static int get_field(const Snapshot *snap, int i) {
+    return *(const int *)((const char *)snap + field_offsets[i]);
+}
+
+static void set_field(Snapshot *snap, int i, int value) {
+    *(int *)((char *)snap + field_offsets[i]) = value;
+}
+
+int seq_newer(uint16_t a, uint16_t b) {
+    return (int16_t)(a - b) > 0;
+}
+
+#define SNAPSHOT_HEADER 17
+
+size_t encode_snapshot(uint8_t *buf, uint16_t seq, const Snapshot *snap,
+                       uint16_t base_seq, const Snapshot *base) {
+    buf[0] = PKT_SNAPSHOT;
+    put16(buf + 1, seq);
+    put16(buf + 3, base ? base_seq : 0);
+    buf[5] = base ? SNAP_DELTA : 0;
+    put32(buf + 6, snap->tick);
+    put16(buf + 10, snap->tick_rate);
+    put32(buf + 12, snap->input_ack);
+
+    uint8_t mask = 0;
+    size_t len = SNAPSHOT_HEADER;
+    for (int i = 0; i < SNAP_FIELDS; i++) {
+        int value = get_field(snap, i);
+        if (base && value == get_field(base, i)) continue;
+        mask |= 1 << i;
+        put16(buf + len, (uint16_t)value);
+        len += 2;
+    }
+    buf[16] = mask;
+    return len;
+}
+
+int decode_snapshot(const uint8_t *buf, size_t len, SnapshotPacket *pkt) {
+    if (len < SNAPSHOT_HEADER || buf[0] != PKT_SNAPSHOT) return -1;
+    pkt->seq = get16(buf + 1);
+    pkt->base_seq = get16(buf + 3);
+    pkt->flags = buf[5];
+    pkt->tick = get32(buf + 6);
+    pkt->tick_rate = get16(buf + 10);
+    pkt->input_ack = get32(buf + 12);
+    pkt->mask = buf[16];
+
+    // A full snapshot must carry every field
+    if (!(pkt->flags & SNAP_DELTA) && pkt->mask != (1 << SNAP_FIELDS) - 1) return -1;
+    size_t pos = SNAPSHOT_HEADER;
+    for (int i = 0; i < SNAP_FIELDS; i++) {
+        if (!(pkt->mask & (1 << i))) continue;
+        if (pos + 2 > len) return -1;
+        pkt->fields[i] = (int16_t)get16(buf + pos);
+        pos += 2;
+    }
+    return pos == len ? 0 : -1;
+}
+
+void apply_snapshot(const SnapshotPacket *pkt, const Snapshot *base, Snapshot *out) {
+    if (pkt->flags & SNAP_DELTA) *out = *base;
+    out->tick = pkt->tick;
+    out->tick_rate = pkt->tick_rate;
+    out->input_ack = pkt->input_ack;
+    for (int i = 0; i < SNAP_FIELDS; i++) {
+        if (pkt->mask & (1 << i)) set_field(out, i, pkt->fields[i]);
+    }
+}
+
+size_t encode_input(uint8_t *buf, const InputPacket *pkt) {
+    buf[0] = PKT_INPUT;
+    put16(buf + 1, pkt->ack_seq);
+    put32(buf + 3, pkt->ack_bits);
+    put32(buf + 7, pkt->input_seq);
+    buf[11] = pkt->count;
+    for (int i = 0; i < pkt->count; i++) buf[12 + i] = (uint8_t)pkt->move[i];
+    return 12 + pkt->count;
+}
+
+int decode_input(const uint8_t *buf, size_t len, InputPacket *pkt) {
+    if (len < 12 || buf[0] != PKT_INPUT) return -1;
+    pkt->ack_seq = get16(buf + 1);
+    pkt->ack_bits = get32(buf + 3);
+    pkt->input_seq = get32(buf + 7);
+    pkt->count = buf[11];
+    if (pkt->count > INPUT_REDUNDANCY || len != 12 + (size_t)pkt->count) return -1;
+    for (int i = 0; i < pkt->count; i++) {
+        pkt->move[i] = (int8_t)buf[12 + i];
+        if (pkt->move[i] < -1 || pkt->move[i] > 1) return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * NetPong UDP wire format
+ * -----------------------
+ * In UDP mode (-u on both sides) the server sends a binary snapshot of the
+ * game every 20 ms and the client sends its input every 30 ms; a lost
+ * packet is simply superseded by the next one instead of holding up
+ * everything behind it as it would over TCP.
+ *
+ * Snapshot (server to client), all fields big-endian:
+ *
+ *     u8  PKT_SNAPSHOT
+ *     u16 seq           counts snapshot packets
+ *     u16 base_seq      snapshot the values are relative to (if SNAP_DELTA)
+ *     u8  flags         SNAP_DELTA
+ *     u32 tick          simulation tick the snapshot was taken at
+ *     u16 tick_rate     ticks per second, to turn ticks into time
+ *     u32 input_ack     newest client input reflected in the snapshot
+ *     u8  mask          bit i set: field i follows
+ *     i16 field...      the fields in mask, in order
+ *
+ * A full snapshot carries every field. A delta carries only the fields that
+ * differ from base_seq, which is always a snapshot the client has acked,
+ * so the client still holds it; each frame usually changes just the ball.
+ * The ball is sent in 1/BALL_SCALE cells so the client can interpolate it.
+ *
+ * Input (client to server):
+ *
+ *     u8  PKT_INPUT
+ *     u16 ack_seq       newest snapshot received
+ *     u32 ack_bits      bit i set: snapshot ack_seq - 1 - i received too
+ *     u32 input_seq     sequence number of the first input below
+ *     u8  count
+ *     i8  move...       count inputs, newest first: -1 left, 0, +1 right
+ *
+ * Inputs are moves rather than positions: the server applies each one to
+ * its own copy of the paddle (paddle_move, in pong_sim.h), and reports in
+ * input_ack which it has applied, so the client can take the server's
+ * paddle and replay only the moves after it. Every input the server has
+ * not acknowledged (up to INPUT_REDUNDANCY) goes in each packet, so one
+ * lost packet loses no input.
+ */
+
+#ifndef PONG_PROTO_H
+#define PONG_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PKT_SNAPSHOT 1
+#define PKT_INPUT 2
+
+#define SNAP_DELTA 0x01
+
+#define SNAP_FIELDS 6
+#define SNAPSHOT_HISTORY 32     // Snapshots either side keeps as delta bases
+#define INPUT_REDUNDANCY 8
+#define MAX_PACKET 64
+#define BALL_SCALE 16           // Snapshot ball units per cell
+
+// Nearest cell to a snapshot ball coordinate
+#define BALL_CELL(v) (((v) + BALL_SCALE / 2) / BALL_SCALE)
+
+// What the client sees of one tick
+typedef struct {
+    uint32_t tick;
+    uint16_t tick_rate;
+    uint32_t input_ack;
+    int ball_x, ball_y;     // In 1/BALL_SCALE cells
+    int paddle_x, paddle2_x;
+    int penalty, penalty_2;
+} Snapshot;
+
+typedef struct {
+    uint16_t seq;
+    uint16_t base_seq;
+    uint8_t flags;
+    uint32_t tick;
+    uint16_t tick_rate;
+    uint32_t input_ack;
+    uint8_t mask;
+    int16_t fields[SNAP_FIELDS];   // Only those in mask are set
+} SnapshotPacket;
+
+typedef struct {
+    uint16_t ack_seq;
+    uint32_t ack_bits;
+    uint32_t input_seq;
+    uint8_t count;
+    int8_t move[INPUT_REDUNDANCY];
+} InputPacket;
+
+// True if sequence number a is after b, allowing for wraparound
+int seq_newer(uint16_t a, uint16_t b);
+
+// Encode snap as packet seq, relative to base if it is not NULL; returns the
+// packet length (at most MAX_PACKET)
+size_t encode_snapshot(uint8_t *buf, uint16_t seq, const Snapshot *snap,
+                       uint16_t base_seq, const Snapshot *base);
+
+// Parse a snapshot packet, -1 if it is malformed. A delta still needs its
+// base: apply_snapshot fills in what the packet left out.
+int decode_snapshot(const uint8_t *buf, size_t len, SnapshotPacket *pkt);
+void apply_snapshot(const SnapshotPacket *pkt, const Snapshot *base, Snapshot *out);
+
+size_t encode_input(uint8_t *buf, const InputPacket *pkt);
+int decode_input(const uint8_t *buf, size_t len, InputPacket *pkt);
+
+#endif
@@ -0,0 +1,679 @@
+// Dedicated multi-room server (see pong_rooms.h)
+
+#define _GNU_SOURCE     // recvmmsg, sendmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "pong_proto.h"
+#include "pong_sim.h"
+#include "pong_tick.h"
+#include "pong_rooms.h"
+
+#define BATCH 64                    // Datagrams per recvmmsg or sendmmsg call
+#define PLAYER_TIMEOUT_MS 5000      // Silence after which a player counts as gone
+#define LOBBY_INTERVAL_MS 250       // How often waiting players hear from the server
+#define STATS_INTERVAL_MS 5000
+#define SOCKET_BUFFER (4 << 20)
+#define QUIET_MARGIN 1e-6           // Cells a fast-path ball must stop short of a plane
+
+// Snapshot ball y as the top player sees it: the two paddle lines swap
+#define MIRROR_Y ((PADDLE_TOP_Y + PADDLE_BOTTOM_Y) * BALL_SCALE)
+
+typedef struct Player {
+    struct sockaddr_in addr;
+    uint64_t key;                   // Address and port, for the hash table
+    struct Player *next;            // Hash chain
+    struct Player *queue_next;      // Matchmaking queue, while waiting
+
+    // Input, applied by the receive thread
+    uint32_t input_seq;             // Newest move applied
+    int paddle_x;                   // Paddle after it
+
+    // Published by the receive thread for the worker (atomic)
+    uint64_t input;                 // input_seq << 32 | paddle_x
+    uint64_t acks;                  // Newest ack word: ack_seq << 32 | ack_bits
+    long last_heard_ms;
+
+    // Snapshots sent, kept as delta bases; used by the receive thread while
+    // the player waits and by the room's worker while it plays
+    uint16_t next_seq;
+    Snapshot sent[SNAPSHOT_HISTORY];        // By seq % SNAPSHOT_HISTORY
+    uint16_t sent_seq[SNAPSHOT_HISTORY];
+    uint8_t sent_valid[SNAPSHOT_HISTORY];
+} Player;
+
+// All rooms, one array per field. Only a room's worker writes the game
+// fields; the receive thread fills in the players before handing it over.
+typedef struct {
+    double *ball_x, *ball_y, *ball_dx, *ball_dy;
+    unsigned *ball_hits;
+    double *near;                   // Set by the fast path: needs ball_step
+    int *paddle_x, *paddle2_x;      // Bottom and top
+    uint32_t *input_ack, *input_ack2;
+    int *penalty, *penalty_2;
+    uint8_t *active;
+    Player **bottom, **top;
+} Rooms;
+
+typedef struct {
+    int first, count;               // Rooms first .. first + count - 1
+    pthread_t thread;
+    TickStats stats;
+
+    // Rooms paired by the receive thread, waiting for the worker to start them
+    pthread_mutex_t lock;
+    int *pending;
+    int npending;
+
+    // Free rooms, receive thread only
+    int *free_rooms;
+    int nfree;
+
+    int playing;                    // Rooms in play (atomic)
+    unsigned long packets, bytes, full;     // Snapshots sent (atomic)
+} Worker;
+
+static Rooms rooms;
+static Worker *workers;
+static int nworkers;
+static int server_socket;
+static int tick_rate;
+static struct timespec server_start;
+
+// Rooms whose game has ended, for the receive thread to clean up
+static pthread_mutex_t closed_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *closed_rooms;
+static int nclosed;
+
+// Receive thread only
+static Player **table;
+static unsigned table_bits;
+static Player *queue_head, *queue_tail;
+static int waiting, players, max_players;
+static unsigned long packets_in, bad_packets;
+
+static long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+// Current tick, by the clock rather than any worker
+static uint32_t current_tick(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ns = (now.tv_sec - server_start.tv_sec) * 1000000000L + (now.tv_nsec - server_start.tv_nsec);
+    return ns / (1000000000L / tick_rate);
+}
+
+// Encode snap for p as a delta against the newest snapshot its latest ack
+// word says it has, or in full if there is none
+static size_t encode_for(Player *p, const Snapshot *snap, uint8_t *buf, int *full) {
+    uint64_t acks = __atomic_load_n(&p->acks, __ATOMIC_RELAXED);
+    uint16_t ack_seq = acks >> 32;
+    uint32_t ack_bits = (uint32_t)acks;
+
+    int base = -1;
+    for (int i = -1; i < 32 && base == -1; i++) {
+        if (i >= 0 && !(ack_bits & (1u << i))) continue;
+        uint16_t seq = ack_seq - 1 - i;
+        int slot = seq % SNAPSHOT_HISTORY;
+        if (p->sent_valid[slot] && p->sent_seq[slot] == seq) base = slot;
+    }
+
+    uint16_t seq = p->next_seq++;
+    size_t len = encode_snapshot(buf, seq, snap,
+                                 base == -1 ? 0 : p->sent_seq[base],
+                                 base == -1 ? NULL : &p->sent[base]);
+    int slot = seq % SNAPSHOT_HISTORY;
+    p->sent[slot] = *snap;
+    p->sent_seq[slot] = seq;
+    p->sent_valid[slot] = 1;
+    *full = base == -1;
+    return len;
+}
+
+// Room i as one of its players sees it; the top player gets it upside down
+static void room_snapshot(int i, int top, uint32_t tick, Snapshot *snap) {
+    snap->tick = tick;
+    snap->tick_rate = tick_rate;
+    snap->ball_x = (int)(rooms.ball_x[i] * BALL_SCALE + 0.5);
+    int ball_y = (int)(rooms.ball_y[i] * BALL_SCALE + 0.5);
+    if (!top) {
+        snap->ball_y = ball_y;
+        snap->paddle_x = rooms.paddle_x[i];
+        snap->paddle2_x = rooms.paddle2_x[i];
+        snap->penalty = rooms.penalty[i];
+        snap->penalty_2 = rooms.penalty_2[i];
+        snap->input_ack = rooms.input_ack[i];
+    } else {
+        // Past the top paddle line the mirrored ball would leave the board
+        snap->ball_y = MIRROR_Y - ball_y < BALL_SCALE ? BALL_SCALE : MIRROR_Y - ball_y;
+        snap->paddle_x = rooms.paddle2_x[i];
+        snap->paddle2_x = rooms.paddle_x[i];
+        snap->penalty = rooms.penalty_2[i];
+        snap->penalty_2 = rooms.penalty[i];
+        snap->input_ack = rooms.input_ack2[i];
+    }
+}
+
+// An empty room holds a still ball, which the fast path leaves alone
+static void clear_room(int i) {
+    rooms.ball_x[i] = WIDTH / 2;
+    rooms.ball_y[i] = HEIGHT / 2;
+    rooms.ball_dx[i] = 0;
+    rooms.ball_dy[i] = 0;
+    rooms.ball_hits[i] = 0;
+    rooms.paddle_x[i] = PADDLE_START_X;
+    rooms.paddle2_x[i] = PADDLE_START_X;
+    rooms.penalty[i] = 0;
+    rooms.penalty_2[i] = 0;
+}
+
+// Start the rooms the receive thread has paired
+static void start_pending(Worker *w) {
+    pthread_mutex_lock(&w->lock);
+    for (int k = 0; k < w->npending; k++) {
+        int i = w->pending[k];
+        Ball ball;
+        serve_ball(&ball);
+        rooms.ball_x[i] = WIDTH / 2;
+        rooms.ball_y[i] = HEIGHT / 2;
+        rooms.ball_dx[i] = ball.dx;
+        rooms.ball_dy[i] = ball.dy;
+        rooms.ball_hits[i] = 0;
+        rooms.penalty[i] = 0;
+        rooms.penalty_2[i] = 0;
+        rooms.active[i] = 1;
+    }
+    __atomic_fetch_add(&w->playing, w->npending, __ATOMIC_RELAXED);
+    w->npending = 0;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Fast path for n balls: a ball that stays clear of every wall and line
+// until the end of the tick just moves; the rest are marked near (1.0).
+// Nearly every ball takes it, including the still ones in empty rooms. A
+// ball with hits set stands on a plane, so it always counts as near.
+//
+// The loop is all doubles, selects rather than branches, so that gcc -O3
+// vectorises it.
+static void move_quiet(double *restrict x, double *restrict y, const double *restrict dx,
+                       const double *restrict dy, double *restrict near, int n, double dt) {
+    for (int i = 0; i < n; i++) {
+        double nx = x[i] + dx[i] * dt;
+        double ny = y[i] + dy[i] * dt;
+
+        // Next plane along y each way: paddle lines, then goal lines. Moving
+        // up, compare negated positions so both ways are a < test.
+        double below = y[i] <= PADDLE_TOP_Y ? PADDLE_TOP_Y : y[i] <= PADDLE_BOTTOM_Y ? PADDLE_BOTTOM_Y : GOAL_BOTTOM_Y;
+        double above = y[i] >= PADDLE_BOTTOM_Y ? PADDLE_BOTTOM_Y : y[i] >= PADDLE_TOP_Y ? PADDLE_TOP_Y : GOAL_TOP_Y;
+        double limit = dy[i] > 0 ? below - QUIET_MARGIN : -(above + QUIET_MARGIN);
+        double ahead = dy[i] > 0 ? ny : -ny;
+
+        // Both ends of the move must be strictly between the walls
+        double lo = nx < x[i] ? nx : x[i];
+        double hi = nx > x[i] ? nx : x[i];
+
+        _Bool quiet = (lo > WALL_LEFT + QUIET_MARGIN) & (hi < WALL_RIGHT - QUIET_MARGIN) & (ahead < limit);
+        x[i] = quiet ? nx : x[i];
+        y[i] = quiet ? ny : y[i];
+        near[i] = quiet ? 0 : 1;
+    }
+}
+
+// One tick for every room of w
+static void step_rooms(Worker *w, double dt) {
+    int first = w->first, end = w->first + w->count;
+
+    // Paddles from the players' latest moves
+    for (int i = first; i < end; i++) {
+        if (!rooms.active[i]) continue;
+        uint64_t in = __atomic_load_n(&rooms.bottom[i]->input, __ATOMIC_RELAXED);
+        rooms.paddle_x[i] = (int)(uint32_t)in;
+        rooms.input_ack[i] = in >> 32;
+        in = __atomic_load_n(&rooms.top[i]->input, __ATOMIC_RELAXED);
+        rooms.paddle2_x[i] = (int)(uint32_t)in;
+        rooms.input_ack2[i] = in >> 32;
+    }
+
+    move_quiet(rooms.ball_x + first, rooms.ball_y + first, rooms.ball_dx + first,
+               rooms.ball_dy + first, rooms.near + first, end - first, dt);
+
+    // The rest bounce or score this tick
+    for (int i = first; i < end; i++) {
+        if (!rooms.near[i]) continue;
+        Ball ball = {rooms.ball_x[i], rooms.ball_y[i], rooms.ball_dx[i], rooms.ball_dy[i],
+                     rooms.ball_hits[i]};
+        ball_step(&ball, rooms.paddle_x[i], rooms.paddle2_x[i],
+                  &rooms.penalty[i], &rooms.penalty_2[i], dt);
+        rooms.ball_x[i] = ball.x;
+        rooms.ball_y[i] = ball.y;
+        rooms.ball_dx[i] = ball.dx;
+        rooms.ball_dy[i] = ball.dy;
+        rooms.ball_hits[i] = ball.hits;
+    }
+}
+
+// Send the datagrams queued in msgs; UDP may drop what the socket will not take
+static void flush_batch(struct mmsghdr *msgs, int n) {
+    int sent = 0;
+    while (sent < n) {
+        int r = sendmmsg(server_socket, msgs + sent, n - sent, 0);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno != EINTR && errno != ECONNREFUSED) perror("Error sending snapshots");
+            // Skip the datagram that failed and carry on with the rest
+            if (errno != EINTR) sent++;
+            continue;
+        }
+        sent += r;
+    }
+}
+
+// Snapshots for every player of w's rooms, in sendmmsg batches; rooms with
+// a player gone quiet are closed instead
+static void send_rooms(Worker *w, uint32_t tick) {
+    static __thread uint8_t buffers[BATCH][MAX_PACKET];
+    static __thread struct mmsghdr msgs[BATCH];
+    static __thread struct iovec iovs[BATCH];
+    int n = 0;
+    long now = now_ms();
+    unsigned long packets = 0, bytes = 0, full = 0;
+
+    for (int i = w->first; i < w->first + w->count; i++) {
+        if (!rooms.active[i]) continue;
+        Player *side[2] = {rooms.bottom[i], rooms.top[i]};
+
+        if (now - __atomic_load_n(&side[0]->last_heard_ms, __ATOMIC_RELAXED) > PLAYER_TIMEOUT_MS ||
+            now - __atomic_load_n(&side[1]->last_heard_ms, __ATOMIC_RELAXED) > PLAYER_TIMEOUT_MS) {
+            rooms.active[i] = 0;
+            clear_room(i);
+            __atomic_fetch_sub(&w->playing, 1, __ATOMIC_RELAXED);
+            pthread_mutex_lock(&closed_lock);
+            closed_rooms[nclosed++] = i;
+            pthread_mutex_unlock(&closed_lock);
+            continue;
+        }
+
+        for (int top = 0; top < 2; top++) {
+            Snapshot snap;
+            int was_full;
+            room_snapshot(i, top, tick, &snap);
+            iovs[n].iov_base = buffers[n];
+            iovs[n].iov_len = encode_for(side[top], &snap, buffers[n], &was_full);
+            msgs[n].msg_hdr = (struct msghdr){.msg_name = &side[top]->addr,
+                                              .msg_namelen = sizeof(side[top]->addr),
+                                              .msg_iov = &iovs[n], .msg_iovlen = 1};
+            packets++;
+            bytes += iovs[n].iov_len;
+            full += was_full;
+            if (++n == BATCH) {
+                flush_batch(msgs, n);
+                n = 0;
+            }
+        }
+    }
+    if (n > 0) flush_batch(msgs, n);
+
+    __atomic_fetch_add(&w->packets, packets, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->full, full, __ATOMIC_RELAXED);
+}
+
+static void *run_worker(void *args) {
+    Worker *w = (Worker *)args;
+    Ticker ticker;
+    if (ticker_start(&ticker, tick_rate, &server_start, &w->stats) == -1) {
+        perror("Timer creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Snapshots go out every 20 ms or so, on the tick at or after it
+    int send_every = (tick_rate + 49) / 50;
+    double dt = 1.0 / tick_rate;
+    unsigned long next_send = 0;
+
+    while (1) {
+        int ticks = ticker_wait(&ticker);
+        if (ticks == -1) {
+            perror("Timer read failed");
+            exit(EXIT_FAILURE);
+        }
+        start_pending(w);
+        for (int i = 0; i < ticks; i++) step_rooms(w, dt);
+        if (ticker.deadlines >= next_send) {
+            send_rooms(w, ticker.deadlines);
+            next_send = ticker.deadlines + send_every;
+        }
+        ticker_done(&ticker);
+    }
+    return NULL;
+}
+
+static unsigned hash_key(uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ull) >> (64 - table_bits);
+}
+
+static uint64_t addr_key(const struct sockaddr_in *addr) {
+    return (uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port;
+}
+
+static Player *find_player(uint64_t key) {
+    Player *p = table[hash_key(key)];
+    while (p && p->key != key) p = p->next;
+    return p;
+}
+
+static void enqueue(Player *p) {
+    p->queue_next = NULL;
+    if (queue_tail) queue_tail->queue_next = p;
+    else queue_head = p;
+    queue_tail = p;
+    waiting++;
+}
+
+static Player *dequeue(void) {
+    Player *p = queue_head;
+    queue_head = p->queue_next;
+    if (!queue_head) queue_tail = NULL;
+    waiting--;
+    return p;
+}
+
+static void remove_player(Player *p) {
+    Player **link = &table[hash_key(p->key)];
+    while (*link != p) link = &(*link)->next;
+    *link = p->next;
+    players--;
+    free(p);
+}
+
+// A player starts a game at the bottom or top with a centred paddle; its
+// input sequence carries on from wherever it was
+static void reset_paddle(Player *p) {
+    p->paddle_x = PADDLE_START_X;
+    __atomic_store_n(&p->input, (uint64_t)p->input_seq << 32 | (uint32_t)p->paddle_x,
+                     __ATOMIC_RELAXED);
+}
+
+// Pair waiting players off into free rooms, each on the least busy worker
+static void match_players(void) {
+    while (waiting >= 2) {
+        Worker *w = NULL;
+        for (int k = 0; k < nworkers; k++) {
+            if (workers[k].nfree > 0 && (!w || workers[k].nfree > w->nfree)) w = &workers[k];
+        }
+        if (!w) return;     // All rooms taken: the rest keep waiting
+
+        int i = w->free_rooms[--w->nfree];
+        Player *bottom = dequeue(), *top = dequeue();
+        reset_paddle(bottom);
+        reset_paddle(top);
+        rooms.bottom[i] = bottom;
+        rooms.top[i] = top;
+
+        pthread_mutex_lock(&w->lock);
+        w->pending[w->npending++] = i;
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static void handle_packet(const struct sockaddr_in *addr, InputPacket *pkt, long now) {
+    uint64_t key = addr_key(addr);
+    Player *p = find_player(key);
+    if (!p) {
+        if (players >= max_players) return;
+        p = calloc(1, sizeof(Player));
+        if (!p) return;
+        p->addr = *addr;
+        p->key = key;
+        p->next_seq = 1;            // Seq 0 would look acked by a new client
+        p->paddle_x = PADDLE_START_X;
+        p->input = PADDLE_START_X;
+        Player **head = &table[hash_key(key)];
+        p->next = *head;
+        *head = p;
+        players++;
+        enqueue(p);
+    }
+
+    // Packets can arrive out of order; keep the newest ack word
+    uint64_t acks = __atomic_load_n(&p->acks, __ATOMIC_RELAXED);
+    if (!seq_newer(acks >> 32, pkt->ack_seq)) {
+        __atomic_store_n(&p->acks, (uint64_t)pkt->ack_seq << 32 | pkt->ack_bits, __ATOMIC_RELAXED);
+    }
+
+    int applied = 0;
+    for (int i = pkt->count - 1; i >= 0; i--) {
+        uint32_t seq = pkt->input_seq - i;
+        if (seq <= p->input_seq) continue;
+        p->paddle_x = paddle_move(p->paddle_x, pkt->move[i]);
+        p->input_seq = seq;
+        applied = 1;
+    }
+    if (applied) {
+        __atomic_store_n(&p->input, (uint64_t)p->input_seq << 32 | (uint32_t)p->paddle_x,
+                         __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&p->last_heard_ms, now, __ATOMIC_RELAXED);
+}
+
+// Take back the rooms workers have closed: players who went quiet are
+// dropped, and their opponents queue again
+static void reclaim_rooms(long now) {
+    pthread_mutex_lock(&closed_lock);
+    for (int k = 0; k < nclosed; k++) {
+        int i = closed_rooms[k];
+        Player *side[2] = {rooms.bottom[i], rooms.top[i]};
+        for (int s = 0; s < 2; s++) {
+            if (now - side[s]->last_heard_ms > PLAYER_TIMEOUT_MS) remove_player(side[s]);
+            else enqueue(side[s]);
+        }
+        rooms.bottom[i] = rooms.top[i] = NULL;
+        Worker *w = &workers[i / workers[0].count];
+        w->free_rooms[w->nfree++] = i;
+    }
+    nclosed = 0;
+    pthread_mutex_unlock(&closed_lock);
+}
+
+// Drop waiting players who went quiet, and show the rest an empty board
+// with their own paddle on it
+static void serve_lobby(long now) {
+    uint8_t buffer[MAX_PACKET];
+    Player **link = &queue_head;
+    Player *prev = NULL;
+    while (*link) {
+        Player *p = *link;
+        if (now - p->last_heard_ms > PLAYER_TIMEOUT_MS) {
+            *link = p->queue_next;
+            if (queue_tail == p) queue_tail = prev;
+            waiting--;
+            remove_player(p);
+            continue;
+        }
+
+        Snapshot snap = {.tick = current_tick(), .tick_rate = tick_rate, .input_ack = p->input_seq,
+                         .ball_x = WIDTH / 2 * BALL_SCALE, .ball_y = HEIGHT / 2 * BALL_SCALE,
+                         .paddle_x = p->paddle_x, .paddle2_x = PADDLE_START_X};
+        int full;
+        size_t len = encode_for(p, &snap, buffer, &full);
+        sendto(server_socket, buffer, len, 0, (struct sockaddr *)&p->addr, sizeof(p->addr));
+        prev = p;
+        link = &p->queue_next;
+    }
+}
+
+static void print_stats(void) {
+    int playing = 0;
+    unsigned long packets = 0, bytes = 0, full = 0, ticks = 0, overruns = 0, dropped = 0;
+    long worst_late = 0, worst_step = 0;
+    for (int k = 0; k < nworkers; k++) {
+        Worker *w = &workers[k];
+        playing += __atomic_load_n(&w->playing, __ATOMIC_RELAXED);
+        packets += __atomic_load_n(&w->packets, __ATOMIC_RELAXED);
+        bytes += __atomic_load_n(&w->bytes, __ATOMIC_RELAXED);
+        full += __atomic_load_n(&w->full, __ATOMIC_RELAXED);
+        ticks += __atomic_load_n(&w->stats.ticks, __ATOMIC_RELAXED);
+        overruns += __atomic_load_n(&w->stats.overruns, __ATOMIC_RELAXED);
+        dropped += __atomic_load_n(&w->stats.dropped, __ATOMIC_RELAXED);
+        long late = __atomic_load_n(&w->stats.worst_late_us, __ATOMIC_RELAXED);
+        long step = __atomic_load_n(&w->stats.worst_step_us, __ATOMIC_RELAXED);
+        if (late > worst_late) worst_late = late;
+        if (step > worst_step) worst_step = step;
+    }
+    printf("%d rooms playing, %d players waiting | in %lu packets (%lu bad), "
+           "out %lu snapshots (%lu full, %.1f bytes avg) | "
+           "%lu ticks, %lu overruns, %lu dropped, worst late %ld us, worst step %ld us\n",
+           playing, waiting, packets_in, bad_packets, packets, full,
+           packets ? (double)bytes / packets : 0.0,
+           ticks, overruns, dropped, worst_late, worst_step);
+}
+
+// Allocate the room arrays and split the rooms between the workers
+static void setup_rooms(int max_rooms) {
+    int per_worker = (max_rooms + nworkers - 1) / nworkers;
+    int total = per_worker * nworkers;
+
+    rooms.ball_x = calloc(total, sizeof(double));
+    rooms.ball_y = calloc(total, sizeof(double));
+    rooms.ball_dx = calloc(total, sizeof(double));
+    rooms.ball_dy = calloc(total, sizeof(double));
+    rooms.ball_hits = calloc(total, sizeof(unsigned));
+    rooms.near = calloc(total, sizeof(double));
+    rooms.paddle_x = calloc(total, sizeof(int));
+    rooms.paddle2_x = calloc(total, sizeof(int));
+    rooms.input_ack = calloc(total, sizeof(uint32_t));
+    rooms.input_ack2 = calloc(total, sizeof(uint32_t));
+    rooms.penalty = calloc(total, sizeof(int));
+    rooms.penalty_2 = calloc(total, sizeof(int));
+    rooms.active = calloc(total, 1);
+    rooms.bottom = calloc(total, sizeof(Player *));
+    rooms.top = calloc(total, sizeof(Player *));
+    closed_rooms = calloc(total, sizeof(int));
+    workers = calloc(nworkers, sizeof(Worker));
+    if (!rooms.ball_x || !rooms.ball_y || !rooms.ball_dx || !rooms.ball_dy || !rooms.ball_hits ||
+        !rooms.near || !rooms.paddle_x || !rooms.paddle2_x || !rooms.input_ack ||
+        !rooms.input_ack2 || !rooms.penalty || !rooms.penalty_2 || !rooms.active ||
+        !rooms.bottom || !rooms.top || !closed_rooms || !workers) {
+        perror("Room allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < total; i++) clear_room(i);
+
+    for (int k = 0; k < nworkers; k++) {
+        Worker *w = &workers[k];
+        w->first = k * per_worker;
+        w->count = per_worker;
+        pthread_mutex_init(&w->lock, NULL);
+        w->pending = malloc(per_worker * sizeof(int));
+        w->free_rooms = malloc(per_worker * sizeof(int));
+        if (!w->pending || !w->free_rooms) {
+            perror("Room allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        // Lowest rooms first, so busy rooms stay packed together
+        for (int i = per_worker - 1; i >= 0; i--) w->free_rooms[w->nfree++] = w->first + i;
+    }
+
+    // Room for everyone playing, plus as many again waiting
+    max_players = 4 * total;
+    for (table_bits = 4; (1u << table_bits) < (unsigned)max_players * 2; table_bits++);
+    table = calloc(1u << table_bits, sizeof(Player *));
+    if (!table) {
+        perror("Room allocation failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int run_dedicated(int port, int rate, int nthreads, int max_rooms) {
+    tick_rate = rate;
+    nworkers = nthreads;
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    server_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_socket == -1) {
+        perror("Socket creation failed");
+        return 1;
+    }
+    int opt = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // Thousands of players send in bursts; give the kernel room to queue them
+    opt = SOCKET_BUFFER;
+    setsockopt(server_socket, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+    setsockopt(server_socket, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt));
+    // Wake up now and then for the lobby even when nobody is sending
+    struct timeval timeout = {0, 100000};
+    setsockopt(server_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("Bind failed");
+        return 1;
+    }
+
+    setup_rooms(max_rooms);
+    clock_gettime(CLOCK_MONOTONIC, &server_start);
+    for (int k = 0; k < nworkers; k++) {
+        if (pthread_create(&workers[k].thread, NULL, run_worker, &workers[k]) != 0) {
+            perror("Thread creation failed");
+            return 1;
+        }
+    }
+    printf("Serving up to %d rooms on UDP port %d, %d workers at %d ticks per second\n",
+           workers[0].count * nworkers, port, nworkers, tick_rate);
+
+    static uint8_t buffers[BATCH][MAX_PACKET];
+    static struct sockaddr_in addrs[BATCH];
+    static struct iovec iovs[BATCH];
+    static struct mmsghdr msgs[BATCH];
+    long next_lobby = 0, next_stats = now_ms() + STATS_INTERVAL_MS;
+
+    while (1) {
+        for (int k = 0; k < BATCH; k++) {
+            iovs[k] = (struct iovec){buffers[k], MAX_PACKET};
+            msgs[k].msg_hdr = (struct msghdr){.msg_name = &addrs[k], .msg_namelen = sizeof(addrs[k]),
+                                              .msg_iov = &iovs[k], .msg_iovlen = 1};
+        }
+        int n = recvmmsg(server_socket, msgs, BATCH, MSG_WAITFORONE, NULL);
+        if (n == -1 && errno != EAGAIN && errno != EINTR && errno != ECONNREFUSED) {
+            perror("Receive failed");
+            return 1;
+        }
+
+        long now = now_ms();
+        for (int k = 0; k < n; k++) {
+            InputPacket pkt;
+            packets_in++;
+            if (addrs[k].sin_family != AF_INET ||
+                decode_input(buffers[k], msgs[k].msg_len, &pkt) == -1) {
+                bad_packets++;
+                continue;
+            }
+            handle_packet(&addrs[k], &pkt, now);
+        }
+
+        if (now >= next_lobby) {
+            reclaim_rooms(now);
+            serve_lobby(now);
+            next_lobby = now + LOBBY_INTERVAL_MS;
+        }
+        match_players();
+        if (now >= next_stats) {
+            print_stats();
+            next_stats = now + STATS_INTERVAL_MS;
+        }
+    }
+}
@@ -0,0 +1,32 @@
+/*
+ * Dedicated multi-room server
+ * ---------------------------
+ * p_server -d runs headless, with no board or player of its own: any
+ * number of UDP clients (p_client -u) connect to one port, wait in a
+ * matchmaking queue, and are paired off two to a room, the first to arrive
+ * playing the bottom paddle and the second the top. The top player is sent
+ * the board upside down, so both see themselves at the bottom and neither
+ * client needs to know which it is.
+ *
+ * Rooms are split evenly between worker threads, each with its own tick
+ * timer (all started together, so tick numbers agree). A worker steps all
+ * of its rooms in one pass per tick, over arrays of each field rather than
+ * an array of rooms: a ball that cannot reach a wall or line this tick, as
+ * almost none can, just moves, in a loop the compiler can vectorise, and
+ * only the rest go through step_ball's full bounce logic. It then sends
+ * every player its snapshot in sendmmsg batches.
+ *
+ * The main thread receives all input (recvmmsg), applies players' moves,
+ * runs the queue, and sends waiting players a still board. A player silent
+ * for five seconds is dropped; its opponent goes back in the queue.
+ */
+
+#ifndef PONG_ROOMS_H
+#define PONG_ROOMS_H
+
+#define DEFAULT_ROOMS 4096
+
+// Serve matches on UDP port until killed; returns 1 if setup fails
+int run_dedicated(int port, int tick_rate, int workers, int max_rooms);
+
+#endif
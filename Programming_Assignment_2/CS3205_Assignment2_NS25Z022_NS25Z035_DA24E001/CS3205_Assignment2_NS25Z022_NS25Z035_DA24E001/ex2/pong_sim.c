@@ -0,0 +1,125 @@
+// NetPong simulation (see pong_sim.h)
+
+#include <string.h>
+
+#include "pong_sim.h"
+
+void init_game(GameState *state) {
+    memset(state, 0, sizeof(*state));
+    reset_ball(state);
+    state->ball.x = WIDTH / 2;
+    state->ball.y = HEIGHT / 2;
+    state->paddle = (Paddle){PADDLE_START_X, PADDLE_WIDTH};
+    state->paddle2 = (Paddle){PADDLE_START_X, PADDLE_WIDTH};
+}
+
+// Things the ball can reach part way through a tick
+enum { HIT_NONE, HIT_WALL_LEFT, HIT_WALL_RIGHT, HIT_PADDLE_BOTTOM, HIT_PADDLE_TOP,
+       HIT_GOAL_BOTTOM, HIT_GOAL_TOP };
+
+// If the ball, at pos moving at v, reaches plane no later than *t (and
+// sooner than any hit found so far), make that the next hit; unless it has
+// just been handled, as recorded in done
+static void check_hit(double pos, double v, double plane, int hit, unsigned done,
+                      double *t, int *next) {
+    if (done & (1u << hit)) return;
+    if ((v > 0 && pos <= plane) || (v < 0 && pos >= plane)) {
+        double when = (plane - pos) / v;
+        if (when < *t || (when == *t && *next == HIT_NONE)) {
+            *t = when;
+            *next = hit;
+        }
+    }
+}
+
+// Move the ball through dt seconds of game time. Rather than jumping a
+// whole tick and then checking for overlap, it finds when within the tick
+// the ball first reaches a wall, paddle line or goal line, moves it exactly
+// there, handles the bounce or score, and carries on with what is left of
+// the tick, so bounces land in the same place at any tick rate.
+//
+// A hit is taken even if it falls exactly at the end of the tick, and two
+// at the same instant (a corner) are both taken; ball->hits remembers what
+// was handled where the ball now stands, so it is not handled again until
+// the ball moves on.
+void ball_step(Ball *ball, int paddle_x, int paddle2_x, int *penalty, int *penalty_2, double dt) {
+    unsigned done = ball->hits;
+
+    // The cap guards against rounding loops
+    for (int hits = 0; hits < 8; hits++) {
+        double t = dt;
+        int next = HIT_NONE;
+        check_hit(ball->x, ball->dx, WALL_LEFT, HIT_WALL_LEFT, done, &t, &next);
+        check_hit(ball->x, ball->dx, WALL_RIGHT, HIT_WALL_RIGHT, done, &t, &next);
+        check_hit(ball->y, ball->dy, PADDLE_BOTTOM_Y, HIT_PADDLE_BOTTOM, done, &t, &next);
+        check_hit(ball->y, ball->dy, PADDLE_TOP_Y, HIT_PADDLE_TOP, done, &t, &next);
+        check_hit(ball->y, ball->dy, GOAL_BOTTOM_Y, HIT_GOAL_BOTTOM, done, &t, &next);
+        check_hit(ball->y, ball->dy, GOAL_TOP_Y, HIT_GOAL_TOP, done, &t, &next);
+
+        if (t > 0) {
+            ball->x += ball->dx * t;
+            ball->y += ball->dy * t;
+            dt -= t;
+            done = 0;
+        }
+        if (next == HIT_NONE) break;
+        done |= 1u << next;
+
+        // Snap onto whatever was reached
+        int cell_x = (int)(ball->x + 0.5);
+        switch (next) {
+        case HIT_WALL_LEFT:
+        case HIT_WALL_RIGHT:
+            ball->x = next == HIT_WALL_LEFT ? WALL_LEFT : WALL_RIGHT;
+            ball->dx = -ball->dx;
+            break;
+        case HIT_PADDLE_BOTTOM:
+            // Bounce off the Bottom Paddle
+            ball->y = PADDLE_BOTTOM_Y;
+            if (cell_x >= paddle_x - 1 && cell_x < paddle_x + PADDLE_WIDTH + 1)
+                ball->dy = -ball->dy;
+            break;
+        case HIT_PADDLE_TOP:
+            // Bounce off the Top Paddle
+            ball->y = PADDLE_TOP_Y;
+            if (cell_x >= paddle2_x && cell_x < paddle2_x + PADDLE_WIDTH)
+                ball->dy = -ball->dy;
+            break;
+        case HIT_GOAL_BOTTOM: // Missed paddle
+            serve_ball(ball);                // Reset ball position
+            (*penalty)++;                    // Increment penalty count
+            done = 0;
+            break;
+        case HIT_GOAL_TOP:
+            serve_ball(ball);                // Reset ball position
+            (*penalty_2)++;                  // Increment penalty count
+            done = 0;
+            break;
+        }
+    }
+    ball->hits = done;
+}
+
+void step_ball(GameState *state, double dt) {
+    ball_step(&state->ball, state->paddle.x, state->paddle2.x,
+              &state->penalty, &state->penalty_2, dt);
+}
+
+void serve_ball(Ball *ball) {
+    ball->x = WIDTH / 3;
+    ball->y = HEIGHT / 3;
+    ball->dx = BALL_SPEED;
+    ball->dy = BALL_SPEED;
+    ball->hits = 0;
+}
+
+void reset_ball(GameState *state) {
+    serve_ball(&state->ball);
+}
+
+int paddle_move(int x, int move) {
+    x += move;
+    if (x < PADDLE_MIN_X) x = PADDLE_MIN_X;
+    if (x > PADDLE_MAX_X) x = PADDLE_MAX_X;
+    return x;
+}
@@ -0,0 +1,70 @@
+/*
+ * NetPong simulation
+ * ------------------
+ * The game rules, shared by the server, which runs them, and the client,
+ * which uses them to predict its own paddle. Everything here is a pure
+ * function of its inputs: the same moves applied in the same order give
+ * the same paddle on both sides, which is what lets the client draw its
+ * paddle as soon as a key is pressed and still agree with the server once
+ * the server's answer comes back.
+ */
+
+#ifndef PONG_SIM_H
+#define PONG_SIM_H
+
+#define WIDTH 80
+#define HEIGHT 30
+
+#define PADDLE_WIDTH 10
+#define PADDLE_MIN_X 1
+#define PADDLE_MAX_X (WIDTH - PADDLE_WIDTH - 1)
+#define PADDLE_START_X (WIDTH / 2 - PADDLE_WIDTH / 2)
+#define BALL_SPEED 12.5         // Cells per second along each axis (one per 80 ms)
+
+// Planes the ball bounces off or scores on (cell coordinates)
+#define WALL_LEFT 2
+#define WALL_RIGHT (WIDTH - 2)
+#define PADDLE_BOTTOM_Y (HEIGHT - 5)
+#define PADDLE_TOP_Y 3
+#define GOAL_BOTTOM_Y (HEIGHT - 1)
+#define GOAL_TOP_Y 2
+
+// Structures for game state
+typedef struct {
+    double x, y;    // Ball position (cells)
+    double dx, dy;  // Ball velocity (cells per second)
+    unsigned hits;  // Walls and lines already handled where the ball stands
+} Ball;
+
+typedef struct {
+    int x;          // Paddle position
+    int width;      // Paddle width
+} Paddle;
+
+// Structure for unified game state
+typedef struct {
+    Ball ball;
+    Paddle paddle;      // Bottom (client's) paddle
+    int penalty;
+    Paddle paddle2;     // Top (server's) paddle
+    int penalty_2;
+    unsigned long tick;
+} GameState;
+
+// A new game: ball in the middle, paddles centred
+void init_game(GameState *state);
+
+// Reset the ball to its serving position
+void reset_ball(GameState *state);
+void serve_ball(Ball *ball);
+
+// Move the ball through dt seconds, bouncing and scoring on the way.
+// ball_step is the same for a ball kept outside a GameState: paddle_x is
+// the bottom paddle, and penalty counts goals past it.
+void step_ball(GameState *state, double dt);
+void ball_step(Ball *ball, int paddle_x, int paddle2_x, int *penalty, int *penalty_2, double dt);
+
+// Paddle position x after one move (-1 left, 0, +1 right), kept on the board
+int paddle_move(int x, int move);
+
+#endif
@@ -0,0 +1,70 @@
+// Fixed-rate tick timer (see pong_tick.h)
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "pong_tick.h"
+
+// Nanoseconds from a to b
+static long elapsed_ns(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000000L + (b->tv_nsec - a->tv_nsec);
+}
+
+// Raise *worst to value if it is larger
+static void note_worst(long *worst, long value) {
+    if (value > __atomic_load_n(worst, __ATOMIC_RELAXED))
+        __atomic_store_n(worst, value, __ATOMIC_RELAXED);
+}
+
+int ticker_start(Ticker *ticker, int rate, const struct timespec *start, TickStats *stats) {
+    ticker->fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (ticker->fd == -1) return -1;
+    ticker->period_ns = 1000000000L / rate;
+    ticker->start = *start;
+    ticker->deadlines = 0;
+    ticker->stats = stats;
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = 0;
+    spec.it_interval.tv_nsec = ticker->period_ns;
+    spec.it_value.tv_sec = start->tv_sec;
+    spec.it_value.tv_nsec = start->tv_nsec + ticker->period_ns;
+    if (spec.it_value.tv_nsec >= 1000000000L) {
+        spec.it_value.tv_nsec -= 1000000000L;
+        spec.it_value.tv_sec++;
+    }
+    if (timerfd_settime(ticker->fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        close(ticker->fd);
+        return -1;
+    }
+    return 0;
+}
+
+int ticker_wait(Ticker *ticker) {
+    uint64_t expirations;
+    if (read(ticker->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &ticker->woke);
+    ticker->deadlines += expirations;
+
+    // How late this wakeup is against the latest deadline it covers
+    TickStats *stats = ticker->stats;
+    long late_ns = elapsed_ns(&ticker->start, &ticker->woke) - (long)ticker->deadlines * ticker->period_ns;
+    note_worst(&stats->worst_late_us, late_ns / 1000);
+    if (expirations > 1) {
+        __atomic_fetch_add(&stats->overruns, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->missed, expirations - 1, __ATOMIC_RELAXED);
+    }
+    if (expirations > MAX_CATCHUP) {
+        __atomic_fetch_add(&stats->dropped, expirations - MAX_CATCHUP, __ATOMIC_RELAXED);
+        expirations = MAX_CATCHUP;
+    }
+    __atomic_fetch_add(&stats->ticks, expirations, __ATOMIC_RELAXED);
+    return expirations;
+}
+
+void ticker_done(Ticker *ticker) {
+    struct timespec done;
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    note_worst(&ticker->stats->worst_step_us, elapsed_ns(&ticker->woke, &done) / 1000);
+}
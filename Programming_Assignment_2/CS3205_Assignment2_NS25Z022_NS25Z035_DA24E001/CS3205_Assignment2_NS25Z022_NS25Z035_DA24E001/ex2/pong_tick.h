@@ -0,0 +1,48 @@
+/*
+ * Fixed-rate tick timer
+ * ---------------------
+ * A timerfd armed at an absolute start time gives a thread its deadlines,
+ * so they do not drift with how long each tick takes or how late the
+ * thread wakes. If it falls behind, the ticks it missed are handed back to
+ * be simulated back to back (up to MAX_CATCHUP) to keep game time in step
+ * with real time. Tickers started from the same start time tick together,
+ * so their tick numbers agree across threads.
+ */
+
+#ifndef PONG_TICK_H
+#define PONG_TICK_H
+
+#include <time.h>
+
+#define MAX_CATCHUP 4           // Most ticks simulated back to back after a stall
+
+// Tick timing, updated by the ticking thread (atomic)
+typedef struct {
+    unsigned long ticks;        // Ticks simulated
+    unsigned long overruns;     // Wakeups that came after the next deadline had passed
+    unsigned long missed;       // Deadlines passed while the loop was behind
+    unsigned long dropped;      // Of those, ticks never simulated (beyond MAX_CATCHUP)
+    long worst_late_us;         // Latest wakeup after a deadline
+    long worst_step_us;         // Longest time spent simulating one wakeup
+} TickStats;
+
+typedef struct {
+    int fd;
+    long period_ns;
+    struct timespec start;
+    unsigned long deadlines;    // Deadlines passed since start
+    struct timespec woke;
+    TickStats *stats;
+} Ticker;
+
+// First deadline one period after start; -1 with errno set on failure
+int ticker_start(Ticker *ticker, int rate, const struct timespec *start, TickStats *stats);
+
+// Wait for the next deadline and return how many ticks to simulate, -1 on
+// error. ticker->deadlines is then the number of the tick just due.
+int ticker_wait(Ticker *ticker);
+
+// Note that the ticks handed out by the last wait have been simulated
+void ticker_done(Ticker *ticker);
+
+#endif